@@ -204,6 +204,7 @@
  * - wimlib_global_init()
  * - wimlib_global_cleanup()
  * - wimlib_set_memory_allocator()
+ * - wimlib_set_memory_limit()
  * - wimlib_set_print_errors()
  * - wimlib_set_error_file()
  * - wimlib_set_error_file_by_name()
@@ -322,6 +323,8 @@
  * read-write.  To mount an image, call wimlib_mount_image().  To unmount an
  * image, call wimlib_unmount_image().  Mounting can be done without root
  * privileges because it is implemented using FUSE (Filesystem in Userspace).
+ * Read-only mounts are multithreaded, so that files can be read concurrently;
+ * read-write mounts handle one filesystem request at a time.
  *
  * If wimlib is compiled using the <c>--without-fuse</c> flag, these functions
  * will be available but will fail with ::WIMLIB_ERR_UNSUPPORTED.
@@ -474,6 +477,12 @@ typedef struct WIMStruct WIMStruct;
 #define WIMLIB_WIMSTRUCT_DECLARED
 #endif
 
+/**
+ * Opaque structure for random-access reads of a file in a WIM image.  See
+ * wimlib_open_file_reader().
+ */
+struct wimlib_file_reader;
+
 #ifdef _WIN32
 typedef wchar_t wimlib_tchar;
 #else
@@ -2153,6 +2162,41 @@ typedef int (*wimlib_iterate_lookup_table_callback_t)(const struct wimlib_resour
  * called.  */
 #define WIMLIB_OPEN_FLAG_WRITE_ACCESS			0x00000004
 
+/**
+ * Open the WIM for concurrent reads.  The metadata of all images is loaded when
+ * the WIM is opened and stays loaded until wimlib_free() is called.  Then,
+ * wimlib_iterate_dir_tree(), wimlib_iterate_lookup_table(),
+ * wimlib_get_wim_info(), and the functions that query image properties may be
+ * called on the ::WIMStruct from multiple threads at the same time.  Reads of
+ * file data share the ::WIMStruct's cache of decompressors and decompressed
+ * chunks, so they scale across threads without needing one ::WIMStruct per
+ * thread.
+ *
+ * Other functions may still be called, but not at the same time as any other
+ * function on the same ::WIMStruct.  The ::WIMStruct cannot be written back to
+ * its file: wimlib_overwrite(), wimlib_delete_image(), and read-write mounts
+ * fail with ::WIMLIB_ERR_WIM_IS_READONLY.  This flag cannot be combined with
+ * ::WIMLIB_OPEN_FLAG_WRITE_ACCESS.
+ *
+ * Since the metadata of all images must be read, opening a WIM with this flag
+ * takes longer and uses more memory than opening it without.
+ */
+#define WIMLIB_OPEN_FLAG_CONCURRENT_READS		0x00000008
+
+/**
+ * Memory-map the WIM file and read from the mapping instead of from the file
+ * descriptor.  Compressed chunks are then decompressed directly from the page
+ * cache, and uncompressed data is passed on without being copied into an
+ * intermediate buffer, which reduces memory bandwidth when extracting or
+ * exporting large WIMs.  If the file cannot be mapped, it is read normally.
+ *
+ * The WIM file must not be truncated by another process while it is open with
+ * this flag, since accessing a mapped page past the end of the file crashes the
+ * process.  wimlib_overwrite() unmaps the file before changing it.  This flag
+ * has no effect on Windows or when the WIM is read from a pipe.
+ */
+#define WIMLIB_OPEN_FLAG_MMAP				0x00000010
+
 /** @} */
 /** @addtogroup G_mounting_wim_images
  * @{ */
@@ -2404,6 +2448,25 @@ typedef int (*wimlib_iterate_lookup_table_callback_t)(const struct wimlib_resour
  */
 #define WIMLIB_WRITE_FLAG_UNSAFE_COMPACT		0x00008000
 
+/**
+ * Write the data of the WIM file with direct I/O (O_DIRECT), bypassing the page
+ * cache, so that writing a large WIM file doesn't evict the cached data of
+ * other programs.  Files on disk that are read to be added to the WIM are also
+ * dropped from the page cache after being read.
+ *
+ * Only the bulk of the file data that needs to be compressed (or written
+ * uncompressed) is written with direct I/O, and only when there are more than a
+ * few megabytes of it, since it's written by a separate thread in that case
+ * only.  Everything else, such as the headers, the metadata resources, the
+ * resources copied without recompression, and the unaligned ends of the
+ * resources, is still written through the page cache.
+ *
+ * This flag has no effect on Windows or on filesystems that don't support
+ * direct I/O.  It is not allowed with wimlib_write_to_fd(), which fails with
+ * ::WIMLIB_ERR_INVALID_PARAM if it is given.
+ */
+#define WIMLIB_WRITE_FLAG_DIRECT_IO			0x00010000
+
 /** @} */
 /** @addtogroup G_general
  * @{ */
@@ -2755,6 +2818,17 @@ wimlib_add_tree(WIMStruct *wim, int image,
 		const wimlib_tchar *fs_source_path,
 		const wimlib_tchar *wim_target_path, int add_flags);
 
+/**
+ * @ingroup G_extracting_wims
+ *
+ * Close a file reader that was opened with wimlib_open_file_reader().
+ *
+ * @param reader
+ *	The file reader to close, or @c NULL to do nothing.
+ */
+WIMLIBAPI void
+wimlib_close_file_reader(struct wimlib_file_reader *reader);
+
 /**
  * @ingroup G_creating_and_opening_wims
  *
@@ -3230,6 +3304,19 @@ wimlib_free(WIMStruct *wim);
 WIMLIBAPI const wimlib_tchar *
 wimlib_get_compression_type_string(enum wimlib_compression_type ctype);
 
+/**
+ * @ingroup G_extracting_wims
+ *
+ * Get the size, in bytes, of the file that a file reader reads.
+ *
+ * @param reader
+ *	A file reader opened with wimlib_open_file_reader().
+ *
+ * @return The uncompressed size of the file's data.
+ */
+WIMLIBAPI uint64_t
+wimlib_get_file_reader_size(const struct wimlib_file_reader *reader);
+
 /**
  * @ingroup G_general
  *
@@ -3461,6 +3548,9 @@ wimlib_image_name_in_use(const WIMStruct *wim, const wimlib_tchar *name);
  * ::WIMLIB_ERR_READ, or ::WIMLIB_ERR_UNEXPECTED_END_OF_FILE, all of which
  * indicate failure (for different reasons) to read the metadata resource for an
  * image over which iteration needed to be done.
+ *
+ * If @p wim was opened with ::WIMLIB_OPEN_FLAG_CONCURRENT_READS, then this
+ * function may be called on it from multiple threads at the same time.
  */
 WIMLIBAPI int
 wimlib_iterate_dir_tree(WIMStruct *wim, int image, const wimlib_tchar *path,
@@ -3665,6 +3755,57 @@ wimlib_mount_image(WIMStruct *wim,
 		   int mount_flags,
 		   const wimlib_tchar *staging_dir);
 
+/**
+ * @ingroup G_extracting_wims
+ *
+ * Open a file in a WIM image for random-access reads of its data, without
+ * extracting it.  Data can then be read from any offset in the file with
+ * wimlib_read_file_reader().  Reads of compressed data go through the
+ * ::WIMStruct's cache of decompressed chunks (see
+ * wimlib_set_chunk_cache_size()), so many small reads from the same region of
+ * a file only decompress that region once.
+ *
+ * @param wim
+ *	The ::WIMStruct containing the image.  This ::WIMStruct must contain
+ *	image metadata, so it cannot be the non-first part of a split WIM.
+ * @param image
+ *	The 1-based index of the image that contains the file.
+ * @param path
+ *	Path to the file in the image.  Only the unnamed data stream of the file
+ *	is read.
+ * @param reader_ret
+ *	On success, a pointer to the new file reader is written to this
+ *	location.  It must be closed with wimlib_close_file_reader().
+ *
+ * @return 0 on success; a ::wimlib_error_code value on failure.
+ *
+ * @retval ::WIMLIB_ERR_INVALID_IMAGE
+ *	@p image does not exist in @p wim.
+ * @retval ::WIMLIB_ERR_NOT_A_REGULAR_FILE
+ *	@p path names a directory.
+ * @retval ::WIMLIB_ERR_PATH_DOES_NOT_EXIST
+ *	@p path does not exist in the image.
+ * @retval ::WIMLIB_ERR_RESOURCE_NOT_FOUND
+ *	The data of the file could not be found in the blob lookup table of @p
+ *	wim.
+ *
+ * This function can additionally return ::WIMLIB_ERR_DECOMPRESSION,
+ * ::WIMLIB_ERR_INVALID_METADATA_RESOURCE, ::WIMLIB_ERR_METADATA_NOT_FOUND,
+ * ::WIMLIB_ERR_READ, or ::WIMLIB_ERR_UNEXPECTED_END_OF_FILE, all of which
+ * indicate failure (for different reasons) to read the metadata resource for
+ * the image.
+ *
+ * The image stays loaded in memory while the file reader is open.  All file
+ * readers must be closed before the image is modified or deleted, and before
+ * @p wim is freed.  If @p wim was opened with
+ * ::WIMLIB_OPEN_FLAG_CONCURRENT_READS, then this function and
+ * wimlib_read_file_reader() may be called from multiple threads at the same
+ * time; otherwise, no other function may be called on @p wim at the same time.
+ */
+WIMLIBAPI int
+wimlib_open_file_reader(WIMStruct *wim, int image, const wimlib_tchar *path,
+			struct wimlib_file_reader **reader_ret);
+
 /**
  * @ingroup G_creating_and_opening_wims
  *
@@ -3850,6 +3991,39 @@ wimlib_print_available_images(const WIMStruct *wim, int image);
 WIMLIBAPI void
 wimlib_print_header(const WIMStruct *wim);
 
+/**
+ * @ingroup G_extracting_wims
+ *
+ * Read data from a file in a WIM image, like pread().  Reading past the end of
+ * the file is not an error; only the data up to the end of the file is read.
+ *
+ * @param reader
+ *	A file reader opened with wimlib_open_file_reader().
+ * @param buf
+ *	Buffer into which to read the data.
+ * @param size
+ *	Maximum number of bytes to read.
+ * @param offset
+ *	Offset in the file at which to start reading.
+ * @param bytes_read_ret
+ *	On success, the number of bytes read is written to this location.  This
+ *	is less than @p size only if the end of the file was reached.
+ *
+ * @return 0 on success; a ::wimlib_error_code value on failure.
+ *
+ * @retval ::WIMLIB_ERR_DECOMPRESSION
+ *	The file data is compressed and could not be decompressed.
+ * @retval ::WIMLIB_ERR_READ
+ *	An error occurred while reading the WIM file.
+ * @retval ::WIMLIB_ERR_UNEXPECTED_END_OF_FILE
+ *	Unexpected end-of-file while reading the WIM file.
+ *
+ * The data is not checked against the file's SHA-1 message digest.
+ */
+WIMLIBAPI int
+wimlib_read_file_reader(struct wimlib_file_reader *reader, void *buf,
+			size_t size, uint64_t offset, size_t *bytes_read_ret);
+
 /**
  * @ingroup G_nonstandalone_wims
  *
@@ -4056,6 +4230,61 @@ WIMLIBAPI int
 wimlib_resolve_image(WIMStruct *wim,
 		     const wimlib_tchar *image_name_or_num);
 
+/**
+ * @ingroup G_general
+ *
+ * Set the maximum amount of memory that a ::WIMStruct may use to cache
+ * decompressed data for random-access reads, such as reads from files in a
+ * mounted WIM image.  Without a cache, each small read from a compressed
+ * resource requires decompressing an entire chunk, which is very slow for
+ * resources with large chunks such as the solid resources of ESD files.  Data
+ * read sequentially, as by wimlib_extract_image(), does not use the cache.
+ *
+ * The cache is allocated only when needed, and the least recently used data is
+ * discarded when the limit is reached.  The default limit is 128 MiB.  If @p
+ * wim references resources in other ::WIMStructs using
+ * wimlib_reference_resource_files(), the WIM files that are opened as a result
+ * inherit the current setting.
+ *
+ * @param wim
+ *	The ::WIMStruct for which to set the cache size.
+ * @param max_size
+ *	The maximum number of bytes of decompressed data to cache, or 0 to
+ *	disable the cache.  Chunks larger than this limit are never cached.
+ *
+ * @return 0
+ */
+WIMLIBAPI int
+wimlib_set_chunk_cache_size(WIMStruct *wim, uint64_t max_size);
+
+/**
+ * @ingroup G_extracting_wims
+ *
+ * Set the number of threads that will be used to decompress data read from a
+ * ::WIMStruct's backing file, for example by wimlib_extract_image(),
+ * wimlib_verify_wim(), or by wimlib_write() when data needs to be recompressed.
+ * The data of large compressed resources will be decompressed by multiple
+ * threads concurrently; however, the data is still processed in the usual
+ * order, so this setting does not affect the result of any operation.  When
+ * extracting to a directory on UNIX-like systems, files whose data is stored in
+ * different resources are also extracted concurrently by this many threads.
+ *
+ * By default, the number of threads is the number of processors.  If @p wim
+ * references resources in other ::WIMStructs using
+ * wimlib_reference_resource_files(), the WIM files that are opened as a result
+ * inherit the current setting.
+ *
+ * @param wim
+ *	The ::WIMStruct for which to set the number of decompression threads.
+ * @param num_threads
+ *	The number of threads to use, or 0 to use the number of processors.  1
+ *	disables multithreaded decompression.
+ *
+ * @return 0
+ */
+WIMLIBAPI int
+wimlib_set_decompression_threads(WIMStruct *wim, unsigned num_threads);
+
 /**
  * @ingroup G_general
  *
@@ -4196,6 +4425,32 @@ wimlib_set_memory_allocator(void *(*malloc_func)(size_t),
 			    void (*free_func)(void *),
 			    void *(*realloc_func)(void *, size_t));
 
+/**
+ * @ingroup G_general
+ *
+ * Set an approximate limit on the amount of memory that wimlib uses for its
+ * large, size-adjustable buffers.  These are the buffers of parallel
+ * compression and decompression, and the caches of decompressed chunks (see
+ * wimlib_set_chunk_cache_size()).  They all share the limit.  Numbers of
+ * threads and buffer sizes are reduced automatically to stay within it.  If
+ * necessary, operations fall back to using a single thread.
+ *
+ * Other memory, such as the in-memory metadata of WIM images and the
+ * compressors' internal state, isn't fully accounted for.  So the process can
+ * still exceed the limit somewhat.  Use a limit well below the memory that's
+ * really available.
+ *
+ * This setting is global and not per-WIM.
+ *
+ * @param limit
+ *	The limit in bytes, or 0 to use the default, which is the amount of
+ *	physical memory in the system.
+ *
+ * @return 0
+ */
+WIMLIBAPI int
+wimlib_set_memory_limit(uint64_t limit);
+
 /**
  * @ingroup G_writing_and_overwriting_wims
  *
@@ -4634,6 +4889,7 @@ wimlib_write(WIMStruct *wim,
  *
  * @retval ::WIMLIB_ERR_INVALID_PARAM
  *	@p fd was not seekable, but ::WIMLIB_WRITE_FLAG_PIPABLE was not
+ *	specified in @p write_flags; or ::WIMLIB_WRITE_FLAG_DIRECT_IO was
  *	specified in @p write_flags.
  */
 WIMLIBAPI int
@@ -66,6 +66,12 @@ struct apply_ctx {
 	/* Features supported by the extraction mode (with booleans)  */
 	struct wim_features supported_features;
 
+	/* Set by the extraction backend while it can extract a blob to any
+	 * number of targets without having them all open at once.  Otherwise,
+	 * a blob with more than MAX_OPEN_FILES targets is first extracted to a
+	 * temporary file, then copied to each target in turn.  */
+	bool unlimited_targets;
+
 	/* The members below should not be used outside of extract.c  */
 	const struct apply_operations *apply_ops;
 	u64 next_progress;
@@ -166,6 +172,15 @@ maybe_detect_sparse_region(const void *data, size_t size, size_t *len_ret,
 int
 extract_blob_list(struct apply_ctx *ctx, const struct read_blob_callbacks *cbs);
 
+unsigned
+get_num_extraction_threads(const struct apply_ctx *ctx);
+
+int
+extract_blob_list_parallel(struct apply_ctx *ctx,
+			   const struct read_blob_callbacks *cbs,
+			   void * const worker_ctxs[], unsigned num_workers,
+			   unsigned max_worker_targets);
+
 /*
  * Represents an extraction backend.
  */
@@ -229,7 +244,8 @@ struct apply_operations {
 	 *
 	 * The blobs required to be extracted will already be prepared in
 	 * 'apply_ctx'.  The extraction backend should call extract_blob_list()
-	 * to extract them.
+	 * to extract them, or extract_blob_list_parallel() if it can extract
+	 * multiple blobs concurrently.
 	 *
 	 * The will_extract_dentry() utility function, given an arbitrary dentry
 	 * in the WIM image (which may not be in the extraction list), can be
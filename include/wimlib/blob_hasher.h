@@ -0,0 +1,29 @@
+/*
+ * blob_hasher.h
+ *
+ * Interface for calculating the SHA-1 message digests of blobs in parallel,
+ * ahead of the thread that needs them.
+ */
+
+#ifndef _WIMLIB_BLOB_HASHER_H
+#define _WIMLIB_BLOB_HASHER_H
+
+#include "wimlib/sha1.h"
+#include "wimlib/types.h"
+
+struct blob_descriptor;
+struct blob_hasher;
+
+int
+new_blob_hasher(struct blob_descriptor * const *blobs, size_t num_blobs,
+		unsigned num_threads, struct blob_hasher **hasher_ret);
+
+int
+blob_hasher_get_hash(struct blob_hasher *hasher,
+		     const struct blob_descriptor *blob,
+		     u8 hash[SHA1_HASH_SIZE]);
+
+void
+free_blob_hasher(struct blob_hasher *hasher);
+
+#endif /* _WIMLIB_BLOB_HASHER_H */
@@ -101,6 +101,10 @@ struct blob_descriptor {
 		struct {
 			struct wim_inode *back_inode;
 			u32 back_stream_id;
+
+			/* Index of this blob in the blob_hasher it was last
+			 * given to, if any; see blob_hasher_get_hash().  */
+			u32 hasher_index;
 		};
 	};
 
@@ -390,6 +394,15 @@ blob_is_in_file(const struct blob_descriptor *blob)
 	   ;
 }
 
+/* Return true if the data of the blob may be read by a blob_hasher's worker
+ * threads.  This excludes, for example, blobs in NTFS volumes, since libntfs-3g
+ * is not thread-safe.  Blobs that are cheap to read are excluded too.  */
+static inline bool
+blob_can_be_hashed_in_parallel(const struct blob_descriptor *blob)
+{
+	return blob_is_in_file(blob);
+}
+
 #ifdef _WIN32
 const wchar_t *
 get_windows_file_path(const struct windows_file *file);
@@ -414,9 +427,10 @@ after_blob_hashed(struct blob_descriptor *blob,
 		  struct blob_descriptor **back_ptr,
 		  struct blob_table *blob_table, struct wim_inode *inode);
 
-int
-hash_unhashed_blob(struct blob_descriptor *blob, struct blob_table *blob_table,
-		   struct blob_descriptor **blob_ret);
+struct blob_descriptor *
+set_unhashed_blob_hash(struct blob_descriptor *blob,
+		       const u8 hash[SHA1_HASH_SIZE],
+		       struct blob_table *blob_table);
 
 struct blob_descriptor **
 retrieve_pointer_to_unhashed_blob(struct blob_descriptor *blob);
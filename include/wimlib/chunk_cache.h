@@ -0,0 +1,67 @@
+#ifndef _WIMLIB_CHUNK_CACHE_H
+#define _WIMLIB_CHUNK_CACHE_H
+
+#include "wimlib/list.h"
+#include "wimlib/types.h"
+
+struct wim_resource_descriptor;
+
+/* Default value of the maximum amount of decompressed data that will be cached
+ * for random-access reads from a WIM file.  This is enough to hold two of the
+ * largest chunks that are produced by default, which are the 64 MiB chunks of
+ * LZMS solid resources.  */
+#define CHUNK_CACHE_DEFAULT_MAX_SIZE	((u64)128 << 20)
+
+/* A chunk of decompressed data from a compressed WIM resource  */
+struct chunk_cache_entry {
+	/* Link in the cache's hash table  */
+	struct hlist_node hash_node;
+
+	/* Link in the cache's LRU list; the most recently used entry is
+	 * first.  */
+	struct list_head lru_node;
+
+	/* The resource and the 0-based index of the chunk in it  */
+	struct wim_resource_descriptor *rdesc;
+	u64 chunk_idx;
+
+	/* The uncompressed size of the chunk  */
+	u32 size;
+
+	/* The uncompressed data of the chunk  */
+	u8 data[];
+};
+
+/* A cache of decompressed chunks, indexed by resource and chunk index.  Only
+ * the most recently used chunks that fit within the memory limit are kept.  */
+struct chunk_cache {
+	struct hlist_head *array;
+	size_t filled;
+	size_t capacity;
+	struct list_head lru_list;
+	u64 cur_size;
+	u64 max_size;
+};
+
+struct chunk_cache *
+new_chunk_cache(u64 max_size);
+
+void
+free_chunk_cache(struct chunk_cache *cache);
+
+struct chunk_cache_entry *
+new_chunk_cache_entry(struct wim_resource_descriptor *rdesc, u64 chunk_idx,
+		      u32 size);
+
+const u8 *
+chunk_cache_lookup(struct chunk_cache *cache,
+		   const struct wim_resource_descriptor *rdesc, u64 chunk_idx);
+
+void
+chunk_cache_insert(struct chunk_cache *cache, struct chunk_cache_entry *entry);
+
+void
+chunk_cache_invalidate_resource(struct chunk_cache *cache,
+				struct wim_resource_descriptor *rdesc);
+
+#endif /* _WIMLIB_CHUNK_CACHE_H */
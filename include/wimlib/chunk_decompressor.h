@@ -0,0 +1,80 @@
+/*
+ * chunk_decompressor.h
+ *
+ * Interface for parallel chunk decompression.
+ */
+
+#ifndef _WIMLIB_CHUNK_DECOMPRESSOR_H
+#define _WIMLIB_CHUNK_DECOMPRESSOR_H
+
+#include "wimlib/types.h"
+
+/* Interface for chunk decompression.  Users can submit chunks of compressed
+ * data to be decompressed, then retrieve the uncompressed data later in order.
+ * This is the counterpart of 'struct chunk_compressor'; it only has a parallel
+ * implementation, since the serial case is handled directly by the code that
+ * reads compressed resources.  */
+struct chunk_decompressor {
+	/* Variables set by the chunk decompressor when it is created.  */
+	int in_ctype;
+	u32 in_chunk_size;
+	unsigned num_threads;
+
+	/* Free the chunk decompressor.  */
+	void (*destroy)(struct chunk_decompressor *);
+
+	/* Try to borrow a buffer into which the compressed data for the next
+	 * chunk should be read.  The buffer has space for @in_chunk_size bytes.
+	 *
+	 * Only one buffer can be borrowed at a time.
+	 *
+	 * Returns a pointer to the buffer, or NULL if no buffer is available.
+	 * If no buffer is available, you must call ->get_decompression_result()
+	 * to retrieve a decompressed chunk before trying again.  */
+	void *(*get_chunk_buffer)(struct chunk_decompressor *);
+
+	/* Signals to the chunk decompressor that the buffer which was loaned
+	 * out from ->get_chunk_buffer() has finished being filled and contains
+	 * the specified number of bytes of compressed data, which decompress to
+	 * the specified number of bytes.  If the two sizes are equal, then the
+	 * chunk is actually stored uncompressed and is passed through as-is.  */
+	void (*signal_chunk_filled)(struct chunk_decompressor *, u32, u32);
+
+	/* Like ->signal_chunk_filled(), but the compressed data was not copied
+	 * into the borrowed buffer; instead it is at the location given by
+	 * argument 2 (typically in a memory-mapped WIM file), which must stay
+	 * valid until the chunk's result has been retrieved and the next call
+	 * to the chunk decompressor has been made.  */
+	void (*signal_chunk_mapped)(struct chunk_decompressor *, const void *,
+				    u32, u32);
+
+	/* Get the next chunk of decompressed data.
+	 *
+	 * The uncompressed data and its size are returned in the locations
+	 * pointed to by arguments 2-3.  The data is in storage internal to the
+	 * chunk decompressor (or, for a stored chunk submitted with
+	 * ->signal_chunk_mapped(), in the caller's memory), and it cannot be
+	 * accessed beyond any subsequent calls to the chunk decompressor.
+	 *
+	 * Chunks will be returned in the same order in which they were
+	 * submitted for decompression.
+	 *
+	 * The location pointed to by argument 4 is set to 0 if the chunk was
+	 * successfully decompressed, or to WIMLIB_ERR_DECOMPRESSION if it was
+	 * not.  In the latter case the returned data is still valid, but it
+	 * only contains whatever could be recovered, padded with zeroes.
+	 *
+	 * The return value is %true if a chunk of uncompressed data was
+	 * successfully retrieved, or %false if there are no chunks currently
+	 * being decompressed.  */
+	bool (*get_decompression_result)(struct chunk_decompressor *,
+					 const void **, u32 *, int *);
+};
+
+int
+new_parallel_chunk_decompressor(int in_ctype, u32 in_chunk_size,
+				unsigned num_threads, u64 max_memory,
+				u64 num_chunks,
+				struct chunk_decompressor **decompressor_ret);
+
+#endif /* _WIMLIB_CHUNK_DECOMPRESSOR_H */
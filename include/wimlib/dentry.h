@@ -189,6 +189,10 @@ dentry_set_name_utf16le(struct wim_dentry *dentry, const utf16lechar *name,
 struct wim_dentry *
 get_dentry(WIMStruct *wim, const tchar *path, CASE_SENSITIVITY_TYPE case_type);
 
+struct wim_dentry *
+get_dentry_in_tree(struct wim_dentry *root, const tchar *path,
+		   CASE_SENSITIVITY_TYPE case_type);
+
 struct wim_dentry *
 get_dentry_child_with_name(const struct wim_dentry *dentry, const tchar *name,
 			   CASE_SENSITIVITY_TYPE case_type);
@@ -203,6 +207,9 @@ struct wim_dentry *
 get_parent_dentry(WIMStruct *wim, const tchar *path,
 		  CASE_SENSITIVITY_TYPE case_type);
 
+int
+get_dentry_full_path(const struct wim_dentry *dentry, tchar **path_ret);
+
 int
 calculate_dentry_full_path(struct wim_dentry *dentry);
 
@@ -5,6 +5,8 @@
 #include <stddef.h>
 #include <sys/types.h>
 
+#include "wimlib/types.h"
+
 /* Wrapper around a file descriptor that keeps track of offset (including in
  * pipes, which don't support lseek()) and a cached flag that tells whether the
  * file descriptor is a pipe or not.  */
@@ -26,6 +28,10 @@ full_write(struct filedes *fd, const void *buf, size_t n);
 int
 full_pwrite(struct filedes *fd, const void *buf, size_t count, off_t offset);
 
+int
+copy_data_in_kernel(struct filedes *in_fd, u64 *in_offset_p, u64 in_end,
+		    struct filedes *out_fd);
+
 #ifndef _WIN32
 #  define O_BINARY 0
 #endif
@@ -0,0 +1,60 @@
+/*
+ * read_ahead.h
+ *
+ * Asynchronous read-ahead of the regions of a file that are about to be read.
+ */
+
+#ifndef _WIMLIB_READ_AHEAD_H
+#define _WIMLIB_READ_AHEAD_H
+
+#include "wimlib/file_io.h"
+#include "wimlib/types.h"
+
+/* Don't bother reading ahead for reads smaller than this.  */
+#define READ_AHEAD_MIN_SIZE	((u64)1 << 20)
+
+struct read_ahead;
+
+#ifndef _WIN32
+
+struct read_ahead *
+read_ahead_new(struct filedes *fd, bool hints_only);
+
+void
+read_ahead_add(struct read_ahead *ra, u64 offset, u64 size);
+
+int
+read_ahead_pread(struct read_ahead *ra, struct filedes *fd, void *buf,
+		 size_t count, u64 offset);
+
+void
+read_ahead_free(struct read_ahead *ra);
+
+#else /* !_WIN32 */
+
+static inline struct read_ahead *
+read_ahead_new(struct filedes *fd, bool hints_only)
+{
+	return NULL;
+}
+
+static inline void
+read_ahead_add(struct read_ahead *ra, u64 offset, u64 size)
+{
+}
+
+static inline int
+read_ahead_pread(struct read_ahead *ra, struct filedes *fd, void *buf,
+		 size_t count, u64 offset)
+{
+	return full_pread(fd, buf, count, offset);
+}
+
+static inline void
+read_ahead_free(struct read_ahead *ra)
+{
+}
+
+#endif /* _WIN32 */
+
+#endif /* _WIMLIB_READ_AHEAD_H */
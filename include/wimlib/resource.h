@@ -55,6 +55,10 @@ struct wim_resource_descriptor {
 	/* Compression chunk size of this resource.  Irrelevant if the resource
 	 * is uncompressed.  */
 	u32 chunk_size;
+
+	/* The number of chunks of this resource that are in the chunk cache of
+	 * @wim.  */
+	u32 num_cached_chunks;
 };
 
 /* On-disk version of a WIM resource header.  */
@@ -171,10 +175,27 @@ get_chunk_entry_size(u64 res_size, bool is_alt)
 
 /* Functions to read blobs  */
 
+/* Locations of the compressed chunks containing a blob's data, for repeated
+ * random-access reads of the blob  */
+struct blob_chunk_table {
+	u64 first_chunk;
+	u64 *chunk_offsets;
+};
+
+int
+load_blob_chunk_table(const struct blob_descriptor *blob,
+		      struct blob_chunk_table *table);
+
 int
 read_partial_wim_blob_into_buf(const struct blob_descriptor *blob,
+			       const struct blob_chunk_table *table,
 			       u64 offset, size_t size, void *buf);
 
+int
+read_partial_blob_into_buf(const struct blob_descriptor *blob,
+			   const struct blob_chunk_table *table,
+			   u64 offset, size_t size, void *buf);
+
 int
 read_blob_into_buf(const struct blob_descriptor *blob, void *buf);
 
@@ -274,6 +295,7 @@ call_end_blob(struct blob_descriptor *blob, int status,
 #define COMPUTE_MISSING_BLOB_HASHES	0x2
 #define BLOB_LIST_ALREADY_SORTED	0x4
 #define RECOVER_DATA			0x8
+#define DROP_FILE_CACHE			0x10
 
 int
 read_blob_list(struct list_head *blob_list, size_t list_head_offset,
@@ -300,6 +322,9 @@ extract_blob_to_fd(struct blob_descriptor *blob, struct filedes *fd,
 int
 sha1_blob(struct blob_descriptor *blob);
 
+int
+sha1_blob_data(const struct blob_descriptor *blob, u8 hash[SHA1_HASH_SIZE]);
+
 /* Functions to read/write metadata resources.  */
 
 int
@@ -54,6 +54,10 @@ sha1_final(struct sha1_ctx *ctx, u8 hash[SHA1_HASH_SIZE]);
 void
 sha1(const void *data, size_t len, u8 hash[SHA1_HASH_SIZE]);
 
+void
+sha1_multi(const void * const msgs[], const size_t lens[], size_t num_msgs,
+	   u8 hashes[][SHA1_HASH_SIZE]);
+
 extern const u8 zero_hash[SHA1_HASH_SIZE];
 
 #define SHA1_HASH_STRING_LEN	(2 * SHA1_HASH_SIZE + 1)
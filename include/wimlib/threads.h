@@ -3,6 +3,8 @@
 
 #include <stdbool.h>
 
+#include "wimlib/list.h"
+
 #ifdef _WIN32
 
 struct thread {
@@ -29,6 +31,43 @@ struct condvar { pthread_cond_t pthread_cond; };
 
 #endif /* !_WIN32 */
 
+/*
+ * Atomic memory accesses, for the few places where a lock would be too
+ * expensive.  These use the GCC/Clang builtins.
+ */
+#define atomic_load_relaxed(p)		__atomic_load_n((p), __ATOMIC_RELAXED)
+#define atomic_load_acquire(p)		__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define atomic_load_seq_cst(p)		__atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define atomic_store_relaxed(p, v)	__atomic_store_n((p), (v), __ATOMIC_RELAXED)
+#define atomic_store_release(p, v)	__atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define atomic_store_seq_cst(p, v)	__atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+
+/* Add @v to *@p and return the new value  */
+#define atomic_add_relaxed(p, v)	__atomic_add_fetch((p), (v), __ATOMIC_RELAXED)
+#define atomic_add_seq_cst(p, v)	__atomic_add_fetch((p), (v), __ATOMIC_SEQ_CST)
+
+/* Full memory barrier  */
+#define atomic_fence_seq_cst()		__atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+/* Try to change *@p from *@expected to @desired.  On failure, *@expected is
+ * updated to the current value.  May fail spuriously.  */
+#define atomic_cmpxchg_weak_relaxed(p, expected, desired)		\
+	__atomic_compare_exchange_n((p), (expected), (desired), true,	\
+				    __ATOMIC_RELAXED, __ATOMIC_RELAXED)
+
+/* Hint to the CPU that this is a spin-wait loop  */
+static inline void
+cpu_relax(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ volatile("yield" ::: "memory");
+#else
+	__asm__ volatile("" ::: "memory");
+#endif
+}
+
 bool thread_create(struct thread *t, void *(*thrproc)(void *), void *arg);
 void thread_join(struct thread *t);
 bool mutex_init(struct mutex *m);
@@ -41,4 +80,43 @@ void condvar_wait(struct condvar *c, struct mutex *m);
 void condvar_signal(struct condvar *c);
 void condvar_broadcast(struct condvar *c);
 
+/*
+ * The library keeps one pool of worker threads which is shared by everything
+ * that wants to do work in parallel, so that the threads aren't created and
+ * destroyed for every operation and so that combining several parallel features
+ * doesn't oversubscribe the processors.
+ *
+ * Work is given to the pool through a 'struct thread_pool_job'.  A job is
+ * serviced by up to @max_tasks tasks running concurrently on the pool's
+ * threads; each task just calls the job's function.  The function should
+ * process work items until it finds none left, then return.  It must never wait
+ * for more work to arrive, since that would tie up a pool thread that other
+ * jobs may be waiting for.  After making new work available, the producer calls
+ * thread_pool_job_kick(), which guarantees that a task will call the function
+ * again afterwards.
+ */
+struct thread_pool_task {
+	struct list_head node;
+	struct thread_pool_job *job;
+};
+
+struct thread_pool_job {
+	void (*func)(void *arg);
+	void *arg;
+	struct mutex lock;
+	struct condvar idle_cond;
+	struct thread_pool_task *tasks;
+	struct list_head free_tasks;
+	unsigned num_active_tasks;
+	bool rerun;
+};
+
+unsigned thread_pool_reserve(unsigned num_threads);
+bool thread_pool_job_init(struct thread_pool_job *job, void (*func)(void *),
+			  void *arg, unsigned max_tasks);
+void thread_pool_job_kick(struct thread_pool_job *job);
+void thread_pool_job_wait(struct thread_pool_job *job);
+void thread_pool_job_destroy(struct thread_pool_job *job);
+void thread_pool_destroy(void);
+
 #endif /* _WIMLIB_THREADS_H */
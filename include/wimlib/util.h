@@ -89,6 +89,13 @@ void *
 mempcpy(void *dst, const void *src, size_t n);
 #endif
 
+/*******************
+ * Zero detection
+ *******************/
+
+bool
+is_all_zeroes(const void *p, size_t size);
+
 /**************************
  * Random number generation
  **************************/
@@ -146,4 +153,13 @@ get_available_cpus(void);
 u64
 get_available_memory(void);
 
+u64
+get_memory_budget(void);
+
+void
+charge_memory(u64 size);
+
+void
+uncharge_memory(u64 size);
+
 #endif /* _WIMLIB_UTIL_H */
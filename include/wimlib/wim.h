@@ -9,10 +9,23 @@
 #include "wimlib/file_io.h"
 #include "wimlib/header.h"
 #include "wimlib/list.h"
+#include "wimlib/threads.h"
 
 struct wim_image_metadata;
 struct wim_xml_info;
 struct blob_table;
+struct chunk_cache;
+
+/* Maximum number of decompressors cached by a WIMStruct  */
+#define WIM_MAX_CACHED_DECOMPRESSORS	16
+
+/* A decompressor that is not currently in use, with the parameters it was
+ * created with  */
+struct cached_decompressor {
+	struct wimlib_decompressor *decompressor;
+	u8 ctype;
+	u32 max_block_size;
+};
 
 /*
  * WIMStruct - represents a WIM, or a part of a non-standalone WIM
@@ -36,7 +49,9 @@ struct blob_table;
  * Note 3: It is unsafe for multiple threads to operate on the same WIMStruct at
  * the same time.  This extends to references to other WIMStructs as noted
  * above.  But besides this, it is safe to operate on *different* WIMStructs in
- * different threads concurrently.
+ * different threads concurrently.  The exception is a WIMStruct opened with
+ * WIMLIB_OPEN_FLAG_CONCURRENT_READS, which supports some read-only operations
+ * from multiple threads; see 'concurrent_reads'.
  */
 struct WIMStruct {
 
@@ -96,22 +111,50 @@ struct WIMStruct {
 	 * Otherwise, this field is invalid (!filedes_valid(&out_fd)).  */
 	struct filedes out_fd;
 
+	/* If the library is writing this WIMStruct out to a file with
+	 * WIMLIB_WRITE_FLAG_DIRECT_IO, then this is a second file descriptor
+	 * open to that file, with O_DIRECT.  Otherwise, this field is invalid.
+	 */
+	struct filedes out_direct_fd;
+
 	/* The size of the backing file, or 0 if unknown */
 	u64 file_size;
 
+	/* If the WIM was opened with WIMLIB_OPEN_FLAG_MMAP, then this is a
+	 * read-only mapping of the first 'in_map_size' bytes of the backing
+	 * file.  Otherwise it is NULL.  */
+	const u8 *in_map;
+	u64 in_map_size;
+
 	/*
-	 * This is the cached decompressor for this WIM file, or NULL if no
-	 * decompressor is cached yet.  Normally, all the compressed data in a
-	 * WIM file has the same compression type and chunk size, so the same
-	 * decompressor can be used for all data --- and that decompressor will
-	 * be cached here.  However, if we do encounter any data with a
+	 * These are the cached decompressors for this WIM file.  Normally, all
+	 * the compressed data in a WIM file has the same compression type and
+	 * chunk size, so the same decompressor can be used for all data --- and
+	 * that decompressor will be cached here.  More than one decompressor is
+	 * cached only if data is read by multiple threads at the same time (as
+	 * in a multithreaded read-only mount), or if we encounter data with a
 	 * different compression type or chunk size (this is possible in solid
-	 * resources), then this cached decompressor will be replaced with a new
-	 * one.
+	 * resources).  Use wim_get_decompressor() and wim_put_decompressor() to
+	 * access them.
 	 */
-	struct wimlib_decompressor *decompressor;
-	u8 decompressor_ctype;
-	u32 decompressor_max_block_size;
+	struct cached_decompressor decompressors[WIM_MAX_CACHED_DECOMPRESSORS];
+	unsigned num_cached_decompressors;
+
+	/* Lock for the cached decompressors and the chunk cache, which are the
+	 * only parts of a WIMStruct that reading data from it modifies.  */
+	struct mutex decompressor_lock;
+
+	/* Number of threads to use when decompressing data from this WIM file,
+	 * or 0 to use the number of processors.  Can be changed by
+	 * wimlib_set_decompression_threads().  */
+	unsigned num_decompression_threads;
+
+	/* Cache of decompressed chunks for random-access reads from this WIM
+	 * file, or NULL if not allocated yet.  The cache holds at most
+	 * chunk_cache_max_size bytes of data, which can be changed by
+	 * wimlib_set_chunk_cache_size(); 0 disables the cache.  */
+	struct chunk_cache *chunk_cache;
+	u64 chunk_cache_max_size;
 
 	/* Temporary field; use sparingly  */
 	void *private;
@@ -119,6 +162,11 @@ struct WIMStruct {
 	/* 1 if any images have been deleted from this WIMStruct, otherwise 0 */
 	u8 image_deletion_occurred : 1;
 
+	/* 1 if the WIMStruct was opened with WIMLIB_OPEN_FLAG_CONCURRENT_READS,
+	 * otherwise 0.  In that case the metadata of all images is loaded and
+	 * pinned in memory, and the WIMStruct must not be modified.  */
+	u8 concurrent_reads : 1;
+
 	/* 1 if the WIM file has been locked for appending, otherwise 0  */
 	u8 locked_for_append : 1;
 
@@ -188,9 +236,34 @@ static inline bool wim_is_pipable(const WIMStruct *wim)
 	return (wim->hdr.magic == PWM_MAGIC);
 }
 
+/*
+ * If the specified region of the WIM's backing file is memory-mapped, return a
+ * pointer to it; otherwise return NULL.  A NULL return just means the caller
+ * has to read the data itself.
+ */
+static inline const u8 *
+wim_mapped_data(const WIMStruct *wim, u64 offset, u64 size)
+{
+	if (wim->in_map == NULL || offset > wim->in_map_size ||
+	    size > wim->in_map_size - offset)
+		return NULL;
+	return wim->in_map + offset;
+}
+
+void
+wim_unmap_file(WIMStruct *wim);
+
 void
 wim_decrement_refcnt(WIMStruct *wim);
 
+int
+wim_get_decompressor(WIMStruct *wim, int ctype, u32 max_block_size,
+		     struct wimlib_decompressor **decompressor_ret);
+
+void
+wim_put_decompressor(WIMStruct *wim, struct wimlib_decompressor *decompressor,
+		     int ctype, u32 max_block_size);
+
 bool
 wim_has_solid_resources(const WIMStruct *wim);
 
@@ -210,6 +283,10 @@ select_wim_image(WIMStruct *wim, int image);
 void
 deselect_current_wim_image(WIMStruct *wim);
 
+int
+get_image_for_reading(WIMStruct *wim, int image,
+		      struct wim_image_metadata **imd_ret);
+
 int
 for_image(WIMStruct *wim, int image, int (*visitor)(WIMStruct *));
 
@@ -28,7 +28,8 @@
 	WIMLIB_WRITE_FLAG_SOLID				| \
 	WIMLIB_WRITE_FLAG_SEND_DONE_WITH_FILE_MESSAGES	| \
 	WIMLIB_WRITE_FLAG_NO_SOLID_SORT			| \
-	WIMLIB_WRITE_FLAG_UNSAFE_COMPACT)
+	WIMLIB_WRITE_FLAG_UNSAFE_COMPACT		| \
+	WIMLIB_WRITE_FLAG_DIRECT_IO)
 
 #if defined(HAVE_SYS_FILE_H) && defined(HAVE_FLOCK)
 int
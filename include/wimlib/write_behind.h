@@ -0,0 +1,35 @@
+/*
+ * write_behind.h
+ *
+ * Asynchronous writing of the data of a WIM file being written.
+ */
+
+#ifndef _WIMLIB_WRITE_BEHIND_H
+#define _WIMLIB_WRITE_BEHIND_H
+
+#include "wimlib/file_io.h"
+#include "wimlib/types.h"
+
+struct write_behind;
+
+struct write_behind *
+write_behind_new(struct filedes *fd, const struct filedes *direct_fd);
+
+int
+write_behind_write(struct write_behind *wb, struct filedes *fd,
+		   const void *buf, size_t count);
+
+int
+write_behind_pwrite(struct write_behind *wb, struct filedes *fd,
+		    const void *buf, size_t count, u64 offset);
+
+off_t
+write_behind_seek(struct write_behind *wb, struct filedes *fd, off_t offset);
+
+int
+write_behind_flush(struct write_behind *wb);
+
+void
+write_behind_free(struct write_behind *wb);
+
+#endif /* _WIMLIB_WRITE_BEHIND_H */
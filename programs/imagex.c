@@ -177,6 +177,7 @@ enum {
 	IMAGEX_DEREFERENCE_OPTION,
 	IMAGEX_DEST_DIR_OPTION,
 	IMAGEX_DETAILED_OPTION,
+	IMAGEX_DIRECT_IO_OPTION,
 	IMAGEX_EXTRACT_XML_OPTION,
 	IMAGEX_FLAGS_OPTION,
 	IMAGEX_FORCE_OPTION,
@@ -241,6 +242,7 @@ static const struct option apply_options[] = {
 	{T("wimboot"),     no_argument,       NULL, IMAGEX_WIMBOOT_OPTION},
 	{T("compact"),     required_argument, NULL, IMAGEX_COMPACT_OPTION},
 	{T("recover-data"), no_argument,      NULL, IMAGEX_RECOVER_DATA_OPTION},
+	{T("threads"),     required_argument, NULL, IMAGEX_THREADS_OPTION},
 	{NULL, 0, NULL, 0},
 };
 
@@ -276,6 +278,7 @@ static const struct option capture_or_append_options[] = {
 	{T("delta-from"),  required_argument, NULL, IMAGEX_DELTA_FROM_OPTION},
 	{T("wimboot"),     no_argument,       NULL, IMAGEX_WIMBOOT_OPTION},
 	{T("unsafe-compact"), no_argument,    NULL, IMAGEX_UNSAFE_COMPACT_OPTION},
+	{T("direct-io"),   no_argument,       NULL, IMAGEX_DIRECT_IO_OPTION},
 	{T("snapshot"),    no_argument,       NULL, IMAGEX_SNAPSHOT_OPTION},
 	{T("create"),      no_argument,       NULL, IMAGEX_CREATE_OPTION},
 	{NULL, 0, NULL, 0},
@@ -317,6 +320,7 @@ static const struct option export_options[] = {
 	{T("not-pipable"), no_argument,       NULL, IMAGEX_NOT_PIPABLE_OPTION},
 	{T("wimboot"),     no_argument,       NULL, IMAGEX_WIMBOOT_OPTION},
 	{T("unsafe-compact"), no_argument,    NULL, IMAGEX_UNSAFE_COMPACT_OPTION},
+	{T("direct-io"),   no_argument,       NULL, IMAGEX_DIRECT_IO_OPTION},
 	{NULL, 0, NULL, 0},
 };
 
@@ -339,6 +343,7 @@ static const struct option extract_options[] = {
 	{T("wimboot"),     no_argument,       NULL, IMAGEX_WIMBOOT_OPTION},
 	{T("compact"),     required_argument, NULL, IMAGEX_COMPACT_OPTION},
 	{T("recover-data"), no_argument,      NULL, IMAGEX_RECOVER_DATA_OPTION},
+	{T("threads"),     required_argument, NULL, IMAGEX_THREADS_OPTION},
 	{NULL, 0, NULL, 0},
 };
 
@@ -392,6 +397,7 @@ static const struct option optimize_options[] = {
 	{T("pipable"),     no_argument,       NULL, IMAGEX_PIPABLE_OPTION},
 	{T("not-pipable"), no_argument,       NULL, IMAGEX_NOT_PIPABLE_OPTION},
 	{T("unsafe-compact"), no_argument,    NULL, IMAGEX_UNSAFE_COMPACT_OPTION},
+	{T("direct-io"),   no_argument,       NULL, IMAGEX_DIRECT_IO_OPTION},
 	{NULL, 0, NULL, 0},
 };
 
@@ -448,6 +454,7 @@ static const struct option update_options[] = {
 static const struct option verify_options[] = {
 	{T("ref"), required_argument, NULL, IMAGEX_REF_OPTION},
 	{T("nocheck"), no_argument, NULL, IMAGEX_NOCHECK_OPTION},
+	{T("threads"), required_argument, NULL, IMAGEX_THREADS_OPTION},
 
 	{NULL, 0, NULL, 0},
 };
@@ -1558,6 +1565,7 @@ imagex_apply(int argc, tchar **argv, int cmd)
 	const tchar *target;
 	const tchar *image_num_or_name = NULL;
 	int extract_flags = 0;
+	unsigned num_threads = 0;
 
 	STRING_LIST(refglobs);
 
@@ -1607,6 +1615,13 @@ imagex_apply(int argc, tchar **argv, int cmd)
 		case IMAGEX_RECOVER_DATA_OPTION:
 			extract_flags |= WIMLIB_EXTRACT_FLAG_RECOVER_DATA;
 			break;
+		case IMAGEX_THREADS_OPTION:
+			num_threads = parse_num_threads(optarg);
+			if (num_threads == UINT_MAX) {
+				ret = -1;
+				goto out_free_refglobs;
+			}
+			break;
 		default:
 			goto out_usage;
 		}
@@ -1634,6 +1649,8 @@ imagex_apply(int argc, tchar **argv, int cmd)
 		if (ret)
 			goto out_free_refglobs;
 
+		wimlib_set_decompression_threads(wim, num_threads);
+
 		wimlib_get_wim_info(wim, &info);
 
 		if (argc >= 3) {
@@ -1910,6 +1927,9 @@ imagex_capture_or_append(int argc, tchar **argv, int cmd)
 		case IMAGEX_UNSAFE_COMPACT_OPTION:
 			write_flags |= WIMLIB_WRITE_FLAG_UNSAFE_COMPACT;
 			break;
+		case IMAGEX_DIRECT_IO_OPTION:
+			write_flags |= WIMLIB_WRITE_FLAG_DIRECT_IO;
+			break;
 		case IMAGEX_SNAPSHOT_OPTION:
 			add_flags |= WIMLIB_ADD_FLAG_SNAPSHOT;
 			break;
@@ -1967,6 +1987,8 @@ imagex_capture_or_append(int argc, tchar **argv, int cmd)
 	#else
 		write_flags |= WIMLIB_WRITE_FLAG_PIPABLE;
 	#endif
+		/* Direct I/O doesn't apply to a pipe.  */
+		write_flags &= ~WIMLIB_WRITE_FLAG_DIRECT_IO;
 		if (appending) {
 			imagex_error(T("Using standard output for append does "
 				       "not make sense."));
@@ -2871,6 +2893,9 @@ imagex_export(int argc, tchar **argv, int cmd)
 		case IMAGEX_UNSAFE_COMPACT_OPTION:
 			write_flags |= WIMLIB_WRITE_FLAG_UNSAFE_COMPACT;
 			break;
+		case IMAGEX_DIRECT_IO_OPTION:
+			write_flags |= WIMLIB_WRITE_FLAG_DIRECT_IO;
+			break;
 		default:
 			goto out_usage;
 		}
@@ -2909,6 +2934,8 @@ imagex_export(int argc, tchar **argv, int cmd)
 	#else
 		write_flags |= WIMLIB_WRITE_FLAG_PIPABLE;
 	#endif
+		/* Direct I/O doesn't apply to a pipe.  */
+		write_flags &= ~WIMLIB_WRITE_FLAG_DIRECT_IO;
 		dest_wimfile = NULL;
 		dest_wim_fd = STDOUT_FILENO;
 		imagex_output_to_stderr();
@@ -3090,6 +3117,7 @@ imagex_extract(int argc, tchar **argv, int cmd)
 			    WIMLIB_EXTRACT_FLAG_GLOB_PATHS |
 			    WIMLIB_EXTRACT_FLAG_STRICT_GLOB;
 	int notlist_extract_flags = WIMLIB_EXTRACT_FLAG_NO_PRESERVE_DIR_STRUCTURE;
+	unsigned num_threads = 0;
 
 	STRING_LIST(refglobs);
 
@@ -3152,6 +3180,13 @@ imagex_extract(int argc, tchar **argv, int cmd)
 		case IMAGEX_RECOVER_DATA_OPTION:
 			extract_flags |= WIMLIB_EXTRACT_FLAG_RECOVER_DATA;
 			break;
+		case IMAGEX_THREADS_OPTION:
+			num_threads = parse_num_threads(optarg);
+			if (num_threads == UINT_MAX) {
+				ret = -1;
+				goto out_free_refglobs;
+			}
+			break;
 		default:
 			goto out_usage;
 		}
@@ -3180,6 +3215,8 @@ imagex_extract(int argc, tchar **argv, int cmd)
 	if (ret)
 		goto out_free_refglobs;
 
+	wimlib_set_decompression_threads(wim, num_threads);
+
 	image = wimlib_resolve_image(wim, image_num_or_name);
 	ret = verify_image_exists_and_is_single(image,
 						image_num_or_name,
@@ -3771,6 +3808,9 @@ imagex_optimize(int argc, tchar **argv, int cmd)
 		case IMAGEX_UNSAFE_COMPACT_OPTION:
 			write_flags |= WIMLIB_WRITE_FLAG_UNSAFE_COMPACT;
 			break;
+		case IMAGEX_DIRECT_IO_OPTION:
+			write_flags |= WIMLIB_WRITE_FLAG_DIRECT_IO;
+			break;
 		default:
 			goto out_usage;
 		}
@@ -4234,6 +4274,7 @@ imagex_verify(int argc, tchar **argv, int cmd)
 	WIMStruct *wim;
 	int open_flags = WIMLIB_OPEN_FLAG_CHECK_INTEGRITY;
 	int verify_flags = 0;
+	unsigned num_threads = 0;
 	STRING_LIST(refglobs);
 	int c;
 
@@ -4247,6 +4288,13 @@ imagex_verify(int argc, tchar **argv, int cmd)
 		case IMAGEX_NOCHECK_OPTION:
 			open_flags &= ~WIMLIB_OPEN_FLAG_CHECK_INTEGRITY;
 			break;
+		case IMAGEX_THREADS_OPTION:
+			num_threads = parse_num_threads(optarg);
+			if (num_threads == UINT_MAX) {
+				ret = -1;
+				goto out_free_refglobs;
+			}
+			break;
 		default:
 			goto out_usage;
 		}
@@ -4273,6 +4321,8 @@ imagex_verify(int argc, tchar **argv, int cmd)
 	if (ret)
 		goto out_free_refglobs;
 
+	wimlib_set_decompression_threads(wim, num_threads);
+
 	ret = wim_reference_globs(wim, &refglobs, open_flags);
 	if (ret)
 		goto out_wimlib_free;
@@ -4368,6 +4418,7 @@ T(
 "                    [--no-attributes] [--rpfix] [--norpfix]\n"
 "                    [--include-invalid-names] [--wimboot] [--unix-data]\n"
 "                    [--compact=FORMAT] [--recover-data]\n"
+"                    [--threads=NUM_THREADS]\n"
 ),
 [CMD_CAPTURE] =
 T(
@@ -4402,6 +4453,7 @@ T(
 "                    [--to-stdout] [--no-acls] [--strict-acls]\n"
 "                    [--no-attributes] [--include-invalid-names] [--no-globs]\n"
 "                    [--nullglob] [--preserve-dir-structure] [--recover-data]\n"
+"                    [--threads=NUM_THREADS]\n"
 ),
 [CMD_INFO] =
 T(
@@ -4456,7 +4508,7 @@ T(
 ),
 [CMD_VERIFY] =
 T(
-"    %"TS" WIMFILE [--ref=\"GLOB\"]\n"
+"    %"TS" WIMFILE [--ref=\"GLOB\"] [--threads=NUM_THREADS]\n"
 ),
 };
 
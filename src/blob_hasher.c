@@ -0,0 +1,472 @@
+/*
+ * blob_hasher.c
+ *
+ * Calculate the SHA-1 message digests of blobs in parallel.
+ */
+
+/*
+ * Copyright (C) 2023 Eric Biggers
+ *
+ * This file is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This file is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this file; if not, see https://www.gnu.org/licenses/.
+ */
+
+/*
+ * Unhashed blobs, such as the files added by wimlib_add_image(), must be
+ * checksummed before they can be deduplicated.  Doing this one blob at a time
+ * on the thread that writes the WIM file makes SHA-1 the bottleneck of a
+ * capture from fast storage, since the compression is already parallel.
+ *
+ * A blob_hasher is given the list of blobs that will need to be checksummed, in
+ * the order in which they will be needed, and checksums them using tasks on the
+ * library's thread pool that run ahead of the consumer.  The consumer then
+ * retrieves each digest with blob_hasher_get_hash(), which only waits if the
+ * workers haven't gotten to that blob yet.  To keep the data that the consumer reads again
+ * after hashing likely to still be in the page cache, the workers run at most
+ * BLOB_HASHER_WINDOW_SIZE bytes ahead of the consumer.
+ *
+ * The workers never access the blob descriptors, since the consumer may be
+ * modifying them at the same time, including bitfields that share a word with
+ * 'blob_location'.  Instead, new_blob_hasher() copies the location of each
+ * blob's data, and the workers read the data through a private descriptor built
+ * from that copy.
+ *
+ * Small blobs are read into memory and hashed in batches with sha1_multi(),
+ * which can hash several messages at once on CPUs with wide vectors.  With
+ * many tiny files, this is much faster than hashing each blob on its own.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include "wimlib.h"
+#include "wimlib/assert.h"
+#include "wimlib/blob_hasher.h"
+#include "wimlib/blob_table.h"
+#include "wimlib/resource.h"
+#include "wimlib/threads.h"
+#include "wimlib/util.h"
+
+/* Maximum number of bytes of blob data that the worker threads may hash ahead
+ * of the consumer, not counting the blob currently needed by the consumer.  */
+#define BLOB_HASHER_WINDOW_SIZE		(64 << 20)
+
+/* Blobs no larger than this are hashed in batches of up to
+ * BLOB_HASHER_MAX_BATCH blobs.  */
+#define BLOB_HASHER_SMALL_BLOB_SIZE	32768
+#define BLOB_HASHER_MAX_BATCH		16
+
+struct hashed_blob {
+	/* The blob; only the consumer may dereference this.  */
+	const struct blob_descriptor *blob;
+
+	/* Copy of the blob's size and location, for the workers  */
+	u64 size;
+	u16 blob_location;
+	union {
+		/* BLOB_IN_WIM  */
+		struct {
+			struct wim_resource_descriptor *rdesc;
+			u64 offset_in_res;
+		};
+
+		/* BLOB_IN_FILE_ON_DISK, BLOB_IN_WINDOWS_FILE,
+		 * BLOB_IN_ATTACHED_BUFFER, BLOB_IN_NTFS_VOLUME  */
+		struct {
+			void *location;
+			struct wim_inode *file_inode;
+		};
+
+	#ifdef WITH_FUSE
+		/* BLOB_IN_STAGING_FILE  */
+		struct {
+			char *staging_file_name;
+			int staging_dir_fd;
+		};
+	#endif
+	};
+
+	u8 hash[SHA1_HASH_SIZE];
+	int status;
+	bool done;
+};
+
+struct blob_hasher {
+	struct mutex lock;
+	struct condvar result_avail_cond;
+	bool terminating;
+
+	struct thread_pool_job job;
+
+	/* Buffers for hashing batches of small blobs, one for each task that
+	 * may be running.  Entries are NULL if they couldn't be allocated.  */
+	u8 **batch_bufs;
+	unsigned num_batch_bufs;
+	unsigned num_free_batch_bufs;
+
+	struct hashed_blob *entries;
+	size_t num_entries;
+
+	/* Index of the next entry to be claimed by a worker thread, and of the
+	 * next entry to be returned to the consumer.  */
+	size_t next_claim;
+	size_t next_result;
+
+	/* Total size of the entries in the range [next_result, next_claim)  */
+	u64 bytes_in_flight;
+};
+
+static bool
+can_claim_entry(const struct blob_hasher *hasher)
+{
+	if (hasher->next_claim == hasher->num_entries)
+		return false;
+	if (hasher->next_claim == hasher->next_result)
+		return true;
+	return hasher->bytes_in_flight +
+		hasher->entries[hasher->next_claim].size <=
+			BLOB_HASHER_WINDOW_SIZE;
+}
+
+/* Copy the size and location of @blob into @entry.  */
+static void
+save_blob_location(struct hashed_blob *entry, const struct blob_descriptor *blob)
+{
+	entry->blob = blob;
+	entry->size = blob->size;
+	entry->blob_location = blob->blob_location;
+	switch (blob->blob_location) {
+	case BLOB_IN_WIM:
+		entry->rdesc = blob->rdesc;
+		entry->offset_in_res = blob->offset_in_res;
+		break;
+	case BLOB_IN_FILE_ON_DISK:
+		entry->location = blob->file_on_disk;
+		entry->file_inode = blob->file_inode;
+		break;
+#ifdef _WIN32
+	case BLOB_IN_WINDOWS_FILE:
+		entry->location = blob->windows_file;
+		entry->file_inode = blob->file_inode;
+		break;
+#endif
+	case BLOB_IN_ATTACHED_BUFFER:
+		entry->location = blob->attached_buffer;
+		break;
+#ifdef WITH_FUSE
+	case BLOB_IN_STAGING_FILE:
+		entry->staging_file_name = blob->staging_file_name;
+		entry->staging_dir_fd = blob->staging_dir_fd;
+		break;
+#endif
+#ifdef WITH_NTFS_3G
+	case BLOB_IN_NTFS_VOLUME:
+		entry->location = blob->ntfs_loc;
+		break;
+#endif
+	}
+}
+
+/* Fill in @blob, a descriptor private to the calling worker thread, with the
+ * size and location saved in @entry.  */
+static void
+load_blob_location(struct blob_descriptor *blob, const struct hashed_blob *entry)
+{
+	memset(blob, 0, sizeof(*blob));
+	blob->size = entry->size;
+	blob->blob_location = entry->blob_location;
+	switch (entry->blob_location) {
+	case BLOB_IN_WIM:
+		blob->rdesc = entry->rdesc;
+		blob->offset_in_res = entry->offset_in_res;
+		break;
+	case BLOB_IN_FILE_ON_DISK:
+		blob->file_on_disk = entry->location;
+		blob->file_inode = entry->file_inode;
+		break;
+#ifdef _WIN32
+	case BLOB_IN_WINDOWS_FILE:
+		blob->windows_file = entry->location;
+		blob->file_inode = entry->file_inode;
+		break;
+#endif
+	case BLOB_IN_ATTACHED_BUFFER:
+		blob->attached_buffer = entry->location;
+		break;
+#ifdef WITH_FUSE
+	case BLOB_IN_STAGING_FILE:
+		blob->staging_file_name = entry->staging_file_name;
+		blob->staging_dir_fd = entry->staging_dir_fd;
+		break;
+#endif
+#ifdef WITH_NTFS_3G
+	case BLOB_IN_NTFS_VOLUME:
+		blob->ntfs_loc = entry->location;
+		break;
+#endif
+	}
+}
+
+/* Hash a batch of consecutive small blobs, using @buf as a buffer of
+ * BLOB_HASHER_MAX_BATCH * BLOB_HASHER_SMALL_BLOB_SIZE bytes.  */
+static void
+hash_small_blobs(struct hashed_blob *entries, size_t num_entries, u8 *buf)
+{
+	const void *msgs[BLOB_HASHER_MAX_BATCH];
+	size_t lens[BLOB_HASHER_MAX_BATCH];
+	struct hashed_blob *msg_entries[BLOB_HASHER_MAX_BATCH];
+	u8 hashes[BLOB_HASHER_MAX_BATCH][SHA1_HASH_SIZE];
+	size_t num_msgs = 0;
+	struct blob_descriptor blob;
+
+	for (size_t i = 0; i < num_entries; i++) {
+		load_blob_location(&blob, &entries[i]);
+		entries[i].status = read_blob_into_buf(&blob, buf);
+		if (entries[i].status)
+			continue;
+		msgs[num_msgs] = buf;
+		lens[num_msgs] = entries[i].size;
+		msg_entries[num_msgs] = &entries[i];
+		num_msgs++;
+		buf += entries[i].size;
+	}
+
+	sha1_multi(msgs, lens, num_msgs, hashes);
+
+	for (size_t i = 0; i < num_msgs; i++)
+		copy_hash(msg_entries[i]->hash, hashes[i]);
+}
+
+static void
+blob_hasher_job_func(void *arg)
+{
+	struct blob_hasher *hasher = arg;
+	struct hashed_blob *entry;
+	size_t num_claimed;
+	u8 *batch_buf;
+	struct blob_descriptor blob;
+
+	mutex_lock(&hasher->lock);
+	if (hasher->terminating || !can_claim_entry(hasher))
+		goto out_unlock;
+	wimlib_assert(hasher->num_free_batch_bufs != 0);
+	batch_buf = hasher->batch_bufs[--hasher->num_free_batch_bufs];
+	do {
+		entry = &hasher->entries[hasher->next_claim++];
+		hasher->bytes_in_flight += entry->size;
+		num_claimed = 1;
+		if (batch_buf && entry->size <= BLOB_HASHER_SMALL_BLOB_SIZE) {
+			while (num_claimed < BLOB_HASHER_MAX_BATCH &&
+			       can_claim_entry(hasher) &&
+			       hasher->entries[hasher->next_claim].size <=
+					BLOB_HASHER_SMALL_BLOB_SIZE)
+			{
+				hasher->bytes_in_flight +=
+					hasher->entries[hasher->next_claim++].size;
+				num_claimed++;
+			}
+		}
+		mutex_unlock(&hasher->lock);
+
+		if (num_claimed > 1)
+			hash_small_blobs(entry, num_claimed, batch_buf);
+		else {
+			load_blob_location(&blob, entry);
+			entry->status = sha1_blob_data(&blob, entry->hash);
+		}
+
+		mutex_lock(&hasher->lock);
+		for (size_t i = 0; i < num_claimed; i++)
+			entry[i].done = true;
+		condvar_broadcast(&hasher->result_avail_cond);
+	} while (!hasher->terminating && can_claim_entry(hasher));
+	hasher->batch_bufs[hasher->num_free_batch_bufs++] = batch_buf;
+out_unlock:
+	mutex_unlock(&hasher->lock);
+}
+
+/*
+ * Start calculating the SHA-1 message digests of the specified blobs, using up
+ * to @num_threads threads of the thread pool (0 means the number of
+ * processors).  The digests should be retrieved with blob_hasher_get_hash() in
+ * the same order as the blobs are given here.  The data the blobs' locations
+ * refer to (files, resources, buffers) must remain valid until the digests have
+ * been retrieved or the blob_hasher has been freed.
+ *
+ * Returns 0 on success, a negative value if multithreaded hashing is not worth
+ * it (in which case the caller should hash the blobs itself), or a positive
+ * wimlib error code.
+ */
+int
+new_blob_hasher(struct blob_descriptor * const *blobs, size_t num_blobs,
+		unsigned num_threads, struct blob_hasher **hasher_ret)
+{
+	struct blob_hasher *hasher;
+
+	if (num_threads == 0)
+		num_threads = get_available_cpus();
+	if (num_threads > num_blobs)
+		num_threads = num_blobs;
+	if (num_threads <= 1)
+		return -1;
+	num_threads = thread_pool_reserve(num_threads);
+	if (num_threads <= 1)
+		return -1;
+
+	hasher = CALLOC(1, sizeof(*hasher));
+	if (!hasher)
+		goto err;
+	hasher->entries = MALLOC(num_blobs * sizeof(hasher->entries[0]));
+	if (!hasher->entries)
+		goto err_free_hasher;
+	for (size_t i = 0; i < num_blobs; i++) {
+		save_blob_location(&hasher->entries[i], blobs[i]);
+		hasher->entries[i].done = false;
+		blobs[i]->hasher_index = i;
+	}
+	hasher->num_entries = num_blobs;
+
+	hasher->batch_bufs = CALLOC(num_threads, sizeof(hasher->batch_bufs[0]));
+	if (!hasher->batch_bufs)
+		goto err_free_entries;
+	/* If these fail, just hash the small blobs one at a time.  */
+	for (unsigned i = 0; i < num_threads; i++)
+		hasher->batch_bufs[i] = MALLOC(BLOB_HASHER_MAX_BATCH *
+					       BLOB_HASHER_SMALL_BLOB_SIZE);
+	hasher->num_batch_bufs = num_threads;
+	hasher->num_free_batch_bufs = num_threads;
+
+	if (!mutex_init(&hasher->lock))
+		goto err_free_batch_bufs;
+	if (!condvar_init(&hasher->result_avail_cond))
+		goto err_destroy_lock;
+	if (!thread_pool_job_init(&hasher->job, blob_hasher_job_func, hasher,
+				  num_threads))
+		goto err_destroy_result_avail_cond;
+
+	for (unsigned i = 0; i < num_threads; i++)
+		thread_pool_job_kick(&hasher->job);
+	*hasher_ret = hasher;
+	return 0;
+
+err_destroy_result_avail_cond:
+	condvar_destroy(&hasher->result_avail_cond);
+err_destroy_lock:
+	mutex_destroy(&hasher->lock);
+err_free_batch_bufs:
+	for (unsigned i = 0; i < hasher->num_batch_bufs; i++)
+		FREE(hasher->batch_bufs[i]);
+	FREE(hasher->batch_bufs);
+err_free_entries:
+	FREE(hasher->entries);
+err_free_hasher:
+	FREE(hasher);
+err:
+	return WIMLIB_ERR_NOMEM;
+}
+
+/*
+ * Get the SHA-1 message digest of the specified blob, waiting for a task on the
+ * thread pool to calculate it if needed.  Blobs that were given to
+ * new_blob_hasher() but are skipped over are assumed to be no longer needed.
+ * If the blob isn't one of the remaining blobs of the blob_hasher, or if
+ * @hasher is NULL, the digest is calculated directly.  Either way, finding the
+ * blob takes constant time.
+ *
+ * Returns 0 on success, or a nonzero error code if the blob's data could not be
+ * read.
+ */
+int
+blob_hasher_get_hash(struct blob_hasher *hasher,
+		     const struct blob_descriptor *blob,
+		     u8 hash[SHA1_HASH_SIZE])
+{
+	struct hashed_blob *entry;
+	size_t i;
+	bool more_work;
+	int ret;
+
+	if (!hasher)
+		return sha1_blob_data(blob, hash);
+
+	/* The index recorded by new_blob_hasher() may be stale, from another
+	 * blob_hasher, so check that the entry really is this blob's.  */
+	i = blob->hasher_index;
+	if (!blob->unhashed || i >= hasher->num_entries ||
+	    hasher->entries[i].blob != blob)
+		return sha1_blob_data(blob, hash);
+
+	mutex_lock(&hasher->lock);
+	if (i < hasher->next_result) {
+		mutex_unlock(&hasher->lock);
+		return sha1_blob_data(blob, hash);
+	}
+
+	/* Retire the skipped entries, and make sure the workers don't start on
+	 * any of them.  */
+	for (; hasher->next_result < i; hasher->next_result++) {
+		if (hasher->next_result < hasher->next_claim)
+			hasher->bytes_in_flight -=
+				hasher->entries[hasher->next_result].size;
+	}
+	if (hasher->next_claim < i)
+		hasher->next_claim = i;
+
+	entry = &hasher->entries[i];
+	if (hasher->next_claim == i) {
+		/* The workers haven't gotten to this blob yet, so hash it
+		 * here rather than waiting.  */
+		hasher->next_claim++;
+		hasher->next_result++;
+		more_work = can_claim_entry(hasher);
+		mutex_unlock(&hasher->lock);
+		if (more_work)
+			thread_pool_job_kick(&hasher->job);
+		return sha1_blob_data(blob, hash);
+	}
+	while (!entry->done)
+		condvar_wait(&hasher->result_avail_cond, &hasher->lock);
+	copy_hash(hash, entry->hash);
+	ret = entry->status;
+	hasher->next_result++;
+	hasher->bytes_in_flight -= entry->size;
+	more_work = can_claim_entry(hasher);
+	mutex_unlock(&hasher->lock);
+	/* Space opened up in the window, so more blobs may be claimable.  */
+	if (more_work)
+		thread_pool_job_kick(&hasher->job);
+	return ret;
+}
+
+/* Stop the tasks of a blob_hasher and free it.  */
+void
+free_blob_hasher(struct blob_hasher *hasher)
+{
+	if (!hasher)
+		return;
+
+	mutex_lock(&hasher->lock);
+	hasher->terminating = true;
+	mutex_unlock(&hasher->lock);
+
+	thread_pool_job_destroy(&hasher->job);
+
+	condvar_destroy(&hasher->result_avail_cond);
+	mutex_destroy(&hasher->lock);
+	for (unsigned i = 0; i < hasher->num_batch_bufs; i++)
+		FREE(hasher->batch_bufs[i]);
+	FREE(hasher->batch_bufs);
+	FREE(hasher->entries);
+	FREE(hasher);
+}
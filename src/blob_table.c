@@ -36,6 +36,7 @@
 #include "wimlib/assert.h"
 #include "wimlib/bitops.h"
 #include "wimlib/blob_table.h"
+#include "wimlib/chunk_cache.h"
 #include "wimlib/dentry.h"
 #include "wimlib/encoding.h"
 #include "wimlib/endianness.h"
@@ -168,6 +169,9 @@ blob_release_location(struct blob_descriptor *blob)
 
 		list_del(&blob->rdesc_node);
 		if (list_empty(&rdesc->blob_list)) {
+			if (rdesc->num_cached_chunks)
+				chunk_cache_invalidate_resource(rdesc->wim->chunk_cache,
+								rdesc);
 			wim_decrement_refcnt(rdesc->wim);
 			FREE(rdesc);
 		}
@@ -1297,38 +1301,35 @@ after_blob_hashed(struct blob_descriptor *blob,
 }
 
 /*
- * Calculate the SHA-1 message digest of a blob and move its descriptor from the
- * list of unhashed blobs to the blob table, possibly joining it with an
+ * Set the SHA-1 message digest of an unhashed blob and move its descriptor from
+ * the list of unhashed blobs to the blob table, possibly joining it with an
  * identical blob.
  *
  * @blob:
- *	The blob to hash
+ *	The unhashed blob
+ * @hash:
+ *	The SHA-1 message digest of the blob's data
  * @blob_table:
  *	The blob table in which the blob needs to be indexed
- * @blob_ret:
- *	On success, a pointer to the resulting blob descriptor is written to
- *	this location.  This will be the same as @blob if it was inserted into
- *	the blob table, or different if a duplicate blob was found.
  *
- * Returns 0 on success; nonzero if there is an error reading the blob data.
+ * Returns a pointer to the resulting blob descriptor.  This will be the same as
+ * @blob if it was inserted into the blob table, or different if a duplicate
+ * blob was found.
  */
-int
-hash_unhashed_blob(struct blob_descriptor *blob, struct blob_table *blob_table,
-		   struct blob_descriptor **blob_ret)
+struct blob_descriptor *
+set_unhashed_blob_hash(struct blob_descriptor *blob,
+		       const u8 hash[SHA1_HASH_SIZE],
+		       struct blob_table *blob_table)
 {
 	struct blob_descriptor **back_ptr;
 	struct wim_inode *inode;
-	int ret;
 
 	back_ptr = retrieve_pointer_to_unhashed_blob(blob);
 	inode = blob->back_inode;
 
-	ret = sha1_blob(blob);
-	if (ret)
-		return ret;
+	copy_hash(blob->hash, hash);
 
-	*blob_ret = after_blob_hashed(blob, back_ptr, blob_table, inode);
-	return 0;
+	return after_blob_hashed(blob, back_ptr, blob_table, inode);
 }
 
 void
@@ -0,0 +1,222 @@
+/*
+ * chunk_cache.c - cache of decompressed chunks for random-access reads
+ */
+
+/*
+ * Copyright (C) 2023 Eric Biggers
+ *
+ * This file is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This file is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this file; if not, see https://www.gnu.org/licenses/.
+ */
+
+/*
+ * Reading a small range of data from a compressed resource requires reading
+ * and decompressing every chunk that overlaps the range.  When a program reads
+ * a file sequentially in small pieces, as happens with a mounted WIM image,
+ * this means that each chunk is decompressed over and over again.  With the
+ * large chunks used in solid resources, that makes reads extremely slow.
+ *
+ * To avoid this, random-access reads go through a per-WIMStruct cache of
+ * decompressed chunks.  The cache is a hash table indexed by (resource, chunk
+ * index), and the total size of the cached data is bounded by evicting the
+ * least recently used chunks.  Entries are removed when their resource
+ * descriptor is freed, so a resource descriptor pointer can never refer to
+ * stale data.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include "wimlib/assert.h"
+#include "wimlib/bitops.h"
+#include "wimlib/chunk_cache.h"
+#include "wimlib/resource.h"
+#include "wimlib/util.h"
+
+static size_t
+hash_chunk(const struct chunk_cache *cache,
+	   const struct wim_resource_descriptor *rdesc, u64 chunk_idx)
+{
+	return hash_u64((uintptr_t)rdesc + chunk_idx) & (cache->capacity - 1);
+}
+
+/* Allocate a new, empty chunk cache that can hold up to @max_size bytes of
+ * decompressed data.  Returns NULL if out of memory.  */
+struct chunk_cache *
+new_chunk_cache(u64 max_size)
+{
+	struct chunk_cache *cache;
+
+	cache = MALLOC(sizeof(*cache));
+	if (!cache)
+		return NULL;
+	cache->capacity = 64;
+	cache->array = CALLOC(cache->capacity, sizeof(cache->array[0]));
+	if (!cache->array) {
+		FREE(cache);
+		return NULL;
+	}
+	cache->filled = 0;
+	INIT_LIST_HEAD(&cache->lru_list);
+	cache->cur_size = 0;
+	cache->max_size = max_size;
+	return cache;
+}
+
+static void
+remove_entry(struct chunk_cache *cache, struct chunk_cache_entry *entry)
+{
+	hlist_del(&entry->hash_node);
+	list_del(&entry->lru_node);
+	cache->filled--;
+	cache->cur_size -= entry->size;
+	uncharge_memory(entry->size);
+	entry->rdesc->num_cached_chunks--;
+	FREE(entry);
+}
+
+/* Free a chunk cache, including all the data in it.  */
+void
+free_chunk_cache(struct chunk_cache *cache)
+{
+	struct chunk_cache_entry *entry, *tmp;
+
+	if (!cache)
+		return;
+	list_for_each_entry_safe(entry, tmp, &cache->lru_list, lru_node)
+		remove_entry(cache, entry);
+	FREE(cache->array);
+	FREE(cache);
+}
+
+/* Allocate a cache entry for the specified chunk, with space for @size bytes of
+ * uncompressed data.  The caller must fill in the data, then either pass the
+ * entry to chunk_cache_insert() or free it with FREE().  */
+struct chunk_cache_entry *
+new_chunk_cache_entry(struct wim_resource_descriptor *rdesc, u64 chunk_idx,
+		      u32 size)
+{
+	struct chunk_cache_entry *entry;
+
+	entry = MALLOC(sizeof(*entry) + size);
+	if (!entry)
+		return NULL;
+	entry->rdesc = rdesc;
+	entry->chunk_idx = chunk_idx;
+	entry->size = size;
+	return entry;
+}
+
+/* Look up a chunk in the cache.  If found, the chunk is marked as the most
+ * recently used one and its data is returned; otherwise NULL is returned.  */
+const u8 *
+chunk_cache_lookup(struct chunk_cache *cache,
+		   const struct wim_resource_descriptor *rdesc, u64 chunk_idx)
+{
+	struct chunk_cache_entry *entry;
+
+	if (!rdesc->num_cached_chunks)
+		return NULL;
+
+	hlist_for_each_entry(entry,
+			     &cache->array[hash_chunk(cache, rdesc, chunk_idx)],
+			     hash_node)
+	{
+		if (entry->rdesc == rdesc && entry->chunk_idx == chunk_idx) {
+			list_move(&entry->lru_node, &cache->lru_list);
+			return entry->data;
+		}
+	}
+	return NULL;
+}
+
+/* Double the capacity of the chunk cache's hash table.  */
+static void
+enlarge_chunk_cache(struct chunk_cache *cache)
+{
+	const size_t old_capacity = cache->capacity;
+	const size_t new_capacity = old_capacity * 2;
+	struct hlist_head *old_array = cache->array;
+	struct hlist_head *new_array;
+	struct chunk_cache_entry *entry;
+	struct hlist_node *tmp;
+
+	new_array = CALLOC(new_capacity, sizeof(struct hlist_head));
+	if (!new_array)
+		return;
+	cache->array = new_array;
+	cache->capacity = new_capacity;
+	for (size_t i = 0; i < old_capacity; i++) {
+		hlist_for_each_entry_safe(entry, tmp, &old_array[i], hash_node) {
+			hlist_add_head(&entry->hash_node,
+				       &new_array[hash_chunk(cache, entry->rdesc,
+							     entry->chunk_idx)]);
+		}
+	}
+	FREE(old_array);
+}
+
+/*
+ * Insert a filled-in entry into the cache, evicting the least recently used
+ * chunks as needed to stay within the size limit and the library's memory
+ * budget.  If the chunk doesn't fit in the memory budget even with the cache
+ * empty, it's just freed.  The cache takes ownership of the entry.  The chunk
+ * must not already be in the cache, and its size must not exceed the size
+ * limit.
+ */
+void
+chunk_cache_insert(struct chunk_cache *cache, struct chunk_cache_entry *entry)
+{
+	wimlib_assert(entry->size <= cache->max_size);
+
+	while (cache->cur_size != 0 &&
+	       (cache->cur_size + entry->size > cache->max_size ||
+		get_memory_budget() < entry->size))
+	{
+		remove_entry(cache, list_last_entry(&cache->lru_list,
+						    struct chunk_cache_entry,
+						    lru_node));
+	}
+	if (get_memory_budget() < entry->size) {
+		FREE(entry);
+		return;
+	}
+
+	hlist_add_head(&entry->hash_node,
+		       &cache->array[hash_chunk(cache, entry->rdesc,
+						entry->chunk_idx)]);
+	list_add(&entry->lru_node, &cache->lru_list);
+	cache->cur_size += entry->size;
+	charge_memory(entry->size);
+	entry->rdesc->num_cached_chunks++;
+	if (++cache->filled > cache->capacity)
+		enlarge_chunk_cache(cache);
+}
+
+/* Remove all chunks of the specified resource from the cache.  This must be
+ * called before freeing a resource descriptor that has chunks cached.  */
+void
+chunk_cache_invalidate_resource(struct chunk_cache *cache,
+				struct wim_resource_descriptor *rdesc)
+{
+	struct chunk_cache_entry *entry, *tmp;
+
+	list_for_each_entry_safe(entry, tmp, &cache->lru_list, lru_node) {
+		if (entry->rdesc == rdesc) {
+			remove_entry(cache, entry);
+			if (!rdesc->num_cached_chunks)
+				break;
+		}
+	}
+}
@@ -36,21 +36,6 @@
 #include "wimlib/threads.h"
 #include "wimlib/util.h"
 
-struct message_queue {
-	struct list_head list;
-	struct mutex lock;
-	struct condvar msg_avail_cond;
-	struct condvar space_avail_cond;
-	bool terminating;
-};
-
-struct compressor_thread_data {
-	struct thread thread;
-	struct message_queue *chunks_to_compress_queue;
-	struct message_queue *compressed_chunks_queue;
-	struct wimlib_compressor *compressor;
-};
-
 #define MAX_CHUNKS_PER_MSG 16
 
 struct message {
@@ -60,19 +45,94 @@ struct message {
 	u32 compressed_chunk_sizes[MAX_CHUNKS_PER_MSG];
 	size_t num_filled_chunks;
 	size_t num_alloc_chunks;
+	size_t batch_size;
 	struct list_head list;
 	bool complete;
 	struct list_head submission_list;
 };
 
+/*
+ * A bounded multi-producer, multi-consumer queue of messages that doesn't use
+ * locks (Dmitry Vyukov's algorithm).  Each cell has a sequence number which
+ * says whether the cell is ready to be filled or emptied in the current lap
+ * around the ring, so producers and consumers only contend on their own
+ * position counter, and only briefly.
+ */
+struct msg_ring_cell {
+	size_t seq;
+	struct message *msg;
+};
+
+struct msg_ring {
+	struct msg_ring_cell *cells;
+	size_t mask;
+	u8 _pad1[64];
+	size_t enqueue_pos;
+	u8 _pad2[64];
+	size_t dequeue_pos;
+	u8 _pad3[64];
+};
+
+/* Number of times to poll for work or for a result before going to sleep  */
+#define COMPRESSOR_SPIN_COUNT	1000
+
+/* Minimum number of messages between adjustments of the batch size and of the
+ * number of tasks  */
+#define ADAPT_INTERVAL_MIN	32
+
+/*
+ * The chunks are compressed by tasks on the library's thread pool.  Each task
+ * borrows one of the compressors for as long as it runs, and there are never
+ * more tasks than compressors, so a task always finds one free.  A task that
+ * runs out of messages to compress polls the queue for a little while before
+ * returning, and the main thread likewise polls for the result it needs before
+ * sleeping on @msg_complete_cond, since with fast compression types a message
+ * is often just about to arrive.
+ *
+ * How many chunks go in each message and how many tasks may run at once aren't
+ * fixed up front, since the best values depend on how fast the data arrives
+ * relative to how fast it compresses, which varies during a write.  Instead the
+ * main thread counts how often it had to wait for a result and how often tasks
+ * ran out of work, and periodically adjusts both; see adapt_to_workload().
+ */
 struct parallel_chunk_compressor {
 	struct chunk_compressor base;
 
-	struct message_queue chunks_to_compress_queue;
-	struct message_queue compressed_chunks_queue;
-	struct compressor_thread_data *thread_data;
-	unsigned num_thread_data;
-	unsigned num_started_threads;
+	struct msg_ring chunks_to_compress;
+	bool terminating;
+
+	/* Protects the free compressors, and is held by the main thread while
+	 * it's waiting on @msg_complete_cond.  */
+	struct mutex lock;
+	struct condvar msg_complete_cond;
+	bool main_thread_waiting;
+	bool initialized_sync;
+
+	struct thread_pool_job job;
+	bool initialized_job;
+
+	/* Number of tasks currently in compressor_job_func(), and the number
+	 * the main thread wants at most  */
+	unsigned num_running_tasks;
+	unsigned target_tasks;
+
+	/* Statistics for adapt_to_workload()  */
+	size_t num_idle_exits;
+	size_t last_idle_exits;
+	size_t num_stalls;
+	size_t msgs_since_adapt;
+
+	/* Current and maximum number of chunks to put in each message.  The
+	 * chunk buffers are allocated as the batch size grows.  */
+	size_t chunks_per_msg;
+	size_t max_chunks_per_msg;
+
+	/* Bytes charged against the memory budget  */
+	u64 mem_charged;
+
+	struct wimlib_compressor **compressors;
+	unsigned num_compressors;
+	unsigned num_free_compressors;
 
 	struct message *msgs;
 	size_t num_messages;
@@ -84,83 +144,99 @@ struct parallel_chunk_compressor {
 	size_t next_chunk_idx;
 };
 
-
-
-static int
-message_queue_init(struct message_queue *q)
+static bool
+msg_ring_init(struct msg_ring *ring, size_t min_size)
 {
-	if (!mutex_init(&q->lock))
-		goto err;
-	if (!condvar_init(&q->msg_avail_cond))
-		goto err_destroy_lock;
-	if (!condvar_init(&q->space_avail_cond))
-		goto err_destroy_msg_avail_cond;
-	INIT_LIST_HEAD(&q->list);
-	return 0;
-
-err_destroy_msg_avail_cond:
-	condvar_destroy(&q->msg_avail_cond);
-err_destroy_lock:
-	mutex_destroy(&q->lock);
-err:
-	return WIMLIB_ERR_NOMEM;
+	size_t size = 1;
+
+	while (size < min_size)
+		size <<= 1;
+	ring->cells = MALLOC(size * sizeof(ring->cells[0]));
+	if (!ring->cells)
+		return false;
+	for (size_t i = 0; i < size; i++)
+		ring->cells[i].seq = i;
+	ring->mask = size - 1;
+	ring->enqueue_pos = 0;
+	ring->dequeue_pos = 0;
+	return true;
 }
 
 static void
-message_queue_destroy(struct message_queue *q)
+msg_ring_destroy(struct msg_ring *ring)
 {
-	if (q->list.next != NULL) {
-		mutex_destroy(&q->lock);
-		condvar_destroy(&q->msg_avail_cond);
-		condvar_destroy(&q->space_avail_cond);
-	}
+	FREE(ring->cells);
 }
 
-static void
-message_queue_put(struct message_queue *q, struct message *msg)
+/* Add a message to the ring.  Returns false if the ring is full.  */
+static bool
+msg_ring_put(struct msg_ring *ring, struct message *msg)
 {
-	mutex_lock(&q->lock);
-	list_add_tail(&msg->list, &q->list);
-	condvar_signal(&q->msg_avail_cond);
-	mutex_unlock(&q->lock);
+	size_t pos = atomic_load_relaxed(&ring->enqueue_pos);
+	struct msg_ring_cell *cell;
+	ptrdiff_t diff;
+
+	for (;;) {
+		cell = &ring->cells[pos & ring->mask];
+		diff = (ptrdiff_t)(atomic_load_acquire(&cell->seq) - pos);
+		if (diff == 0) {
+			if (atomic_cmpxchg_weak_relaxed(&ring->enqueue_pos,
+							&pos, pos + 1))
+				break;
+		} else if (diff < 0) {
+			return false;
+		} else {
+			pos = atomic_load_relaxed(&ring->enqueue_pos);
+		}
+	}
+	cell->msg = msg;
+	atomic_store_release(&cell->seq, pos + 1);
+	return true;
 }
 
+/* Remove a message from the ring.  Returns NULL if the ring is empty.  */
 static struct message *
-message_queue_get(struct message_queue *q)
+msg_ring_get(struct msg_ring *ring)
 {
+	size_t pos = atomic_load_relaxed(&ring->dequeue_pos);
+	struct msg_ring_cell *cell;
 	struct message *msg;
+	ptrdiff_t diff;
 
-	mutex_lock(&q->lock);
-	while (list_empty(&q->list) && !q->terminating)
-		condvar_wait(&q->msg_avail_cond, &q->lock);
-	if (!q->terminating) {
-		msg = list_entry(q->list.next, struct message, list);
-		list_del(&msg->list);
-	} else
-		msg = NULL;
-	mutex_unlock(&q->lock);
+	for (;;) {
+		cell = &ring->cells[pos & ring->mask];
+		diff = (ptrdiff_t)(atomic_load_acquire(&cell->seq) - (pos + 1));
+		if (diff == 0) {
+			if (atomic_cmpxchg_weak_relaxed(&ring->dequeue_pos,
+							&pos, pos + 1))
+				break;
+		} else if (diff < 0) {
+			return NULL;
+		} else {
+			pos = atomic_load_relaxed(&ring->dequeue_pos);
+		}
+	}
+	msg = cell->msg;
+	atomic_store_release(&cell->seq, pos + ring->mask + 1);
 	return msg;
 }
 
-static void
-message_queue_terminate(struct message_queue *q)
-{
-	mutex_lock(&q->lock);
-	q->terminating = true;
-	condvar_broadcast(&q->msg_avail_cond);
-	mutex_unlock(&q->lock);
-}
-
+/* Make sure @msg has buffers for at least @num_chunks chunks.  */
 static int
-init_message(struct message *msg, size_t num_chunks, u32 out_chunk_size)
+grow_message(struct message *msg, size_t num_chunks, u32 out_chunk_size)
 {
-	msg->num_alloc_chunks = num_chunks;
-	for (size_t i = 0; i < num_chunks; i++) {
+	while (msg->num_alloc_chunks < num_chunks) {
+		size_t i = msg->num_alloc_chunks;
+
 		msg->compressed_chunks[i] = MALLOC(out_chunk_size - 1);
 		msg->uncompressed_chunks[i] = MALLOC(out_chunk_size);
 		if (msg->compressed_chunks[i] == NULL ||
-		    msg->uncompressed_chunks[i] == NULL)
+		    msg->uncompressed_chunks[i] == NULL) {
+			FREE(msg->compressed_chunks[i]);
+			FREE(msg->uncompressed_chunks[i]);
 			return WIMLIB_ERR_NOMEM;
+		}
+		msg->num_alloc_chunks++;
 	}
 	return 0;
 }
@@ -193,7 +269,7 @@ allocate_messages(size_t count, size_t chunks_per_msg, u32 out_chunk_size)
 	if (msgs == NULL)
 		return NULL;
 	for (size_t i = 0; i < count; i++) {
-		if (init_message(&msgs[i], chunks_per_msg, out_chunk_size)) {
+		if (grow_message(&msgs[i], chunks_per_msg, out_chunk_size)) {
 			free_messages(msgs, count);
 			return NULL;
 		}
@@ -216,43 +292,93 @@ compress_chunks(struct message *msg, struct wimlib_compressor *compressor)
 	}
 }
 
-static void *
-compressor_thread_proc(void *arg)
+static void
+compressor_job_func(void *arg)
 {
-	struct compressor_thread_data *params = arg;
+	struct parallel_chunk_compressor *ctx = arg;
+	struct wimlib_compressor *compressor = NULL;
 	struct message *msg;
+	unsigned spins = 0;
+
+	if (atomic_add_seq_cst(&ctx->num_running_tasks, 1) >
+	    atomic_load_relaxed(&ctx->target_tasks))
+		goto stop;
+
+	while (!atomic_load_relaxed(&ctx->terminating)) {
+		msg = msg_ring_get(&ctx->chunks_to_compress);
+		if (!msg) {
+			if (++spins <= COMPRESSOR_SPIN_COUNT) {
+				cpu_relax();
+				continue;
+			}
+			atomic_add_relaxed(&ctx->num_idle_exits, 1);
+		stop:
+			/* The main thread doesn't start a task for a new
+			 * message if it sees that enough are running already,
+			 * so check for work once more after no longer counting
+			 * as running.  This pairs with the fence in
+			 * submit_compression_msg().  */
+			atomic_add_seq_cst(&ctx->num_running_tasks, -1);
+			atomic_fence_seq_cst();
+			msg = msg_ring_get(&ctx->chunks_to_compress);
+			if (!msg)
+				break;
+			atomic_add_seq_cst(&ctx->num_running_tasks, 1);
+		}
+		spins = 0;
+		if (!compressor) {
+			mutex_lock(&ctx->lock);
+			wimlib_assert(ctx->num_free_compressors != 0);
+			compressor = ctx->compressors[--ctx->num_free_compressors];
+			mutex_unlock(&ctx->lock);
+		}
 
-	while ((msg = message_queue_get(params->chunks_to_compress_queue)) != NULL) {
-		compress_chunks(msg, params->compressor);
-		message_queue_put(params->compressed_chunks_queue, msg);
+		compress_chunks(msg, compressor);
+
+		/* This pairs with the main thread's write of
+		 * main_thread_waiting and read of msg->complete, so that
+		 * either it sees the message is complete, or it gets woken
+		 * up.  */
+		atomic_store_seq_cst(&msg->complete, true);
+		if (atomic_load_seq_cst(&ctx->main_thread_waiting)) {
+			mutex_lock(&ctx->lock);
+			condvar_signal(&ctx->msg_complete_cond);
+			mutex_unlock(&ctx->lock);
+		}
+	}
+	if (compressor) {
+		mutex_lock(&ctx->lock);
+		ctx->compressors[ctx->num_free_compressors++] = compressor;
+		mutex_unlock(&ctx->lock);
 	}
-	return NULL;
 }
 
 static void
 parallel_chunk_compressor_destroy(struct chunk_compressor *_ctx)
 {
 	struct parallel_chunk_compressor *ctx = (struct parallel_chunk_compressor *)_ctx;
-	unsigned i;
 
 	if (ctx == NULL)
 		return;
 
-	if (ctx->num_started_threads != 0) {
-		message_queue_terminate(&ctx->chunks_to_compress_queue);
+	if (ctx->initialized_job) {
+		atomic_store_relaxed(&ctx->terminating, true);
+		thread_pool_job_destroy(&ctx->job);
+	}
 
-		for (i = 0; i < ctx->num_started_threads; i++)
-			thread_join(&ctx->thread_data[i].thread);
+	if (ctx->initialized_sync) {
+		condvar_destroy(&ctx->msg_complete_cond);
+		mutex_destroy(&ctx->lock);
 	}
 
-	message_queue_destroy(&ctx->chunks_to_compress_queue);
-	message_queue_destroy(&ctx->compressed_chunks_queue);
+	msg_ring_destroy(&ctx->chunks_to_compress);
 
-	if (ctx->thread_data != NULL)
-		for (i = 0; i < ctx->num_thread_data; i++)
-			wimlib_free_compressor(ctx->thread_data[i].compressor);
+	uncharge_memory(ctx->mem_charged);
 
-	FREE(ctx->thread_data);
+	if (ctx->compressors != NULL)
+		for (unsigned i = 0; i < ctx->num_compressors; i++)
+			wimlib_free_compressor(ctx->compressors[i]);
+	FREE(ctx->compressors);
 
 	free_messages(ctx->msgs, ctx->num_messages);
 
@@ -263,13 +389,64 @@ static void
 submit_compression_msg(struct parallel_chunk_compressor *ctx)
 {
 	struct message *msg = ctx->next_submit_msg;
+	bool ok;
 
 	msg->complete = false;
 	list_add_tail(&msg->submission_list, &ctx->submitted_msgs);
-	message_queue_put(&ctx->chunks_to_compress_queue, msg);
+	/* The ring has room for all the messages, so this can't fail.  */
+	ok = msg_ring_put(&ctx->chunks_to_compress, msg);
+	wimlib_assert(ok);
+	atomic_fence_seq_cst();
+	if (atomic_load_relaxed(&ctx->num_running_tasks) < ctx->target_tasks)
+		thread_pool_job_kick(&ctx->job);
 	ctx->next_submit_msg = NULL;
 }
 
+/* Wait for a compression task to finish with @msg.  */
+static void
+wait_for_message(struct parallel_chunk_compressor *ctx, struct message *msg)
+{
+	if (atomic_load_acquire(&msg->complete))
+		return;
+	ctx->num_stalls++;
+	for (unsigned i = 0; i < COMPRESSOR_SPIN_COUNT; i++) {
+		if (atomic_load_acquire(&msg->complete))
+			return;
+		cpu_relax();
+	}
+	mutex_lock(&ctx->lock);
+	atomic_store_seq_cst(&ctx->main_thread_waiting, true);
+	while (!atomic_load_seq_cst(&msg->complete))
+		condvar_wait(&ctx->msg_complete_cond, &ctx->lock);
+	atomic_store_relaxed(&ctx->main_thread_waiting, false);
+	mutex_unlock(&ctx->lock);
+}
+
+/* Give @msg buffers for the current batch size, if the memory budget allows.
+ * If it doesn't, stop growing the batches.  */
+static void
+grow_message_to_batch_size(struct parallel_chunk_compressor *ctx,
+			   struct message *msg)
+{
+	const u32 chunk_size = ctx->base.out_chunk_size;
+	const size_t old_alloc_chunks = msg->num_alloc_chunks;
+	u64 cost;
+
+	if (ctx->chunks_per_msg <= old_alloc_chunks)
+		return;
+
+	if ((u64)(ctx->chunks_per_msg - old_alloc_chunks) * chunk_size >
+			get_memory_budget() ||
+	    grow_message(msg, ctx->chunks_per_msg, chunk_size))
+	{
+		ctx->max_chunks_per_msg = msg->num_alloc_chunks;
+		ctx->chunks_per_msg = msg->num_alloc_chunks;
+	}
+	cost = (u64)(msg->num_alloc_chunks - old_alloc_chunks) * chunk_size;
+	charge_memory(cost);
+	ctx->mem_charged += cost;
+}
+
 static void *
 parallel_chunk_compressor_get_chunk_buffer(struct chunk_compressor *_ctx)
 {
@@ -284,6 +461,8 @@ parallel_chunk_compressor_get_chunk_buffer(struct chunk_compressor *_ctx)
 
 		msg = list_entry(ctx->available_msgs.next, struct message, list);
 		list_del(&msg->list);
+		grow_message_to_batch_size(ctx, msg);
+		msg->batch_size = min(ctx->chunks_per_msg, msg->num_alloc_chunks);
 		ctx->next_submit_msg = msg;
 		msg->num_filled_chunks = 0;
 	}
@@ -303,10 +482,51 @@ parallel_chunk_compressor_signal_chunk_filled(struct chunk_compressor *_ctx, u32
 
 	msg = ctx->next_submit_msg;
 	msg->uncompressed_chunk_sizes[msg->num_filled_chunks] = usize;
-	if (++msg->num_filled_chunks == msg->num_alloc_chunks)
+	if (++msg->num_filled_chunks == msg->batch_size)
 		submit_compression_msg(ctx);
 }
 
+/*
+ * Adjust the batch size and the number of tasks based on what happened since
+ * the last call:
+ *
+ * - If the main thread often had to wait for results while the tasks rarely
+ *   ran out of work, compression is the bottleneck, so allow another task.
+ * - If the main thread often waited but tasks also often ran out of work, the
+ *   messages are too coarse-grained to keep the tasks busy, so make them
+ *   smaller.
+ * - If the tasks often ran out of work but the main thread rarely waited, the
+ *   data can't be supplied fast enough, so use one task fewer and make the
+ *   messages bigger to reduce the number of handoffs.
+ */
+static void
+adapt_to_workload(struct parallel_chunk_compressor *ctx)
+{
+	size_t idle_exits = atomic_load_relaxed(&ctx->num_idle_exits);
+	size_t interval = ctx->msgs_since_adapt;
+	bool stalled = ctx->num_stalls * 4 > interval;
+	bool idle = (idle_exits - ctx->last_idle_exits) * 4 > interval;
+
+	if (stalled && !idle) {
+		if (ctx->target_tasks < ctx->num_compressors)
+			atomic_store_relaxed(&ctx->target_tasks,
+					     ctx->target_tasks + 1);
+	} else if (stalled && idle) {
+		if (ctx->chunks_per_msg > 1)
+			ctx->chunks_per_msg--;
+	} else if (idle) {
+		if (ctx->target_tasks > 1)
+			atomic_store_relaxed(&ctx->target_tasks,
+					     ctx->target_tasks - 1);
+		if (ctx->chunks_per_msg < ctx->max_chunks_per_msg)
+			ctx->chunks_per_msg++;
+	}
+
+	ctx->last_idle_exits = idle_exits;
+	ctx->num_stalls = 0;
+	ctx->msgs_since_adapt = 0;
+}
+
 static bool
 parallel_chunk_compressor_get_compression_result(struct chunk_compressor *_ctx,
 						 const void **cdata_ret, u32 *csize_ret,
@@ -324,10 +544,9 @@ parallel_chunk_compressor_get_compression_result(struct chunk_compressor *_ctx,
 		if (list_empty(&ctx->submitted_msgs))
 			return false;
 
-		while (!(msg = list_entry(ctx->submitted_msgs.next,
-					  struct message,
-					  submission_list))->complete)
-			message_queue_get(&ctx->compressed_chunks_queue)->complete = true;
+		msg = list_entry(ctx->submitted_msgs.next, struct message,
+				 submission_list);
+		wait_for_message(ctx, msg);
 
 		ctx->next_ready_msg = msg;
 		ctx->next_chunk_idx = 0;
@@ -346,20 +565,37 @@ parallel_chunk_compressor_get_compression_result(struct chunk_compressor *_ctx,
 		list_del(&msg->submission_list);
 		list_add_tail(&msg->list, &ctx->available_msgs);
 		ctx->next_ready_msg = NULL;
+		if (++ctx->msgs_since_adapt >=
+		    max(ctx->num_messages, ADAPT_INTERVAL_MIN))
+			adapt_to_workload(ctx);
 	}
 	return true;
 }
 
+static u64
+approx_mem_required(int out_ctype, u32 out_chunk_size, size_t chunks_per_msg,
+		    size_t msgs_per_thread, unsigned num_threads)
+{
+	return (u64)chunks_per_msg *
+		(u64)msgs_per_thread *
+		(u64)num_threads *
+		(u64)out_chunk_size
+		+ out_chunk_size
+		+ 1000000
+		+ num_threads * wimlib_get_compressor_needed_memory(out_ctype,
+								    out_chunk_size,
+								    0);
+}
+
 int
 new_parallel_chunk_compressor(int out_ctype, u32 out_chunk_size,
 			      unsigned num_threads, u64 max_memory,
 			      struct chunk_compressor **compressor_ret)
 {
-	u64 approx_mem_required;
 	size_t chunks_per_msg;
+	size_t max_chunks_per_msg;
 	size_t msgs_per_thread;
 	struct parallel_chunk_compressor *ctx;
-	unsigned i;
 	int ret;
 	unsigned desired_num_threads;
 
@@ -372,7 +608,7 @@ new_parallel_chunk_compressor(int out_ctype, u32 out_chunk_size,
 		return -1;
 
 	if (max_memory == 0)
-		max_memory = get_available_memory();
+		max_memory = get_memory_budget();
 
 	desired_num_threads = num_threads;
 
@@ -392,17 +628,9 @@ new_parallel_chunk_compressor(int out_ctype, u32 out_chunk_size,
 		msgs_per_thread = 1;
 	}
 	for (;;) {
-		approx_mem_required =
-			(u64)chunks_per_msg *
-			(u64)msgs_per_thread *
-			(u64)num_threads *
-			(u64)out_chunk_size
-			+ out_chunk_size
-			+ 1000000
-			+ num_threads * wimlib_get_compressor_needed_memory(out_ctype,
-									    out_chunk_size,
-									    0);
-		if (approx_mem_required <= max_memory)
+		if (approx_mem_required(out_ctype, out_chunk_size,
+					chunks_per_msg, msgs_per_thread,
+					num_threads) <= max_memory)
 			break;
 
 		if (chunks_per_msg > 1)
@@ -424,6 +652,18 @@ new_parallel_chunk_compressor(int out_ctype, u32 out_chunk_size,
 	if (num_threads == 1)
 		return -2;
 
+	/* The batch size starts out at the value chosen above, but it may grow
+	 * later as far as the memory limit allows.  */
+	max_chunks_per_msg = chunks_per_msg;
+	if (out_chunk_size < ((u32)1 << 23)) {
+		while (max_chunks_per_msg < MAX_CHUNKS_PER_MSG &&
+		       approx_mem_required(out_ctype, out_chunk_size,
+					   max_chunks_per_msg + 1,
+					   msgs_per_thread,
+					   num_threads) <= max_memory)
+			max_chunks_per_msg++;
+	}
+
 	ret = WIMLIB_ERR_NOMEM;
 	ctx = CALLOC(1, sizeof(*ctx));
 	if (ctx == NULL)
@@ -436,59 +676,58 @@ new_parallel_chunk_compressor(int out_ctype, u32 out_chunk_size,
 	ctx->base.signal_chunk_filled = parallel_chunk_compressor_signal_chunk_filled;
 	ctx->base.get_compression_result = parallel_chunk_compressor_get_compression_result;
 
-	ctx->num_thread_data = num_threads;
-
-	ret = message_queue_init(&ctx->chunks_to_compress_queue);
-	if (ret)
+	if (!mutex_init(&ctx->lock))
 		goto err;
-
-	ret = message_queue_init(&ctx->compressed_chunks_queue);
-	if (ret)
+	if (!condvar_init(&ctx->msg_complete_cond)) {
+		mutex_destroy(&ctx->lock);
 		goto err;
+	}
+	ctx->initialized_sync = true;
 
-	ret = WIMLIB_ERR_NOMEM;
-	ctx->thread_data = CALLOC(num_threads, sizeof(ctx->thread_data[0]));
-	if (ctx->thread_data == NULL)
+	num_threads = thread_pool_reserve(num_threads);
+	if (num_threads < 2)
 		goto err;
 
-	for (i = 0; i < num_threads; i++) {
-		struct compressor_thread_data *dat;
-
-		dat = &ctx->thread_data[i];
+	ctx->compressors = CALLOC(num_threads, sizeof(ctx->compressors[0]));
+	if (ctx->compressors == NULL)
+		goto err;
 
-		dat->chunks_to_compress_queue = &ctx->chunks_to_compress_queue;
-		dat->compressed_chunks_queue = &ctx->compressed_chunks_queue;
+	for (ctx->num_compressors = 0; ctx->num_compressors < num_threads;
+	     ctx->num_compressors++)
+	{
 		ret = wimlib_create_compressor(out_ctype, out_chunk_size,
 					       WIMLIB_COMPRESSOR_FLAG_DESTRUCTIVE,
-					       &dat->compressor);
+					       &ctx->compressors[ctx->num_compressors]);
 		if (ret)
 			goto err;
 	}
+	ctx->num_free_compressors = num_threads;
 
-	for (ctx->num_started_threads = 0;
-	     ctx->num_started_threads < num_threads;
-	     ctx->num_started_threads++)
-	{
-		if (!thread_create(&ctx->thread_data[ctx->num_started_threads].thread,
-				   compressor_thread_proc,
-				   &ctx->thread_data[ctx->num_started_threads]))
-		{
-			ret = WIMLIB_ERR_NOMEM;
-			if (ctx->num_started_threads >= 2)
-				break;
-			goto err;
-		}
-	}
+	ret = WIMLIB_ERR_NOMEM;
+	if (!thread_pool_job_init(&ctx->job, compressor_job_func, ctx,
+				  num_threads))
+		goto err;
+	ctx->initialized_job = true;
 
-	ctx->base.num_threads = ctx->num_started_threads;
+	ctx->base.num_threads = num_threads;
+	ctx->target_tasks = num_threads;
+	ctx->chunks_per_msg = chunks_per_msg;
+	ctx->max_chunks_per_msg = max_chunks_per_msg;
+	ctx->mem_charged = approx_mem_required(out_ctype, out_chunk_size,
+					       chunks_per_msg, msgs_per_thread,
+					       num_threads);
+	charge_memory(ctx->mem_charged);
 
 	ret = WIMLIB_ERR_NOMEM;
-	ctx->num_messages = ctx->num_started_threads * msgs_per_thread;
+	ctx->num_messages = num_threads * msgs_per_thread;
 	ctx->msgs = allocate_messages(ctx->num_messages,
 				      chunks_per_msg, out_chunk_size);
 	if (ctx->msgs == NULL)
 		goto err;
 
+	if (!msg_ring_init(&ctx->chunks_to_compress, ctx->num_messages))
+		goto err;
+
 	INIT_LIST_HEAD(&ctx->available_msgs);
 	for (size_t i = 0; i < ctx->num_messages; i++)
 		list_add_tail(&ctx->msgs[i].list, &ctx->available_msgs);
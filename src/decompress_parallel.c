@@ -0,0 +1,391 @@
+/*
+ * decompress_parallel.c
+ *
+ * Decompress chunks of data (parallel version).
+ */
+
+/*
+ * Copyright (C) 2013-2023 Eric Biggers
+ *
+ * This file is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This file is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this file; if not, see https://www.gnu.org/licenses/.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <string.h>
+
+#include "wimlib.h"
+#include "wimlib/assert.h"
+#include "wimlib/chunk_decompressor.h"
+#include "wimlib/error.h"
+#include "wimlib/threads.h"
+#include "wimlib/util.h"
+
+/*
+ * A slot holds one chunk while it is being decompressed.  The slots form a ring
+ * which is filled by the main thread in submission order.  The worker threads
+ * claim slots in the same order, so the oldest submitted chunks are always the
+ * first to be decompressed, and the main thread retrieves the results by simply
+ * walking the ring behind them.
+ */
+struct decompression_slot {
+	u8 *cdata;
+	u8 *udata;
+
+	/* The compressed data of the chunk: either 'cdata', or memory owned by
+	 * the caller (such as a mapping of the WIM file)  */
+	const u8 *src;
+	u32 csize;
+	u32 usize;
+	int status;
+	bool done;
+};
+
+struct parallel_chunk_decompressor {
+	struct chunk_decompressor base;
+
+	struct mutex lock;
+	struct condvar result_avail_cond;
+	bool terminating;
+
+	/* The chunks are decompressed by tasks on the library's thread pool.
+	 * Each task borrows one of the decompressors while it runs; there are
+	 * never more tasks than decompressors.  */
+	struct thread_pool_job job;
+	bool initialized_job;
+
+	struct wimlib_decompressor **decompressors;
+	unsigned num_decompressors;
+	unsigned num_free_decompressors;
+
+	struct decompression_slot *slots;
+	size_t num_slots;
+
+	/* Slot counters, all monotonically increasing.  The slot for counter
+	 * value 'n' is slots[n % num_slots].  Invariant:
+	 * next_result <= next_claim <= next_submit <= next_result + num_slots
+	 */
+	u64 next_submit;	/* Next slot to be filled by the main thread  */
+	u64 next_claim;		/* Next slot to be claimed by a worker thread  */
+	u64 next_result;	/* Next slot to be returned to the main thread  */
+
+	/* Bytes charged against the memory budget  */
+	u64 mem_charged;
+
+	bool have_buffer;
+	bool initialized_sync;
+};
+
+static void
+decompress_slot(struct decompression_slot *slot,
+		struct wimlib_decompressor *decompressor)
+{
+	slot->status = 0;
+
+	/* A chunk that was stored uncompressed is returned directly from its
+	 * source buffer.  */
+	if (slot->csize == slot->usize)
+		return;
+
+	if (likely(wimlib_decompress(slot->src, slot->csize,
+				     slot->udata, slot->usize,
+				     decompressor) == 0))
+		return;
+
+	/* Try to recover as much of the data as possible.  The main thread
+	 * decides whether this is acceptable or not.  */
+	slot->status = WIMLIB_ERR_DECOMPRESSION;
+	memset(slot->udata, 0, slot->usize);
+	(void)wimlib_decompress(slot->src, slot->csize,
+				slot->udata, slot->usize, decompressor);
+}
+
+static void
+decompressor_job_func(void *arg)
+{
+	struct parallel_chunk_decompressor *ctx = arg;
+	struct wimlib_decompressor *decompressor;
+	struct decompression_slot *slot;
+
+	mutex_lock(&ctx->lock);
+	if (ctx->next_claim == ctx->next_submit || ctx->terminating)
+		goto out_unlock;
+	wimlib_assert(ctx->num_free_decompressors != 0);
+	decompressor = ctx->decompressors[--ctx->num_free_decompressors];
+	do {
+		slot = &ctx->slots[ctx->next_claim++ % ctx->num_slots];
+		mutex_unlock(&ctx->lock);
+
+		decompress_slot(slot, decompressor);
+
+		mutex_lock(&ctx->lock);
+		slot->done = true;
+		condvar_signal(&ctx->result_avail_cond);
+	} while (ctx->next_claim != ctx->next_submit && !ctx->terminating);
+	ctx->decompressors[ctx->num_free_decompressors++] = decompressor;
+out_unlock:
+	mutex_unlock(&ctx->lock);
+}
+
+static void
+parallel_chunk_decompressor_destroy(struct chunk_decompressor *_ctx)
+{
+	struct parallel_chunk_decompressor *ctx =
+		(struct parallel_chunk_decompressor *)_ctx;
+
+	if (ctx == NULL)
+		return;
+
+	if (ctx->initialized_job) {
+		mutex_lock(&ctx->lock);
+		ctx->terminating = true;
+		mutex_unlock(&ctx->lock);
+		thread_pool_job_destroy(&ctx->job);
+	}
+
+	if (ctx->initialized_sync) {
+		condvar_destroy(&ctx->result_avail_cond);
+		mutex_destroy(&ctx->lock);
+	}
+
+	uncharge_memory(ctx->mem_charged);
+
+	if (ctx->decompressors != NULL)
+		for (unsigned i = 0; i < ctx->num_decompressors; i++)
+			wimlib_free_decompressor(ctx->decompressors[i]);
+	FREE(ctx->decompressors);
+
+	if (ctx->slots != NULL) {
+		for (size_t j = 0; j < ctx->num_slots; j++) {
+			FREE(ctx->slots[j].cdata);
+			FREE(ctx->slots[j].udata);
+		}
+		FREE(ctx->slots);
+	}
+
+	FREE(ctx);
+}
+
+static void *
+parallel_chunk_decompressor_get_chunk_buffer(struct chunk_decompressor *_ctx)
+{
+	struct parallel_chunk_decompressor *ctx =
+		(struct parallel_chunk_decompressor *)_ctx;
+
+	/* No locking is needed here, since only the main thread changes
+	 * next_submit and next_result.  */
+	if (ctx->next_submit - ctx->next_result == ctx->num_slots)
+		return NULL;
+
+	ctx->have_buffer = true;
+	return ctx->slots[ctx->next_submit % ctx->num_slots].cdata;
+}
+
+static void
+submit_chunk(struct parallel_chunk_decompressor *ctx, const void *src,
+	     u32 csize, u32 usize)
+{
+	struct decompression_slot *slot;
+
+	wimlib_assert(ctx->have_buffer);
+	wimlib_assert(csize > 0 && csize <= usize);
+	wimlib_assert(usize <= ctx->base.in_chunk_size);
+
+	slot = &ctx->slots[ctx->next_submit % ctx->num_slots];
+	slot->src = (src != NULL) ? src : slot->cdata;
+	slot->csize = csize;
+	slot->usize = usize;
+	slot->done = false;
+	ctx->have_buffer = false;
+
+	mutex_lock(&ctx->lock);
+	ctx->next_submit++;
+	mutex_unlock(&ctx->lock);
+	thread_pool_job_kick(&ctx->job);
+}
+
+static void
+parallel_chunk_decompressor_signal_chunk_filled(struct chunk_decompressor *_ctx,
+						u32 csize, u32 usize)
+{
+	submit_chunk((struct parallel_chunk_decompressor *)_ctx, NULL,
+		     csize, usize);
+}
+
+static void
+parallel_chunk_decompressor_signal_chunk_mapped(struct chunk_decompressor *_ctx,
+						const void *cdata,
+						u32 csize, u32 usize)
+{
+	submit_chunk((struct parallel_chunk_decompressor *)_ctx, cdata,
+		     csize, usize);
+}
+
+static bool
+parallel_chunk_decompressor_get_decompression_result(struct chunk_decompressor *_ctx,
+						     const void **udata_ret,
+						     u32 *usize_ret,
+						     int *status_ret)
+{
+	struct parallel_chunk_decompressor *ctx =
+		(struct parallel_chunk_decompressor *)_ctx;
+	struct decompression_slot *slot;
+
+	if (ctx->next_result == ctx->next_submit)
+		return false;
+
+	slot = &ctx->slots[ctx->next_result % ctx->num_slots];
+
+	mutex_lock(&ctx->lock);
+	while (!slot->done)
+		condvar_wait(&ctx->result_avail_cond, &ctx->lock);
+	mutex_unlock(&ctx->lock);
+
+	if (slot->csize == slot->usize)
+		*udata_ret = slot->src;
+	else
+		*udata_ret = slot->udata;
+	*usize_ret = slot->usize;
+	*status_ret = slot->status;
+	ctx->next_result++;
+	return true;
+}
+
+int
+new_parallel_chunk_decompressor(int in_ctype, u32 in_chunk_size,
+				unsigned num_threads, u64 max_memory,
+				u64 num_chunks,
+				struct chunk_decompressor **decompressor_ret)
+{
+	u64 approx_mem_required;
+	size_t slots_per_thread;
+	struct parallel_chunk_decompressor *ctx;
+	int ret;
+
+	wimlib_assert(in_chunk_size > 0);
+
+	if (num_threads == 0)
+		num_threads = get_available_cpus();
+
+	/* There's no point in having more threads than chunks.  */
+	if (num_threads > num_chunks)
+		num_threads = num_chunks;
+
+	if (num_threads <= 1)
+		return -1;
+
+	if (max_memory == 0)
+		max_memory = get_memory_budget();
+
+	/* Use 2 slots per thread so that each thread has another chunk to
+	 * decompress ready while the main thread consumes the result of its
+	 * previous one.  But with big chunks, 1 slot per thread is enough.  */
+	if (in_chunk_size < ((u32)1 << 23))
+		slots_per_thread = 2;
+	else
+		slots_per_thread = 1;
+
+	for (;;) {
+		approx_mem_required =
+			(u64)slots_per_thread *
+			(u64)num_threads *
+			(u64)in_chunk_size * 2
+			+ 1000000
+			+ num_threads * (u64)in_chunk_size / 8;
+		if (approx_mem_required <= max_memory)
+			break;
+
+		if (slots_per_thread > 1)
+			slots_per_thread--;
+		else if (num_threads > 1)
+			num_threads--;
+		else
+			break;
+	}
+
+	if (num_threads <= 1)
+		return -2;
+
+	ret = WIMLIB_ERR_NOMEM;
+	ctx = CALLOC(1, sizeof(*ctx));
+	if (ctx == NULL)
+		goto err;
+
+	ctx->base.in_ctype = in_ctype;
+	ctx->base.in_chunk_size = in_chunk_size;
+	ctx->base.destroy = parallel_chunk_decompressor_destroy;
+	ctx->base.get_chunk_buffer = parallel_chunk_decompressor_get_chunk_buffer;
+	ctx->base.signal_chunk_filled = parallel_chunk_decompressor_signal_chunk_filled;
+	ctx->base.signal_chunk_mapped = parallel_chunk_decompressor_signal_chunk_mapped;
+	ctx->base.get_decompression_result = parallel_chunk_decompressor_get_decompression_result;
+
+	if (!mutex_init(&ctx->lock))
+		goto err;
+	if (!condvar_init(&ctx->result_avail_cond)) {
+		mutex_destroy(&ctx->lock);
+		goto err;
+	}
+	ctx->initialized_sync = true;
+
+	num_threads = thread_pool_reserve(num_threads);
+	if (num_threads < 2)
+		goto err;
+
+	ctx->mem_charged = (u64)slots_per_thread * num_threads *
+			   in_chunk_size * 2 +
+			   num_threads * (u64)in_chunk_size / 8;
+	charge_memory(ctx->mem_charged);
+
+	ctx->num_slots = (size_t)num_threads * slots_per_thread;
+	ctx->slots = CALLOC(ctx->num_slots, sizeof(ctx->slots[0]));
+	if (ctx->slots == NULL)
+		goto err;
+	for (size_t j = 0; j < ctx->num_slots; j++) {
+		ctx->slots[j].cdata = MALLOC(in_chunk_size);
+		ctx->slots[j].udata = MALLOC(in_chunk_size);
+		if (ctx->slots[j].cdata == NULL || ctx->slots[j].udata == NULL)
+			goto err;
+	}
+
+	ctx->decompressors = CALLOC(num_threads, sizeof(ctx->decompressors[0]));
+	if (ctx->decompressors == NULL)
+		goto err;
+
+	for (ctx->num_decompressors = 0; ctx->num_decompressors < num_threads;
+	     ctx->num_decompressors++)
+	{
+		ret = wimlib_create_decompressor(in_ctype, in_chunk_size,
+						 &ctx->decompressors[ctx->num_decompressors]);
+		if (ret)
+			goto err;
+	}
+	ctx->num_free_decompressors = num_threads;
+
+	ret = WIMLIB_ERR_NOMEM;
+	if (!thread_pool_job_init(&ctx->job, decompressor_job_func, ctx,
+				  num_threads))
+		goto err;
+	ctx->initialized_job = true;
+
+	ctx->base.num_threads = num_threads;
+
+	*decompressor_ret = &ctx->base;
+	return 0;
+
+err:
+	parallel_chunk_decompressor_destroy(&ctx->base);
+	return ret;
+}
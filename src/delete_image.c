@@ -83,6 +83,9 @@ wimlib_delete_image(WIMStruct *wim, int image)
 	int ret;
 	int first, last;
 
+	if (wim->concurrent_reads)
+		return WIMLIB_ERR_WIM_IS_READONLY;
+
 	if (image == WIMLIB_ALL_IMAGES) {
 		/* Deleting all images  */
 		last = wim->hdr.image_count;
@@ -462,24 +462,20 @@ for_dentry_in_tree_depth(struct wim_dentry *root,
 }
 
 /*
- * Calculate the full path to @dentry within the WIM image, if not already done.
- *
- * The full name will be saved in the cached value 'dentry->d_full_path'.
+ * Calculate the full path to @dentry within the WIM image and return it in a
+ * newly allocated string in *path_ret.
  *
- * Whenever possible, use dentry_full_path() instead of calling this and
- * accessing d_full_path directly.
+ * Unlike calculate_dentry_full_path(), this does not modify the dentry, so it
+ * can be used on an image that other threads are reading concurrently.
  *
  * Returns 0 or an error code resulting from a failed string conversion.
  */
 int
-calculate_dentry_full_path(struct wim_dentry *dentry)
+get_dentry_full_path(const struct wim_dentry *dentry, tchar **path_ret)
 {
 	size_t ulen;
 	const struct wim_dentry *d;
 
-	if (dentry->d_full_path)
-		return 0;
-
 	ulen = 0;
 	d = dentry;
 	do {
@@ -503,7 +499,25 @@ calculate_dentry_full_path(struct wim_dentry *dentry)
 	wimlib_assert(p == ubuf);
 
 	return utf16le_to_tstr(ubuf, ulen * sizeof(utf16lechar),
-			       &dentry->d_full_path, NULL);
+			       path_ret, NULL);
+}
+
+/*
+ * Calculate the full path to @dentry within the WIM image, if not already done.
+ *
+ * The full name will be saved in the cached value 'dentry->d_full_path'.
+ *
+ * Whenever possible, use dentry_full_path() instead of calling this and
+ * accessing d_full_path directly.
+ *
+ * Returns 0 or an error code resulting from a failed string conversion.
+ */
+int
+calculate_dentry_full_path(struct wim_dentry *dentry)
+{
+	if (dentry->d_full_path)
+		return 0;
+	return get_dentry_full_path(dentry, &dentry->d_full_path);
 }
 
 /*
@@ -704,10 +718,11 @@ get_dentry_child_with_name(const struct wim_dentry *dir, const tchar *name,
 	return child;
 }
 
-/* This is the UTF-16LE version of get_dentry(), currently private to this file
- * because no one needs it besides get_dentry().  */
+/* This is the UTF-16LE version of get_dentry_in_tree(), currently private to
+ * this file because no one needs it besides get_dentry() and
+ * get_dentry_in_tree().  */
 static struct wim_dentry *
-get_dentry_utf16le(WIMStruct *wim, const utf16lechar *path,
+get_dentry_utf16le(struct wim_dentry *root, const utf16lechar *path,
 		   CASE_SENSITIVITY_TYPE case_type)
 {
 	struct wim_dentry *cur_dentry;
@@ -716,7 +731,7 @@ get_dentry_utf16le(WIMStruct *wim, const utf16lechar *path,
 	/* Start with the root directory of the image.  Note: this will be NULL
 	 * if an image has been added directly with wimlib_add_empty_image() but
 	 * no files have been added yet; in that case we fail with ENOENT.  */
-	cur_dentry = wim_get_current_root_dentry(wim);
+	cur_dentry = root;
 
 	name_start = path;
 	for (;;) {
@@ -809,6 +824,16 @@ get_dentry_utf16le(WIMStruct *wim, const utf16lechar *path,
  */
 struct wim_dentry *
 get_dentry(WIMStruct *wim, const tchar *path, CASE_SENSITIVITY_TYPE case_type)
+{
+	return get_dentry_in_tree(wim_get_current_root_dentry(wim), path,
+				  case_type);
+}
+
+/* Like get_dentry(), but search the dentry tree rooted at @root (which may be
+ * NULL) instead of the currently selected image of a WIMStruct.  */
+struct wim_dentry *
+get_dentry_in_tree(struct wim_dentry *root, const tchar *path,
+		   CASE_SENSITIVITY_TYPE case_type)
 {
 	int ret;
 	const utf16lechar *path_utf16le;
@@ -817,7 +842,7 @@ get_dentry(WIMStruct *wim, const tchar *path, CASE_SENSITIVITY_TYPE case_type)
 	ret = tstr_get_utf16le(path, &path_utf16le);
 	if (ret)
 		return NULL;
-	dentry = get_dentry_utf16le(wim, path_utf16le, case_type);
+	dentry = get_dentry_utf16le(root, path_utf16le, case_type);
 	tstr_put_utf16le(path_utf16le);
 	return dentry;
 }
@@ -60,6 +60,7 @@
 #include "wimlib/reparse.h"
 #include "wimlib/resource.h"
 #include "wimlib/security.h"
+#include "wimlib/threads.h"
 #include "wimlib/unix_data.h"
 #include "wimlib/wim.h"
 #include "wimlib/win32.h" /* for realpath() equivalent */
@@ -143,27 +144,6 @@ end_file_metadata_phase(struct apply_ctx *ctx)
 	return end_file_phase(ctx, WIMLIB_PROGRESS_MSG_EXTRACT_METADATA);
 }
 
-/* Are all bytes in the specified buffer zero? */
-static bool
-is_all_zeroes(const u8 *p, const size_t size)
-{
-	const u8 * const end = p + size;
-
-	for (; (uintptr_t)p % WORDBYTES && p != end; p++)
-		if (*p)
-			return false;
-
-	for (; end - p >= WORDBYTES; p += WORDBYTES)
-		if (*(const machine_word_t *)p)
-			return false;
-
-	for (; p != end; p++)
-		if (*p)
-			return false;
-
-	return true;
-}
-
 /*
  * Sparse regions should be detected at the granularity of the filesystem block
  * size.  For now just assume 4096 bytes, which is the default block size on
@@ -428,20 +408,22 @@ begin_extract_blob(struct blob_descriptor *blob, void *_ctx)
 {
 	struct apply_ctx *ctx = _ctx;
 
-	if (unlikely(blob->out_refcnt > MAX_OPEN_FILES))
+	if (unlikely(blob->out_refcnt > MAX_OPEN_FILES &&
+		     !ctx->unlimited_targets))
 		return create_temporary_file(&ctx->tmpfile_fd, &ctx->tmpfile_name);
 
 	return call_begin_blob(blob, ctx->saved_cbs);
 }
 
-static int
-extract_chunk(const struct blob_descriptor *blob, u64 offset,
-	      const void *chunk, size_t size, void *_ctx)
+/* Account for @size bytes of @blob having been extracted to each of its
+ * targets.  Returns true if a WIMLIB_PROGRESS_MSG_EXTRACT_STREAMS message is
+ * due.  */
+static bool
+account_extracted_data(struct apply_ctx *ctx, const struct blob_descriptor *blob,
+		       u64 offset, size_t size)
 {
-	struct apply_ctx *ctx = _ctx;
 	union wimlib_progress_info *progress = &ctx->progress;
 	bool last = (offset + size == blob->size);
-	int ret;
 
 	if (likely(ctx->supported_features.hard_links)) {
 		progress->extract.completed_bytes +=
@@ -462,14 +444,24 @@ extract_chunk(const struct blob_descriptor *blob, u64 offset,
 			}
 		}
 	}
-	if (progress->extract.completed_bytes >= ctx->next_progress) {
+	return progress->extract.completed_bytes >= ctx->next_progress;
+}
+
+static int
+extract_chunk(const struct blob_descriptor *blob, u64 offset,
+	      const void *chunk, size_t size, void *_ctx)
+{
+	struct apply_ctx *ctx = _ctx;
+	int ret;
+
+	if (account_extracted_data(ctx, blob, offset, size)) {
 
 		ret = extract_progress(ctx, WIMLIB_PROGRESS_MSG_EXTRACT_STREAMS);
 		if (ret)
 			return ret;
 
-		set_next_progress(progress->extract.completed_bytes,
-				  progress->extract.total_bytes,
+		set_next_progress(ctx->progress.extract.completed_bytes,
+				  ctx->progress.extract.total_bytes,
 				  &ctx->next_progress);
 	}
 
@@ -523,11 +515,10 @@ warn_about_corrupted_file(struct wim_dentry *dentry,
 		dentry_full_path(dentry));
 }
 
-static int
-end_extract_blob(struct blob_descriptor *blob, int status, void *_ctx)
+static void
+maybe_warn_about_corrupted_blob(const struct apply_ctx *ctx,
+				const struct blob_descriptor *blob, int status)
 {
-	struct apply_ctx *ctx = _ctx;
-
 	if ((ctx->extract_flags & WIMLIB_EXTRACT_FLAG_RECOVER_DATA) &&
 	    !status && blob->corrupted) {
 		const struct blob_extraction_target *targets =
@@ -539,6 +530,14 @@ end_extract_blob(struct blob_descriptor *blob, int status, void *_ctx)
 			warn_about_corrupted_file(dentry, targets[i].stream);
 		}
 	}
+}
+
+static int
+end_extract_blob(struct blob_descriptor *blob, int status, void *_ctx)
+{
+	struct apply_ctx *ctx = _ctx;
+
+	maybe_warn_about_corrupted_blob(ctx, blob, status);
 
 	if (unlikely(filedes_valid(&ctx->tmpfile_fd))) {
 		filedes_close(&ctx->tmpfile_fd);
@@ -554,6 +553,16 @@ end_extract_blob(struct blob_descriptor *blob, int status, void *_ctx)
 	return call_end_blob(blob, status, ctx->saved_cbs);
 }
 
+static int
+extract_read_flags(const struct apply_ctx *ctx)
+{
+	int flags = VERIFY_BLOB_HASHES;
+
+	if (ctx->extract_flags & WIMLIB_EXTRACT_FLAG_RECOVER_DATA)
+		flags |= RECOVER_DATA;
+	return flags;
+}
+
 /*
  * Read the list of blobs to extract and feed their data into the specified
  * callback functions.
@@ -565,7 +574,8 @@ end_extract_blob(struct blob_descriptor *blob, int status, void *_ctx)
  * This also works if the WIM is being read from a pipe.
  *
  * This also will split up blobs that will need to be extracted to more than
- * MAX_OPEN_FILES locations, as measured by the 'out_refcnt' of each blob.
+ * MAX_OPEN_FILES locations, as measured by the 'out_refcnt' of each blob,
+ * unless the apply_operations implementation has set 'unlimited_targets'.
  * Therefore, the apply_operations implementation need not worry about running
  * out of file descriptors, unless it might open more than one file descriptor
  * per 'blob_extraction_target' (e.g. Win32 currently might because the
@@ -584,18 +594,408 @@ extract_blob_list(struct apply_ctx *ctx, const struct read_blob_callbacks *cbs)
 	if (ctx->extract_flags & WIMLIB_EXTRACT_FLAG_FROM_PIPE) {
 		return read_blobs_from_pipe(ctx, &wrapper_cbs);
 	} else {
-		int flags = VERIFY_BLOB_HASHES;
-
-		if (ctx->extract_flags & WIMLIB_EXTRACT_FLAG_RECOVER_DATA)
-			flags |= RECOVER_DATA;
-
 		return read_blob_list(&ctx->blob_list,
 				      offsetof(struct blob_descriptor,
 					       extraction_list),
-				      &wrapper_cbs, flags);
+				      &wrapper_cbs, extract_read_flags(ctx));
 	}
 }
 
+/*
+ * Return the number of worker threads that extract_blob_list_parallel() may
+ * use, or 1 if the blobs must be extracted by the calling thread.  Extraction
+ * backends that support parallel extraction call this to decide how many
+ * worker contexts to create.
+ */
+unsigned
+get_num_extraction_threads(const struct apply_ctx *ctx)
+{
+	unsigned num_threads;
+
+	if (ctx->extract_flags & WIMLIB_EXTRACT_FLAG_FROM_PIPE)
+		return 1;
+	num_threads = ctx->wim->num_decompression_threads;
+	if (num_threads == 0)
+		num_threads = get_available_cpus();
+	return max(num_threads, 1);
+}
+
+struct parallel_extract_ctx {
+	struct apply_ctx *ctx;
+	struct mutex lock;
+	struct condvar cond;
+
+	/* Each group is a list of the blobs in one resource.  */
+	struct list_head *groups;
+	size_t num_groups;
+	size_t next_group;
+	size_t num_busy_groups;
+
+	/* The workers not currently in use by a task on the thread pool  */
+	struct extract_worker **free_workers;
+	unsigned num_free_workers;
+
+	bool progress_pending;
+	bool aborting;
+	int status;
+};
+
+struct extract_worker {
+	struct parallel_extract_ctx *pctx;
+
+	/* The backend's callbacks, with the worker's own backend context  */
+	struct read_blob_callbacks cbs;
+};
+
+static int
+parallel_begin_extract_blob(struct blob_descriptor *blob, void *_worker)
+{
+	struct extract_worker *worker = _worker;
+
+	return call_begin_blob(blob, &worker->cbs);
+}
+
+/* Like extract_chunk(), but called from a worker thread.  The progress
+ * messages are sent by the main thread, so this just wakes it up when one is
+ * due.  */
+static int
+parallel_extract_chunk(const struct blob_descriptor *blob, u64 offset,
+		       const void *chunk, size_t size, void *_worker)
+{
+	struct extract_worker *worker = _worker;
+	struct parallel_extract_ctx *pctx = worker->pctx;
+	int ret = 0;
+
+	mutex_lock(&pctx->lock);
+	if (pctx->aborting) {
+		/* Another thread failed; the status doesn't matter.  */
+		ret = WIMLIB_ERR_ABORTED_BY_PROGRESS;
+	} else if (account_extracted_data(pctx->ctx, blob, offset, size) &&
+		   !pctx->progress_pending) {
+		pctx->progress_pending = true;
+		condvar_broadcast(&pctx->cond);
+	}
+	mutex_unlock(&pctx->lock);
+	if (ret)
+		return ret;
+
+	return call_continue_blob(blob, offset, chunk, size, &worker->cbs);
+}
+
+static int
+parallel_end_extract_blob(struct blob_descriptor *blob, int status,
+			  void *_worker)
+{
+	struct extract_worker *worker = _worker;
+
+	maybe_warn_about_corrupted_blob(worker->pctx->ctx, blob, status);
+	return call_end_blob(blob, status, &worker->cbs);
+}
+
+static void
+extract_job_func(void *_pctx)
+{
+	struct parallel_extract_ctx *pctx = _pctx;
+	struct read_blob_callbacks cbs = {
+		.begin_blob	= parallel_begin_extract_blob,
+		.continue_blob	= parallel_extract_chunk,
+		.end_blob	= parallel_end_extract_blob,
+	};
+	const int flags = extract_read_flags(pctx->ctx);
+	struct extract_worker *worker;
+	struct list_head *group;
+	int ret;
+
+	mutex_lock(&pctx->lock);
+	if (pctx->aborting || pctx->next_group == pctx->num_groups)
+		goto out_unlock;
+	wimlib_assert(pctx->num_free_workers != 0);
+	worker = pctx->free_workers[--pctx->num_free_workers];
+	cbs.ctx = worker;
+	do {
+		group = &pctx->groups[pctx->next_group++];
+		pctx->num_busy_groups++;
+		mutex_unlock(&pctx->lock);
+
+		ret = read_blob_list(group,
+				     offsetof(struct blob_descriptor,
+					      extraction_list),
+				     &cbs, flags);
+
+		mutex_lock(&pctx->lock);
+		pctx->num_busy_groups--;
+		if (ret && !pctx->aborting) {
+			pctx->status = ret;
+			pctx->aborting = true;
+		}
+		condvar_broadcast(&pctx->cond);
+	} while (!pctx->aborting && pctx->next_group < pctx->num_groups);
+	pctx->free_workers[pctx->num_free_workers++] = worker;
+out_unlock:
+	mutex_unlock(&pctx->lock);
+}
+
+static bool
+extract_groups_done(const struct parallel_extract_ctx *pctx)
+{
+	return (pctx->aborting || pctx->next_group == pctx->num_groups) &&
+		pctx->num_busy_groups == 0;
+}
+
+/*
+ * Extract the groups of blobs in @pctx->groups using up to one thread of the
+ * thread pool per entry in @workers.  The main thread just sends the progress
+ * messages.  Returns a negative value if the work couldn't be started, in which
+ * case the caller should extract the blobs itself.
+ */
+static int
+extract_groups_in_parallel(struct parallel_extract_ctx *pctx,
+			   struct extract_worker *workers, unsigned num_workers)
+{
+	struct apply_ctx *ctx = pctx->ctx;
+	struct thread_pool_job job;
+	union wimlib_progress_info progress;
+	int ret;
+
+	num_workers = thread_pool_reserve(num_workers);
+	if (num_workers == 0)
+		return -1;
+	pctx->free_workers = MALLOC(num_workers * sizeof(pctx->free_workers[0]));
+	if (!pctx->free_workers)
+		return -1;
+	if (!mutex_init(&pctx->lock))
+		goto out_free_workers;
+	if (!condvar_init(&pctx->cond))
+		goto out_destroy_lock;
+	if (!thread_pool_job_init(&job, extract_job_func, pctx, num_workers))
+		goto out_destroy_cond;
+
+	for (unsigned i = 0; i < num_workers; i++)
+		pctx->free_workers[i] = &workers[i];
+	pctx->num_free_workers = num_workers;
+	pctx->next_group = 0;
+	pctx->num_busy_groups = 0;
+	pctx->progress_pending = false;
+	pctx->aborting = false;
+	pctx->status = 0;
+
+	for (unsigned i = 0; i < num_workers; i++)
+		thread_pool_job_kick(&job);
+
+	mutex_lock(&pctx->lock);
+	for (;;) {
+		while (!extract_groups_done(pctx) && !pctx->progress_pending)
+			condvar_wait(&pctx->cond, &pctx->lock);
+		if (!pctx->progress_pending)
+			break;
+		pctx->progress_pending = false;
+		if (pctx->aborting)
+			continue;
+		progress = ctx->progress;
+		set_next_progress(progress.extract.completed_bytes,
+				  progress.extract.total_bytes,
+				  &ctx->next_progress);
+		mutex_unlock(&pctx->lock);
+
+		ret = call_progress(ctx->progfunc,
+				    WIMLIB_PROGRESS_MSG_EXTRACT_STREAMS,
+				    &progress, ctx->progctx);
+
+		mutex_lock(&pctx->lock);
+		if (ret && !pctx->aborting) {
+			pctx->status = ret;
+			pctx->aborting = true;
+		}
+	}
+	mutex_unlock(&pctx->lock);
+
+	thread_pool_job_destroy(&job);
+	condvar_destroy(&pctx->cond);
+	mutex_destroy(&pctx->lock);
+	FREE(pctx->free_workers);
+	return pctx->status;
+
+out_destroy_cond:
+	condvar_destroy(&pctx->cond);
+out_destroy_lock:
+	mutex_destroy(&pctx->lock);
+out_free_workers:
+	FREE(pctx->free_workers);
+	return -1;
+}
+
+/* Should the blob be extracted by a worker thread, together with the other
+ * blobs in the same resource?  Large compressed resources are better left to
+ * the parallel chunk decompressor, other locations may not support concurrent
+ * reads, and a worker may not open more than @max_targets files at once.  */
+static bool
+blob_can_be_extracted_in_parallel(const struct blob_descriptor *blob,
+				  unsigned max_targets)
+{
+	const struct wim_resource_descriptor *rdesc;
+
+	if (blob->blob_location != BLOB_IN_WIM)
+		return false;
+	if (blob->out_refcnt > max_targets)
+		return false;
+	rdesc = blob->rdesc;
+	if (!filedes_is_seekable(&rdesc->wim->in_fd))
+		return false;
+	return rdesc->compression_type == WIMLIB_COMPRESSION_TYPE_NONE ||
+	       rdesc->uncompressed_size <= max(2000000, rdesc->chunk_size);
+}
+
+/* Order blobs by the location of their resource, so that the worker threads
+ * claim the resources in roughly sequential order.  */
+static int
+cmp_blobs_by_resource_location(const void *p1, const void *p2)
+{
+	const struct blob_descriptor *blob1 = *(const struct blob_descriptor **)p1;
+	const struct blob_descriptor *blob2 = *(const struct blob_descriptor **)p2;
+	const struct wim_resource_descriptor *rdesc1 = blob1->rdesc;
+	const struct wim_resource_descriptor *rdesc2 = blob2->rdesc;
+
+	if (rdesc1->wim != rdesc2->wim)
+		return (uintptr_t)rdesc1->wim < (uintptr_t)rdesc2->wim ? -1 : 1;
+	if (rdesc1->offset_in_wim != rdesc2->offset_in_wim)
+		return rdesc1->offset_in_wim < rdesc2->offset_in_wim ? -1 : 1;
+	if (rdesc1 != rdesc2)
+		return (uintptr_t)rdesc1 < (uintptr_t)rdesc2 ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Like extract_blob_list(), but partition the blobs by WIM resource and extract
+ * the resources concurrently, each one as a unit, using up to @num_workers
+ * threads of the thread pool.  Each thread calls the callbacks in @cbs with a
+ * context from @worker_ctxs, so the extraction backend must keep all per-blob
+ * state, such as open files, in that context.  A worker context is only ever
+ * used by one thread at a time.  The blobs that can't be extracted this way are
+ * extracted first by the calling thread, using @cbs->ctx.
+ *
+ * The callbacks may be called concurrently for different blobs.  Since all
+ * aliases of a file are created while extracting the blob that contains its
+ * data, hard links are created exactly as in the serial case.
+ *
+ * All the workers together must stay within the file descriptor budget of a
+ * serial extraction, so the backend gives in @max_worker_targets the number of
+ * targets that each worker may have open at once.  Blobs with more targets
+ * than that are extracted by the calling thread.
+ *
+ * If there aren't at least two resources, or if the threads can't be started,
+ * this falls back to extract_blob_list().
+ */
+int
+extract_blob_list_parallel(struct apply_ctx *ctx,
+			   const struct read_blob_callbacks *cbs,
+			   void * const worker_ctxs[], unsigned num_workers,
+			   unsigned max_worker_targets)
+{
+	struct read_blob_callbacks wrapper_cbs = {
+		.begin_blob	= begin_extract_blob,
+		.continue_blob	= extract_chunk,
+		.end_blob	= end_extract_blob,
+		.ctx		= ctx,
+	};
+	struct parallel_extract_ctx pctx;
+	struct extract_worker *workers = NULL;
+	struct blob_descriptor **blobs = NULL;
+	struct blob_descriptor *blob, *tmp;
+	size_t num_blobs = 0;
+	size_t i;
+	LIST_HEAD(serial_list);
+	int ret;
+
+	if (num_workers <= 1 || (ctx->extract_flags & WIMLIB_EXTRACT_FLAG_FROM_PIPE))
+		return extract_blob_list(ctx, cbs);
+
+	list_for_each_entry(blob, &ctx->blob_list, extraction_list)
+		if (blob_can_be_extracted_in_parallel(blob,
+						      max_worker_targets))
+			num_blobs++;
+	if (num_blobs < 2)
+		return extract_blob_list(ctx, cbs);
+
+	blobs = MALLOC(num_blobs * sizeof(blobs[0]));
+	if (!blobs)
+		return extract_blob_list(ctx, cbs);
+	i = 0;
+	list_for_each_entry(blob, &ctx->blob_list, extraction_list)
+		if (blob_can_be_extracted_in_parallel(blob,
+						      max_worker_targets))
+			blobs[i++] = blob;
+	qsort(blobs, num_blobs, sizeof(blobs[0]),
+	      cmp_blobs_by_resource_location);
+
+	pctx.ctx = ctx;
+	pctx.num_groups = 0;
+	for (i = 0; i < num_blobs; i++)
+		if (i == 0 || blobs[i]->rdesc != blobs[i - 1]->rdesc)
+			pctx.num_groups++;
+	if (pctx.num_groups < 2) {
+		FREE(blobs);
+		return extract_blob_list(ctx, cbs);
+	}
+	num_workers = min(num_workers, pctx.num_groups);
+	pctx.groups = MALLOC(pctx.num_groups * sizeof(pctx.groups[0]));
+	workers = MALLOC(num_workers * sizeof(workers[0]));
+	if (!pctx.groups || !workers) {
+		FREE(workers);
+		FREE(pctx.groups);
+		FREE(blobs);
+		return extract_blob_list(ctx, cbs);
+	}
+
+	/* Move the blobs into their groups; the rest stay on the list.  */
+	pctx.num_groups = 0;
+	for (i = 0; i < num_blobs; i++) {
+		if (i == 0 || blobs[i]->rdesc != blobs[i - 1]->rdesc)
+			INIT_LIST_HEAD(&pctx.groups[pctx.num_groups++]);
+		list_move_tail(&blobs[i]->extraction_list,
+			       &pctx.groups[pctx.num_groups - 1]);
+	}
+	list_for_each_entry_safe(blob, tmp, &ctx->blob_list, extraction_list)
+		list_move_tail(&blob->extraction_list, &serial_list);
+
+	for (i = 0; i < num_workers; i++) {
+		workers[i].pctx = &pctx;
+		workers[i].cbs = *cbs;
+		workers[i].cbs.ctx = worker_ctxs[i];
+	}
+
+	ctx->saved_cbs = cbs;
+	ret = read_blob_list(&serial_list,
+			     offsetof(struct blob_descriptor, extraction_list),
+			     &wrapper_cbs, extract_read_flags(ctx));
+	if (ret == 0) {
+		ret = extract_groups_in_parallel(&pctx, workers, num_workers);
+		if (ret < 0) {
+			LIST_HEAD(parallel_list);
+
+			for (i = 0; i < pctx.num_groups; i++)
+				list_splice_tail(&pctx.groups[i],
+						 &parallel_list);
+			ret = read_blob_list(&parallel_list,
+					     offsetof(struct blob_descriptor,
+						      extraction_list),
+					     &wrapper_cbs,
+					     extract_read_flags(ctx));
+			list_splice_tail(&parallel_list, &ctx->blob_list);
+			pctx.num_groups = 0;
+		}
+	}
+
+	/* Put the blobs back on the blob list, which is still needed to free
+	 * their extraction targets.  */
+	list_splice_tail(&serial_list, &ctx->blob_list);
+	for (i = 0; i < pctx.num_groups; i++)
+		list_splice_tail(&pctx.groups[i], &ctx->blob_list);
+	FREE(workers);
+	FREE(pctx.groups);
+	FREE(blobs);
+	return ret;
+}
+
 /* Extract a WIM dentry to standard output.
  *
  * This obviously doesn't make sense in all cases.  We return an error if the
@@ -24,6 +24,11 @@
 #endif
 
 #include <errno.h>
+#ifdef HAVE_LINUX_FS_H
+#  include <linux/fs.h>	/* for FICLONERANGE */
+#  include <sys/ioctl.h>
+#endif
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include "wimlib/error.h"
@@ -192,6 +197,93 @@ full_pwrite(struct filedes *fd, const void *buf, size_t count, off_t offset)
 	return 0;
 }
 
+#ifdef HAVE_COPY_FILE_RANGE
+/* Return true if copy_file_range() failed with @err just because it can't copy
+ * between the two files, as opposed to an actual I/O error.  */
+static bool
+copy_file_range_unsupported(int err)
+{
+	return err == EXDEV || err == EINVAL || err == ENOSYS ||
+	       err == EOPNOTSUPP || err == EBADF || err == ETXTBSY ||
+	       err == EPERM;
+}
+#endif
+
+/*
+ * Copy data from the region of @in_fd starting at *@in_offset_p and ending at
+ * @in_end to the current offset of @out_fd, without passing it through user
+ * memory.  If the offsets and size are aligned to the filesystem block size,
+ * the extents are cloned (FICLONERANGE) so that the data isn't copied at all;
+ * otherwise copy_file_range() is used, which may also share extents.
+ *
+ * This copies only as much as the kernel is able to.  *@in_offset_p and
+ * @out_fd's offset are advanced past what was copied, and the caller must copy
+ * any remainder itself.  This can be all of the data, e.g. if the files are on
+ * different filesystems or the kernel doesn't support these system calls.
+ *
+ * Return values:
+ *	WIMLIB_ERR_SUCCESS	(0)
+ *	WIMLIB_ERR_WRITE	(errno set)
+ */
+int
+copy_data_in_kernel(struct filedes *in_fd, u64 *in_offset_p, u64 in_end,
+		    struct filedes *out_fd)
+{
+	u64 in_offset = *in_offset_p;
+
+	if (in_fd->is_pipe || out_fd->is_pipe || in_offset == in_end)
+		return 0;
+
+#if defined(HAVE_LINUX_FS_H) && defined(FICLONERANGE)
+	struct stat stbuf;
+
+	if (fstat(out_fd->fd, &stbuf) == 0 && stbuf.st_blksize > 0 &&
+	    (in_offset % stbuf.st_blksize) == 0 &&
+	    (in_end % stbuf.st_blksize) == 0 &&
+	    (out_fd->offset % stbuf.st_blksize) == 0)
+	{
+		struct file_clone_range range = {
+			.src_fd = in_fd->fd,
+			.src_offset = in_offset,
+			.src_length = in_end - in_offset,
+			.dest_offset = out_fd->offset,
+		};
+		off_t new_offset = out_fd->offset + (in_end - in_offset);
+
+		if (ioctl(out_fd->fd, FICLONERANGE, &range) == 0) {
+			if (lseek(out_fd->fd, new_offset, SEEK_SET) == -1)
+				return WIMLIB_ERR_WRITE;
+			out_fd->offset = new_offset;
+			*in_offset_p = in_end;
+			return 0;
+		}
+	}
+#endif
+
+#ifdef HAVE_COPY_FILE_RANGE
+	while (in_offset != in_end) {
+		off_t off = in_offset;
+		ssize_t ret = copy_file_range(in_fd->fd, &off, out_fd->fd, NULL,
+					      min(in_end - in_offset,
+						  (u64)1 << 30), 0);
+		if (unlikely(ret <= 0)) {
+			if (ret < 0 && errno == EINTR)
+				continue;
+			/* On end-of-file, leave the rest to the caller so that
+			 * it's reported in the usual way.  */
+			if (ret == 0 || copy_file_range_unsupported(errno))
+				break;
+			*in_offset_p = in_offset;
+			return WIMLIB_ERR_WRITE;
+		}
+		in_offset += ret;
+		out_fd->offset += ret;
+	}
+	*in_offset_p = in_offset;
+#endif
+	return 0;
+}
+
 off_t filedes_seek(struct filedes *fd, off_t offset)
 {
 	if (fd->is_pipe) {
@@ -0,0 +1,157 @@
+/*
+ * file_reader.c
+ *
+ * Random-access reads of files in a WIM image.
+ */
+
+/*
+ * Copyright (C) 2023 Eric Biggers
+ *
+ * This file is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This file is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this file; if not, see https://www.gnu.org/licenses/.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include "wimlib.h"
+#include "wimlib/blob_table.h"
+#include "wimlib/dentry.h"
+#include "wimlib/error.h"
+#include "wimlib/inode.h"
+#include "wimlib/metadata.h"
+#include "wimlib/paths.h"
+#include "wimlib/resource.h"
+#include "wimlib/sha1.h"
+#include "wimlib/util.h"
+#include "wimlib/wim.h"
+
+struct wimlib_file_reader {
+
+	/* The image containing the file, if this reader has pinned it in
+	 * memory; or NULL if the WIM was opened for concurrent reads, in which
+	 * case all images are already pinned.  */
+	struct wim_image_metadata *pinned_imd;
+
+	/* The blob containing the file's data, or NULL if the file is empty  */
+	const struct blob_descriptor *blob;
+
+	/* The locations of the blob's compressed chunks, if it's in a WIM  */
+	struct blob_chunk_table chunk_table;
+};
+
+/* API function documented in wimlib.h  */
+WIMLIBAPI int
+wimlib_open_file_reader(WIMStruct *wim, int image, const tchar *_path,
+			struct wimlib_file_reader **reader_ret)
+{
+	struct wimlib_file_reader *reader;
+	struct wim_image_metadata *imd;
+	struct wim_dentry *dentry;
+	const struct wim_inode_stream *strm;
+	const struct blob_descriptor *blob = NULL;
+	tchar *path;
+	int ret;
+
+	if (!_path || !reader_ret)
+		return WIMLIB_ERR_INVALID_PARAM;
+
+	ret = get_image_for_reading(wim, image, &imd);
+	if (ret)
+		return ret;
+
+	path = canonicalize_wim_path(_path);
+	if (!path)
+		return WIMLIB_ERR_NOMEM;
+	dentry = get_dentry_in_tree(imd->root_dentry, path,
+				    WIMLIB_CASE_PLATFORM_DEFAULT);
+	FREE(path);
+	if (!dentry)
+		return WIMLIB_ERR_PATH_DOES_NOT_EXIST;
+
+	if (inode_is_directory(dentry->d_inode))
+		return WIMLIB_ERR_NOT_A_REGULAR_FILE;
+
+	strm = inode_get_unnamed_data_stream(dentry->d_inode);
+	if (strm) {
+		blob = stream_blob(strm, wim->blob_table);
+		if (!blob && !is_zero_hash(stream_hash(strm)))
+			return blob_not_found_error(dentry->d_inode,
+						    stream_hash(strm));
+	}
+
+	reader = MALLOC(sizeof(*reader));
+	if (!reader)
+		return WIMLIB_ERR_NOMEM;
+	reader->pinned_imd = NULL;
+	reader->blob = blob;
+	reader->chunk_table.chunk_offsets = NULL;
+	if (blob && blob->blob_location == BLOB_IN_WIM) {
+		ret = load_blob_chunk_table(blob, &reader->chunk_table);
+		if (ret) {
+			FREE(reader);
+			return ret;
+		}
+	}
+	if (!wim->concurrent_reads) {
+		/* Keep the image loaded even if another image gets selected  */
+		imd->selected_refcnt++;
+		reader->pinned_imd = imd;
+	}
+	*reader_ret = reader;
+	return 0;
+}
+
+/* API function documented in wimlib.h  */
+WIMLIBAPI uint64_t
+wimlib_get_file_reader_size(const struct wimlib_file_reader *reader)
+{
+	return reader->blob ? reader->blob->size : 0;
+}
+
+/* API function documented in wimlib.h  */
+WIMLIBAPI int
+wimlib_read_file_reader(struct wimlib_file_reader *reader, void *buf,
+			size_t size, uint64_t offset, size_t *bytes_read_ret)
+{
+	const u64 file_size = wimlib_get_file_reader_size(reader);
+	int ret;
+
+	if (offset >= file_size)
+		size = 0;
+	else if (size > file_size - offset)
+		size = file_size - offset;
+
+	if (size) {
+		ret = read_partial_blob_into_buf(reader->blob,
+						 &reader->chunk_table,
+						 offset, size, buf);
+		if (ret)
+			return ret;
+	}
+	*bytes_read_ret = size;
+	return 0;
+}
+
+/* API function documented in wimlib.h  */
+WIMLIBAPI void
+wimlib_close_file_reader(struct wimlib_file_reader *reader)
+{
+	if (!reader)
+		return;
+	if (reader->pinned_imd)
+		reader->pinned_imd->selected_refcnt--;
+	FREE(reader->chunk_table.chunk_offsets);
+	FREE(reader);
+}
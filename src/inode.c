@@ -486,13 +486,19 @@ blob_not_found_error(const struct wim_inode *inode, const u8 *hash)
 {
 	if (wimlib_print_errors) {
 		tchar hashstr[SHA1_HASH_STRING_LEN];
+		tchar *path = NULL;
 
 		sprint_hash(hash, hashstr);
 
+		/* Don't cache the path in the dentry, since this may be called
+		 * on an image that is being read by multiple threads.  */
+		get_dentry_full_path(inode_any_dentry(inode), &path);
+
 		ERROR("\"%"TS"\": blob not found\n"
 		      "        SHA-1 message digest of missing blob:\n"
 		      "        %"TS"",
-		      inode_any_full_path(inode), hashstr);
+		      path, hashstr);
+		FREE(path);
 	}
 	return WIMLIB_ERR_RESOURCE_NOT_FOUND;
 }
@@ -35,6 +35,8 @@
 #include "wimlib/progress.h"
 #include "wimlib/resource.h"
 #include "wimlib/sha1.h"
+#include "wimlib/threads.h"
+#include "wimlib/util.h"
 #include "wimlib/wim.h"
 #include "wimlib/write.h"
 
@@ -82,6 +84,212 @@ calculate_chunk_sha1(struct filedes *in_fd, size_t this_chunk_size,
 	return 0;
 }
 
+/*
+ * The integrity chunks are independent, so their SHA-1 message digests are
+ * calculated by workers on the thread pool.  The workers claim chunks in order,
+ * and each worker reads and hashes its own chunk, so the reads of different
+ * chunks overlap.  The calling thread consumes the digests in order, which keeps
+ * the progress messages and the verification results the same as if the chunks
+ * had been hashed one after another.  If no worker has claimed the next chunk yet,
+ * the calling thread hashes it itself.
+ */
+struct integrity_chunk_result {
+	int status;
+	bool done;
+};
+
+struct integrity_hasher {
+	struct filedes *in_fd;
+	u64 check_bytes;
+	size_t chunk_size;
+	u32 num_chunks;
+
+	/* The calculated digests.  If @expected is not NULL, the digests are
+	 * verified against it as they are consumed.  */
+	u8 (*sha1sums)[SHA1_HASH_SIZE];
+	const struct integrity_table *expected;
+
+	int progress_msg;
+	union wimlib_progress_info *progress;
+	wimlib_progress_func_t progfunc;
+	void *progctx;
+
+	/* The remaining fields are only used if the chunks are being hashed by
+	 * tasks on the thread pool.  */
+	bool parallel;
+	struct mutex lock;
+	struct condvar chunk_done_cond;
+	struct integrity_chunk_result *results;
+	u32 next_chunk;
+	bool aborting;
+	struct thread_pool_job job;
+};
+
+static size_t
+integrity_chunk_size(const struct integrity_hasher *hasher, u32 i)
+{
+	if (i == hasher->num_chunks - 1)
+		return MODULO_NONZERO(hasher->check_bytes, hasher->chunk_size);
+	return hasher->chunk_size;
+}
+
+static int
+hash_integrity_chunk(struct integrity_hasher *hasher, u32 i)
+{
+	return calculate_chunk_sha1(hasher->in_fd,
+				    integrity_chunk_size(hasher, i),
+				    WIM_HEADER_DISK_SIZE +
+					(u64)i * hasher->chunk_size,
+				    hasher->sha1sums[i]);
+}
+
+static void
+integrity_hasher_job_func(void *arg)
+{
+	struct integrity_hasher *hasher = arg;
+	u32 i;
+	int status;
+
+	mutex_lock(&hasher->lock);
+	while (!hasher->aborting && hasher->next_chunk < hasher->num_chunks) {
+		i = hasher->next_chunk++;
+		mutex_unlock(&hasher->lock);
+
+		status = hash_integrity_chunk(hasher, i);
+
+		mutex_lock(&hasher->lock);
+		hasher->results[i].status = status;
+		hasher->results[i].done = true;
+		condvar_broadcast(&hasher->chunk_done_cond);
+	}
+	mutex_unlock(&hasher->lock);
+}
+
+/* Start hashing chunks [@first_chunk, @num_chunks) using the thread pool.  If
+ * that fails or isn't worthwhile, the chunks are hashed by the calling thread
+ * instead.  */
+static void
+start_integrity_hasher_tasks(struct integrity_hasher *hasher, u32 first_chunk)
+{
+	unsigned num_threads = get_available_cpus();
+
+	hasher->parallel = false;
+	hasher->next_chunk = first_chunk;
+	hasher->aborting = false;
+
+	if (hasher->in_fd->is_pipe)
+		return;
+	if (num_threads > hasher->num_chunks - first_chunk)
+		num_threads = hasher->num_chunks - first_chunk;
+	if (num_threads <= 1)
+		return;
+	num_threads = thread_pool_reserve(num_threads);
+	if (num_threads <= 1)
+		return;
+
+	hasher->results = CALLOC(hasher->num_chunks,
+				 sizeof(hasher->results[0]));
+	if (!hasher->results)
+		return;
+	if (!mutex_init(&hasher->lock))
+		goto err_free_results;
+	if (!condvar_init(&hasher->chunk_done_cond))
+		goto err_destroy_lock;
+	if (!thread_pool_job_init(&hasher->job, integrity_hasher_job_func,
+				  hasher, num_threads))
+		goto err_destroy_chunk_done_cond;
+
+	for (unsigned i = 0; i < num_threads; i++)
+		thread_pool_job_kick(&hasher->job);
+	hasher->parallel = true;
+	return;
+
+err_destroy_chunk_done_cond:
+	condvar_destroy(&hasher->chunk_done_cond);
+err_destroy_lock:
+	mutex_destroy(&hasher->lock);
+err_free_results:
+	FREE(hasher->results);
+}
+
+static void
+stop_integrity_hasher_tasks(struct integrity_hasher *hasher)
+{
+	if (!hasher->parallel)
+		return;
+
+	mutex_lock(&hasher->lock);
+	hasher->aborting = true;
+	mutex_unlock(&hasher->lock);
+
+	thread_pool_job_destroy(&hasher->job);
+
+	condvar_destroy(&hasher->chunk_done_cond);
+	mutex_destroy(&hasher->lock);
+	FREE(hasher->results);
+}
+
+/* Get the status of hashing chunk @i, hashing it now if needed.  */
+static int
+get_integrity_chunk_status(struct integrity_hasher *hasher, u32 i)
+{
+	int status;
+
+	if (!hasher->parallel)
+		return hash_integrity_chunk(hasher, i);
+
+	mutex_lock(&hasher->lock);
+	if (hasher->next_chunk == i) {
+		hasher->next_chunk++;
+		mutex_unlock(&hasher->lock);
+		return hash_integrity_chunk(hasher, i);
+	}
+	while (!hasher->results[i].done)
+		condvar_wait(&hasher->chunk_done_cond, &hasher->lock);
+	status = hasher->results[i].status;
+	mutex_unlock(&hasher->lock);
+	return status;
+}
+
+/*
+ * Hash chunks [@first_chunk, @num_chunks) of the file, verifying them against
+ * the expected digests if any, and sending a progress message after each one.
+ *
+ * Returns 0 on success, WIM_INTEGRITY_NOT_OK if a digest doesn't match the
+ * expected one, or a positive error code.
+ */
+static int
+hash_integrity_chunks(struct integrity_hasher *hasher, u32 first_chunk)
+{
+	int ret = 0;
+
+	start_integrity_hasher_tasks(hasher, first_chunk);
+
+	for (u32 i = first_chunk; i < hasher->num_chunks; i++) {
+		ret = get_integrity_chunk_status(hasher, i);
+		if (ret)
+			break;
+
+		if (hasher->expected &&
+		    !hashes_equal(hasher->sha1sums[i],
+				  hasher->expected->sha1sums[i]))
+		{
+			ret = WIM_INTEGRITY_NOT_OK;
+			break;
+		}
+
+		hasher->progress->integrity.completed_chunks++;
+		hasher->progress->integrity.completed_bytes +=
+			integrity_chunk_size(hasher, i);
+		ret = call_progress(hasher->progfunc, hasher->progress_msg,
+				    hasher->progress, hasher->progctx);
+		if (ret)
+			break;
+	}
+
+	stop_integrity_hasher_tasks(hasher);
+	return ret;
+}
 
 /*
  * read_integrity_table: -  Reads the integrity table from a WIM file.
@@ -212,7 +420,6 @@ calculate_integrity_table(struct filedes *in_fd,
 	new_table->size = new_table_size;
 	new_table->chunk_size = chunk_size;
 
-	u64 offset = WIM_HEADER_DISK_SIZE;
 	union wimlib_progress_info progress;
 
 	progress.integrity.total_bytes      = new_check_bytes;
@@ -227,27 +434,22 @@ calculate_integrity_table(struct filedes *in_fd,
 	if (ret)
 		goto out_free_new_table;
 
-	for (u32 i = 0; i < new_num_chunks; i++) {
+	/* The chunks whose SHA1 message digests can be reused from the old
+	 * integrity table are always a prefix of the chunks.  */
+	u32 i;
+	for (i = 0; i < new_num_chunks; i++) {
 		size_t this_chunk_size;
 		if (i == new_num_chunks - 1)
 			this_chunk_size = new_last_chunk_size;
 		else
 			this_chunk_size = chunk_size;
-		if (old_table &&
-		    ((this_chunk_size == chunk_size && i < old_num_chunks - 1) ||
-		      (i == old_num_chunks - 1 && this_chunk_size == old_last_chunk_size)))
-		{
-			/* Can use SHA1 message digest from old integrity table
-			 * */
-			copy_hash(new_table->sha1sums[i], old_table->sha1sums[i]);
-		} else {
-			/* Calculate the SHA1 message digest of this chunk */
-			ret = calculate_chunk_sha1(in_fd, this_chunk_size,
-						   offset, new_table->sha1sums[i]);
-			if (ret)
-				goto out_free_new_table;
-		}
-		offset += this_chunk_size;
+		if (!(old_table &&
+		      ((this_chunk_size == chunk_size && i < old_num_chunks - 1) ||
+		       (i == old_num_chunks - 1 && this_chunk_size == old_last_chunk_size))))
+			break;
+
+		/* Can use SHA1 message digest from old integrity table */
+		copy_hash(new_table->sha1sums[i], old_table->sha1sums[i]);
 
 		progress.integrity.completed_chunks++;
 		progress.integrity.completed_bytes += this_chunk_size;
@@ -256,6 +458,23 @@ calculate_integrity_table(struct filedes *in_fd,
 		if (ret)
 			goto out_free_new_table;
 	}
+
+	/* Calculate the SHA1 message digests of the remaining chunks */
+	struct integrity_hasher hasher = {
+		.in_fd		= in_fd,
+		.check_bytes	= new_check_bytes,
+		.chunk_size	= chunk_size,
+		.num_chunks	= new_num_chunks,
+		.sha1sums	= new_table->sha1sums,
+		.expected	= NULL,
+		.progress_msg	= WIMLIB_PROGRESS_MSG_CALC_INTEGRITY,
+		.progress	= &progress,
+		.progfunc	= progfunc,
+		.progctx	= progctx,
+	};
+	ret = hash_integrity_chunks(&hasher, i);
+	if (ret)
+		goto out_free_new_table;
 	*integrity_table_ret = new_table;
 	return 0;
 
@@ -346,7 +565,8 @@ write_integrity_table(WIMStruct *wim,
  *	blob table minus offset of end of the header).
  *
  * Returns:
- *	> 0 (WIMLIB_ERR_READ, WIMLIB_ERR_UNEXPECTED_END_OF_FILE) on error
+ *	> 0 (WIMLIB_ERR_NOMEM, WIMLIB_ERR_READ,
+ *	     WIMLIB_ERR_UNEXPECTED_END_OF_FILE) on error
  *	0 (WIM_INTEGRITY_OK) if the integrity was checked successfully and there
  *	were no inconsistencies.
  *	-1 (WIM_INTEGRITY_NOT_OK) if the WIM failed the integrity check.
@@ -358,8 +578,7 @@ verify_integrity(struct filedes *in_fd, const tchar *filename,
 		 wimlib_progress_func_t progfunc, void *progctx)
 {
 	int ret;
-	u64 offset = WIM_HEADER_DISK_SIZE;
-	u8 sha1_md[SHA1_HASH_SIZE];
+	u8 (*sha1sums)[SHA1_HASH_SIZE];
 	union wimlib_progress_info progress;
 
 	progress.integrity.total_bytes      = bytes_to_check;
@@ -374,31 +593,25 @@ verify_integrity(struct filedes *in_fd, const tchar *filename,
 	if (ret)
 		return ret;
 
-	for (u32 i = 0; i < table->num_entries; i++) {
-		size_t this_chunk_size;
-		if (i == table->num_entries - 1)
-			this_chunk_size = MODULO_NONZERO(bytes_to_check,
-							 table->chunk_size);
-		else
-			this_chunk_size = table->chunk_size;
-
-		ret = calculate_chunk_sha1(in_fd, this_chunk_size, offset, sha1_md);
-		if (ret)
-			return ret;
-
-		if (!hashes_equal(sha1_md, table->sha1sums[i]))
-			return WIM_INTEGRITY_NOT_OK;
-
-		offset += this_chunk_size;
-		progress.integrity.completed_chunks++;
-		progress.integrity.completed_bytes += this_chunk_size;
+	sha1sums = MALLOC((size_t)table->num_entries * SHA1_HASH_SIZE);
+	if (!sha1sums)
+		return WIMLIB_ERR_NOMEM;
 
-		ret = call_progress(progfunc, WIMLIB_PROGRESS_MSG_VERIFY_INTEGRITY,
-				    &progress, progctx);
-		if (ret)
-			return ret;
-	}
-	return WIM_INTEGRITY_OK;
+	struct integrity_hasher hasher = {
+		.in_fd		= in_fd,
+		.check_bytes	= bytes_to_check,
+		.chunk_size	= table->chunk_size,
+		.num_chunks	= table->num_entries,
+		.sha1sums	= sha1sums,
+		.expected	= table,
+		.progress_msg	= WIMLIB_PROGRESS_MSG_VERIFY_INTEGRITY,
+		.progress	= &progress,
+		.progfunc	= progfunc,
+		.progctx	= progctx,
+	};
+	ret = hash_integrity_chunks(&hasher, 0);
+	FREE(sha1sums);
+	return ret;
 }
 
 
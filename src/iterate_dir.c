@@ -83,7 +83,8 @@ get_default_stream_type(const struct wim_inode *inode)
 
 static int
 init_wimlib_dentry(struct wimlib_dir_entry *wdentry, struct wim_dentry *dentry,
-		   WIMStruct *wim, int flags)
+		   WIMStruct *wim, const struct wim_image_metadata *imd,
+		   int flags)
 {
 	int ret;
 	const struct wim_inode *inode = dentry->d_inode;
@@ -91,6 +92,7 @@ init_wimlib_dentry(struct wimlib_dir_entry *wdentry, struct wim_dentry *dentry,
 	struct wimlib_unix_data unix_data;
 	const void *object_id;
 	u32 object_id_len;
+	tchar *full_path;
 
 	ret = utf16le_get_tstr(dentry->d_name, dentry->d_name_nbytes,
 			       &wdentry->filename, NULL);
@@ -102,10 +104,13 @@ init_wimlib_dentry(struct wimlib_dir_entry *wdentry, struct wim_dentry *dentry,
 	if (ret)
 		return ret;
 
-	ret = calculate_dentry_full_path(dentry);
+	/* Don't cache the full path in the dentry, since other threads may be
+	 * iterating over the same image if the WIM was opened for concurrent
+	 * reads.  */
+	ret = get_dentry_full_path(dentry, &full_path);
 	if (ret)
 		return ret;
-	wdentry->full_path = dentry->d_full_path;
+	wdentry->full_path = full_path;
 
 	for (struct wim_dentry *d = dentry; !dentry_is_root(d); d = d->d_parent)
 		wdentry->depth++;
@@ -113,7 +118,7 @@ init_wimlib_dentry(struct wimlib_dir_entry *wdentry, struct wim_dentry *dentry,
 	if (inode_has_security_descriptor(inode)) {
 		struct wim_security_data *sd;
 
-		sd = wim_get_current_security_data(wim);
+		sd = imd->security_data;
 		wdentry->security_descriptor = sd->descriptors[inode->i_security_id];
 		wdentry->security_descriptor_size = sd->sizes[inode->i_security_id];
 	}
@@ -179,13 +184,14 @@ free_wimlib_dentry(struct wimlib_dir_entry *wdentry)
 {
 	utf16le_put_tstr(wdentry->filename);
 	utf16le_put_tstr(wdentry->dos_name);
+	FREE((tchar *)wdentry->full_path);
 	for (unsigned i = 1; i <= wdentry->num_named_streams; i++)
 		utf16le_put_tstr(wdentry->streams[i].stream_name);
 	FREE(wdentry);
 }
 
 static int
-do_iterate_dir_tree(WIMStruct *wim,
+do_iterate_dir_tree(WIMStruct *wim, const struct wim_image_metadata *imd,
 		    struct wim_dentry *dentry, int flags,
 		    wimlib_iterate_dir_tree_callback_t cb,
 		    void *user_ctx)
@@ -200,7 +206,7 @@ do_iterate_dir_tree(WIMStruct *wim,
 	if (wdentry == NULL)
 		goto out;
 
-	ret = init_wimlib_dentry(wdentry, dentry, wim, flags);
+	ret = init_wimlib_dentry(wdentry, dentry, wim, imd, flags);
 	if (ret)
 		goto out_free_wimlib_dentry;
 
@@ -217,7 +223,7 @@ do_iterate_dir_tree(WIMStruct *wim,
 
 		ret = 0;
 		for_dentry_child(child, dentry) {
-			ret = do_iterate_dir_tree(wim, child,
+			ret = do_iterate_dir_tree(wim, imd, child,
 						  flags & ~WIMLIB_ITERATE_DIR_TREE_FLAG_CHILDREN,
 						  cb, user_ctx);
 			if (ret)
@@ -225,33 +231,11 @@ do_iterate_dir_tree(WIMStruct *wim,
 		}
 	}
 out_free_wimlib_dentry:
-	FREE(dentry->d_full_path);
-	dentry->d_full_path = NULL;
 	free_wimlib_dentry(wdentry);
 out:
 	return ret;
 }
 
-struct image_iterate_dir_tree_ctx {
-	const tchar *path;
-	int flags;
-	wimlib_iterate_dir_tree_callback_t cb;
-	void *user_ctx;
-};
-
-
-static int
-image_do_iterate_dir_tree(WIMStruct *wim)
-{
-	struct image_iterate_dir_tree_ctx *ctx = wim->private;
-	struct wim_dentry *dentry;
-
-	dentry = get_dentry(wim, ctx->path, WIMLIB_CASE_PLATFORM_DEFAULT);
-	if (dentry == NULL)
-		return WIMLIB_ERR_PATH_DOES_NOT_EXIST;
-	return do_iterate_dir_tree(wim, dentry, ctx->flags, ctx->cb, ctx->user_ctx);
-}
-
 /* API function documented in wimlib.h  */
 WIMLIBAPI int
 wimlib_iterate_dir_tree(WIMStruct *wim, int image, const tchar *_path,
@@ -259,6 +243,7 @@ wimlib_iterate_dir_tree(WIMStruct *wim, int image, const tchar *_path,
 			wimlib_iterate_dir_tree_callback_t cb, void *user_ctx)
 {
 	tchar *path;
+	int start, end;
 	int ret;
 
 	if (flags & ~(WIMLIB_ITERATE_DIR_TREE_FLAG_RECURSIVE |
@@ -266,17 +251,41 @@ wimlib_iterate_dir_tree(WIMStruct *wim, int image, const tchar *_path,
 		      WIMLIB_ITERATE_DIR_TREE_FLAG_RESOURCES_NEEDED))
 		return WIMLIB_ERR_INVALID_PARAM;
 
+	if (image == WIMLIB_ALL_IMAGES) {
+		start = 1;
+		end = wim->hdr.image_count;
+	} else if (image >= 1 && image <= wim->hdr.image_count) {
+		start = image;
+		end = image;
+	} else {
+		return WIMLIB_ERR_INVALID_IMAGE;
+	}
+
 	path = canonicalize_wim_path(_path);
 	if (path == NULL)
 		return WIMLIB_ERR_NOMEM;
-	struct image_iterate_dir_tree_ctx ctx = {
-		.path = path,
-		.flags = flags,
-		.cb = cb,
-		.user_ctx = user_ctx,
-	};
-	wim->private = &ctx;
-	ret = for_image(wim, image, image_do_iterate_dir_tree);
+
+	/* This doesn't use for_image(), since that would select each image in
+	 * the WIMStruct, which isn't allowed when the WIM has been opened for
+	 * concurrent reads.  */
+	ret = 0;
+	for (image = start; image <= end; image++) {
+		struct wim_image_metadata *imd;
+		struct wim_dentry *dentry;
+
+		ret = get_image_for_reading(wim, image, &imd);
+		if (ret)
+			break;
+		dentry = get_dentry_in_tree(imd->root_dentry, path,
+					    WIMLIB_CASE_PLATFORM_DEFAULT);
+		if (dentry == NULL) {
+			ret = WIMLIB_ERR_PATH_DOES_NOT_EXIST;
+			break;
+		}
+		ret = do_iterate_dir_tree(wim, imd, dentry, flags, cb, user_ctx);
+		if (ret)
+			break;
+	}
 	FREE(path);
 	return ret;
 }
@@ -167,6 +167,13 @@ struct wimfs_context {
 	/* Number of file descriptors open to the mounted WIM image.  */
 	unsigned long num_open_fds;
 
+	/* Lock for the file descriptor tables of the inodes, the open file
+	 * counts of the inodes and blobs, and 'num_open_fds'.  Read-only mounts
+	 * are multithreaded, and these are the only things that change when
+	 * files are opened and read.  (Read-write mounts are single-threaded.)
+	 */
+	struct mutex fd_lock;
+
 	/* For read-write mounts, the original metadata resource of the mounted
 	 * image.  */
 	struct blob_descriptor *metadata_resource;
@@ -1183,6 +1190,7 @@ unmount_wimfs(void)
 		}
 	}
 
+	mutex_lock(&wimfs_ctx->fd_lock);
 	if (wimfs_ctx->num_open_fds) {
 
 		/* There are still open file descriptors to the image.  */
@@ -1193,6 +1201,7 @@ unmount_wimfs(void)
 				      WIMLIB_UNMOUNT_FLAG_FORCE))
 				 == WIMLIB_UNMOUNT_FLAG_COMMIT)
 		{
+			mutex_unlock(&wimfs_ctx->fd_lock);
 			ret = WIMLIB_ERR_MOUNTED_IMAGE_IS_BUSY;
 			goto out;
 		}
@@ -1200,6 +1209,7 @@ unmount_wimfs(void)
 		/* Force-close all file descriptors.  */
 		close_all_fds(wimfs_ctx);
 	}
+	mutex_unlock(&wimfs_ctx->fd_lock);
 
 	if (unmount_flags & WIMLIB_UNMOUNT_FLAG_COMMIT)
 		ret = commit_image(wimfs_ctx, unmount_flags, mq);
@@ -1679,7 +1689,9 @@ wimfs_open(const char *path, struct fuse_file_info *fi)
 		blob = stream_blob_resolved(strm);
 	}
 
+	mutex_lock(&ctx->fd_lock);
 	ret = alloc_wimfs_fd(inode, strm, &fd);
+	mutex_unlock(&ctx->fd_lock);
 	if (ret)
 		return ret;
 
@@ -1690,8 +1702,11 @@ wimfs_open(const char *path, struct fuse_file_info *fi)
 				(fi->flags & (O_ACCMODE | O_TRUNC)) |
 				O_NOFOLLOW);
 		if (raw_fd < 0) {
+			ret = -errno;
+			mutex_lock(&ctx->fd_lock);
 			close_wimfs_fd(fd);
-			return -errno;
+			mutex_unlock(&ctx->fd_lock);
+			return ret;
 		}
 		filedes_init(&fd->f_staging_fd, raw_fd);
 		if (fi->flags & O_TRUNC) {
@@ -1706,7 +1721,8 @@ wimfs_open(const char *path, struct fuse_file_info *fi)
 static int
 wimfs_opendir(const char *path, struct fuse_file_info *fi)
 {
-	WIMStruct *wim = wimfs_get_WIMStruct();
+	struct wimfs_context *ctx = wimfs_get_context();
+	WIMStruct *wim = ctx->wim;
 	struct wim_inode *inode;
 	struct wim_inode_stream *strm;
 	struct wimfs_fd *fd;
@@ -1720,7 +1736,9 @@ wimfs_opendir(const char *path, struct fuse_file_info *fi)
 	strm = inode_get_unnamed_data_stream(inode);
 	if (!strm)
 		return -ENOTDIR;
+	mutex_lock(&ctx->fd_lock);
 	ret = alloc_wimfs_fd(inode, strm, &fd);
+	mutex_unlock(&ctx->fd_lock);
 	if (ret)
 		return ret;
 	fi->fh = (uintptr_t)fd;
@@ -1750,7 +1768,8 @@ wimfs_read(const char *path, char *buf, size_t size,
 
 	switch (blob->blob_location) {
 	case BLOB_IN_WIM:
-		if (read_partial_wim_blob_into_buf(blob, offset, size, buf))
+		if (read_partial_wim_blob_into_buf(blob, NULL, offset, size,
+						   buf))
 			ret = errno ? -errno : -EIO;
 		else
 			ret = size;
@@ -1832,7 +1851,13 @@ wimfs_readlink(const char *path, char *buf, size_t bufsize)
 static int
 wimfs_release(const char *path, struct fuse_file_info *fi)
 {
-	return close_wimfs_fd(WIMFS_FD(fi));
+	struct wimfs_context *ctx = wimfs_get_context();
+	int ret;
+
+	mutex_lock(&ctx->fd_lock);
+	ret = close_wimfs_fd(WIMFS_FD(fi));
+	mutex_unlock(&ctx->fd_lock);
+	return ret;
 }
 
 static int
@@ -2228,6 +2253,10 @@ wimlib_mount_image(WIMStruct *wim, int image, const char *dir,
 
 	/* Start initializing the wimfs_context.  */
 	memset(&ctx, 0, sizeof(struct wimfs_context));
+	if (!mutex_init(&ctx.fd_lock)) {
+		ret = WIMLIB_ERR_NOMEM;
+		goto out_unlock;
+	}
 	ctx.wim = wim;
 	ctx.mount_flags = mount_flags;
 	if (mount_flags & WIMLIB_MOUNT_FLAG_STREAM_INTERFACE_WINDOWS)
@@ -2264,8 +2293,13 @@ wimlib_mount_image(WIMStruct *wim, int image, const char *dir,
 	fuse_argv[fuse_argc++] = "wimlib";
 	fuse_argv[fuse_argc++] = (char *)dir;
 
-	/* Disable multi-threaded operation.  */
-	fuse_argv[fuse_argc++] = "-s";
+	/* Disable multi-threaded operation for read-write mounts.  Read-only
+	 * mounts can be multithreaded, since the only state that reads and
+	 * lookups change is protected by locks: the file descriptor tables
+	 * (ctx.fd_lock), and the WIM's decompressors and chunk cache.  This
+	 * allows concurrent reads to proceed in parallel.  */
+	if (mount_flags & WIMLIB_MOUNT_FLAG_READWRITE)
+		fuse_argv[fuse_argc++] = "-s";
 
 	/* Enable FUSE debug mode (don't fork) if requested by the user.  */
 	if (mount_flags & WIMLIB_MOUNT_FLAG_DEBUG)
@@ -2302,6 +2336,8 @@ out:
 	free_blob_descriptor(ctx.metadata_resource);
 	if (ctx.staging_dir_name)
 		delete_staging_dir(&ctx);
+	mutex_destroy(&ctx.fd_lock);
+out_unlock:
 	unlock_wim_for_append(wim);
 	return ret;
 }
@@ -0,0 +1,590 @@
+/*
+ * read_ahead.c - asynchronous read-ahead of the data being read from files
+ */
+
+/*
+ * Copyright (C) 2023 Eric Biggers
+ *
+ * This file is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This file is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this file; if not, see https://www.gnu.org/licenses/.
+ */
+
+/*
+ * Reading a WIM file consists of many reads that are individually small (a
+ * chunk table, a compressed chunk, an uncompressed resource) but that mostly
+ * proceed sequentially through the file.  Doing each one with a blocking
+ * pread() means the processing of the data never overlaps with waiting for the
+ * next piece of it.
+ *
+ * A 'struct read_ahead' is given the list of extents of a file that are about
+ * to be read, in order.  It keeps several fixed-size blocks of those extents
+ * being read at all times using io_uring, and satisfies the actual reads from
+ * the blocks, waiting only if the needed block hasn't arrived yet.  Reads that
+ * don't match what was read ahead, such as reads that go backwards, are simply
+ * done with full_pread(); reads that skip ahead restart the read-ahead from the
+ * new position.  Likewise, any problem with an asynchronous read, including a
+ * short read, just makes the read fall back to full_pread(), so that errors are
+ * reported in exactly the same way as before.
+ *
+ * The io_uring interface is used through the raw system calls, so there is no
+ * dependency on liburing.  If io_uring isn't available, or if the caller only
+ * asks for hints, the reads are done synchronously instead, but the kernel is
+ * told with posix_fadvise() that the file is being read sequentially and which
+ * parts of it will be read next (POSIX_FADV_WILLNEED), always staying a few
+ * megabytes ahead of the reads.  That way the kernel can start reading them,
+ * including across the gaps between extents where its own read-ahead would
+ * stop, while the data already read is being processed.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#ifdef ENABLE_IO_URING
+#  include <linux/io_uring.h>
+#  include <sys/mman.h>
+#  include <sys/syscall.h>
+#  include <sys/uio.h>
+#endif
+#include <string.h>
+#include <unistd.h>
+
+#include "wimlib/read_ahead.h"
+#include "wimlib/threads.h"
+#include "wimlib/util.h"
+
+/* Size and number of the blocks being read ahead  */
+#define READ_AHEAD_BLOCK_SIZE	((u32)1 << 18)
+#define READ_AHEAD_DEPTH	8
+
+/* When only giving hints, the size of the region covered by each hint, and how
+ * far ahead of the reads to give them  */
+#define READ_AHEAD_HINT_SIZE	((u32)1 << 20)
+#define READ_AHEAD_HINT_WINDOW	((u64)1 << 23)
+
+#ifdef ENABLE_IO_URING
+struct read_ahead_block {
+	struct iovec iov;
+	u64 offset;
+	s32 result;
+	bool complete;
+};
+#endif
+
+struct read_ahead_extent {
+	u64 offset;
+	u64 end;
+};
+
+struct read_ahead {
+	int fd;
+
+	/* The extents to read ahead, and the position up to which reads of
+	 * them (or hints) have been issued  */
+	struct read_ahead_extent *extents;
+	size_t num_extents;
+	size_t alloc_extents;
+	size_t cur_extent;
+	u64 next_offset;
+
+	/* True if reading ahead with io_uring, or false if just giving hints */
+	bool use_ring;
+
+#ifdef ENABLE_IO_URING
+	/* The io_uring instance and its memory-mapped rings  */
+	int ring_fd;
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+	unsigned num_unsubmitted;
+
+	/* Set if io_uring_enter() failed unexpectedly.  Reads that are still
+	 * in progress may then never be reaped, so the blocks can't be used
+	 * or freed anymore.  */
+	bool broken;
+
+	/* The blocks, used as a ring.  blocks[head] is the oldest block that
+	 * has been issued, and there are num_issued of them in order.  */
+	struct read_ahead_block blocks[READ_AHEAD_DEPTH];
+	unsigned head;
+	unsigned num_issued;
+#endif /* ENABLE_IO_URING */
+};
+
+#if defined(ENABLE_IO_URING) || defined(HAVE_POSIX_FADVISE)
+/* Advance to the next extent if the current one has been fully issued.  */
+static void
+advance_extent(struct read_ahead *ra)
+{
+	if (ra->next_offset == ra->extents[ra->cur_extent].end &&
+	    ++ra->cur_extent < ra->num_extents)
+		ra->next_offset = ra->extents[ra->cur_extent].offset;
+}
+
+/* Position the read-ahead so that it continues from @offset.  Returns false if
+ * @offset is behind the read-ahead or isn't in any of the remaining extents;
+ * in the latter case, the read-ahead continues from the next extent after
+ * @offset, if any.  With io_uring, no blocks may be issued.  */
+static bool
+seek_read_ahead(struct read_ahead *ra, u64 offset)
+{
+	if (ra->cur_extent >= ra->num_extents || offset < ra->next_offset)
+		return false;
+	while (ra->extents[ra->cur_extent].end <= offset) {
+		if (++ra->cur_extent == ra->num_extents)
+			return false;
+		ra->next_offset = ra->extents[ra->cur_extent].offset;
+	}
+	if (offset < ra->next_offset)
+		return false;
+	ra->next_offset = offset;
+	return true;
+}
+#endif /* ENABLE_IO_URING || HAVE_POSIX_FADVISE */
+
+#ifdef HAVE_POSIX_FADVISE
+/* Tell the kernel about the parts of the extents that will be read in the near
+ * future, given that a read at @offset is about to be done.  */
+static void
+issue_hints(struct read_ahead *ra, u64 offset)
+{
+	/* Don't give hints for anything that was skipped over.  */
+	seek_read_ahead(ra, offset);
+
+	while (ra->cur_extent < ra->num_extents &&
+	       ra->next_offset < offset + READ_AHEAD_HINT_WINDOW)
+	{
+		u64 len = min(ra->extents[ra->cur_extent].end - ra->next_offset,
+			      READ_AHEAD_HINT_SIZE);
+
+		posix_fadvise(ra->fd, ra->next_offset, len,
+			      POSIX_FADV_WILLNEED);
+		ra->next_offset += len;
+		advance_extent(ra);
+	}
+}
+#else
+static void
+issue_hints(struct read_ahead *ra, u64 offset)
+{
+}
+#endif /* !HAVE_POSIX_FADVISE */
+
+#ifdef ENABLE_IO_URING
+
+static int
+ring_enter(struct read_ahead *ra, unsigned min_complete)
+{
+	int ret;
+
+	do {
+		ret = syscall(__NR_io_uring_enter, ra->ring_fd,
+			      ra->num_unsubmitted, min_complete,
+			      min_complete ? IORING_ENTER_GETEVENTS : 0,
+			      NULL, 0);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret < 0) {
+		/* EAGAIN and EBUSY mean the kernel is temporarily out of
+		 * resources or that completions need to be reaped first; both
+		 * are handled by just trying again later.  */
+		if (errno != EAGAIN && errno != EBUSY) {
+			ra->broken = true;
+			return -1;
+		}
+		return 0;
+	}
+	ra->num_unsubmitted -= ret;
+	return 0;
+}
+
+/* Record the results of any completed reads.  */
+static void
+reap_completions(struct read_ahead *ra)
+{
+	unsigned head = *ra->cq_head;
+	unsigned tail = atomic_load_acquire(ra->cq_tail);
+
+	while (head != tail) {
+		const struct io_uring_cqe *cqe = &ra->cqes[head & *ra->cq_mask];
+		struct read_ahead_block *block = &ra->blocks[cqe->user_data];
+
+		block->result = cqe->res;
+		block->complete = true;
+		head++;
+	}
+	atomic_store_release(ra->cq_head, head);
+}
+
+/* Wait for the read of @block to complete.  Returns false if this is no longer
+ * possible.  */
+static bool
+wait_for_block(struct read_ahead *ra, struct read_ahead_block *block)
+{
+	for (;;) {
+		reap_completions(ra);
+		if (block->complete)
+			return true;
+		if (ra->broken || ring_enter(ra, 1))
+			return false;
+	}
+}
+
+/* Issue reads of as many blocks as possible.  */
+static void
+issue_reads(struct read_ahead *ra)
+{
+	unsigned prev_unsubmitted = ra->num_unsubmitted;
+
+	if (ra->broken)
+		return;
+
+	while (ra->num_issued < READ_AHEAD_DEPTH &&
+	       ra->cur_extent < ra->num_extents)
+	{
+		const struct read_ahead_extent *extent =
+			&ra->extents[ra->cur_extent];
+		unsigned slot = (ra->head + ra->num_issued) % READ_AHEAD_DEPTH;
+		struct read_ahead_block *block = &ra->blocks[slot];
+		unsigned tail = *ra->sq_tail;
+		unsigned idx = tail & *ra->sq_mask;
+		struct io_uring_sqe *sqe = &ra->sqes[idx];
+
+		block->offset = ra->next_offset;
+		block->iov.iov_len = min(extent->end - ra->next_offset,
+					 READ_AHEAD_BLOCK_SIZE);
+		block->complete = false;
+
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode = IORING_OP_READV;
+		sqe->fd = ra->fd;
+		sqe->off = block->offset;
+		sqe->addr = (uintptr_t)&block->iov;
+		sqe->len = 1;
+		sqe->user_data = slot;
+		ra->sq_array[idx] = idx;
+		atomic_store_release(ra->sq_tail, tail + 1);
+		ra->num_unsubmitted++;
+		ra->num_issued++;
+
+		ra->next_offset += block->iov.iov_len;
+		advance_extent(ra);
+	}
+	if (ra->num_unsubmitted != prev_unsubmitted)
+		ring_enter(ra, 0);
+}
+
+/* Retire the oldest issued block.  */
+static bool
+drop_head_block(struct read_ahead *ra)
+{
+	if (!wait_for_block(ra, &ra->blocks[ra->head]))
+		return false;
+	ra->head = (ra->head + 1) % READ_AHEAD_DEPTH;
+	ra->num_issued--;
+	return true;
+}
+
+/* Set up the io_uring instance and the blocks.  */
+static bool
+ring_setup(struct read_ahead *ra)
+{
+	struct io_uring_params p = {};
+	unsigned i;
+
+	for (i = 0; i < READ_AHEAD_DEPTH; i++) {
+		ra->blocks[i].iov.iov_base = MALLOC(READ_AHEAD_BLOCK_SIZE);
+		if (!ra->blocks[i].iov.iov_base)
+			return false;
+	}
+
+	ra->ring_fd = syscall(__NR_io_uring_setup, READ_AHEAD_DEPTH, &p);
+	if (ra->ring_fd < 0)
+		return false;
+
+	ra->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ra->cq_ring_size = p.cq_off.cqes +
+			   p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ra->sq_ring_size = max(ra->sq_ring_size, ra->cq_ring_size);
+		ra->cq_ring_size = 0;
+	}
+	ra->sq_ring = mmap(NULL, ra->sq_ring_size, PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_POPULATE, ra->ring_fd,
+			   IORING_OFF_SQ_RING);
+	if (ra->sq_ring == MAP_FAILED)
+		return false;
+	if (ra->cq_ring_size) {
+		ra->cq_ring = mmap(NULL, ra->cq_ring_size,
+				   PROT_READ | PROT_WRITE,
+				   MAP_SHARED | MAP_POPULATE, ra->ring_fd,
+				   IORING_OFF_CQ_RING);
+		if (ra->cq_ring == MAP_FAILED)
+			return false;
+	}
+	ra->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ra->sqes = mmap(NULL, ra->sqes_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ra->ring_fd,
+			IORING_OFF_SQES);
+	if (ra->sqes == MAP_FAILED)
+		return false;
+
+	ra->sq_tail = ra->sq_ring + p.sq_off.tail;
+	ra->sq_mask = ra->sq_ring + p.sq_off.ring_mask;
+	ra->sq_array = ra->sq_ring + p.sq_off.array;
+	{
+		void *cq_ring = ra->cq_ring_size ? ra->cq_ring : ra->sq_ring;
+
+		ra->cq_head = cq_ring + p.cq_off.head;
+		ra->cq_tail = cq_ring + p.cq_off.tail;
+		ra->cq_mask = cq_ring + p.cq_off.ring_mask;
+		ra->cqes = cq_ring + p.cq_off.cqes;
+	}
+	return true;
+}
+
+/* Tear down the io_uring instance and free the blocks, after waiting for any
+ * reads still in progress.  This also works after a partial ring_setup().  */
+static void
+ring_free(struct read_ahead *ra)
+{
+	while (ra->num_issued)
+		if (!drop_head_block(ra))
+			break;
+
+	if (ra->sqes != MAP_FAILED)
+		munmap(ra->sqes, ra->sqes_size);
+	if (ra->cq_ring != MAP_FAILED)
+		munmap(ra->cq_ring, ra->cq_ring_size);
+	if (ra->sq_ring != MAP_FAILED)
+		munmap(ra->sq_ring, ra->sq_ring_size);
+	if (ra->ring_fd >= 0)
+		close(ra->ring_fd);
+
+	/* If reads might still be in progress, the kernel might still write
+	 * to the blocks, so leak them rather than risk corrupting memory.  */
+	if (!ra->num_issued)
+		for (unsigned i = 0; i < READ_AHEAD_DEPTH; i++)
+			FREE(ra->blocks[i].iov.iov_base);
+}
+
+/* Do a read, taking the data from the blocks that have been read ahead if
+ * possible.  */
+static int
+ring_pread(struct read_ahead *ra, struct filedes *fd, void *buf,
+	   size_t count, u64 offset)
+{
+	if (ra->broken)
+		return full_pread(fd, buf, count, offset);
+
+	while (count) {
+		struct read_ahead_block *block;
+		size_t n;
+
+		/* Discard blocks that end before the requested data.  */
+		while (ra->num_issued &&
+		       ra->blocks[ra->head].offset +
+		       ra->blocks[ra->head].iov.iov_len <= offset)
+		{
+			if (!drop_head_block(ra))
+				goto sync_read;
+		}
+
+		if (ra->num_issued == 0) {
+			/* The read is past everything that was issued, so
+			 * continue the read-ahead from here.  */
+			if (!seek_read_ahead(ra, offset))
+				goto sync_read;
+			issue_reads(ra);
+			if (ra->num_issued == 0)
+				goto sync_read;
+		}
+
+		block = &ra->blocks[ra->head];
+		if (offset < block->offset || !wait_for_block(ra, block) ||
+		    block->result <= 0 ||
+		    offset >= block->offset + block->result)
+			goto sync_read;
+
+		n = min(count, block->offset + block->result - offset);
+		buf = mempcpy(buf, block->iov.iov_base +
+				   (offset - block->offset), n);
+		count -= n;
+		offset += n;
+		if (offset == block->offset + block->iov.iov_len) {
+			if (!drop_head_block(ra))
+				goto sync_read;
+			issue_reads(ra);
+		}
+	}
+	return 0;
+
+sync_read:
+	return full_pread(fd, buf, count, offset);
+}
+
+#else /* ENABLE_IO_URING */
+
+static bool
+ring_setup(struct read_ahead *ra)
+{
+	return false;
+}
+
+static void
+ring_free(struct read_ahead *ra)
+{
+}
+
+static void
+issue_reads(struct read_ahead *ra)
+{
+}
+
+static int
+ring_pread(struct read_ahead *ra, struct filedes *fd, void *buf,
+	   size_t count, u64 offset)
+{
+	return full_pread(fd, buf, count, offset);
+}
+
+#endif /* !ENABLE_IO_URING */
+
+/*
+ * Create a read-ahead context for the file @fd.  If @hints_only is true, or if
+ * io_uring isn't available, the reads will be synchronous and the kernel will
+ * just be given hints about them.  Returns NULL if neither is possible, in
+ * which case reads should just be done synchronously.
+ */
+struct read_ahead *
+read_ahead_new(struct filedes *fd, bool hints_only)
+{
+	struct read_ahead *ra;
+
+	if (!filedes_is_seekable(fd))
+		return NULL;
+
+	ra = CALLOC(1, sizeof(*ra));
+	if (!ra)
+		return NULL;
+	ra->fd = fd->fd;
+#ifdef ENABLE_IO_URING
+	ra->ring_fd = -1;
+	ra->sq_ring = MAP_FAILED;
+	ra->cq_ring = MAP_FAILED;
+	ra->sqes = MAP_FAILED;
+#endif
+
+	if (!hints_only) {
+		if (ring_setup(ra)) {
+			ra->use_ring = true;
+			return ra;
+		}
+		ring_free(ra);
+	}
+#ifdef HAVE_POSIX_FADVISE
+	posix_fadvise(ra->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	return ra;
+#else
+	FREE(ra);
+	return NULL;
+#endif
+}
+
+/* Add an extent to the end of the list of extents that will be read.  */
+void
+read_ahead_add(struct read_ahead *ra, u64 offset, u64 size)
+{
+	struct read_ahead_extent *extent;
+
+	if (!ra || !size)
+		return;
+
+	/* Extend the last extent if possible.  */
+	if (ra->num_extents > ra->cur_extent) {
+		extent = &ra->extents[ra->num_extents - 1];
+		if (offset >= extent->offset && offset <= extent->end) {
+			extent->end = max(extent->end, offset + size);
+			return;
+		}
+	}
+
+	if (ra->num_extents == ra->alloc_extents) {
+		size_t new_alloc = max(ra->alloc_extents * 2, 16);
+		struct read_ahead_extent *new_extents;
+
+		new_extents = REALLOC(ra->extents,
+				      new_alloc * sizeof(ra->extents[0]));
+		if (!new_extents)
+			return;
+		ra->extents = new_extents;
+		ra->alloc_extents = new_alloc;
+	}
+	extent = &ra->extents[ra->num_extents++];
+	extent->offset = offset;
+	extent->end = offset + size;
+	if (ra->num_extents == ra->cur_extent + 1)
+		ra->next_offset = offset;
+	if (ra->use_ring)
+		issue_reads(ra);
+}
+
+/*
+ * Read @count bytes at @offset in @fd into @buf, like full_pread(), but take
+ * the data from the blocks that have been read ahead if possible.  @ra may be
+ * NULL or may be for a different file, in which case this just calls
+ * full_pread().
+ */
+int
+read_ahead_pread(struct read_ahead *ra, struct filedes *fd, void *buf,
+		 size_t count, u64 offset)
+{
+	if (!ra || ra->fd != fd->fd)
+		return full_pread(fd, buf, count, offset);
+
+	if (ra->use_ring)
+		return ring_pread(ra, fd, buf, count, offset);
+
+	issue_hints(ra, offset);
+	return full_pread(fd, buf, count, offset);
+}
+
+/* Free a read-ahead context.  Any reads still in progress are waited for.  */
+void
+read_ahead_free(struct read_ahead *ra)
+{
+	if (!ra)
+		return;
+
+	if (ra->use_ring) {
+		ring_free(ra);
+	} else {
+#ifdef HAVE_POSIX_FADVISE
+		posix_fadvise(ra->fd, 0, 0, POSIX_FADV_NORMAL);
+#endif
+	}
+	FREE(ra->extents);
+	FREE(ra);
+}
@@ -153,6 +153,10 @@ reference_resource_path(struct reference_info *info, const tchar *path,
 	if (ret)
 		return ret;
 
+	src_wim->num_decompression_threads =
+		info->dest_wim->num_decompression_threads;
+	src_wim->chunk_cache_max_size = info->dest_wim->chunk_cache_max_size;
+
 	info->src_table = src_wim->blob_table;
 	for_blob_in_table(src_wim->blob_table, blob_gift, info);
 	wimlib_free(src_wim);
@@ -27,16 +27,21 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include "wimlib/alloca.h"
 #include "wimlib/assert.h"
 #include "wimlib/bitops.h"
 #include "wimlib/blob_table.h"
+#include "wimlib/chunk_cache.h"
+#include "wimlib/chunk_decompressor.h"
 #include "wimlib/endianness.h"
 #include "wimlib/error.h"
 #include "wimlib/file_io.h"
+#include "wimlib/inode.h"
 #include "wimlib/ntfs_3g.h"
+#include "wimlib/read_ahead.h"
 #include "wimlib/resource.h"
 #include "wimlib/sha1.h"
 #include "wimlib/wim.h"
@@ -77,12 +82,85 @@
  *   format allows a resource to be written without rewinding.
  */
 
+/*
+ * The read-ahead context of the read_blob_list() call in progress in this
+ * thread, if any.  Reads of WIM resources go through it, so that the data of
+ * the following resources is read while the current one is being processed.
+ * Reads of large resources outside of read_blob_list() use their own read-ahead
+ * context.
+ */
+static __thread struct read_ahead *blob_list_read_ahead;
+
+/* Whether the read_blob_list() call in progress in this thread, if any, was
+ * given DROP_FILE_CACHE.  */
+static __thread bool blob_list_drop_cache;
 
 struct data_range {
 	u64 offset;
 	u64 size;
 };
 
+/* Position in an array of data ranges being fed to a consume_chunk callback  */
+struct data_range_cursor {
+	const struct data_range *cur_range;
+	const struct data_range *end_range;
+	u64 cur_range_pos;
+	u64 cur_range_end;
+};
+
+static void
+data_range_cursor_init(struct data_range_cursor *cursor,
+		       const struct data_range *ranges, size_t num_ranges)
+{
+	cursor->cur_range = ranges;
+	cursor->end_range = &ranges[num_ranges];
+	cursor->cur_range_pos = ranges[0].offset;
+	cursor->cur_range_end = ranges[0].offset + ranges[0].size;
+}
+
+/*
+ * Feed the parts of an uncompressed chunk that are covered by the data ranges
+ * to the callback, then advance the cursor past the chunk.  The chunk must
+ * contain the cursor's current position.
+ */
+static int
+consume_chunk_ranges(struct data_range_cursor *cursor, const u8 *ubuf,
+		     u64 chunk_start_offset, u64 chunk_end_offset,
+		     const struct consume_chunk_callback *cb)
+{
+	int ret;
+
+	do {
+		size_t start, end, size;
+
+		/* Calculate how many bytes of data should be sent to the
+		 * callback function, taking into account that data sent to the
+		 * callback function must not overlap range boundaries.  */
+		start = cursor->cur_range_pos - chunk_start_offset;
+		end = min(cursor->cur_range_end, chunk_end_offset) -
+		      chunk_start_offset;
+		size = end - start;
+
+		ret = consume_chunk(cb, &ubuf[start], size);
+		if (unlikely(ret))
+			return ret;
+
+		cursor->cur_range_pos += size;
+		if (cursor->cur_range_pos == cursor->cur_range_end) {
+			/* Advance to next range.  */
+			if (++cursor->cur_range == cursor->end_range) {
+				cursor->cur_range_pos = ~0ULL;
+			} else {
+				cursor->cur_range_pos = cursor->cur_range->offset;
+				cursor->cur_range_end = cursor->cur_range->offset +
+							cursor->cur_range->size;
+			}
+		}
+	} while (cursor->cur_range_pos < chunk_end_offset);
+
+	return 0;
+}
+
 static int
 decompress_chunk(const void *cbuf, u32 chunk_csize, u8 *ubuf, u32 chunk_usize,
 		 struct wimlib_decompressor *decompressor, bool recover_data)
@@ -111,6 +189,46 @@ decompress_chunk(const void *cbuf, u32 chunk_csize, u8 *ubuf, u32 chunk_usize,
 	return WIMLIB_ERR_DECOMPRESSION;
 }
 
+/*
+ * Retrieve the next chunk from a parallel chunk decompressor and feed it to the
+ * callback.  The recovery of corrupted chunks was already done by the worker
+ * thread; here we just decide whether to accept the result.
+ */
+static int
+consume_decompressed_chunk(struct chunk_decompressor *chunk_decompressor,
+			   struct data_range_cursor *cursor, u32 chunk_order,
+			   const struct consume_chunk_callback *cb,
+			   bool recover_data)
+{
+	const void *udata;
+	u32 usize;
+	int status;
+	bool ok;
+
+	ok = chunk_decompressor->get_decompression_result(chunk_decompressor,
+							  &udata, &usize,
+							  &status);
+	wimlib_assert(ok);
+
+	if (unlikely(status)) {
+		if (!recover_data) {
+			ERROR("Failed to decompress data!");
+			errno = EINVAL;
+			return WIMLIB_ERR_DECOMPRESSION;
+		}
+		WARNING("Failed to decompress data!  Continuing anyway since data recovery mode is enabled.");
+	}
+
+	/* Chunks are returned in order, and each one contains data that is
+	 * needed, so the chunk containing the cursor's position is always the
+	 * one being returned.  */
+	const u64 chunk_start_offset =
+		(cursor->cur_range_pos >> chunk_order) << chunk_order;
+
+	return consume_chunk_ranges(cursor, udata, chunk_start_offset,
+				    chunk_start_offset + usize, cb);
+}
+
 /*
  * Read data from a compressed WIM resource.
  *
@@ -130,6 +248,10 @@ decompress_chunk(const void *cbuf, u32 chunk_csize, u8 *ubuf, u32 chunk_usize,
  *	If a chunk can't be fully decompressed due to being corrupted, continue
  *	with whatever data can be recovered rather than return an error.
  *
+ * If the requested data spans enough chunks and the WIMStruct allows it, the
+ * chunks are decompressed by a parallel chunk decompressor.  The callback is
+ * still always called from the calling thread, with the data in order.
+ *
  * Possible return values:
  *
  *	WIMLIB_ERR_SUCCESS (0)
@@ -156,6 +278,9 @@ read_compressed_wim_resource(const struct wim_resource_descriptor * const rdesc,
 	bool ubuf_malloced = false;
 	bool cbuf_malloced = false;
 	struct wimlib_decompressor *decompressor = NULL;
+	struct chunk_decompressor *chunk_decompressor = NULL;
+	struct read_ahead *ra = blob_list_read_ahead;
+	struct read_ahead *local_ra = NULL;
 
 	/* Sanity checks  */
 	wimlib_assert(num_ranges != 0);
@@ -180,6 +305,12 @@ read_compressed_wim_resource(const struct wim_resource_descriptor * const rdesc,
 	const bool alt_chunk_table = (rdesc->flags & WIM_RESHDR_FLAG_SOLID)
 					&& !is_pipe_read;
 
+	/* If the resource is memory-mapped, then the compressed chunks are used
+	 * in place rather than read into a buffer.  */
+	const bool mapped = !is_pipe_read &&
+		wim_mapped_data(rdesc->wim, rdesc->offset_in_wim,
+				rdesc->size_in_wim) != NULL;
+
 	/* Get the maximum size of uncompressed chunks in this resource, which
 	 * we require be a power of 2.  */
 	u64 cur_read_offset = rdesc->offset_in_wim;
@@ -202,24 +333,6 @@ read_compressed_wim_resource(const struct wim_resource_descriptor * const rdesc,
 		goto out_cleanup;
 	}
 
-	/* Get valid decompressor.  */
-	if (likely(ctype == rdesc->wim->decompressor_ctype &&
-		   chunk_size == rdesc->wim->decompressor_max_block_size))
-	{
-		/* Cached decompressor.  */
-		decompressor = rdesc->wim->decompressor;
-		rdesc->wim->decompressor_ctype = WIMLIB_COMPRESSION_TYPE_NONE;
-		rdesc->wim->decompressor = NULL;
-	} else {
-		ret = wimlib_create_decompressor(ctype, chunk_size,
-						 &decompressor);
-		if (unlikely(ret)) {
-			if (ret != WIMLIB_ERR_NOMEM)
-				errno = EINVAL;
-			goto out_cleanup;
-		}
-	}
-
 	const u32 chunk_order = bsr32(chunk_size);
 
 	/* Calculate the total number of chunks the resource is divided into.  */
@@ -230,6 +343,39 @@ read_compressed_wim_resource(const struct wim_resource_descriptor * const rdesc,
 	const u64 first_needed_chunk = first_offset >> chunk_order;
 	const u64 last_needed_chunk = last_offset >> chunk_order;
 
+	/* If there is enough data to decompress, try to decompress it using
+	 * multiple threads.  This uses the same heuristic as the write path
+	 * uses for compression.  */
+	if (rdesc->wim->num_decompression_threads != 1 &&
+	    last_offset - first_offset + 1 > max(2000000, chunk_size))
+	{
+		ret = new_parallel_chunk_decompressor(ctype, chunk_size,
+						      rdesc->wim->num_decompression_threads,
+						      0,
+						      last_needed_chunk -
+						      first_needed_chunk + 1,
+						      &chunk_decompressor);
+		if (ret > 0) {
+			WARNING("Couldn't create parallel chunk decompressor: %"TS".\n"
+				"          Falling back to single-threaded decompression.",
+				wimlib_get_error_string(ret));
+		}
+	}
+
+	/* Get valid decompressor.  */
+	if (chunk_decompressor) {
+		/* Each thread of the parallel chunk decompressor has its own
+		 * decompressor.  */
+	} else {
+		ret = wim_get_decompressor(rdesc->wim, ctype, chunk_size,
+					   &decompressor);
+		if (unlikely(ret)) {
+			if (ret != WIMLIB_ERR_NOMEM)
+				errno = EINVAL;
+			goto out_cleanup;
+		}
+	}
+
 	/* Calculate the 0-based index of the first chunk that actually needs to
 	 * be read.  This is normally first_needed_chunk, but for pipe reads we
 	 * must always start from the 0th chunk.  */
@@ -325,8 +471,9 @@ read_compressed_wim_resource(const struct wim_resource_descriptor * const rdesc,
 			chunk_offsets_alloc_size -
 			chunk_table_size_to_read;
 
-		ret = full_pread(in_fd, chunk_table_data, chunk_table_size_to_read,
-				 file_offset_of_needed_chunk_entries);
+		ret = read_ahead_pread(ra, in_fd, chunk_table_data,
+				       chunk_table_size_to_read,
+				       file_offset_of_needed_chunk_entries);
 		if (unlikely(ret))
 			goto read_error;
 
@@ -370,10 +517,33 @@ read_compressed_wim_resource(const struct wim_resource_descriptor * const rdesc,
 			cur_read_offset += read_start_chunk * sizeof(struct pwm_chunk_hdr);
 		else
 			cur_read_offset += chunk_table_size;
+
+		/* Unless a read-ahead of this resource is already in progress,
+		 * read ahead of the chunks if there are enough of them.  */
+		if (!ra && !rdesc->is_pipable && !mapped) {
+			u64 end_offset = rdesc->offset_in_wim +
+					 rdesc->size_in_wim;
+
+			if (last_needed_chunk < num_chunks - 1) {
+				end_offset = cur_read_offset +
+					chunk_offsets[last_needed_chunk + 1 -
+						      read_start_chunk] -
+					chunk_offsets[0];
+			}
+			if (end_offset - cur_read_offset >= READ_AHEAD_MIN_SIZE) {
+				ra = local_ra = read_ahead_new(in_fd, false);
+				read_ahead_add(ra, cur_read_offset,
+					       end_offset - cur_read_offset);
+			}
+		}
 	}
 
-	/* Allocate buffer for holding the uncompressed data of each chunk.  */
-	if (chunk_size <= STACK_MAX) {
+	/* Allocate buffer for holding the uncompressed data of each chunk.
+	 * This isn't needed if a parallel chunk decompressor is being used,
+	 * since then the data is decompressed into its own buffers.  */
+	if (chunk_decompressor) {
+		/* No buffer needed.  */
+	} else if (chunk_size <= STACK_MAX) {
 		ubuf = alloca(chunk_size);
 	} else {
 		ubuf = MALLOC(chunk_size);
@@ -385,8 +555,11 @@ read_compressed_wim_resource(const struct wim_resource_descriptor * const rdesc,
 	/* Allocate a temporary buffer for reading compressed chunks, each of
 	 * which can be at most @chunk_size - 1 bytes.  This excludes compressed
 	 * chunks that are a full @chunk_size bytes, which are actually stored
-	 * uncompressed.  */
-	if (chunk_size - 1 <= STACK_MAX) {
+	 * uncompressed.  Again, this isn't needed if a parallel chunk
+	 * decompressor is being used, or if the resource is memory-mapped.  */
+	if (chunk_decompressor || mapped) {
+		/* No buffer needed.  */
+	} else if (chunk_size - 1 <= STACK_MAX) {
 		cbuf = alloca(chunk_size - 1);
 	} else {
 		cbuf = MALLOC(chunk_size - 1);
@@ -395,11 +568,15 @@ read_compressed_wim_resource(const struct wim_resource_descriptor * const rdesc,
 		cbuf_malloced = true;
 	}
 
-	/* Set current data range.  */
-	const struct data_range *cur_range = ranges;
+	/* Set up two cursors into the data ranges: one which tracks the data
+	 * that has been passed to the callback, and one which tracks which
+	 * chunks need to be read.  They only differ when decompressing in
+	 * parallel, since then chunks are read ahead of being consumed.  */
+	struct data_range_cursor cursor;
+	const struct data_range *need_range = ranges;
 	const struct data_range * const end_range = &ranges[num_ranges];
-	u64 cur_range_pos = cur_range->offset;
-	u64 cur_range_end = cur_range->offset + cur_range->size;
+
+	data_range_cursor_init(&cursor, ranges, num_ranges);
 
 	/* Read and process each needed chunk.  */
 	for (u64 i = read_start_chunk; i <= last_needed_chunk; i++) {
@@ -447,7 +624,13 @@ read_compressed_wim_resource(const struct wim_resource_descriptor * const rdesc,
 		const u64 chunk_start_offset = i << chunk_order;
 		const u64 chunk_end_offset = chunk_start_offset + chunk_usize;
 
-		if (chunk_end_offset <= cur_range_pos) {
+		/* Skip past the ranges that end before this chunk.  */
+		while (need_range != end_range &&
+		       need_range->offset + need_range->size <= chunk_start_offset)
+			need_range++;
+
+		if (need_range == end_range ||
+		    need_range->offset >= chunk_end_offset) {
 
 			/* The next range does not require data in this chunk,
 			 * so skip it.  */
@@ -459,62 +642,105 @@ read_compressed_wim_resource(const struct wim_resource_descriptor * const rdesc,
 				if (unlikely(ret))
 					goto read_error;
 			}
+		} else if (chunk_decompressor) {
+
+			/* Read the chunk and submit it for decompression.  If
+			 * no buffer is available, first consume the oldest
+			 * chunk that is being decompressed.  */
+			void *read_buf;
+
+			while (!(read_buf = chunk_decompressor->get_chunk_buffer(
+							chunk_decompressor)))
+			{
+				ret = consume_decompressed_chunk(chunk_decompressor,
+								 &cursor,
+								 chunk_order,
+								 cb,
+								 recover_data);
+				if (unlikely(ret))
+					goto out_cleanup;
+			}
+
+			if (mapped) {
+				const u8 *cdata = wim_mapped_data(rdesc->wim,
+								  cur_read_offset,
+								  chunk_csize);
+				if (unlikely(!cdata))
+					goto past_eof;
+				chunk_decompressor->signal_chunk_mapped(
+					chunk_decompressor, cdata,
+					chunk_csize, chunk_usize);
+			} else {
+				ret = read_ahead_pread(ra, in_fd, read_buf,
+						       chunk_csize,
+						       cur_read_offset);
+				if (unlikely(ret))
+					goto read_error;
+
+				chunk_decompressor->signal_chunk_filled(
+					chunk_decompressor,
+					chunk_csize, chunk_usize);
+			}
+			cur_read_offset += chunk_csize;
 		} else {
 
 			/* Read the chunk and feed data to the callback
 			 * function.  */
-			u8 *read_buf;
+			const u8 *cdata;
+			const u8 *udata;
+
+			if (mapped) {
+				cdata = wim_mapped_data(rdesc->wim,
+							cur_read_offset,
+							chunk_csize);
+				if (unlikely(!cdata))
+					goto past_eof;
+			} else {
+				u8 *read_buf;
 
-			if (chunk_csize == chunk_usize)
-				read_buf = ubuf;
-			else
-				read_buf = cbuf;
+				if (chunk_csize == chunk_usize)
+					read_buf = ubuf;
+				else
+					read_buf = cbuf;
 
-			ret = full_pread(in_fd,
-					 read_buf,
-					 chunk_csize,
-					 cur_read_offset);
-			if (unlikely(ret))
-				goto read_error;
+				ret = read_ahead_pread(ra, in_fd, read_buf,
+						       chunk_csize,
+						       cur_read_offset);
+				if (unlikely(ret))
+					goto read_error;
+				cdata = read_buf;
+			}
 
-			if (read_buf == cbuf) {
-				ret = decompress_chunk(cbuf, chunk_csize,
+			if (chunk_csize == chunk_usize) {
+				udata = cdata;
+			} else {
+				ret = decompress_chunk(cdata, chunk_csize,
 						       ubuf, chunk_usize,
 						       decompressor,
 						       recover_data);
 				if (unlikely(ret))
 					goto out_cleanup;
+				udata = ubuf;
 			}
 			cur_read_offset += chunk_csize;
 
 			/* At least one range requires data in this chunk.  */
-			do {
-				size_t start, end, size;
-
-				/* Calculate how many bytes of data should be
-				 * sent to the callback function, taking into
-				 * account that data sent to the callback
-				 * function must not overlap range boundaries.
-				 */
-				start = cur_range_pos - chunk_start_offset;
-				end = min(cur_range_end, chunk_end_offset) - chunk_start_offset;
-				size = end - start;
-
-				ret = consume_chunk(cb, &ubuf[start], size);
-				if (unlikely(ret))
-					goto out_cleanup;
+			ret = consume_chunk_ranges(&cursor, udata,
+						   chunk_start_offset,
+						   chunk_end_offset, cb);
+			if (unlikely(ret))
+				goto out_cleanup;
+		}
+	}
 
-				cur_range_pos += size;
-				if (cur_range_pos == cur_range_end) {
-					/* Advance to next range.  */
-					if (++cur_range == end_range) {
-						cur_range_pos = ~0ULL;
-					} else {
-						cur_range_pos = cur_range->offset;
-						cur_range_end = cur_range->offset + cur_range->size;
-					}
-				}
-			} while (cur_range_pos < chunk_end_offset);
+	/* Consume the chunks that are still being decompressed.  */
+	if (chunk_decompressor) {
+		while (cursor.cur_range != end_range) {
+			ret = consume_decompressed_chunk(chunk_decompressor,
+							 &cursor, chunk_order,
+							 cb, recover_data);
+			if (unlikely(ret))
+				goto out_cleanup;
 		}
 	}
 
@@ -535,12 +761,11 @@ read_compressed_wim_resource(const struct wim_resource_descriptor * const rdesc,
 	ret = 0;
 
 out_cleanup:
-	if (decompressor) {
-		wimlib_free_decompressor(rdesc->wim->decompressor);
-		rdesc->wim->decompressor = decompressor;
-		rdesc->wim->decompressor_ctype = ctype;
-		rdesc->wim->decompressor_max_block_size = chunk_size;
-	}
+	read_ahead_free(local_ra);
+	if (chunk_decompressor)
+		chunk_decompressor->destroy(chunk_decompressor);
+	if (decompressor)
+		wim_put_decompressor(rdesc->wim, decompressor, ctype, chunk_size);
 	if (chunk_offsets_malloced)
 		FREE(chunk_offsets);
 	if (ubuf_malloced)
@@ -554,6 +779,11 @@ oom:
 	ret = WIMLIB_ERR_NOMEM;
 	goto out_cleanup;
 
+past_eof:
+	/* A corrupt chunk table pointed outside the mapped file; report it the
+	 * same way a read past the end of the file would be.  */
+	ret = WIMLIB_ERR_UNEXPECTED_END_OF_FILE;
+	errno = EINVAL;
 read_error:
 	ERROR_WITH_ERRNO("Error reading data from WIM file");
 	goto out_cleanup;
@@ -568,20 +798,31 @@ read_raw_file_data(struct filedes *in_fd, u64 offset, u64 size,
 {
 	u8 buf[BUFFER_SIZE];
 	size_t bytes_to_read;
+	struct read_ahead *ra = blob_list_read_ahead;
+	struct read_ahead *local_ra = NULL;
 	int ret;
 
+	/* When reading a large amount of data from a WIM file, read ahead of
+	 * it unless read_blob_list() is already doing so.  When reading a
+	 * large external file, just give the kernel hints about it.  */
+	if (size >= READ_AHEAD_MIN_SIZE && (filename || !ra)) {
+		ra = local_ra = read_ahead_new(in_fd, filename != NULL);
+		read_ahead_add(ra, offset, size);
+	}
+
 	while (size) {
 		bytes_to_read = min(sizeof(buf), size);
-		ret = full_pread(in_fd, buf, bytes_to_read, offset);
+		ret = read_ahead_pread(ra, in_fd, buf, bytes_to_read, offset);
 		if (unlikely(ret))
 			goto read_error;
 		ret = consume_chunk(cb, buf, bytes_to_read);
 		if (unlikely(ret))
-			return ret;
+			goto out;
 		size -= bytes_to_read;
 		offset += bytes_to_read;
 	}
-	return 0;
+	ret = 0;
+	goto out;
 
 read_error:
 	if (!filename) {
@@ -592,9 +833,35 @@ read_error:
 	} else {
 		ERROR_WITH_ERRNO("\"%"TS"\": Error reading data", filename);
 	}
+out:
+	read_ahead_free(local_ra);
 	return ret;
 }
 
+/* Maximum size of each piece of memory-mapped data passed to a callback  */
+#define MAPPED_CHUNK_SIZE	((u64)1 << 20)
+
+/* Feed data from a memory-mapped WIM file to the specified callback function
+ * without copying it.  It's passed on in pieces so that the callback still sees
+ * a steady stream of moderately sized chunks.  */
+static int
+consume_mapped_data(const u8 *map, u64 size,
+		    const struct consume_chunk_callback *cb)
+{
+	int ret;
+
+	while (size) {
+		size_t len = min(size, MAPPED_CHUNK_SIZE);
+
+		ret = consume_chunk(cb, map, len);
+		if (unlikely(ret))
+			return ret;
+		map += len;
+		size -= len;
+	}
+	return 0;
+}
+
 /* A consume_chunk implementation which simply concatenates all chunks into an
  * in-memory buffer.  */
 static int
@@ -637,21 +904,338 @@ read_partial_wim_resource(const struct wim_resource_descriptor *rdesc,
 	}
 
 	/* Uncompressed resource  */
+	const u8 *map = wim_mapped_data(rdesc->wim,
+					rdesc->offset_in_wim + offset, size);
+	if (map)
+		return consume_mapped_data(map, size, cb);
 	return read_raw_file_data(&rdesc->wim->in_fd,
 				  rdesc->offset_in_wim + offset,
 				  size, cb, NULL);
 }
 
+/* Return the chunk cache to use for random-access reads from the specified
+ * resource, allocating it if needed; or return NULL if the resource's chunks
+ * should not be cached.  */
+static struct chunk_cache *
+get_chunk_cache(const struct wim_resource_descriptor *rdesc)
+{
+	WIMStruct *wim = rdesc->wim;
+	struct chunk_cache *cache;
+
+	if (!(rdesc->flags & (WIM_RESHDR_FLAG_COMPRESSED |
+			      WIM_RESHDR_FLAG_SOLID)))
+		return NULL;
+	if (!is_power_of_2(rdesc->chunk_size) ||
+	    rdesc->chunk_size > wim->chunk_cache_max_size)
+		return NULL;
+	if (rdesc->is_pipable && !filedes_is_seekable(&wim->in_fd))
+		return NULL;
+	mutex_lock(&wim->decompressor_lock);
+	if (!wim->chunk_cache)
+		wim->chunk_cache = new_chunk_cache(wim->chunk_cache_max_size);
+	cache = wim->chunk_cache;
+	mutex_unlock(&wim->decompressor_lock);
+	return cache;
+}
+
+/*
+ * Read the chunk of a compressed resource that starts at @chunk_offsets[0] in
+ * the WIM file and decompress it into @udata.  @chunk_offsets[1] must be the
+ * offset of the next chunk, as saved by load_blob_chunk_table().
+ */
+static int
+read_wim_chunk(const struct wim_resource_descriptor *rdesc,
+	       const u64 chunk_offsets[2], u32 chunk_usize, u8 *udata)
+{
+	WIMStruct *wim = rdesc->wim;
+	const u64 chunk_csize = chunk_offsets[1] - chunk_offsets[0] -
+		(rdesc->is_pipable ? sizeof(struct pwm_chunk_hdr) : 0);
+	struct wimlib_decompressor *decompressor;
+	const u8 *cdata;
+	u8 *cbuf = NULL;
+	int ret;
+
+	if (unlikely(chunk_csize == 0 || chunk_csize > chunk_usize)) {
+		ERROR("Invalid chunk size in compressed resource!");
+		errno = EINVAL;
+		return WIMLIB_ERR_DECOMPRESSION;
+	}
+
+	cdata = wim_mapped_data(wim, chunk_offsets[0], chunk_csize);
+	if (chunk_csize == chunk_usize) {
+		/* Chunk stored uncompressed  */
+		if (cdata) {
+			memcpy(udata, cdata, chunk_usize);
+			return 0;
+		}
+		ret = full_pread(&wim->in_fd, udata, chunk_usize,
+				 chunk_offsets[0]);
+		if (unlikely(ret))
+			goto read_error;
+		return 0;
+	}
+
+	if (!cdata) {
+		cbuf = MALLOC(chunk_csize);
+		if (unlikely(!cbuf)) {
+			ERROR("Out of memory while reading compressed WIM resource");
+			return WIMLIB_ERR_NOMEM;
+		}
+		ret = full_pread(&wim->in_fd, cbuf, chunk_csize,
+				 chunk_offsets[0]);
+		if (unlikely(ret))
+			goto read_error;
+		cdata = cbuf;
+	}
+
+	ret = wim_get_decompressor(wim, rdesc->compression_type,
+				   rdesc->chunk_size, &decompressor);
+	if (unlikely(ret))
+		goto out;
+	ret = decompress_chunk(cdata, chunk_csize, udata, chunk_usize,
+			       decompressor, false);
+	wim_put_decompressor(wim, decompressor, rdesc->compression_type,
+			     rdesc->chunk_size);
+	goto out;
+
+read_error:
+	ERROR_WITH_ERRNO("Error reading data from WIM file");
+out:
+	FREE(cbuf);
+	return ret;
+}
+
+/*
+ * Read the specified range of uncompressed data from a compressed resource into
+ * a buffer, using the cache of decompressed chunks.  Each chunk that isn't
+ * already cached is decompressed in full and then added to the cache.  If
+ * @table is not NULL and has been loaded, it gives the locations of the chunks,
+ * so the chunk table doesn't need to be read again.
+ *
+ * This may be called by multiple threads concurrently.  The cache is only
+ * accessed with the WIM's decompressor_lock held, but chunks are decompressed
+ * without it.  If two threads miss on the same chunk, both decompress it, and
+ * the second one to finish just discards its copy.
+ */
+static int
+read_partial_wim_resource_cached(struct wim_resource_descriptor *rdesc,
+				 struct chunk_cache *cache,
+				 const struct blob_chunk_table *table,
+				 u64 offset, size_t size, u8 *buf)
+{
+	const u32 chunk_order = bsr32(rdesc->chunk_size);
+
+	while (size) {
+		const u64 chunk_idx = offset >> chunk_order;
+		const u64 chunk_start_offset = chunk_idx << chunk_order;
+		const u32 chunk_usize = min(rdesc->chunk_size,
+					    rdesc->uncompressed_size -
+					    chunk_start_offset);
+		const size_t start = offset - chunk_start_offset;
+		const size_t len = min(size, chunk_usize - start);
+		const u8 *udata;
+
+		mutex_lock(&rdesc->wim->decompressor_lock);
+		udata = chunk_cache_lookup(cache, rdesc, chunk_idx);
+		if (udata)
+			memcpy(buf, &udata[start], len);
+		mutex_unlock(&rdesc->wim->decompressor_lock);
+		if (!udata) {
+			struct chunk_cache_entry *entry;
+			void *p;
+			int ret;
+
+			entry = new_chunk_cache_entry(rdesc, chunk_idx,
+						      chunk_usize);
+			if (!entry) {
+				ERROR("Out of memory while reading compressed WIM resource");
+				return WIMLIB_ERR_NOMEM;
+			}
+			if (table && table->chunk_offsets) {
+				wimlib_assert(chunk_idx >= table->first_chunk);
+				ret = read_wim_chunk(rdesc,
+						     &table->chunk_offsets[
+						     chunk_idx - table->first_chunk],
+						     chunk_usize, entry->data);
+			} else {
+				p = entry->data;
+				struct consume_chunk_callback cb = {
+					.func	= bufferer_cb,
+					.ctx	= &p,
+				};
+				ret = read_partial_wim_resource(rdesc,
+								chunk_start_offset,
+								chunk_usize,
+								&cb, false);
+			}
+			if (ret) {
+				FREE(entry);
+				return ret;
+			}
+			memcpy(buf, &entry->data[start], len);
+
+			mutex_lock(&rdesc->wim->decompressor_lock);
+			if (chunk_cache_lookup(cache, rdesc, chunk_idx))
+				FREE(entry);
+			else
+				chunk_cache_insert(cache, entry);
+			mutex_unlock(&rdesc->wim->decompressor_lock);
+		}
+		buf += len;
+		offset += len;
+		size -= len;
+	}
+	return 0;
+}
+
+/*
+ * Save the locations of the compressed chunks that contain the data of the
+ * specified blob, so that they don't have to be read from the chunk table on
+ * each random-access read of the blob.  The blob must be located in a WIM file.
+ * If the blob's chunks won't be read through the chunk cache, then
+ * @table->chunk_offsets is set to NULL and no table is needed.  Otherwise the
+ * table must be freed with FREE(table->chunk_offsets).
+ *
+ * @table->chunk_offsets[i] is set to the offset in the WIM file of the data of
+ * chunk @table->first_chunk + i, and one more entry is added for the end of the
+ * last chunk.  For pipable resources, the data of each chunk is preceded by a
+ * chunk header, which is included in the previous chunk's extent.
+ */
+int
+load_blob_chunk_table(const struct blob_descriptor *blob,
+		      struct blob_chunk_table *table)
+{
+	const struct wim_resource_descriptor *rdesc = blob->rdesc;
+	const bool alt_chunk_table = (rdesc->flags & WIM_RESHDR_FLAG_SOLID);
+	const u64 hdr_size = rdesc->is_pipable ? sizeof(struct pwm_chunk_hdr) : 0;
+	u64 first_chunk, last_chunk, num_chunks;
+	u64 chunk_entry_size, chunk_table_size, chunk_table_full_size;
+	u64 table_offset, data_offset, first_entry, end_entry, rel_offset;
+	u32 chunk_order;
+	u8 *entries = NULL;
+	int ret;
+
+	table->chunk_offsets = NULL;
+	if (!blob->size || !get_chunk_cache(rdesc))
+		return 0;
+
+	chunk_order = bsr32(rdesc->chunk_size);
+	num_chunks = (rdesc->uncompressed_size + rdesc->chunk_size - 1) >>
+		     chunk_order;
+	first_chunk = blob->offset_in_res >> chunk_order;
+	last_chunk = (blob->offset_in_res + blob->size - 1) >> chunk_order;
+
+	chunk_entry_size = get_chunk_entry_size(rdesc->uncompressed_size,
+						alt_chunk_table);
+	chunk_table_size = (alt_chunk_table ? num_chunks : num_chunks - 1) *
+			   chunk_entry_size;
+	chunk_table_full_size = chunk_table_size;
+	table_offset = rdesc->offset_in_wim;
+	if (alt_chunk_table) {
+		chunk_table_full_size +=
+			sizeof(struct alt_chunk_table_header_disk);
+		table_offset += sizeof(struct alt_chunk_table_header_disk);
+	}
+	if (rdesc->is_pipable) {
+		data_offset = rdesc->offset_in_wim;
+		table_offset += rdesc->size_in_wim - chunk_table_size;
+	} else {
+		data_offset = table_offset + chunk_table_size;
+	}
+
+	/* Decide which chunk table entries are needed.  The alternate format
+	 * gives chunk sizes, so all entries up to the last chunk are needed.
+	 * The original format gives the offsets of all chunks but the first.  */
+	if (alt_chunk_table) {
+		first_entry = 0;
+		end_entry = last_chunk + 1;
+	} else {
+		first_entry = (first_chunk ? first_chunk - 1 : 0);
+		end_entry = min(last_chunk + 1, num_chunks - 1);
+	}
+	if (end_entry > first_entry) {
+		if ((size_t)((end_entry - first_entry) * chunk_entry_size) !=
+		    (end_entry - first_entry) * chunk_entry_size)
+			goto oom;
+		entries = MALLOC((end_entry - first_entry) * chunk_entry_size);
+		if (!entries)
+			goto oom;
+		ret = full_pread(&rdesc->wim->in_fd, entries,
+				 (end_entry - first_entry) * chunk_entry_size,
+				 table_offset + first_entry * chunk_entry_size);
+		if (ret) {
+			ERROR_WITH_ERRNO("Error reading data from WIM file");
+			goto out;
+		}
+	}
+
+	if ((size_t)((last_chunk - first_chunk + 2) * sizeof(u64)) !=
+	    (last_chunk - first_chunk + 2) * sizeof(u64))
+		goto oom;
+	table->chunk_offsets = MALLOC((last_chunk - first_chunk + 2) *
+				      sizeof(u64));
+	if (!table->chunk_offsets)
+		goto oom;
+	table->first_chunk = first_chunk;
+
+	/* Convert the entries into the offsets of chunks first_chunk through
+	 * last_chunk + 1, where the "chunk" past the end of the resource
+	 * starts at the end of the compressed data.  */
+	rel_offset = 0;
+	for (u64 i = (alt_chunk_table ? 0 : first_chunk);
+	     i <= last_chunk + 1; i++)
+	{
+		if (i == num_chunks) {
+			rel_offset = rdesc->size_in_wim - chunk_table_full_size -
+				     num_chunks * hdr_size;
+		} else if (alt_chunk_table) {
+			if (i)
+				rel_offset += le32_to_cpu(((const le32 *)entries)[i - 1]);
+		} else if (i) {
+			if (chunk_entry_size == 4)
+				rel_offset = le32_to_cpu(((const le32 *)entries)[i - 1 - first_entry]);
+			else
+				rel_offset = le64_to_cpu(((const le64 *)entries)[i - 1 - first_entry]);
+		}
+		if (i >= first_chunk) {
+			table->chunk_offsets[i - first_chunk] =
+				data_offset + rel_offset + (i + 1) * hdr_size;
+		}
+	}
+	ret = 0;
+	goto out;
+
+oom:
+	ERROR("Out of memory while reading compressed WIM resource");
+	ret = WIMLIB_ERR_NOMEM;
+out:
+	FREE(entries);
+	return ret;
+}
+
 /* Read the specified range of uncompressed data from the specified blob, which
- * must be located in a WIM file, into the specified buffer.  */
+ * must be located in a WIM file, into the specified buffer.  This is meant for
+ * random access to the data, so the data is read through the WIM's chunk cache
+ * if possible.  @table, if not NULL, is the blob's chunk table as saved by
+ * load_blob_chunk_table().  */
 int
 read_partial_wim_blob_into_buf(const struct blob_descriptor *blob,
+			       const struct blob_chunk_table *table,
 			       u64 offset, size_t size, void *buf)
 {
+	struct chunk_cache *cache = get_chunk_cache(blob->rdesc);
 	struct consume_chunk_callback cb = {
 		.func	= bufferer_cb,
 		.ctx	= &buf,
 	};
+
+	if (cache)
+		return read_partial_wim_resource_cached(blob->rdesc, cache,
+							table,
+							blob->offset_in_res +
+							offset,
+							size, buf);
+
 	return read_partial_wim_resource(blob->rdesc,
 					 blob->offset_in_res + offset,
 					 size,
@@ -683,6 +1267,97 @@ read_wim_blob_prefix(const struct blob_descriptor *blob, u64 size,
 					 size, cb, recover_data);
 }
 
+#ifdef SEEK_HOLE
+/* Feed @size zero bytes into the specified callback function.  */
+static int
+consume_zeroes(const struct consume_chunk_callback *cb, u64 size)
+{
+	static const u8 zeroes[BUFFER_SIZE];
+
+	while (size) {
+		size_t n = min(size, sizeof(zeroes));
+		int ret = consume_chunk(cb, zeroes, n);
+
+		if (ret)
+			return ret;
+		size -= n;
+	}
+	return 0;
+}
+
+/*
+ * If the external file containing @blob is sparse, read its first @size bytes
+ * using SEEK_DATA and SEEK_HOLE to find the holes, which are fed to the callback
+ * function as zeroes without actually being read.  Returns -1 without consuming
+ * anything if the file isn't sparse or its holes can't be found, in which case
+ * the caller should just read the file normally.
+ */
+static int
+read_sparse_file_data(const struct blob_descriptor *blob, struct filedes *fd,
+		      u64 size, const struct consume_chunk_callback *cb)
+{
+	struct stat stbuf;
+	u64 offset = 0;
+	int ret;
+
+	/* Only files that were sparse when scanned are worth checking.  */
+	if (blob->file_inode &&
+	    !(blob->file_inode->i_attributes & FILE_ATTRIBUTE_SPARSE_FILE))
+		return -1;
+
+	/* Leave files that have been truncated for the normal path to report.
+	 */
+	if (fstat(fd->fd, &stbuf) || (u64)stbuf.st_size < size ||
+	    (u64)stbuf.st_blocks * 512 >= size)
+		return -1;
+
+	while (offset != size) {
+		off_t data_start = lseek(fd->fd, offset, SEEK_DATA);
+		off_t data_end;
+
+		if (data_start < 0) {
+			if (errno == ENXIO) {
+				/* The rest of the file is a hole.  */
+				data_start = size;
+			} else if (offset == 0) {
+				return -1;
+			} else {
+				goto seek_error;
+			}
+		}
+		data_start = min((u64)data_start, size);
+		data_end = size;
+		if (data_start != size) {
+			data_end = lseek(fd->fd, data_start, SEEK_HOLE);
+			if (data_end < 0)
+				goto seek_error;
+			data_end = min((u64)data_end, size);
+		}
+
+		ret = consume_zeroes(cb, data_start - offset);
+		if (ret)
+			return ret;
+		ret = read_raw_file_data(fd, data_start, data_end - data_start,
+					 cb, blob->file_on_disk);
+		if (ret)
+			return ret;
+		offset = data_end;
+	}
+	return 0;
+
+seek_error:
+	ERROR_WITH_ERRNO("\"%"TS"\": Error finding holes", blob->file_on_disk);
+	return WIMLIB_ERR_READ;
+}
+#else /* SEEK_HOLE */
+static int
+read_sparse_file_data(const struct blob_descriptor *blob, struct filedes *fd,
+		      u64 size, const struct consume_chunk_callback *cb)
+{
+	return -1;
+}
+#endif /* !SEEK_HOLE */
+
 /* This function handles reading blob data that is located in an external file,
  * such as a file that has been added to the WIM image through execution of a
  * wimlib_add_command.
@@ -706,7 +1381,13 @@ read_file_on_disk_prefix(const struct blob_descriptor *blob, u64 size,
 		return WIMLIB_ERR_OPEN;
 	}
 	filedes_init(&fd, raw_fd);
-	ret = read_raw_file_data(&fd, 0, size, cb, blob->file_on_disk);
+	ret = read_sparse_file_data(blob, &fd, size, cb);
+	if (ret < 0)
+		ret = read_raw_file_data(&fd, 0, size, cb, blob->file_on_disk);
+#ifdef HAVE_POSIX_FADVISE
+	if (blob_list_drop_cache)
+		posix_fadvise(raw_fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
 	filedes_close(&fd);
 	return ret;
 }
@@ -831,6 +1512,61 @@ read_blob_with_cbs(struct blob_descriptor *blob,
 	return call_end_blob(blob, ret, cbs);
 }
 
+struct range_copier_ctx {
+	u64 skip;
+	void *buf;
+};
+
+/* A consume_chunk implementation which discards the first ctx->skip bytes of
+ * data, then concatenates the rest into an in-memory buffer.  */
+static int
+range_copier_cb(const void *chunk, size_t size, void *_ctx)
+{
+	struct range_copier_ctx *ctx = _ctx;
+
+	if (size <= ctx->skip) {
+		ctx->skip -= size;
+		return 0;
+	}
+	ctx->buf = mempcpy(ctx->buf, (const u8 *)chunk + ctx->skip,
+			   size - ctx->skip);
+	ctx->skip = 0;
+	return 0;
+}
+
+/* Read the specified range of uncompressed data from the specified blob into
+ * the specified buffer.  Unlike read_partial_wim_blob_into_buf(), the blob can
+ * be in any location; @table is only used if it's in a WIM file.  Locations
+ * that don't support random access are read sequentially from the beginning of
+ * the blob.  The SHA-1 message digest is *not* checked.  */
+int
+read_partial_blob_into_buf(const struct blob_descriptor *blob,
+			   const struct blob_chunk_table *table,
+			   u64 offset, size_t size, void *buf)
+{
+	struct range_copier_ctx ctx = {
+		.skip	= offset,
+		.buf	= buf,
+	};
+	struct consume_chunk_callback cb = {
+		.func	= range_copier_cb,
+		.ctx	= &ctx,
+	};
+
+	wimlib_assert(offset + size <= blob->size);
+
+	switch (blob->blob_location) {
+	case BLOB_IN_WIM:
+		return read_partial_wim_blob_into_buf(blob, table, offset, size,
+						      buf);
+	case BLOB_IN_ATTACHED_BUFFER:
+		memcpy(buf, (const u8 *)blob->attached_buffer + offset, size);
+		return 0;
+	default:
+		return read_blob_prefix(blob, offset + size, &cb, false);
+	}
+}
+
 /* Read the full uncompressed data of the specified blob into the specified
  * buffer, which must have space for at least blob->size bytes.  The SHA-1
  * message digest is *not* checked.  */
@@ -1201,6 +1937,60 @@ oom:
 	return WIMLIB_ERR_NOMEM;
 }
 
+/*
+ * Start reading ahead of the WIM resources containing the blobs in @blob_list,
+ * which must be sorted in sequential order.  Only resources in the same WIM
+ * file as the first one are read ahead, and only if there's enough data in
+ * them.  Memory-mapped WIM files are skipped, since they are read in place.
+ * Solid resources are read ahead in full even if only some of their blobs are
+ * needed; the reads skip over the rest.  Returns NULL if not reading ahead.
+ */
+static struct read_ahead *
+start_blob_list_read_ahead(struct list_head *blob_list,
+			   size_t list_head_offset)
+{
+	struct list_head *cur;
+	const struct blob_descriptor *blob;
+	const struct wim_resource_descriptor *rdesc;
+	const struct wim_resource_descriptor *prev_rdesc;
+	struct filedes *in_fd = NULL;
+	struct read_ahead *ra = NULL;
+	u64 total_size = 0;
+	int pass;
+
+	for (pass = 0; pass < 2; pass++) {
+		prev_rdesc = NULL;
+		list_for_each(cur, blob_list) {
+			blob = (const struct blob_descriptor *)
+				((const u8 *)cur - list_head_offset);
+			if (blob->blob_location != BLOB_IN_WIM)
+				continue;
+			rdesc = blob->rdesc;
+			if (rdesc == prev_rdesc || rdesc->is_pipable ||
+			    rdesc->wim->in_map)
+				continue;
+			prev_rdesc = rdesc;
+			if (!in_fd)
+				in_fd = &rdesc->wim->in_fd;
+			if (&rdesc->wim->in_fd != in_fd)
+				continue;
+			if (pass == 0)
+				total_size += rdesc->size_in_wim;
+			else
+				read_ahead_add(ra, rdesc->offset_in_wim,
+					       rdesc->size_in_wim);
+		}
+		if (pass == 0) {
+			if (total_size < READ_AHEAD_MIN_SIZE)
+				return NULL;
+			ra = read_ahead_new(in_fd, false);
+			if (!ra)
+				return NULL;
+		}
+	}
+	return ra;
+}
+
 /*
  * Read a list of blobs, each of which may be in any supported location (e.g.
  * in a WIM or in an external file).  This function optimizes the case where
@@ -1236,6 +2026,11 @@ oom:
  *	RECOVER_DATA
  *		Don't consider corrupted blob data to be an error.
  *
+ *	DROP_FILE_CACHE
+ *		After reading the data of each file on disk, tell the operating
+ *		system that it won't be needed again, so that it's dropped from
+ *		the page cache.
+ *
  * The callback functions are allowed to delete the current blob from the list
  * if necessary.
  *
@@ -1252,6 +2047,8 @@ read_blob_list(struct list_head *blob_list, size_t list_head_offset,
 	struct blob_descriptor *blob;
 	struct hasher_context *hasher_ctx;
 	struct read_blob_callbacks *sink_cbs;
+	struct read_ahead *prev_read_ahead = blob_list_read_ahead;
+	bool prev_drop_cache = blob_list_drop_cache;
 
 	if (!(flags & BLOB_LIST_ALREADY_SORTED)) {
 		ret = sort_blob_list_by_sequential_order(blob_list,
@@ -1277,6 +2074,10 @@ read_blob_list(struct list_head *blob_list, size_t list_head_offset,
 		sink_cbs = (struct read_blob_callbacks *)cbs;
 	}
 
+	blob_list_read_ahead = start_blob_list_read_ahead(blob_list,
+							  list_head_offset);
+	blob_list_drop_cache = (flags & DROP_FILE_CACHE);
+
 	for (cur = blob_list->next, next = cur->next;
 	     cur != blob_list;
 	     cur = next, next = cur->next)
@@ -1324,16 +2125,21 @@ read_blob_list(struct list_head *blob_list, size_t list_head_offset,
 								   sink_cbs,
 								   flags & RECOVER_DATA);
 				if (ret)
-					return ret;
+					goto out;
 				continue;
 			}
 		}
 
 		ret = read_blob_with_cbs(blob, sink_cbs, flags & RECOVER_DATA);
 		if (unlikely(ret && ret != BEGIN_BLOB_STATUS_SKIP_BLOB))
-			return ret;
+			goto out;
 	}
-	return 0;
+	ret = 0;
+out:
+	read_ahead_free(blob_list_read_ahead);
+	blob_list_read_ahead = prev_read_ahead;
+	blob_list_drop_cache = prev_drop_cache;
+	return ret;
 }
 
 static int
@@ -1388,6 +2194,34 @@ sha1_blob(struct blob_descriptor *blob)
 	return read_blob_with_sha1(blob, &cbs, false);
 }
 
+static int
+sha1_chunk_cb(const void *chunk, size_t size, void *_ctx)
+{
+	sha1_update(_ctx, chunk, size);
+	return 0;
+}
+
+/* Calculate the SHA-1 message digest of a blob's data and return it in @hash.
+ * Unlike sha1_blob(), this doesn't modify the blob descriptor, so it can be
+ * called on a blob that another thread is accessing.  */
+int
+sha1_blob_data(const struct blob_descriptor *blob, u8 hash[SHA1_HASH_SIZE])
+{
+	struct sha1_ctx sha_ctx;
+	struct consume_chunk_callback cb = {
+		.func	= sha1_chunk_cb,
+		.ctx	= &sha_ctx,
+	};
+	int ret;
+
+	sha1_init(&sha_ctx);
+	ret = read_blob_prefix(blob, blob->size, &cb, false);
+	if (ret)
+		return ret;
+	sha1_final(&sha_ctx, hash);
+	return 0;
+}
+
 /*
  * Convert a short WIM resource header to a stand-alone WIM resource descriptor.
  *
@@ -1411,6 +2245,7 @@ wim_reshdr_to_desc(const struct wim_reshdr *reshdr, WIMStruct *wim,
 		rdesc->compression_type = WIMLIB_COMPRESSION_TYPE_NONE;
 		rdesc->chunk_size = 0;
 	}
+	rdesc->num_cached_chunks = 0;
 }
 
 /*
@@ -508,6 +508,162 @@ sha1_blocks_arm_ce(u32 h[5], const void *data, size_t num_blocks)
 }
 #endif /* ARMv8 Crypto Extensions implementation */
 
+/*----------------------------------------------------------------------------*
+ *                  x86 AVX2 and AVX-512 multi-buffer implementation          *
+ *----------------------------------------------------------------------------*/
+
+/*
+ * This is SHA-1 on several independent messages at once, using one 32-bit lane
+ * of a vector register per message: 8 messages with AVX2, or 16 with AVX-512.
+ * Unlike the SSSE3 implementation, this vectorizes the SHA itself, not just the
+ * message schedule, so it is much faster per message when there are enough
+ * messages to fill the lanes.  That makes it a good fit for hashing many small
+ * files.  It doesn't help with hashing a single large message at all.
+ *
+ * The state is stored transposed: state[i * LANES + j] is word i of the state
+ * of the message in lane j.  Each call processes the next @num_blocks blocks of
+ * every lane's message, and advances the lanes' data pointers accordingly.
+ *
+ * The message words are loaded with scalar code into a buffer in transposed
+ * order, then loaded from there into vectors.  This isn't the fastest possible
+ * transposition, but it's simple and it's not the bottleneck.
+ */
+#if defined(__i386__) || defined(__x86_64__)
+#include <immintrin.h>
+
+#define SHA1_MB_ROUND(i, a, b, c, d, e)					\
+	if ((i) >= 16)							\
+		w[(i) % 16] = V_ROL(V_XOR(V_XOR(w[((i) - 16) % 16],	\
+						w[((i) - 14) % 16]),	\
+					  V_XOR(w[((i) - 8) % 16],	\
+						w[((i) - 3) % 16])), 1);\
+	e = V_ADD(V_ADD(e, V_ADD(w[(i) % 16], V_SET1(SHA1_K(i)))),	\
+		  V_ADD(V_ROL(a, 5),					\
+			((i) < 20) ? V_CHOICE(b, c, d) :		\
+			((i) < 40) ? V_PARITY(b, c, d) :		\
+			((i) < 60) ? V_MAJORITY(b, c, d) :		\
+				     V_PARITY(b, c, d)));		\
+	b = V_ROL(b, 30);
+	/* implicit: the new (a, b, c, d, e) is the old (e, a, b, c, d) */
+
+#define SHA1_MB_5ROUNDS(i)				\
+	SHA1_MB_ROUND((i) + 0, a, b, c, d, e);		\
+	SHA1_MB_ROUND((i) + 1, e, a, b, c, d);		\
+	SHA1_MB_ROUND((i) + 2, d, e, a, b, c);		\
+	SHA1_MB_ROUND((i) + 3, c, d, e, a, b);		\
+	SHA1_MB_ROUND((i) + 4, b, c, d, e, a);
+
+#define SHA1_MB_20ROUNDS(i)		\
+	SHA1_MB_5ROUNDS((i) +  0);	\
+	SHA1_MB_5ROUNDS((i) +  5);	\
+	SHA1_MB_5ROUNDS((i) + 10);	\
+	SHA1_MB_5ROUNDS((i) + 15);
+
+#define SHA1_MB_BODY(LANES)						\
+	vec_t a, b, c, d, e;						\
+	vec_t w[16];							\
+	u32 wbuf[16][LANES] __attribute__((aligned(64)));		\
+	vec_t h0 = V_LOAD(&state[0 * LANES]);				\
+	vec_t h1 = V_LOAD(&state[1 * LANES]);				\
+	vec_t h2 = V_LOAD(&state[2 * LANES]);				\
+	vec_t h3 = V_LOAD(&state[3 * LANES]);				\
+	vec_t h4 = V_LOAD(&state[4 * LANES]);				\
+									\
+	do {								\
+		for (int j = 0; j < LANES; j++) {			\
+			for (int i = 0; i < 16; i++)			\
+				wbuf[i][j] = get_unaligned_be32(	\
+						data[j] + (i * 4));	\
+			data[j] += SHA1_BLOCK_SIZE;			\
+		}							\
+		for (int i = 0; i < 16; i++)				\
+			w[i] = V_LOAD(wbuf[i]);				\
+									\
+		a = h0;							\
+		b = h1;							\
+		c = h2;							\
+		d = h3;							\
+		e = h4;							\
+									\
+		SHA1_MB_20ROUNDS(0);					\
+		SHA1_MB_20ROUNDS(20);					\
+		SHA1_MB_20ROUNDS(40);					\
+		SHA1_MB_20ROUNDS(60);					\
+									\
+		h0 = V_ADD(h0, a);					\
+		h1 = V_ADD(h1, b);					\
+		h2 = V_ADD(h2, c);					\
+		h3 = V_ADD(h3, d);					\
+		h4 = V_ADD(h4, e);					\
+	} while (--num_blocks);						\
+									\
+	V_STORE(&state[0 * LANES], h0);					\
+	V_STORE(&state[1 * LANES], h1);					\
+	V_STORE(&state[2 * LANES], h2);					\
+	V_STORE(&state[3 * LANES], h3);					\
+	V_STORE(&state[4 * LANES], h4);
+
+#define vec_t			__m256i
+#define V_LOAD(p)		_mm256_load_si256((const void *)(p))
+#define V_STORE(p, v)		_mm256_store_si256((void *)(p), (v))
+#define V_SET1(x)		_mm256_set1_epi32(x)
+#define V_ADD(x, y)		_mm256_add_epi32((x), (y))
+#define V_AND(x, y)		_mm256_and_si256((x), (y))
+#define V_XOR(x, y)		_mm256_xor_si256((x), (y))
+#define V_ROL(x, n)		_mm256_or_si256(_mm256_slli_epi32((x), (n)), \
+						_mm256_srli_epi32((x), 32 - (n)))
+#define V_CHOICE(b, c, d)	V_XOR(V_AND((b), V_XOR((c), (d))), (d))
+#define V_PARITY(b, c, d)	V_XOR(V_XOR((b), (c)), (d))
+#define V_MAJORITY(b, c, d)	V_XOR(V_AND((c), (d)),			\
+				      V_AND((b), V_XOR((c), (d))))
+#define HAVE_SHA1_MB_BLOCKS_X86_AVX2
+static void __attribute__((target("avx2")))
+sha1_mb_blocks_x86_avx2(u32 *state, const u8 **data, size_t num_blocks)
+{
+	SHA1_MB_BODY(8);
+}
+#undef vec_t
+#undef V_LOAD
+#undef V_STORE
+#undef V_SET1
+#undef V_ADD
+#undef V_AND
+#undef V_XOR
+#undef V_ROL
+#undef V_CHOICE
+#undef V_PARITY
+#undef V_MAJORITY
+
+/* AVX-512 has a rotate instruction, and the ternary logic instruction can do
+ * each of the three SHA-1 functions in one instruction.  */
+#define vec_t			__m512i
+#define V_LOAD(p)		_mm512_load_si512((const void *)(p))
+#define V_STORE(p, v)		_mm512_store_si512((void *)(p), (v))
+#define V_SET1(x)		_mm512_set1_epi32(x)
+#define V_ADD(x, y)		_mm512_add_epi32((x), (y))
+#define V_XOR(x, y)		_mm512_xor_si512((x), (y))
+#define V_ROL(x, n)		_mm512_rol_epi32((x), (n))
+#define V_CHOICE(b, c, d)	_mm512_ternarylogic_epi32((b), (c), (d), 0xCA)
+#define V_PARITY(b, c, d)	_mm512_ternarylogic_epi32((b), (c), (d), 0x96)
+#define V_MAJORITY(b, c, d)	_mm512_ternarylogic_epi32((b), (c), (d), 0xE8)
+#define HAVE_SHA1_MB_BLOCKS_X86_AVX512
+static void __attribute__((target("avx512f")))
+sha1_mb_blocks_x86_avx512(u32 *state, const u8 **data, size_t num_blocks)
+{
+	SHA1_MB_BODY(16);
+}
+#undef vec_t
+#undef V_LOAD
+#undef V_STORE
+#undef V_SET1
+#undef V_ADD
+#undef V_XOR
+#undef V_ROL
+#undef V_CHOICE
+#undef V_PARITY
+#undef V_MAJORITY
+#endif /* x86 AVX2 and AVX-512 multi-buffer implementation */
+
 /*----------------------------------------------------------------------------*
  *                              Everything else                               *
  *----------------------------------------------------------------------------*/
@@ -622,6 +778,162 @@ sha1(const void *data, size_t len, u8 hash[SHA1_HASH_SIZE])
 	sha1_final(&ctx, hash);
 }
 
+#if defined(HAVE_SHA1_MB_BLOCKS_X86_AVX2) || \
+	defined(HAVE_SHA1_MB_BLOCKS_X86_AVX512)
+#define SHA1_MB_MAX_LANES	16
+
+/* A message being hashed in one lane of a multi-buffer implementation  */
+struct sha1_mb_lane {
+	size_t msg_idx;
+	/* Number of blocks remaining in the current segment: first the
+	 * message's full blocks, then its padded tail in @tail.  */
+	size_t num_blocks;
+	unsigned num_tail_blocks;
+	u8 tail[2 * SHA1_BLOCK_SIZE];
+};
+
+/* Start hashing message @msg_idx in the given lane.  */
+static void
+sha1_mb_start_lane(struct sha1_mb_lane *lane, const u8 **data_p,
+		   size_t msg_idx, const u8 *data, size_t len)
+{
+	size_t full_blocks = len / SHA1_BLOCK_SIZE;
+	unsigned rem = len % SHA1_BLOCK_SIZE;
+	unsigned tail_len = (rem + 1 + 8 <= SHA1_BLOCK_SIZE) ?
+			    SHA1_BLOCK_SIZE : 2 * SHA1_BLOCK_SIZE;
+	const be64 bitcount = cpu_to_be64((u64)len * 8);
+
+	memcpy(lane->tail, data + full_blocks * SHA1_BLOCK_SIZE, rem);
+	lane->tail[rem] = 0x80;
+	memset(&lane->tail[rem + 1], 0, tail_len - 8 - (rem + 1));
+	memcpy(&lane->tail[tail_len - 8], &bitcount, 8);
+
+	lane->msg_idx = msg_idx;
+	if (full_blocks) {
+		*data_p = data;
+		lane->num_blocks = full_blocks;
+		lane->num_tail_blocks = tail_len / SHA1_BLOCK_SIZE;
+	} else {
+		*data_p = lane->tail;
+		lane->num_blocks = tail_len / SHA1_BLOCK_SIZE;
+		lane->num_tail_blocks = 0;
+	}
+}
+
+/*
+ * Hash the messages using a multi-buffer implementation with @num_lanes lanes.
+ * Each lane is refilled with the next message as soon as its current message
+ * is done, so messages of different lengths are fine.  When no messages are
+ * left to refill a lane with, the messages still in the other lanes are
+ * finished with the single-buffer code, since running the multi-buffer code
+ * with idle lanes would be a waste.
+ */
+static void
+sha1_multi_lanes(unsigned num_lanes,
+		 void (*mb_blocks)(u32 *state, const u8 **data,
+				   size_t num_blocks),
+		 const void * const msgs[], const size_t lens[],
+		 size_t num_msgs, u8 hashes[][SHA1_HASH_SIZE])
+{
+	static const u32 iv[5] = {
+		0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0,
+	};
+	u32 state[5 * SHA1_MB_MAX_LANES] __attribute__((aligned(64)));
+	const u8 *data[SHA1_MB_MAX_LANES];
+	struct sha1_mb_lane lanes[SHA1_MB_MAX_LANES];
+	bool active[SHA1_MB_MAX_LANES];
+	size_t next_msg = 0;
+	bool draining = false;
+	unsigned i, j;
+
+	for (j = 0; j < num_lanes; j++) {
+		for (i = 0; i < 5; i++)
+			state[i * num_lanes + j] = iv[i];
+		sha1_mb_start_lane(&lanes[j], &data[j], next_msg,
+				   msgs[next_msg], lens[next_msg]);
+		next_msg++;
+		active[j] = true;
+	}
+
+	while (!draining) {
+		size_t n = lanes[0].num_blocks;
+
+		for (j = 1; j < num_lanes; j++)
+			n = min(n, lanes[j].num_blocks);
+		(*mb_blocks)(state, data, n);
+
+		for (j = 0; j < num_lanes; j++) {
+			struct sha1_mb_lane *lane = &lanes[j];
+
+			lane->num_blocks -= n;
+			if (lane->num_blocks)
+				continue;
+			if (lane->num_tail_blocks) {
+				data[j] = lane->tail;
+				lane->num_blocks = lane->num_tail_blocks;
+				lane->num_tail_blocks = 0;
+				continue;
+			}
+			for (i = 0; i < 5; i++) {
+				put_unaligned_be32(state[i * num_lanes + j],
+						   &hashes[lane->msg_idx][i * 4]);
+			}
+			if (next_msg == num_msgs) {
+				active[j] = false;
+				draining = true;
+				continue;
+			}
+			for (i = 0; i < 5; i++)
+				state[i * num_lanes + j] = iv[i];
+			sha1_mb_start_lane(lane, &data[j], next_msg,
+					   msgs[next_msg], lens[next_msg]);
+			next_msg++;
+		}
+	}
+
+	for (j = 0; j < num_lanes; j++) {
+		struct sha1_mb_lane *lane = &lanes[j];
+		u32 h[5];
+
+		if (!active[j])
+			continue;
+		for (i = 0; i < 5; i++)
+			h[i] = state[i * num_lanes + j];
+		sha1_blocks(h, data[j], lane->num_blocks);
+		if (lane->num_tail_blocks)
+			sha1_blocks(h, lane->tail, lane->num_tail_blocks);
+		for (i = 0; i < 5; i++)
+			put_unaligned_be32(h[i], &hashes[lane->msg_idx][i * 4]);
+	}
+}
+#endif /* HAVE_SHA1_MB_BLOCKS_X86_AVX2 || HAVE_SHA1_MB_BLOCKS_X86_AVX512 */
+
+/*
+ * Calculate the SHA-1 message digests of @num_msgs independent messages.  This
+ * gives the same results as calling sha1() on each message, but it may be much
+ * faster when there are many messages, especially short ones, since some CPUs
+ * can hash several messages in parallel.
+ */
+void
+sha1_multi(const void * const msgs[], const size_t lens[], size_t num_msgs,
+	   u8 hashes[][SHA1_HASH_SIZE])
+{
+#ifdef HAVE_SHA1_MB_BLOCKS_X86_AVX512
+	if ((cpu_features & X86_CPU_FEATURE_AVX512F) && num_msgs >= 16)
+		return sha1_multi_lanes(16, sha1_mb_blocks_x86_avx512,
+					msgs, lens, num_msgs, hashes);
+#endif
+#ifdef HAVE_SHA1_MB_BLOCKS_X86_AVX2
+	/* With only 8 lanes, the SHA Extensions are faster.  */
+	if ((cpu_features & X86_CPU_FEATURE_AVX2) &&
+	    !(cpu_features & X86_CPU_FEATURE_SHA) && num_msgs >= 8)
+		return sha1_multi_lanes(8, sha1_mb_blocks_x86_avx2,
+					msgs, lens, num_msgs, hashes);
+#endif
+	for (size_t i = 0; i < num_msgs; i++)
+		sha1(msgs[i], lens[i], hashes[i]);
+}
+
 /* "Null" SHA-1 message digest containing all 0's */
 const u8 zero_hash[SHA1_HASH_SIZE];
 
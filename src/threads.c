@@ -1,6 +1,7 @@
 /*
  * threads.c - Thread, mutex, and condition variable support.  Wraps around
- *             pthreads or Windows native threads.
+ *             pthreads or Windows native threads.  Also contains the
+ *             library-wide thread pool.
  */
 
 /*
@@ -69,6 +70,11 @@ void thread_join(struct thread *t)
 	wimlib_assert(res == WAIT_OBJECT_0);
 }
 
+static bool thread_is_current(const struct thread *t)
+{
+	return GetThreadId((HANDLE)t->win32_thread) == GetCurrentThreadId();
+}
+
 bool mutex_init(struct mutex *m)
 {
 	CRITICAL_SECTION *crit = MALLOC(sizeof(*crit));
@@ -168,6 +174,11 @@ void thread_join(struct thread *t)
 	wimlib_assert(err == 0);
 }
 
+static bool thread_is_current(const struct thread *t)
+{
+	return pthread_equal(t->pthread, pthread_self());
+}
+
 bool mutex_init(struct mutex *m)
 {
 	int err = pthread_mutex_init(&m->pthread_mutex, NULL);
@@ -242,3 +253,316 @@ void condvar_broadcast(struct condvar *c)
 }
 
 #endif /* !_WIN32 */
+
+/*----------------------------------------------------------------------------*
+ *                                Thread pool                                 *
+ *----------------------------------------------------------------------------*/
+
+/*
+ * Each pool thread has a deque of queued tasks.  A task submitted from a pool
+ * thread, i.e. by a job function that made more work available, goes on the
+ * bottom of that thread's own deque, and each thread takes its next task from
+ * the bottom of its own deque, so related work tends to stay on one processor.
+ * Tasks submitted from other threads are spread over the deques round-robin.  A
+ * thread whose deque is empty steals the task at the top of another thread's
+ * deque, which is the one that has been waiting the longest.
+ *
+ * Lock ordering: job lock, then pool lock, then deque lock.
+ */
+
+#define THREAD_POOL_MAX_THREADS		256
+
+struct pool_worker {
+	struct thread thread;
+	unsigned index;
+	struct mutex deque_lock;
+	struct list_head deque;
+};
+
+static struct {
+	struct mutex lock;
+	struct condvar work_avail_cond;
+	bool initialized;
+	bool terminating;
+
+	/* Entries below num_workers never change until the pool is destroyed,
+	 * so they can be read without the lock once num_workers has been.  */
+	struct pool_worker *workers[THREAD_POOL_MAX_THREADS];
+	unsigned num_workers;
+
+	/* Number of tasks in all the deques  */
+	unsigned num_queued_tasks;
+
+	unsigned next_deque;
+} pool = {
+	.lock = MUTEX_INITIALIZER,
+};
+
+static struct thread_pool_task *
+take_task_from_deque(struct pool_worker *w, bool steal)
+{
+	struct thread_pool_task *task = NULL;
+
+	mutex_lock(&w->deque_lock);
+	if (!list_empty(&w->deque)) {
+		if (steal)
+			task = list_first_entry(&w->deque,
+						struct thread_pool_task, node);
+		else
+			task = list_last_entry(&w->deque,
+					       struct thread_pool_task, node);
+		list_del(&task->node);
+	}
+	mutex_unlock(&w->deque_lock);
+	return task;
+}
+
+static struct thread_pool_task *
+take_task(struct pool_worker *self)
+{
+	struct thread_pool_task *task;
+	unsigned num_workers;
+
+	task = take_task_from_deque(self, false);
+
+	mutex_lock(&pool.lock);
+	num_workers = pool.num_workers;
+	mutex_unlock(&pool.lock);
+
+	for (unsigned i = 1; !task && i < num_workers; i++) {
+		task = take_task_from_deque(
+				pool.workers[(self->index + i) % num_workers],
+				true);
+	}
+	if (task) {
+		mutex_lock(&pool.lock);
+		pool.num_queued_tasks--;
+		mutex_unlock(&pool.lock);
+	}
+	return task;
+}
+
+static void
+run_task(struct thread_pool_task *task)
+{
+	struct thread_pool_job *job = task->job;
+
+	mutex_lock(&job->lock);
+	do {
+		job->rerun = false;
+		mutex_unlock(&job->lock);
+
+		(*job->func)(job->arg);
+
+		mutex_lock(&job->lock);
+	} while (job->rerun);
+	list_add(&task->node, &job->free_tasks);
+	if (--job->num_active_tasks == 0)
+		condvar_broadcast(&job->idle_cond);
+	mutex_unlock(&job->lock);
+}
+
+static void *
+pool_worker_proc(void *arg)
+{
+	struct pool_worker *self = arg;
+	struct thread_pool_task *task;
+
+	for (;;) {
+		task = take_task(self);
+		if (task) {
+			run_task(task);
+			continue;
+		}
+		mutex_lock(&pool.lock);
+		while (pool.num_queued_tasks == 0 && !pool.terminating)
+			condvar_wait(&pool.work_avail_cond, &pool.lock);
+		if (pool.num_queued_tasks == 0) {
+			mutex_unlock(&pool.lock);
+			break;
+		}
+		mutex_unlock(&pool.lock);
+	}
+	return NULL;
+}
+
+/*
+ * Make sure that the thread pool has at least @num_threads threads (0 means the
+ * number of processors), creating them if needed.  Returns the number of pool
+ * threads, up to @num_threads, that are actually available.
+ */
+unsigned
+thread_pool_reserve(unsigned num_threads)
+{
+	unsigned n;
+
+	if (num_threads == 0)
+		num_threads = get_available_cpus();
+	num_threads = min(num_threads, THREAD_POOL_MAX_THREADS);
+
+	mutex_lock(&pool.lock);
+	if (!pool.initialized) {
+		if (!condvar_init(&pool.work_avail_cond))
+			goto out;
+		pool.initialized = true;
+	}
+	while (pool.num_workers < num_threads) {
+		struct pool_worker *w = CALLOC(1, sizeof(*w));
+
+		if (!w)
+			break;
+		w->index = pool.num_workers;
+		INIT_LIST_HEAD(&w->deque);
+		if (!mutex_init(&w->deque_lock)) {
+			FREE(w);
+			break;
+		}
+		if (!thread_create(&w->thread, pool_worker_proc, w)) {
+			mutex_destroy(&w->deque_lock);
+			FREE(w);
+			break;
+		}
+		pool.workers[pool.num_workers++] = w;
+	}
+out:
+	n = min(pool.num_workers, num_threads);
+	mutex_unlock(&pool.lock);
+	return n;
+}
+
+/* Queue a task on the thread pool.  */
+static void
+pool_submit(struct thread_pool_task *task)
+{
+	struct pool_worker *w = NULL;
+
+	mutex_lock(&pool.lock);
+	wimlib_assert(pool.num_workers != 0);
+	for (unsigned i = 0; i < pool.num_workers; i++) {
+		if (thread_is_current(&pool.workers[i]->thread)) {
+			w = pool.workers[i];
+			break;
+		}
+	}
+	if (!w)
+		w = pool.workers[pool.next_deque++ % pool.num_workers];
+	mutex_lock(&w->deque_lock);
+	list_add_tail(&task->node, &w->deque);
+	mutex_unlock(&w->deque_lock);
+	pool.num_queued_tasks++;
+	condvar_signal(&pool.work_avail_cond);
+	mutex_unlock(&pool.lock);
+}
+
+/*
+ * Initialize a job that is serviced by up to @max_tasks concurrent tasks, each
+ * of which calls @func(@arg).  thread_pool_reserve() must have returned nonzero
+ * first.  Returns false if out of memory.
+ */
+bool
+thread_pool_job_init(struct thread_pool_job *job, void (*func)(void *),
+		     void *arg, unsigned max_tasks)
+{
+	wimlib_assert(max_tasks != 0);
+
+	job->func = func;
+	job->arg = arg;
+	job->tasks = MALLOC(max_tasks * sizeof(job->tasks[0]));
+	if (!job->tasks)
+		return false;
+	if (!mutex_init(&job->lock))
+		goto err_free_tasks;
+	if (!condvar_init(&job->idle_cond))
+		goto err_destroy_lock;
+	INIT_LIST_HEAD(&job->free_tasks);
+	for (unsigned i = 0; i < max_tasks; i++) {
+		job->tasks[i].job = job;
+		list_add_tail(&job->tasks[i].node, &job->free_tasks);
+	}
+	job->num_active_tasks = 0;
+	job->rerun = false;
+	return true;
+
+err_destroy_lock:
+	mutex_destroy(&job->lock);
+err_free_tasks:
+	FREE(job->tasks);
+	return false;
+}
+
+/*
+ * Tell the thread pool that @job has work available: start another task for it
+ * if it has fewer than the maximum number, otherwise make one of its tasks call
+ * the job function again after it returns.  This must not be called while
+ * holding any lock that the job function takes.
+ */
+void
+thread_pool_job_kick(struct thread_pool_job *job)
+{
+	struct thread_pool_task *task;
+
+	mutex_lock(&job->lock);
+	if (list_empty(&job->free_tasks)) {
+		job->rerun = true;
+	} else {
+		task = list_first_entry(&job->free_tasks,
+					struct thread_pool_task, node);
+		list_del(&task->node);
+		job->num_active_tasks++;
+		pool_submit(task);
+	}
+	mutex_unlock(&job->lock);
+}
+
+/* Wait until no tasks of @job are queued or running.  */
+void
+thread_pool_job_wait(struct thread_pool_job *job)
+{
+	mutex_lock(&job->lock);
+	while (job->num_active_tasks != 0)
+		condvar_wait(&job->idle_cond, &job->lock);
+	mutex_unlock(&job->lock);
+}
+
+/* Wait for @job's tasks to finish, then free its resources.  The caller must
+ * have made sure that the job function will find no more work.  */
+void
+thread_pool_job_destroy(struct thread_pool_job *job)
+{
+	thread_pool_job_wait(job);
+	condvar_destroy(&job->idle_cond);
+	mutex_destroy(&job->lock);
+	FREE(job->tasks);
+}
+
+/* Stop the pool's threads.  No jobs may exist.  The pool is recreated if
+ * needed.  */
+void
+thread_pool_destroy(void)
+{
+	mutex_lock(&pool.lock);
+	if (!pool.initialized) {
+		mutex_unlock(&pool.lock);
+		return;
+	}
+	pool.terminating = true;
+	condvar_broadcast(&pool.work_avail_cond);
+	mutex_unlock(&pool.lock);
+
+	/* Threads that haven't exited yet may still look in the deques of the
+	 * others, so don't free any of them until all have exited.  */
+	for (unsigned i = 0; i < pool.num_workers; i++)
+		thread_join(&pool.workers[i]->thread);
+	for (unsigned i = 0; i < pool.num_workers; i++) {
+		mutex_destroy(&pool.workers[i]->deque_lock);
+		FREE(pool.workers[i]);
+	}
+
+	mutex_lock(&pool.lock);
+	pool.num_workers = 0;
+	pool.next_deque = 0;
+	pool.terminating = false;
+	condvar_destroy(&pool.work_avail_cond);
+	pool.initialized = false;
+	mutex_unlock(&pool.lock);
+}
@@ -25,6 +25,10 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#ifdef HAVE_LINUX_FS_H
+#  include <linux/fs.h>	/* for FICLONE */
+#  include <sys/ioctl.h>
+#endif
 #include <stdlib.h>
 #include <sys/stat.h>
 #include <sys/time.h>
@@ -41,6 +45,7 @@
 #include "wimlib/error.h"
 #include "wimlib/file_io.h"
 #include "wimlib/reparse.h"
+#include "wimlib/threads.h"
 #include "wimlib/timestamp.h"
 #include "wimlib/unix_data.h"
 #include "wimlib/xattr.h"
@@ -54,6 +59,68 @@
 #  define O_NOFOLLOW 0
 #endif
 
+#ifndef O_DIRECTORY
+#  define O_DIRECTORY 0
+#endif
+
+/*
+ * Files are created and accessed relative to open file descriptors of their
+ * parent directories if the *at() system calls are available.  Otherwise, the
+ * "relative" paths are just the full paths, and the directory file descriptors
+ * are always AT_FDCWD.
+ */
+#if defined(HAVE_OPENAT) && defined(HAVE_FSTATAT) && defined(HAVE_MKDIRAT) && \
+	defined(HAVE_LINKAT) && defined(HAVE_SYMLINKAT) && \
+	defined(HAVE_MKNODAT) && defined(HAVE_UNLINKAT) && \
+	defined(HAVE_FCHOWNAT) && defined(HAVE_FCHMODAT)
+#  define USE_DIRFDS 1
+#  define my_openat(dirfd, relpath, flags, mode) \
+		openat((dirfd), (relpath), (flags), (mode))
+#  define my_fstatat(dirfd, relpath, stbuf, flags) \
+		fstatat((dirfd), (relpath), (stbuf), (flags))
+#  define my_mkdirat(dirfd, relpath, mode) \
+		mkdirat((dirfd), (relpath), (mode))
+#  define my_linkat(olddirfd, oldrelpath, newdirfd, newrelpath) \
+		linkat((olddirfd), (oldrelpath), (newdirfd), (newrelpath), 0)
+#  define my_symlinkat(target, dirfd, relpath) \
+		symlinkat((target), (dirfd), (relpath))
+#  define my_mknodat(dirfd, relpath, mode, dev) \
+		mknodat((dirfd), (relpath), (mode), (dev))
+#  define my_unlinkat(dirfd, relpath) \
+		unlinkat((dirfd), (relpath), 0)
+#  define my_lchownat(dirfd, relpath, uid, gid) \
+		fchownat((dirfd), (relpath), (uid), (gid), AT_SYMLINK_NOFOLLOW)
+#  define my_fchmodat(dirfd, relpath, mode) \
+		fchmodat((dirfd), (relpath), (mode), 0)
+#else
+#  define my_openat(dirfd, relpath, flags, mode) \
+		open((relpath), (flags), (mode))
+#  define my_fstatat(dirfd, relpath, stbuf, flags) \
+		lstat((relpath), (stbuf))
+#  define my_mkdirat(dirfd, relpath, mode) \
+		mkdir((relpath), (mode))
+#  define my_linkat(olddirfd, oldrelpath, newdirfd, newrelpath) \
+		link((oldrelpath), (newrelpath))
+#  define my_symlinkat(target, dirfd, relpath) \
+		symlink((target), (relpath))
+#  define my_mknodat(dirfd, relpath, mode, dev) \
+		mknod((relpath), (mode), (dev))
+#  define my_unlinkat(dirfd, relpath) \
+		unlink((relpath))
+#  define my_lchownat(dirfd, relpath, uid, gid) \
+		lchown((relpath), (uid), (gid))
+#  define my_fchmodat(dirfd, relpath, mode) \
+		chmod((relpath), (mode))
+#endif
+
+#ifndef AT_FDCWD
+#  define AT_FDCWD	-100
+#endif
+
+#ifndef AT_SYMLINK_NOFOLLOW
+#  define AT_SYMLINK_NOFOLLOW	0x100
+#endif
+
 static int
 unix_get_supported_features(const char *target,
 			    struct wim_features *supported_features)
@@ -72,6 +139,19 @@ unix_get_supported_features(const char *target,
 
 #define NUM_PATHBUFS 2  /* We need 2 when creating hard links  */
 
+/* Maximum number of directory file descriptors cached by each context  */
+#define MAX_CACHED_DIRFDS 16
+
+/* Number of directory file descriptors that each extraction worker may hold:
+ * its cached ones and the target directory.  Since the workers together get the
+ * MAX_OPEN_FILES descriptors that a serial extraction would use, there can be
+ * only so many workers if each one is to be able to extract a blob to at least
+ * UNIX_MIN_WORKER_TARGETS files.  */
+#define UNIX_WORKER_DIRFDS	(MAX_CACHED_DIRFDS + 1)
+#define UNIX_MIN_WORKER_TARGETS	15
+#define UNIX_MAX_WORKERS	\
+	(MAX_OPEN_FILES / (UNIX_WORKER_DIRFDS + UNIX_MIN_WORKER_TARGETS))
+
 struct unix_apply_ctx {
 	/* Extract flags, the pointer to the WIMStruct, etc.  */
 	struct apply_ctx common;
@@ -96,6 +176,17 @@ struct unix_apply_ctx {
 	/* Whether is_sparse_file[] is true for any currently open file  */
 	bool any_sparse_files;
 
+	/* Whether the data of the current blob is being written only to the
+	 * first regular file it's being extracted to, which is the only one
+	 * opened at first.  Once the blob has been fully read, the other files
+	 * are created one at a time as clones of it (FICLONE).  */
+	bool cloning_blob;
+
+	/* Set once cloning has failed because the target filesystem doesn't
+	 * support it; from then on, each blob is written to all its targets.
+	 */
+	bool clone_unsupported;
+
 	/* Buffer for reading reparse point data into memory  */
 	u8 reparse_data[REPARSE_DATA_MAX_SIZE];
 
@@ -111,6 +202,16 @@ struct unix_apply_ctx {
 
 	/* Number of special files we couldn't create due to EPERM  */
 	unsigned long num_special_files_ignored;
+
+	/* File descriptor of the target directory, or -1 if not opened yet  */
+	int target_dirfd;
+
+	/* Open file descriptors of the first @num_cached_dirfds directories
+	 * below the target directory on the path to the most recently accessed
+	 * file, and the dentries they were opened for.  */
+	const struct wim_dentry *cached_dirfd_dentries[MAX_CACHED_DIRFDS];
+	int cached_dirfds[MAX_CACHED_DIRFDS];
+	unsigned num_cached_dirfds;
 };
 
 /* Returns the number of characters needed to represent the path to the
@@ -189,6 +290,114 @@ unix_reuse_pathbuf(struct unix_apply_ctx *ctx)
 	ctx->which_pathbuf = (ctx->which_pathbuf - 1) % NUM_PATHBUFS;
 }
 
+static void
+unix_close_cached_dirfds(struct unix_apply_ctx *ctx, unsigned num_to_keep)
+{
+	while (ctx->num_cached_dirfds > num_to_keep)
+		close(ctx->cached_dirfds[--ctx->num_cached_dirfds]);
+}
+
+static void
+unix_close_dirfds(struct unix_apply_ctx *ctx)
+{
+	unix_close_cached_dirfds(ctx, 0);
+	if (ctx->target_dirfd >= 0)
+		close(ctx->target_dirfd);
+	ctx->target_dirfd = -1;
+}
+
+/*
+ * Like unix_build_extraction_path(), but also return in *dirfd_ret and
+ * *relpath_ret a directory file descriptor and a path relative to it with which
+ * the file can be accessed using the *at() system calls.  The full path is
+ * still returned for use in messages, and for the operations that have no *at()
+ * variant.  *relpath_ret points into the full path, so it is valid for as long
+ * as the full path is.
+ *
+ * The file descriptors of the directories on the path are cached in @ctx, so
+ * that accessing files in the same or nearby directories in a row doesn't make
+ * the kernel walk the whole path from the target directory again each time.
+ * Only the first MAX_CACHED_DIRFDS directories are cached; files in deeper
+ * directories are accessed relative to the deepest cached one.
+ */
+static const char *
+unix_build_extraction_path_at(const struct wim_dentry *dentry, int *dirfd_ret,
+			      const char **relpath_ret,
+			      struct unix_apply_ctx *ctx)
+{
+	char *path = (char *)unix_build_extraction_path(dentry, ctx);
+#ifdef USE_DIRFDS
+	const struct wim_dentry *dirs[MAX_CACHED_DIRFDS];
+	const struct wim_dentry *d;
+	size_t offsets[MAX_CACHED_DIRFDS + 1];
+	unsigned num_ancestors = 0;
+	unsigned num_dirs;
+	unsigned i;
+
+	/* The root is extracted to the target directory itself.  */
+	if (dentry_is_root(dentry))
+		goto use_full_path;
+
+	if (ctx->target_dirfd < 0) {
+		ctx->target_dirfd = open(ctx->common.target,
+					 O_RDONLY | O_DIRECTORY);
+		if (ctx->target_dirfd < 0)
+			goto use_full_path;
+	}
+
+	/* Find the extracted ancestors of the file, excluding the root, and
+	 * where the first few of them start in the path.  */
+	for (d = dentry->d_parent; !dentry_is_root(d) && will_extract_dentry(d);
+	     d = d->d_parent)
+		num_ancestors++;
+	num_dirs = min(num_ancestors, MAX_CACHED_DIRFDS);
+	d = dentry->d_parent;
+	for (i = num_ancestors; i > num_dirs; i--)
+		d = d->d_parent;
+	for (i = num_dirs; i > 0; i--) {
+		dirs[i - 1] = d;
+		d = d->d_parent;
+	}
+	offsets[0] = ctx->common.target_nchars + 1;
+	for (i = 0; i < num_dirs; i++)
+		offsets[i + 1] = offsets[i] + dirs[i]->d_extraction_name_nchars + 1;
+
+	/* Keep the cached file descriptors that are still on the path, then
+	 * open the rest of the directories on it.  */
+	for (i = 0; i < ctx->num_cached_dirfds && i < num_dirs &&
+		    ctx->cached_dirfd_dentries[i] == dirs[i]; i++)
+		;
+	unix_close_cached_dirfds(ctx, i);
+	while (ctx->num_cached_dirfds < num_dirs) {
+		int parent_fd, fd;
+		char *name_end;
+
+		i = ctx->num_cached_dirfds;
+		parent_fd = i ? ctx->cached_dirfds[i - 1] : ctx->target_dirfd;
+		name_end = &path[offsets[i + 1] - 1];
+		*name_end = '\0';
+		fd = openat(parent_fd, &path[offsets[i]],
+			    O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+		*name_end = '/';
+		if (fd < 0)
+			break;
+		ctx->cached_dirfd_dentries[i] = dirs[i];
+		ctx->cached_dirfds[i] = fd;
+		ctx->num_cached_dirfds++;
+	}
+
+	i = ctx->num_cached_dirfds;
+	*dirfd_ret = i ? ctx->cached_dirfds[i - 1] : ctx->target_dirfd;
+	*relpath_ret = &path[offsets[i]];
+	return path;
+
+use_full_path:
+#endif /* USE_DIRFDS */
+	*dirfd_ret = AT_FDCWD;
+	*relpath_ret = path;
+	return path;
+}
+
 /* Builds and returns the filesystem path to which to extract an unspecified
  * alias of the @inode.  This cycles through NUM_PATHBUFS different buffers.  */
 static const char *
@@ -212,9 +421,11 @@ should_extract_as_directory(const struct wim_inode *inode)
 /* Sets the timestamps on a file being extracted.
  *
  * Either @fd or @path must be specified (not -1 and not NULL, respectively).
+ * If @fd isn't specified, @relpath must be @path relative to @dirfd.
  */
 static int
-unix_set_timestamps(int fd, const char *path, u64 atime, u64 mtime)
+unix_set_timestamps(int fd, int dirfd, const char *relpath, const char *path,
+		    u64 atime, u64 mtime)
 {
 	{
 		struct timespec times[2];
@@ -228,7 +439,8 @@ unix_set_timestamps(int fd, const char *path, u64 atime, u64 mtime)
 			return 0;
 #endif
 #ifdef HAVE_UTIMENSAT
-		if (fd < 0 && !utimensat(AT_FDCWD, path, times, AT_SYMLINK_NOFOLLOW))
+		if (fd < 0 && !utimensat(dirfd, relpath, times,
+					 AT_SYMLINK_NOFOLLOW))
 			return 0;
 #endif
 		if (errno != ENOSYS)
@@ -249,21 +461,22 @@ unix_set_timestamps(int fd, const char *path, u64 atime, u64 mtime)
 }
 
 static int
-unix_set_owner_and_group(int fd, const char *path, uid_t uid, gid_t gid)
+unix_set_owner_and_group(int fd, int dirfd, const char *relpath,
+			 uid_t uid, gid_t gid)
 {
 	if (fd >= 0 && !fchown(fd, uid, gid))
 		return 0;
-	if (fd < 0 && !lchown(path, uid, gid))
+	if (fd < 0 && !my_lchownat(dirfd, relpath, uid, gid))
 		return 0;
 	return WIMLIB_ERR_SET_SECURITY;
 }
 
 static int
-unix_set_mode(int fd, const char *path, mode_t mode)
+unix_set_mode(int fd, int dirfd, const char *relpath, mode_t mode)
 {
 	if (fd >= 0 && !fchmod(fd, mode))
 		return 0;
-	if (fd < 0 && !chmod(path, mode))
+	if (fd < 0 && !my_fchmodat(dirfd, relpath, mode))
 		return 0;
 	return WIMLIB_ERR_SET_SECURITY;
 }
@@ -359,12 +572,14 @@ apply_linux_xattrs(int fd, const struct wim_inode *inode,
  * setxattr(), then chmod().
  *
  * N.B. the file may be specified by either 'fd' (for regular files) or 'path',
- * and it may be a symlink.  For symlinks we need lchown() and lsetxattr() but
- * need to skip the chmod(), since mode bits are not meaningful for symlinks.
+ * which is 'relpath' relative to 'dirfd', and it may be a symlink.  For
+ * symlinks we need lchown() and lsetxattr() but need to skip the chmod(), since
+ * mode bits are not meaningful for symlinks.
  */
 static int
-apply_unix_metadata(int fd, const struct wim_inode *inode,
-		    const char *path, struct unix_apply_ctx *ctx)
+apply_unix_metadata(int fd, const struct wim_inode *inode, int dirfd,
+		    const char *relpath, const char *path,
+		    struct unix_apply_ctx *ctx)
 {
 	bool have_dat;
 	struct wimlib_unix_data dat;
@@ -378,7 +593,8 @@ apply_unix_metadata(int fd, const struct wim_inode *inode,
 	have_dat = inode_get_unix_data(inode, &dat);
 
 	if (have_dat) {
-		ret = unix_set_owner_and_group(fd, path, dat.uid, dat.gid);
+		ret = unix_set_owner_and_group(fd, dirfd, relpath,
+					       dat.uid, dat.gid);
 		if (ret) {
 			if (!path)
 				path = unix_build_inode_extraction_path(inode, ctx);
@@ -405,7 +621,7 @@ apply_unix_metadata(int fd, const struct wim_inode *inode,
 #endif
 
 	if (have_dat && !inode_is_symlink(inode)) {
-		ret = unix_set_mode(fd, path, dat.mode);
+		ret = unix_set_mode(fd, dirfd, relpath, dat.mode);
 		if (ret) {
 			if (!path)
 				path = unix_build_inode_extraction_path(inode, ctx);
@@ -428,26 +644,32 @@ apply_unix_metadata(int fd, const struct wim_inode *inode,
  * Set metadata on an extracted file.
  *
  * @fd is an open file descriptor to the extracted file, or -1.  @path is the
- * path to the extracted file, or NULL.  If valid, this function uses @fd.
- * Otherwise, if valid, it uses @path.  Otherwise, it calculates the path to one
- * alias of the extracted file and uses it.
+ * path to the extracted file, or NULL; if set, @relpath is the same file
+ * relative to @dirfd.  If valid, this function uses @fd.  Otherwise, if valid,
+ * it uses @path.  Otherwise, it calculates the path to one alias of the
+ * extracted file and uses it.
  */
 static int
-unix_set_metadata(int fd, const struct wim_inode *inode,
-		  const char *path, struct unix_apply_ctx *ctx)
+unix_set_metadata(int fd, const struct wim_inode *inode, int dirfd,
+		  const char *relpath, const char *path,
+		  struct unix_apply_ctx *ctx)
 {
 	int ret;
 
-	if (fd < 0 && !path)
-		path = unix_build_inode_extraction_path(inode, ctx);
+	if (fd < 0 && !path) {
+		path = unix_build_extraction_path_at(
+				inode_first_extraction_dentry(inode),
+				&dirfd, &relpath, ctx);
+	}
 
 	if (ctx->common.extract_flags & WIMLIB_EXTRACT_FLAG_UNIX_DATA) {
-		ret = apply_unix_metadata(fd, inode, path, ctx);
+		ret = apply_unix_metadata(fd, inode, dirfd, relpath, path, ctx);
 		if (ret)
 			return ret;
 	}
 
-	ret = unix_set_timestamps(fd, path, inode->i_last_access_time,
+	ret = unix_set_timestamps(fd, dirfd, relpath, path,
+				  inode->i_last_access_time,
 				  inode->i_last_write_time);
 	if (ret) {
 		if (!path)
@@ -464,96 +686,125 @@ unix_set_metadata(int fd, const struct wim_inode *inode,
 	return 0;
 }
 
-/* Extract all needed aliases of the @inode, where one alias, corresponding to
- * @first_dentry, has already been extracted to @first_path.  */
+/* Extract all needed aliases of the @inode, where the first alias,
+ * corresponding to @first_dentry, has already been extracted to @first_path,
+ * which is @first_relpath relative to @first_dirfd.  */
 static int
 unix_create_hardlinks(const struct wim_inode *inode,
-		      const struct wim_dentry *first_dentry,
-		      const char *first_path, struct unix_apply_ctx *ctx)
+		      const struct wim_dentry *first_dentry, int first_dirfd,
+		      const char *first_relpath, const char *first_path,
+		      struct unix_apply_ctx *ctx)
 {
 	const struct wim_dentry *dentry;
 	const char *newpath;
+	const char *newrelpath;
+	int newdirfd;
+	int ret = 0;
+
+	if (!first_dentry->d_next_extraction_alias)
+		return 0;
+
+	/* Getting the directories of the other aliases may close the cached
+	 * file descriptor of the first alias's directory.  */
+	if (first_dirfd != AT_FDCWD) {
+		first_dirfd = dup(first_dirfd);
+		if (first_dirfd < 0) {
+			first_dirfd = AT_FDCWD;
+			first_relpath = first_path;
+		}
+	}
 
 	inode_for_each_extraction_alias(dentry, inode) {
 		if (dentry == first_dentry)
 			continue;
 
-		newpath = unix_build_extraction_path(dentry, ctx);
+		newpath = unix_build_extraction_path_at(dentry, &newdirfd,
+							&newrelpath, ctx);
 	retry_link:
-		if (link(first_path, newpath)) {
-			if (errno == EEXIST && !unlink(newpath))
+		if (my_linkat(first_dirfd, first_relpath, newdirfd, newrelpath)) {
+			if (errno == EEXIST && !my_unlinkat(newdirfd, newrelpath))
 				goto retry_link;
 			ERROR_WITH_ERRNO("Can't create hard link "
 					 "\"%s\" => \"%s\"", newpath, first_path);
-			return WIMLIB_ERR_LINK;
+			ret = WIMLIB_ERR_LINK;
+			break;
 		}
 		unix_reuse_pathbuf(ctx);
 	}
-	return 0;
+	if (first_dirfd != AT_FDCWD)
+		close(first_dirfd);
+	return ret;
 }
 
-/* If @dentry represents a directory, create it.  */
+/* Create the directory @dentry.  */
 static int
-unix_create_if_directory(const struct wim_dentry *dentry,
-			 struct unix_apply_ctx *ctx)
+unix_create_directory(const struct wim_dentry *dentry,
+		      struct unix_apply_ctx *ctx)
 {
 	const char *path;
+	const char *relpath;
+	int dirfd;
 	struct stat stbuf;
 
-	if (!should_extract_as_directory(dentry->d_inode))
-		return 0;
-
-	path = unix_build_extraction_path(dentry, ctx);
-	if (mkdir(path, 0755) &&
+	path = unix_build_extraction_path_at(dentry, &dirfd, &relpath, ctx);
+	if (my_mkdirat(dirfd, relpath, 0755) &&
 	    /* It's okay if the path already exists, as long as it's a
 	     * directory.  */
-	    !(errno == EEXIST && !lstat(path, &stbuf) && S_ISDIR(stbuf.st_mode)))
+	    !(errno == EEXIST &&
+	      !my_fstatat(dirfd, relpath, &stbuf, AT_SYMLINK_NOFOLLOW) &&
+	      S_ISDIR(stbuf.st_mode)))
 	{
 		ERROR_WITH_ERRNO("Can't create directory \"%s\"", path);
 		return WIMLIB_ERR_MKDIR;
 	}
+	return 0;
+}
 
-	return report_file_created(&ctx->common);
+/* Should @dentry be created as an empty regular file or a special file?  All
+ * aliases of a file are extracted when its "first" alias comes up, so this is
+ * only true for the first one.  */
+static bool
+unix_is_empty_file_to_extract(const struct wim_dentry *dentry)
+{
+	const struct wim_inode *inode = dentry->d_inode;
+
+	return dentry == inode_first_extraction_dentry(inode) &&
+	       !should_extract_as_directory(inode) &&
+	       !inode_is_symlink(inode) &&
+	       !inode_get_blob_for_unnamed_data_stream_resolved(inode);
 }
 
-/* If @dentry represents an empty regular file or a special file, create it, set
- * its metadata, and create any needed hard links.  */
+/* Create the empty regular file or special file @dentry, which must satisfy
+ * unix_is_empty_file_to_extract(), set its metadata, and create any needed
+ * hard links.  */
 static int
-unix_extract_if_empty_file(const struct wim_dentry *dentry,
-			   struct unix_apply_ctx *ctx)
+unix_extract_empty_file(const struct wim_dentry *dentry,
+			struct unix_apply_ctx *ctx)
 {
 	const struct wim_inode *inode;
 	struct wimlib_unix_data unix_data;
 	const char *path;
+	const char *relpath;
+	int dirfd;
 	int ret;
 
 	inode = dentry->d_inode;
-
-	/* Extract all aliases only when the "first" comes up.  */
-	if (dentry != inode_first_extraction_dentry(inode))
-		return 0;
-
-	/* Is this a directory, a symbolic link, or any type of nonempty file?
-	 */
-	if (should_extract_as_directory(inode) || inode_is_symlink(inode) ||
-	    inode_get_blob_for_unnamed_data_stream_resolved(inode))
-		return 0;
+	path = unix_build_extraction_path_at(dentry, &dirfd, &relpath, ctx);
 
 	/* Recognize special files in UNIX_DATA mode  */
 	if ((ctx->common.extract_flags & WIMLIB_EXTRACT_FLAG_UNIX_DATA) &&
 	    inode_get_unix_data(inode, &unix_data) &&
 	    !S_ISREG(unix_data.mode))
 	{
-		path = unix_build_extraction_path(dentry, ctx);
 	retry_mknod:
-		if (mknod(path, unix_data.mode, unix_data.rdev)) {
+		if (my_mknodat(dirfd, relpath, unix_data.mode, unix_data.rdev)) {
 			if (errno == EPERM) {
 				WARNING_WITH_ERRNO("Can't create special "
 						   "file \"%s\"", path);
 				ctx->num_special_files_ignored++;
 				return 0;
 			}
-			if (errno == EEXIST && !unlink(path))
+			if (errno == EEXIST && !my_unlinkat(dirfd, relpath))
 				goto retry_mknod;
 			ERROR_WITH_ERRNO("Can't create special file \"%s\"",
 					 path);
@@ -561,22 +812,22 @@ unix_extract_if_empty_file(const struct wim_dentry *dentry,
 		}
 		/* On special files, we can set timestamps immediately because
 		 * we don't need to write any data to them.  */
-		ret = unix_set_metadata(-1, inode, path, ctx);
+		ret = unix_set_metadata(-1, inode, dirfd, relpath, path, ctx);
 	} else {
 		int fd;
 
-		path = unix_build_extraction_path(dentry, ctx);
 	retry_create:
-		fd = open(path, O_EXCL | O_CREAT | O_WRONLY | O_NOFOLLOW, 0644);
+		fd = my_openat(dirfd, relpath,
+			       O_EXCL | O_CREAT | O_WRONLY | O_NOFOLLOW, 0644);
 		if (fd < 0) {
-			if (errno == EEXIST && !unlink(path))
+			if (errno == EEXIST && !my_unlinkat(dirfd, relpath))
 				goto retry_create;
 			ERROR_WITH_ERRNO("Can't create regular file \"%s\"", path);
 			return WIMLIB_ERR_OPEN;
 		}
 		/* On empty files, we can set timestamps immediately because we
 		 * don't need to write any data to them.  */
-		ret = unix_set_metadata(fd, inode, path, ctx);
+		ret = unix_set_metadata(fd, inode, dirfd, relpath, path, ctx);
 		if (close(fd) && !ret) {
 			ERROR_WITH_ERRNO("Error closing \"%s\"", path);
 			ret = WIMLIB_ERR_WRITE;
@@ -585,31 +836,7 @@ unix_extract_if_empty_file(const struct wim_dentry *dentry,
 	if (ret)
 		return ret;
 
-	ret = unix_create_hardlinks(inode, dentry, path, ctx);
-	if (ret)
-		return ret;
-
-	return report_file_created(&ctx->common);
-}
-
-static int
-unix_create_dirs_and_empty_files(const struct list_head *dentry_list,
-				 struct unix_apply_ctx *ctx)
-{
-	const struct wim_dentry *dentry;
-	int ret;
-
-	list_for_each_entry(dentry, dentry_list, d_extraction_list_node) {
-		ret = unix_create_if_directory(dentry, ctx);
-		if (ret)
-			return ret;
-	}
-	list_for_each_entry(dentry, dentry_list, d_extraction_list_node) {
-		ret = unix_extract_if_empty_file(dentry, ctx);
-		if (ret)
-			return ret;
-	}
-	return 0;
+	return unix_create_hardlinks(inode, dentry, dirfd, relpath, path, ctx);
 }
 
 static void
@@ -626,9 +853,7 @@ unix_count_dentries(const struct list_head *dentry_list,
 
 		if (should_extract_as_directory(inode))
 			dir_count++;
-		else if ((dentry == inode_first_extraction_dentry(inode)) &&
-			 !inode_is_symlink(inode) &&
-			 !inode_get_blob_for_unnamed_data_stream_resolved(inode))
+		else if (unix_is_empty_file_to_extract(dentry))
 			empty_file_count++;
 	}
 
@@ -637,8 +862,9 @@ unix_count_dentries(const struct list_head *dentry_list,
 }
 
 static int
-unix_create_symlink(const struct wim_inode *inode, const char *path,
-		    size_t rpdatalen, struct unix_apply_ctx *ctx)
+unix_create_symlink(const struct wim_inode *inode, int dirfd,
+		    const char *relpath, size_t rpdatalen,
+		    struct unix_apply_ctx *ctx)
 {
 	char target[REPARSE_POINT_MAX_SIZE];
 	struct blob_descriptor blob_override;
@@ -658,8 +884,8 @@ unix_create_symlink(const struct wim_inode *inode, const char *path,
 	target[ret] = '\0';
 
 retry_symlink:
-	if (symlink(target, path)) {
-		if (errno == EEXIST && !unlink(path))
+	if (my_symlinkat(target, dirfd, relpath)) {
+		if (errno == EEXIST && !my_unlinkat(dirfd, relpath))
 			goto retry_symlink;
 		return WIMLIB_ERR_LINK;
 	}
@@ -673,6 +899,7 @@ unix_cleanup_open_fds(struct unix_apply_ctx *ctx, unsigned offset)
 		filedes_close(&ctx->open_fds[i]);
 	ctx->num_open_fds = 0;
 	ctx->any_sparse_files = false;
+	ctx->cloning_blob = false;
 }
 
 static int
@@ -683,6 +910,8 @@ unix_begin_extract_blob_instance(const struct blob_descriptor *blob,
 {
 	const struct wim_dentry *first_dentry;
 	const char *first_path;
+	const char *first_relpath;
+	int dirfd;
 	int fd;
 
 	if (unlikely(strm->stream_type == STREAM_TYPE_REPARSE_POINT)) {
@@ -707,11 +936,16 @@ unix_begin_extract_blob_instance(const struct blob_descriptor *blob,
 	wimlib_assert(ctx->num_open_fds < MAX_OPEN_FILES);
 
 	first_dentry = inode_first_extraction_dentry(inode);
-	first_path = unix_build_extraction_path(first_dentry, ctx);
+	first_path = unix_build_extraction_path_at(first_dentry, &dirfd,
+						   &first_relpath, ctx);
 retry_create:
-	fd = open(first_path, O_EXCL | O_CREAT | O_WRONLY | O_NOFOLLOW, 0644);
+	/* The file that others will be cloned from must be readable.  */
+	fd = my_openat(dirfd, first_relpath,
+		       O_EXCL | O_CREAT | O_NOFOLLOW |
+		       ((ctx->cloning_blob && ctx->num_open_fds == 0) ?
+				O_RDWR : O_WRONLY), 0644);
 	if (fd < 0) {
-		if (errno == EEXIST && !unlink(first_path))
+		if (errno == EEXIST && !my_unlinkat(dirfd, first_relpath))
 			goto retry_create;
 		ERROR_WITH_ERRNO("Can't create regular file \"%s\"", first_path);
 		return WIMLIB_ERR_OPEN;
@@ -722,11 +956,14 @@ retry_create:
 	} else {
 		ctx->is_sparse_file[ctx->num_open_fds] = false;
 #ifdef HAVE_POSIX_FALLOCATE
-		posix_fallocate(fd, 0, blob->size);
+		/* Don't preallocate space for files that will be clones.  */
+		if (!ctx->cloning_blob || ctx->num_open_fds == 0)
+			posix_fallocate(fd, 0, blob->size);
 #endif
 	}
 	filedes_init(&ctx->open_fds[ctx->num_open_fds++], fd);
-	return unix_create_hardlinks(inode, first_dentry, first_path, ctx);
+	return unix_create_hardlinks(inode, first_dentry, dirfd, first_relpath,
+				     first_path, ctx);
 }
 
 /* Called when starting to read a blob for extraction  */
@@ -736,11 +973,19 @@ unix_begin_extract_blob(struct blob_descriptor *blob, void *_ctx)
 	struct unix_apply_ctx *ctx = _ctx;
 	const struct blob_extraction_target *targets = blob_extraction_targets(blob);
 
+#ifdef FICLONE
+	ctx->cloning_blob = (blob->out_refcnt > 1 && !ctx->clone_unsupported);
+#endif
 	for (u32 i = 0; i < blob->out_refcnt; i++) {
-		int ret = unix_begin_extract_blob_instance(blob,
-							   targets[i].inode,
-							   targets[i].stream,
-							   ctx);
+		int ret;
+
+		/* Files that will be clones are created later.  */
+		if (ctx->cloning_blob && ctx->num_open_fds != 0 &&
+		    targets[i].stream->stream_type != STREAM_TYPE_REPARSE_POINT)
+			continue;
+
+		ret = unix_begin_extract_blob_instance(blob, targets[i].inode,
+						       targets[i].stream, ctx);
 		if (ret) {
 			ctx->reparse_ptr = NULL;
 			unix_cleanup_open_fds(ctx, 0);
@@ -789,6 +1034,113 @@ err:
 	return ret;
 }
 
+#ifdef FICLONE
+/* Return true if FICLONE failed with @err just because cloning isn't possible
+ * on the target filesystem, as opposed to an actual I/O error.  */
+static bool
+clone_unsupported(int err)
+{
+	return err == EOPNOTSUPP || err == ENOTTY || err == EXDEV ||
+	       err == EINVAL || err == ENOSYS || err == EPERM;
+}
+
+/* Copy all data of @blob from the first open file to @dst.  */
+static int
+unix_copy_from_first_file(const struct blob_descriptor *blob,
+			  struct filedes *dst, struct unix_apply_ctx *ctx)
+{
+	struct filedes *src = &ctx->open_fds[0];
+	u64 offset = 0;
+	u8 buf[BUFFER_SIZE];
+	int ret;
+
+	ret = copy_data_in_kernel(src, &offset, blob->size, dst);
+	while (!ret && offset != blob->size) {
+		size_t n = min(blob->size - offset, sizeof(buf));
+
+		ret = full_pread(src, buf, n, offset);
+		if (!ret)
+			ret = full_pwrite(dst, buf, n, offset);
+		offset += n;
+	}
+	return ret;
+}
+
+/*
+ * Create each regular file that @blob is being extracted to, other than the
+ * first, as a clone of the first, which is the only one open and has already
+ * had the blob's data written to it.  This shares the data extents between the
+ * files, so the data is stored on the filesystem only once.  The files are
+ * created, cloned, and closed one at a time, so this works with any number of
+ * files.  If the filesystem turns out not to support cloning, fall back to
+ * copying the data, and don't try cloning again for later blobs.
+ *
+ * On failure, the file being created is left open for the caller to clean up.
+ */
+static int
+unix_clone_first_file(const struct blob_descriptor *blob,
+		      struct unix_apply_ctx *ctx)
+{
+	const struct blob_extraction_target *targets = blob_extraction_targets(blob);
+	struct filedes *src = &ctx->open_fds[0];
+	struct filedes *dst = &ctx->open_fds[1];
+	bool first = true;
+	int ret;
+
+	/* The size must be final before cloning.  */
+	if (ctx->is_sparse_file[0] && ftruncate(src->fd, blob->size)) {
+		ERROR_WITH_ERRNO("Error extending file to final size");
+		return WIMLIB_ERR_WRITE;
+	}
+
+	for (u32 i = 0; i < blob->out_refcnt; i++) {
+		struct wim_inode *inode = targets[i].inode;
+
+		if (targets[i].stream->stream_type == STREAM_TYPE_REPARSE_POINT)
+			continue;
+		if (first) {
+			first = false;
+			continue;
+		}
+
+		ret = unix_begin_extract_blob_instance(blob, inode,
+						       targets[i].stream, ctx);
+		if (ret)
+			return ret;
+
+		if (ctx->clone_unsupported ||
+		    ioctl(dst->fd, FICLONE, src->fd) != 0)
+		{
+			if (!ctx->clone_unsupported) {
+				if (!clone_unsupported(errno)) {
+					ERROR_WITH_ERRNO("Error cloning file data");
+					return WIMLIB_ERR_WRITE;
+				}
+				ctx->clone_unsupported = true;
+				ctx->common.unlimited_targets = false;
+			}
+			if (unix_copy_from_first_file(blob, dst, ctx)) {
+				ERROR_WITH_ERRNO("Error writing data to filesystem");
+				return WIMLIB_ERR_WRITE;
+			}
+		}
+
+		ret = unix_set_metadata(dst->fd, inode, AT_FDCWD, NULL, NULL,
+					ctx);
+		if (ret)
+			return ret;
+
+		ctx->num_open_fds--;
+		if (filedes_close(dst)) {
+			ERROR_WITH_ERRNO("Error closing \"%s\"",
+					 unix_build_inode_extraction_path(inode, ctx));
+			return WIMLIB_ERR_WRITE;
+		}
+	}
+	return 0;
+}
+#endif /* FICLONE */
+
 /* Called when a blob has been fully read for extraction  */
 static int
 unix_end_extract_blob(struct blob_descriptor *blob, int status, void *_ctx)
@@ -805,6 +1157,16 @@ unix_end_extract_blob(struct blob_descriptor *blob, int status, void *_ctx)
 		return status;
 	}
 
+#ifdef FICLONE
+	if (ctx->cloning_blob && ctx->num_open_fds != 0) {
+		ret = unix_clone_first_file(blob, ctx);
+		if (ret) {
+			unix_cleanup_open_fds(ctx, 0);
+			return ret;
+		}
+	}
+#endif
+
 	j = 0;
 	ret = 0;
 	for (u32 i = 0; i < blob->out_refcnt; i++) {
@@ -814,17 +1176,26 @@ unix_end_extract_blob(struct blob_descriptor *blob, int status, void *_ctx)
 			/* We finally have the symlink data, so we can create
 			 * the symlink.  */
 			const char *path;
-
-			path = unix_build_inode_extraction_path(inode, ctx);
-			ret = unix_create_symlink(inode, path, blob->size, ctx);
+			const char *relpath;
+			int dirfd;
+
+			path = unix_build_extraction_path_at(
+					inode_first_extraction_dentry(inode),
+					&dirfd, &relpath, ctx);
+			ret = unix_create_symlink(inode, dirfd, relpath,
+						  blob->size, ctx);
 			if (ret) {
 				ERROR_WITH_ERRNO("Can't create symbolic link "
 						 "\"%s\"", path);
 				break;
 			}
-			ret = unix_set_metadata(-1, inode, path, ctx);
+			ret = unix_set_metadata(-1, inode, dirfd, relpath, path,
+						ctx);
 			if (ret)
 				break;
+		} else if (ctx->cloning_blob && j != 0) {
+			/* Already created as a clone  */
+			continue;
 		} else {
 			struct filedes *fd = &ctx->open_fds[j];
 
@@ -837,7 +1208,8 @@ unix_end_extract_blob(struct blob_descriptor *blob, int status, void *_ctx)
 			}
 
 			/* Set metadata on regular file just before closing.  */
-			ret = unix_set_metadata(fd->fd, inode, NULL, ctx);
+			ret = unix_set_metadata(fd->fd, inode, AT_FDCWD, NULL,
+						NULL, ctx);
 			if (ret)
 				break;
 
@@ -854,21 +1226,460 @@ unix_end_extract_blob(struct blob_descriptor *blob, int status, void *_ctx)
 	return ret;
 }
 
+/* Allocate the path buffers of @ctx, with the target directory pre-filled.  */
 static int
-unix_set_dir_metadata(struct list_head *dentry_list, struct unix_apply_ctx *ctx)
+unix_alloc_pathbufs(struct unix_apply_ctx *ctx, size_t path_max)
 {
-	const struct wim_dentry *dentry;
+	for (unsigned i = 0; i < NUM_PATHBUFS; i++) {
+		ctx->pathbufs[i] = MALLOC(path_max);
+		if (!ctx->pathbufs[i])
+			return WIMLIB_ERR_NOMEM;
+		/* Pre-fill the target in each path buffer.  We'll just append
+		 * the rest of the paths after this.  */
+		memcpy(ctx->pathbufs[i],
+		       ctx->common.target, ctx->common.target_nchars);
+	}
+	return 0;
+}
+
+static void
+unix_free_worker_ctx(struct unix_apply_ctx *wctx)
+{
+	if (!wctx)
+		return;
+	unix_close_dirfds(wctx);
+	for (unsigned i = 0; i < NUM_PATHBUFS; i++)
+		FREE(wctx->pathbufs[i]);
+	FREE(wctx);
+}
+
+/* Create a context for a thread that extracts files concurrently with other
+ * threads.  It gets its own path buffers, open files, directory file
+ * descriptors, and reparse data buffer, and shares everything else with @ctx
+ * read-only.  */
+static struct unix_apply_ctx *
+unix_new_worker_ctx(const struct unix_apply_ctx *ctx, size_t path_max)
+{
+	struct unix_apply_ctx *wctx;
+
+	wctx = MALLOC(sizeof(*wctx));
+	if (!wctx)
+		return NULL;
+	memcpy(wctx, ctx, sizeof(*wctx));
+	memset(wctx->pathbufs, 0, sizeof(wctx->pathbufs));
+	wctx->which_pathbuf = 0;
+	wctx->num_open_fds = 0;
+	wctx->any_sparse_files = false;
+	wctx->cloning_blob = false;
+	wctx->reparse_ptr = NULL;
+	wctx->target_dirfd = -1;
+	wctx->num_cached_dirfds = 0;
+	if (unix_alloc_pathbufs(wctx, path_max)) {
+		unix_free_worker_ctx(wctx);
+		return NULL;
+	}
+	return wctx;
+}
+
+/*
+ * Creating directories and empty files, and setting the metadata of
+ * directories, consists of one or a few system calls per file.  With many
+ * files, or with a network filesystem, this can take a long time, so it's done
+ * by several threads.  A directory can only be created after its parent and
+ * should only have its metadata set after its children, so the directories are
+ * processed one depth level at a time; the directories of each level are
+ * independent of each other.  Empty files are created after all directories
+ * exist, so they are independent as well, including their hard links.
+ *
+ * The calling thread takes part in processing each set of dentries, and it
+ * also sends all the progress messages.
+ */
+
+#define UNIX_DENTRY_BATCH_SIZE 32
+
+typedef int (*unix_dentry_func_t)(const struct wim_dentry *dentry,
+				  struct unix_apply_ctx *ctx);
+
+struct unix_dentry_workers {
+	struct mutex lock;
+	struct condvar done_cond;
+	struct thread_pool_job job;
+	unsigned num_ctxs;
+
+	/* The worker contexts not currently in use by a task on the thread
+	 * pool  */
+	struct unix_apply_ctx **free_ctxs;
+	unsigned num_free_ctxs;
+
+	/* The current set of dentries  */
+	unix_dentry_func_t func;
+	const struct wim_dentry * const *dentries;
+	size_t num_dentries;
+
+	/* Number of dentries claimed and finished, and the first error  */
+	size_t next_dentry;
+	size_t num_done;
+	int status;
+};
+
+static void
+unix_dentry_job_func(void *_workers)
+{
+	struct unix_dentry_workers *workers = _workers;
+	struct unix_apply_ctx *ctx;
+	size_t start, count;
 	int ret;
 
-	list_for_each_entry_reverse(dentry, dentry_list, d_extraction_list_node) {
+	mutex_lock(&workers->lock);
+	if (workers->status || workers->next_dentry >= workers->num_dentries)
+		goto out_unlock;
+	wimlib_assert(workers->num_free_ctxs != 0);
+	ctx = workers->free_ctxs[--workers->num_free_ctxs];
+	do {
+		start = workers->next_dentry;
+		count = min(UNIX_DENTRY_BATCH_SIZE,
+			    workers->num_dentries - start);
+		workers->next_dentry += count;
+		mutex_unlock(&workers->lock);
+
+		ret = 0;
+		for (size_t i = start; i < start + count && !ret; i++)
+			ret = (*workers->func)(workers->dentries[i], ctx);
+
+		mutex_lock(&workers->lock);
+		if (ret && !workers->status)
+			workers->status = ret;
+		workers->num_done += count;
+		condvar_broadcast(&workers->done_cond);
+	} while (!workers->status &&
+		 workers->next_dentry < workers->num_dentries);
+	workers->free_ctxs[workers->num_free_ctxs++] = ctx;
+out_unlock:
+	mutex_unlock(&workers->lock);
+}
+
+/* Prepare to have up to @num_threads threads of the thread pool help process
+ * dentries, using the contexts in @worker_ctxs.  Returns NULL if that isn't
+ * possible.  */
+static struct unix_dentry_workers *
+unix_start_dentry_workers(struct unix_apply_ctx * const worker_ctxs[],
+			  unsigned num_threads)
+{
+	struct unix_dentry_workers *workers;
+
+	if (num_threads == 0)
+		return NULL;
+	num_threads = thread_pool_reserve(num_threads);
+	if (num_threads == 0)
+		return NULL;
+	workers = CALLOC(1, sizeof(*workers));
+	if (!workers)
+		return NULL;
+	workers->free_ctxs = MALLOC(num_threads *
+				    sizeof(workers->free_ctxs[0]));
+	if (!workers->free_ctxs)
+		goto err_free_workers;
+	if (!mutex_init(&workers->lock))
+		goto err_free_ctxs;
+	if (!condvar_init(&workers->done_cond))
+		goto err_destroy_lock;
+	if (!thread_pool_job_init(&workers->job, unix_dentry_job_func,
+				  workers, num_threads))
+		goto err_destroy_done_cond;
+
+	for (unsigned i = 0; i < num_threads; i++)
+		workers->free_ctxs[i] = worker_ctxs[i];
+	workers->num_ctxs = num_threads;
+	workers->num_free_ctxs = num_threads;
+	return workers;
+
+err_destroy_done_cond:
+	condvar_destroy(&workers->done_cond);
+err_destroy_lock:
+	mutex_destroy(&workers->lock);
+err_free_ctxs:
+	FREE(workers->free_ctxs);
+err_free_workers:
+	FREE(workers);
+	return NULL;
+}
+
+static void
+unix_stop_dentry_workers(struct unix_dentry_workers *workers)
+{
+	if (!workers)
+		return;
+	thread_pool_job_destroy(&workers->job);
+	condvar_destroy(&workers->done_cond);
+	mutex_destroy(&workers->lock);
+	FREE(workers->free_ctxs);
+	FREE(workers);
+}
+
+/* Call @func on each of the @num_dentries dentries in @dentries, in no
+ * particular order, then call @report once for each of them.  */
+static int
+unix_process_dentries(const struct wim_dentry * const *dentries,
+		      size_t num_dentries, unix_dentry_func_t func,
+		      int (*report)(struct apply_ctx *),
+		      struct unix_dentry_workers *workers,
+		      struct unix_apply_ctx *ctx)
+{
+	size_t num_reported = 0;
+	size_t start, count, i;
+	int ret;
+
+	if (!workers || num_dentries < 2 * UNIX_DENTRY_BATCH_SIZE) {
+		for (i = 0; i < num_dentries; i++) {
+			ret = (*func)(dentries[i], ctx);
+			if (ret)
+				return ret;
+			ret = (*report)(&ctx->common);
+			if (ret)
+				return ret;
+		}
+		return 0;
+	}
+
+	mutex_lock(&workers->lock);
+	workers->func = func;
+	workers->dentries = dentries;
+	workers->num_dentries = num_dentries;
+	workers->next_dentry = 0;
+	workers->num_done = 0;
+	workers->status = 0;
+	mutex_unlock(&workers->lock);
+
+	for (unsigned j = 0; j < workers->num_ctxs; j++)
+		thread_pool_job_kick(&workers->job);
+
+	mutex_lock(&workers->lock);
+	for (;;) {
+		if (!workers->status &&
+		    workers->next_dentry < workers->num_dentries) {
+			start = workers->next_dentry;
+			count = min(UNIX_DENTRY_BATCH_SIZE,
+				    workers->num_dentries - start);
+			workers->next_dentry += count;
+			mutex_unlock(&workers->lock);
+
+			ret = 0;
+			for (i = start; i < start + count && !ret; i++)
+				ret = (*func)(dentries[i], ctx);
+
+			mutex_lock(&workers->lock);
+			if (ret && !workers->status)
+				workers->status = ret;
+			workers->num_done += count;
+		} else if (workers->num_done < workers->next_dentry) {
+			condvar_wait(&workers->done_cond, &workers->lock);
+		} else {
+			break;
+		}
+
+		/* Report the files that have been finished so far.  */
+		count = workers->num_done - num_reported;
+		if (count && !workers->status) {
+			mutex_unlock(&workers->lock);
+			ret = 0;
+			for (i = 0; i < count && !ret; i++)
+				ret = (*report)(&ctx->common);
+			mutex_lock(&workers->lock);
+			if (ret && !workers->status)
+				workers->status = ret;
+			num_reported += count;
+		}
+	}
+	ret = workers->status;
+	workers->num_dentries = 0;
+	workers->next_dentry = 0;
+	mutex_unlock(&workers->lock);
+	return ret;
+}
+
+/* Returns the number of ancestors of @dentry that are being extracted.  */
+static unsigned
+unix_dentry_depth(const struct wim_dentry *dentry)
+{
+	unsigned depth = 0;
+
+	while (!dentry_is_root(dentry)) {
+		dentry = dentry->d_parent;
+		if (!will_extract_dentry(dentry))
+			break;
+		depth++;
+	}
+	return depth;
+}
+
+/* The dentries that are extracted as directories, sorted by depth  */
+struct unix_dir_levels {
+	const struct wim_dentry **dirs;
+
+	/* Level i consists of the directories with indices in the range
+	 * [level_starts[i], level_starts[i + 1]).  */
+	size_t *level_starts;
+	unsigned num_levels;
+};
+
+static int
+unix_sort_dirs_by_depth(const struct list_head *dentry_list, u64 dir_count,
+			struct unix_dir_levels *levels)
+{
+	const struct wim_dentry *dentry;
+	unsigned *depths;
+	unsigned max_depth = 0;
+	size_t i;
+
+	levels->dirs = MALLOC(dir_count * sizeof(levels->dirs[0]));
+	depths = MALLOC(dir_count * sizeof(depths[0]));
+	if (!levels->dirs || !depths)
+		goto err;
+
+	i = 0;
+	list_for_each_entry(dentry, dentry_list, d_extraction_list_node) {
 		if (should_extract_as_directory(dentry->d_inode)) {
-			ret = unix_set_metadata(-1, dentry->d_inode, NULL, ctx);
+			depths[i] = unix_dentry_depth(dentry);
+			max_depth = max(max_depth, depths[i]);
+			i++;
+		}
+	}
+
+	levels->num_levels = max_depth + 1;
+	levels->level_starts = CALLOC(levels->num_levels + 1,
+				      sizeof(levels->level_starts[0]));
+	if (!levels->level_starts)
+		goto err;
+	for (i = 0; i < dir_count; i++)
+		levels->level_starts[depths[i] + 1]++;
+	for (unsigned l = 0; l < levels->num_levels; l++)
+		levels->level_starts[l + 1] += levels->level_starts[l];
+
+	/* Use level_starts[depth] as the next index in each level while
+	 * filling in the directories, then shift it back.  */
+	i = 0;
+	list_for_each_entry(dentry, dentry_list, d_extraction_list_node) {
+		if (should_extract_as_directory(dentry->d_inode))
+			levels->dirs[levels->level_starts[depths[i++]]++] = dentry;
+	}
+	for (unsigned l = levels->num_levels; l > 0; l--)
+		levels->level_starts[l] = levels->level_starts[l - 1];
+	levels->level_starts[0] = 0;
+	FREE(depths);
+	return 0;
+
+err:
+	FREE(depths);
+	FREE(levels->dirs);
+	return WIMLIB_ERR_NOMEM;
+}
+
+static void
+unix_free_dir_levels(struct unix_dir_levels *levels)
+{
+	FREE(levels->dirs);
+	FREE(levels->level_starts);
+}
+
+static int
+unix_create_dirs_and_empty_files(const struct list_head *dentry_list,
+				 const struct unix_dir_levels *levels,
+				 u64 empty_file_count,
+				 struct unix_dentry_workers *workers,
+				 struct unix_apply_ctx *ctx)
+{
+	const struct wim_dentry *dentry;
+	const struct wim_dentry **empty_files;
+	size_t i;
+	int ret;
+
+	if (!levels) {
+		list_for_each_entry(dentry, dentry_list, d_extraction_list_node) {
+			if (!should_extract_as_directory(dentry->d_inode))
+				continue;
+			ret = unix_create_directory(dentry, ctx);
+			if (!ret)
+				ret = report_file_created(&ctx->common);
+			if (ret)
+				return ret;
+		}
+		list_for_each_entry(dentry, dentry_list, d_extraction_list_node) {
+			if (!unix_is_empty_file_to_extract(dentry))
+				continue;
+			ret = unix_extract_empty_file(dentry, ctx);
+			if (!ret)
+				ret = report_file_created(&ctx->common);
+			if (ret)
+				return ret;
+		}
+		return 0;
+	}
+
+	for (unsigned l = 0; l < levels->num_levels; l++) {
+		ret = unix_process_dentries(&levels->dirs[levels->level_starts[l]],
+					    levels->level_starts[l + 1] -
+						levels->level_starts[l],
+					    unix_create_directory,
+					    report_file_created, workers, ctx);
+		if (ret)
+			return ret;
+	}
+
+	empty_files = MALLOC(empty_file_count * sizeof(empty_files[0]));
+	if (!empty_files)
+		return WIMLIB_ERR_NOMEM;
+	i = 0;
+	list_for_each_entry(dentry, dentry_list, d_extraction_list_node)
+		if (unix_is_empty_file_to_extract(dentry))
+			empty_files[i++] = dentry;
+	ret = unix_process_dentries(empty_files, i, unix_extract_empty_file,
+				    report_file_created, workers, ctx);
+	FREE(empty_files);
+	return ret;
+}
+
+static int
+unix_set_dir_metadata_func(const struct wim_dentry *dentry,
+			   struct unix_apply_ctx *ctx)
+{
+	return unix_set_metadata(-1, dentry->d_inode, AT_FDCWD, NULL, NULL,
+				 ctx);
+}
+
+static int
+unix_set_dir_metadata(struct list_head *dentry_list,
+		      const struct unix_dir_levels *levels,
+		      struct unix_dentry_workers *workers,
+		      struct unix_apply_ctx *ctx)
+{
+	const struct wim_dentry *dentry;
+	int ret;
+
+	if (!levels) {
+		list_for_each_entry_reverse(dentry, dentry_list,
+					    d_extraction_list_node) {
+			if (!should_extract_as_directory(dentry->d_inode))
+				continue;
+			ret = unix_set_metadata(-1, dentry->d_inode, AT_FDCWD,
+						NULL, NULL, ctx);
 			if (ret)
 				return ret;
 			ret = report_file_metadata_applied(&ctx->common);
 			if (ret)
 				return ret;
 		}
+		return 0;
+	}
+
+	for (unsigned l = levels->num_levels; l > 0; l--) {
+		ret = unix_process_dentries(&levels->dirs[levels->level_starts[l - 1]],
+					    levels->level_starts[l] -
+						levels->level_starts[l - 1],
+					    unix_set_dir_metadata_func,
+					    report_file_metadata_applied,
+					    workers, ctx);
+		if (ret)
+			return ret;
 	}
 	return 0;
 }
@@ -881,21 +1692,51 @@ unix_extract(struct list_head *dentry_list, struct apply_ctx *_ctx)
 	size_t path_max;
 	u64 dir_count;
 	u64 empty_file_count;
+	struct unix_apply_ctx **worker_ctxs = NULL;
+	unsigned num_workers;
+	struct unix_dentry_workers *dentry_workers = NULL;
+	struct unix_dir_levels _levels, *levels = NULL;
+
+	ctx->target_dirfd = -1;
 
 	/* Compute the maximum path length that will be needed, then allocate
 	 * some path buffers.  */
 	path_max = unix_compute_path_max(dentry_list, ctx);
 
-	for (unsigned i = 0; i < NUM_PATHBUFS; i++) {
-		ctx->pathbufs[i] = MALLOC(path_max);
-		if (!ctx->pathbufs[i]) {
-			ret = WIMLIB_ERR_NOMEM;
-			goto out;
+	ret = unix_alloc_pathbufs(ctx, path_max);
+	if (ret)
+		goto out;
+
+	unix_count_dentries(dentry_list, &dir_count, &empty_file_count);
+
+	/* If multiple threads can be used, each one needs its own context.  If
+	 * not all the contexts can be allocated, just use fewer threads.  The
+	 * calling thread helps the worker threads with creating directories and
+	 * empty files and with setting directory metadata, but not with
+	 * extracting blobs.  */
+	num_workers = min(get_num_extraction_threads(&ctx->common),
+			  UNIX_MAX_WORKERS);
+	if (num_workers > 1) {
+		worker_ctxs = CALLOC(num_workers, sizeof(worker_ctxs[0]));
+		if (!worker_ctxs)
+			num_workers = 1;
+	}
+	for (unsigned i = 0; worker_ctxs && i < num_workers; i++) {
+		worker_ctxs[i] = unix_new_worker_ctx(ctx, path_max);
+		if (!worker_ctxs[i]) {
+			num_workers = i;
+			break;
 		}
-		/* Pre-fill the target in each path buffer.  We'll just append
-		 * the rest of the paths after this.  */
-		memcpy(ctx->pathbufs[i],
-		       ctx->common.target, ctx->common.target_nchars);
+	}
+	if (num_workers > 1 && dir_count != 0 &&
+	    !unix_sort_dirs_by_depth(dentry_list, dir_count, &_levels))
+	{
+		dentry_workers = unix_start_dentry_workers(worker_ctxs,
+							   num_workers - 1);
+		if (dentry_workers)
+			levels = &_levels;
+		else
+			unix_free_dir_levels(&_levels);
 	}
 
 	/* Extract directories and empty regular files.  Directories are needed
@@ -903,13 +1744,13 @@ unix_extract(struct list_head *dentry_list, struct apply_ctx *_ctx)
 	 * exist.  Empty files are needed because they don't have
 	 * representatives in the blob list.  */
 
-	unix_count_dentries(dentry_list, &dir_count, &empty_file_count);
-
 	ret = start_file_structure_phase(&ctx->common, dir_count + empty_file_count);
 	if (ret)
 		goto out;
 
-	ret = unix_create_dirs_and_empty_files(dentry_list, ctx);
+	ret = unix_create_dirs_and_empty_files(dentry_list, levels,
+					       empty_file_count,
+					       dentry_workers, ctx);
 	if (ret)
 		goto out;
 
@@ -928,27 +1769,43 @@ unix_extract(struct list_head *dentry_list, struct apply_ctx *_ctx)
 		}
 		ctx->target_abspath_nchars = strlen(ctx->target_abspath);
 	}
+	for (unsigned i = 0; i < num_workers && worker_ctxs; i++) {
+		worker_ctxs[i]->target_abspath = ctx->target_abspath;
+		worker_ctxs[i]->target_abspath_nchars = ctx->target_abspath_nchars;
+	}
 
-	/* Extract nonempty regular files and symbolic links.  */
+	/* Extract nonempty regular files and symbolic links.  The workers'
+	 * directory file descriptors are closed first, since blobs with too
+	 * many targets for a worker are extracted by this thread while the
+	 * workers are idle.  */
+	for (unsigned i = 0; i < num_workers && worker_ctxs; i++)
+		unix_close_dirfds(worker_ctxs[i]);
 
+#ifdef FICLONE
+	/* Blobs with many targets can be cloned to them one at a time.  */
+	ctx->common.unlimited_targets = !ctx->clone_unsupported;
+#endif
 	struct read_blob_callbacks cbs = {
 		.begin_blob	= unix_begin_extract_blob,
 		.continue_blob	= unix_extract_chunk,
 		.end_blob	= unix_end_extract_blob,
 		.ctx		= ctx,
 	};
-	ret = extract_blob_list(&ctx->common, &cbs);
+	ret = extract_blob_list_parallel(&ctx->common, &cbs,
+					 (void * const *)worker_ctxs,
+					 num_workers,
+					 MAX_OPEN_FILES / max(num_workers, 1) -
+					 UNIX_WORKER_DIRFDS);
 	if (ret)
 		goto out;
 
-
 	/* Set directory metadata.  We do this last so that we get the right
 	 * directory timestamps.  */
 	ret = start_file_metadata_phase(&ctx->common, dir_count);
 	if (ret)
 		goto out;
 
-	ret = unix_set_dir_metadata(dentry_list, ctx);
+	ret = unix_set_dir_metadata(dentry_list, levels, dentry_workers, ctx);
 	if (ret)
 		goto out;
 
@@ -956,11 +1813,23 @@ unix_extract(struct list_head *dentry_list, struct apply_ctx *_ctx)
 	if (ret)
 		goto out;
 
+	for (unsigned i = 0; i < num_workers && worker_ctxs; i++)
+		ctx->num_special_files_ignored +=
+			worker_ctxs[i]->num_special_files_ignored;
 	if (ctx->num_special_files_ignored) {
 		WARNING("%lu special files were not extracted due to EPERM!",
 			ctx->num_special_files_ignored);
 	}
 out:
+	unix_stop_dentry_workers(dentry_workers);
+	if (levels)
+		unix_free_dir_levels(levels);
+	if (worker_ctxs) {
+		for (unsigned i = 0; i < num_workers; i++)
+			unix_free_worker_ctx(worker_ctxs[i]);
+		FREE(worker_ctxs);
+	}
+	unix_close_dirfds(ctx);
 	for (unsigned i = 0; i < NUM_PATHBUFS; i++)
 		FREE(ctx->pathbufs[i]);
 	FREE(ctx->target_abspath);
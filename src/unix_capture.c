@@ -40,6 +40,7 @@
 #include "wimlib/error.h"
 #include "wimlib/reparse.h"
 #include "wimlib/scan.h"
+#include "wimlib/threads.h"
 #include "wimlib/timestamp.h"
 #include "wimlib/unix_data.h"
 #include "wimlib/xattr.h"
@@ -319,15 +320,458 @@ err_nomem:
 	return WIMLIB_ERR_NOMEM;
 }
 
+/*
+ * On filesystems where each readdir() or fstatat() has a high latency, such as
+ * network filesystems, scanning a large directory tree one system call at a
+ * time is slow.  To hide the latency, worker threads list the directories and
+ * stat their entries ahead of the thread that builds the dentry tree, in the
+ * same depth-first order.
+ *
+ * The dentry tree itself is still built by the calling thread, in the same
+ * order as without prefetching, so exclusions, hard link detection, progress
+ * messages, error handling, and the order of the resulting dentries and blobs
+ * are all unchanged.  The workers just save it the readdir() and per-file
+ * fstatat() calls.  If the prefetched information for a directory is missing
+ * or incomplete, the calling thread scans that directory itself as usual.
+ *
+ * Each directory to be prefetched is represented by a 'struct scan_dir'.  When
+ * a directory has been listed, a new scan_dir is queued for each of its
+ * subdirectories.  The queue is LIFO, with the subdirectories pushed in
+ * reverse order, so that the workers follow the same depth-first order as the
+ * calling thread.  If the calling thread needs a directory that no worker has
+ * started on yet, it lists the directory itself rather than waiting.
+ *
+ * The calling thread releases each scan_dir when it's done with the
+ * corresponding directory, which also releases any subdirectories it didn't
+ * descend into, e.g. because they were excluded.  To bound the memory usage,
+ * the workers stop when too many directory entries are buffered.
+ */
+
+/* The maximum number of workers, which run as tasks on the thread pool.  The
+ * workers mostly wait for I/O, so this doesn't depend on the number of
+ * processors.  */
+#define SCAN_PREFETCH_NUM_THREADS	8
+
+/* The maximum number of prefetched directory entries that may be buffered  */
+#define SCAN_PREFETCH_MAX_ENTRIES	65536
+
+struct scan_prefetcher;
+
+struct scan_dir_entry {
+	const char *name;
+	size_t name_len;
+
+	/* 0 if @stbuf is valid, otherwise the errno from fstatat()  */
+	int stat_errno;
+	struct stat stbuf;
+
+	/* If this entry is a directory, its scan_dir, or NULL if none  */
+	struct scan_dir *subdir;
+};
+
+enum scan_dir_state {
+	SCAN_DIR_QUEUED,
+	SCAN_DIR_LISTING,
+	SCAN_DIR_LISTED,
+};
+
+struct scan_dir {
+	struct scan_prefetcher *pf;
+	struct list_head queue_node;
+	enum scan_dir_state state;
+
+	/* Set if the dentry tree builder released this directory while it was
+	 * being listed; the lister then frees it.  */
+	bool abandoned;
+
+	/* Set if the directory couldn't be listed  */
+	bool failed;
+
+	char *path;
+	struct scan_dir_entry *entries;
+	size_t num_entries;
+	char *names;
+};
+
+struct scan_prefetcher {
+	struct mutex lock;
+	struct condvar listing_done_cond;
+	struct list_head queue;
+	size_t num_buffered_entries;
+	bool terminating;
+	int stat_flags;
+	struct thread_pool_job job;
+};
+
+static struct scan_dir *
+new_scan_dir(struct scan_prefetcher *pf, const char *path, size_t path_len)
+{
+	struct scan_dir *d = CALLOC(1, sizeof(*d));
+
+	if (!d)
+		return NULL;
+	d->path = MALLOC(path_len + 1);
+	if (!d->path) {
+		FREE(d);
+		return NULL;
+	}
+	memcpy(d->path, path, path_len);
+	d->path[path_len] = '\0';
+	d->pf = pf;
+	d->state = SCAN_DIR_QUEUED;
+	return d;
+}
+
+static void
+free_scan_dir(struct scan_dir *d)
+{
+	FREE(d->path);
+	FREE(d->entries);
+	FREE(d->names);
+	FREE(d);
+}
+
+/*
+ * List the directory @d and stat its entries, without holding the lock.  A new
+ * scan_dir is created for each subdirectory and added to @children, in order.
+ * On failure, @d->failed is set and nothing is added to @children.
+ */
+static void
+list_scan_dir(struct scan_dir *d, int stat_flags, struct list_head *children)
+{
+	const size_t path_len = strlen(d->path);
+	size_t entries_alloc = 0;
+	size_t names_size = 0;
+	size_t names_alloc = 0;
+	char *child_path = NULL;
+	size_t child_path_alloc = 0;
+	DIR *dir;
+	struct scan_dir *child, *tmp;
+
+	dir = opendir(d->path);
+	if (!dir)
+		goto err;
+
+	for (;;) {
+		struct dirent *ent;
+		struct scan_dir_entry *e;
+		size_t name_len;
+
+		errno = 0;
+		ent = readdir(dir);
+		if (!ent) {
+			if (errno)
+				goto err_close;
+			break;
+		}
+		name_len = strlen(ent->d_name);
+		if (ent->d_name[0] == '.' &&
+		    (name_len == 1 || (name_len == 2 && ent->d_name[1] == '.')))
+			continue;
+
+		if (d->num_entries == entries_alloc) {
+			struct scan_dir_entry *p;
+
+			entries_alloc = max(2 * entries_alloc, 16);
+			p = REALLOC(d->entries, entries_alloc * sizeof(*p));
+			if (!p)
+				goto err_close;
+			d->entries = p;
+		}
+		if (names_size + name_len + 1 > names_alloc) {
+			char *p;
+
+			names_alloc = max(2 * names_alloc,
+					  names_size + name_len + 1 + 1024);
+			p = REALLOC(d->names, names_alloc);
+			if (!p)
+				goto err_close;
+			d->names = p;
+		}
+		if (path_len + 1 + name_len + 1 > child_path_alloc) {
+			char *p;
+
+			child_path_alloc = path_len + 1 + name_len + 1 + 256;
+			p = REALLOC(child_path, child_path_alloc);
+			if (!p)
+				goto err_close;
+			child_path = p;
+		}
+		memcpy(child_path, d->path, path_len);
+		child_path[path_len] = '/';
+		memcpy(&child_path[path_len + 1], ent->d_name, name_len + 1);
+
+		e = &d->entries[d->num_entries++];
+		/* For now, store the offset of the name; it's converted to a
+		 * pointer once @d->names can no longer move.  */
+		e->name = (const char *)(uintptr_t)names_size;
+		e->name_len = name_len;
+		memcpy(&d->names[names_size], ent->d_name, name_len + 1);
+		names_size += name_len + 1;
+
+		e->subdir = NULL;
+		e->stat_errno = 0;
+		if (my_fstatat(child_path, dirfd(dir), ent->d_name,
+			       &e->stbuf, stat_flags) != 0)
+		{
+			e->stat_errno = errno ? errno : EIO;
+		} else if (S_ISDIR(e->stbuf.st_mode)) {
+			/* If this fails, the subdirectory just won't be
+			 * prefetched.  */
+			e->subdir = new_scan_dir(d->pf, child_path,
+						 path_len + 1 + name_len);
+			if (e->subdir)
+				list_add_tail(&e->subdir->queue_node, children);
+		}
+	}
+	closedir(dir);
+	FREE(child_path);
+
+	for (size_t i = 0; i < d->num_entries; i++)
+		d->entries[i].name = d->names + (uintptr_t)d->entries[i].name;
+	return;
+
+err_close:
+	closedir(dir);
+err:
+	FREE(child_path);
+	list_for_each_entry_safe(child, tmp, children, queue_node)
+		free_scan_dir(child);
+	INIT_LIST_HEAD(children);
+	FREE(d->entries);
+	d->entries = NULL;
+	FREE(d->names);
+	d->names = NULL;
+	d->num_entries = 0;
+	d->failed = true;
+}
+
+/* Publish the results of list_scan_dir().  The lock must be held.  */
+static void
+finish_scan_dir_listing(struct scan_prefetcher *pf, struct scan_dir *d,
+			struct list_head *children)
+{
+	struct scan_dir *child, *tmp;
+
+	if (d->abandoned) {
+		list_for_each_entry_safe(child, tmp, children, queue_node)
+			free_scan_dir(child);
+		free_scan_dir(d);
+		return;
+	}
+	d->state = SCAN_DIR_LISTED;
+	pf->num_buffered_entries += d->num_entries;
+	list_splice(children, &pf->queue);
+	condvar_broadcast(&pf->listing_done_cond);
+}
+
+/* Is there a directory that a worker may start listing?  The lock must be
+ * held.  */
+static bool
+scan_prefetch_work_avail(const struct scan_prefetcher *pf)
+{
+	return !pf->terminating && !list_empty(&pf->queue) &&
+		pf->num_buffered_entries < SCAN_PREFETCH_MAX_ENTRIES;
+}
+
+/* Release a scan_dir and its remaining subdirectories.  The lock must be
+ * held.  */
+static void
+release_scan_dir_locked(struct scan_prefetcher *pf, struct scan_dir *d)
+{
+	switch (d->state) {
+	case SCAN_DIR_QUEUED:
+		list_del(&d->queue_node);
+		free_scan_dir(d);
+		break;
+	case SCAN_DIR_LISTING:
+		d->abandoned = true;
+		break;
+	case SCAN_DIR_LISTED:
+		for (size_t i = 0; i < d->num_entries; i++)
+			if (d->entries[i].subdir)
+				release_scan_dir_locked(pf, d->entries[i].subdir);
+		pf->num_buffered_entries -= d->num_entries;
+		free_scan_dir(d);
+		break;
+	}
+}
+
+static void
+release_scan_dir(struct scan_dir *d)
+{
+	struct scan_prefetcher *pf;
+	bool work_avail;
+
+	if (!d)
+		return;
+	pf = d->pf;
+	mutex_lock(&pf->lock);
+	release_scan_dir_locked(pf, d);
+	work_avail = scan_prefetch_work_avail(pf);
+	mutex_unlock(&pf->lock);
+	/* The workers may have stopped because too many entries were
+	 * buffered.  */
+	if (work_avail)
+		thread_pool_job_kick(&pf->job);
+}
+
+/* Get the listing of the directory @d, listing it now if no worker has started
+ * on it yet.  Returns false if it couldn't be listed.  */
+static bool
+get_scan_dir_listing(struct scan_dir *d)
+{
+	struct scan_prefetcher *pf = d->pf;
+	bool work_avail = false;
+	bool ok;
+
+	mutex_lock(&pf->lock);
+	if (d->state == SCAN_DIR_QUEUED) {
+		LIST_HEAD(children);
+
+		list_del(&d->queue_node);
+		d->state = SCAN_DIR_LISTING;
+		mutex_unlock(&pf->lock);
+
+		list_scan_dir(d, pf->stat_flags, &children);
+
+		mutex_lock(&pf->lock);
+		finish_scan_dir_listing(pf, d, &children);
+		work_avail = scan_prefetch_work_avail(pf);
+	}
+	while (d->state != SCAN_DIR_LISTED)
+		condvar_wait(&pf->listing_done_cond, &pf->lock);
+	ok = !d->failed;
+	mutex_unlock(&pf->lock);
+	if (work_avail)
+		thread_pool_job_kick(&pf->job);
+	return ok;
+}
+
+static void
+scan_prefetch_job_func(void *arg)
+{
+	struct scan_prefetcher *pf = arg;
+	struct scan_dir *d;
+	bool found_subdirs;
+
+	mutex_lock(&pf->lock);
+	while (scan_prefetch_work_avail(pf)) {
+		LIST_HEAD(children);
+
+		d = list_first_entry(&pf->queue, struct scan_dir, queue_node);
+		list_del(&d->queue_node);
+		d->state = SCAN_DIR_LISTING;
+		mutex_unlock(&pf->lock);
+
+		list_scan_dir(d, pf->stat_flags, &children);
+
+		mutex_lock(&pf->lock);
+		found_subdirs = !list_empty(&children);
+		finish_scan_dir_listing(pf, d, &children);
+		if (found_subdirs) {
+			/* Let other workers help with the subdirectories.  */
+			mutex_unlock(&pf->lock);
+			thread_pool_job_kick(&pf->job);
+			mutex_lock(&pf->lock);
+		}
+	}
+	mutex_unlock(&pf->lock);
+}
+
+/*
+ * Start prefetching the directory tree rooted at @root_path.  On success,
+ * returns the scan_dir for the root directory.  Returns NULL if prefetching
+ * couldn't be started, in which case the tree should just be scanned without
+ * it.
+ */
+static struct scan_dir *
+start_scan_prefetch(const char *root_path, int stat_flags)
+{
+	struct scan_prefetcher *pf;
+	struct scan_dir *root;
+
+	pf = CALLOC(1, sizeof(*pf));
+	if (!pf)
+		return NULL;
+	INIT_LIST_HEAD(&pf->queue);
+	pf->stat_flags = stat_flags;
+	root = new_scan_dir(pf, root_path, strlen(root_path));
+	if (!root)
+		goto err_free_pf;
+	list_add(&root->queue_node, &pf->queue);
+	if (thread_pool_reserve(SCAN_PREFETCH_NUM_THREADS) == 0)
+		goto err_free_root;
+	if (!mutex_init(&pf->lock))
+		goto err_free_root;
+	if (!condvar_init(&pf->listing_done_cond))
+		goto err_destroy_lock;
+	if (!thread_pool_job_init(&pf->job, scan_prefetch_job_func, pf,
+				  SCAN_PREFETCH_NUM_THREADS))
+		goto err_destroy_listing_done_cond;
+
+	thread_pool_job_kick(&pf->job);
+	return root;
+
+err_destroy_listing_done_cond:
+	condvar_destroy(&pf->listing_done_cond);
+err_destroy_lock:
+	mutex_destroy(&pf->lock);
+err_free_root:
+	free_scan_dir(root);
+err_free_pf:
+	FREE(pf);
+	return NULL;
+}
+
+/* Stop prefetching.  All scan_dirs must have been released.  */
+static void
+stop_scan_prefetch(struct scan_prefetcher *pf)
+{
+	mutex_lock(&pf->lock);
+	pf->terminating = true;
+	mutex_unlock(&pf->lock);
+
+	thread_pool_job_destroy(&pf->job);
+
+	condvar_destroy(&pf->listing_done_cond);
+	mutex_destroy(&pf->lock);
+	FREE(pf);
+}
 static int
 unix_build_dentry_tree_recursive(struct wim_dentry **tree_ret,
 				 int dirfd, const char *relpath,
-				 struct scan_params *params);
+				 struct scan_params *params,
+				 struct scan_dir_entry *pentry);
+
+static int
+unix_scan_directory_entry(struct wim_dentry *dir_dentry, int dirfd,
+			  const char *name, size_t name_len,
+			  struct scan_params *params,
+			  struct scan_dir_entry *pentry)
+{
+	struct wim_dentry *child;
+	size_t orig_path_len;
+	int ret;
+
+	if (should_ignore_filename(name, name_len))
+		return 0;
+
+	if (!pathbuf_append_name(params, name, name_len, &orig_path_len))
+		return WIMLIB_ERR_NOMEM;
+	ret = unix_build_dentry_tree_recursive(&child, dirfd, name, params,
+					       pentry);
+	pathbuf_truncate(params, orig_path_len);
+	if (ret)
+		return ret;
+	attach_scanned_tree(dir_dentry, child, params->blob_table);
+	return 0;
+}
 
 static int
 unix_scan_directory(struct wim_dentry *dir_dentry,
 		    int parent_dirfd, const char *dir_relpath,
-		    struct scan_params *params)
+		    struct scan_params *params, struct scan_dir *sdir)
 {
 
 	int dirfd;
@@ -342,6 +786,26 @@ unix_scan_directory(struct wim_dentry *dir_dentry,
 	}
 
 	dir_dentry->d_inode->i_attributes = FILE_ATTRIBUTE_DIRECTORY;
+
+	/* Use the prefetched directory listing if available.  The directory
+	 * still needs to be opened for the entries that aren't fully
+	 * prefetched, such as symbolic links.  */
+	if (sdir && get_scan_dir_listing(sdir)) {
+		ret = 0;
+		for (size_t i = 0; i < sdir->num_entries; i++) {
+			struct scan_dir_entry *entry = &sdir->entries[i];
+
+			ret = unix_scan_directory_entry(dir_dentry, dirfd,
+							entry->name,
+							entry->name_len,
+							params, entry);
+			if (ret)
+				break;
+		}
+		close(dirfd);
+		return ret;
+	}
+
 	dir = my_fdopendir(&dirfd);
 	if (!dir) {
 		ERROR_WITH_ERRNO("\"%s\": Can't open directory",
@@ -353,9 +817,6 @@ unix_scan_directory(struct wim_dentry *dir_dentry,
 	ret = 0;
 	for (;;) {
 		struct dirent *entry;
-		struct wim_dentry *child;
-		size_t name_len;
-		size_t orig_path_len;
 
 		errno = 0;
 		entry = readdir(dir);
@@ -368,21 +829,12 @@ unix_scan_directory(struct wim_dentry *dir_dentry,
 			break;
 		}
 
-		name_len = strlen(entry->d_name);
-
-		if (should_ignore_filename(entry->d_name, name_len))
-			continue;
-
-		ret = WIMLIB_ERR_NOMEM;
-		if (!pathbuf_append_name(params, entry->d_name, name_len,
-					 &orig_path_len))
-			break;
-		ret = unix_build_dentry_tree_recursive(&child, dirfd,
-						       entry->d_name, params);
-		pathbuf_truncate(params, orig_path_len);
+		ret = unix_scan_directory_entry(dir_dentry, dirfd,
+						entry->d_name,
+						strlen(entry->d_name),
+						params, NULL);
 		if (ret)
 			break;
-		attach_scanned_tree(dir_dentry, child, params->blob_table);
 	}
 	closedir(dir);
 	return ret;
@@ -526,17 +978,30 @@ unix_scan_symlink(int dirfd, const char *relpath,
 	return 0;
 }
 
+/*
+ * Scan the file or directory tree at @relpath (relative to @dirfd), whose full
+ * path is params->cur_path.  If @pentry is not NULL, it's the prefetched
+ * directory entry for the file.
+ */
 static int
 unix_build_dentry_tree_recursive(struct wim_dentry **tree_ret,
 				 int dirfd, const char *relpath,
-				 struct scan_params *params)
+				 struct scan_params *params,
+				 struct scan_dir_entry *pentry)
 {
 	struct wim_dentry *tree = NULL;
 	struct wim_inode *inode = NULL;
+	struct scan_dir *sdir = NULL;
 	int ret;
 	struct stat stbuf;
 	int stat_flags;
 
+	if (pentry) {
+		/* Take ownership of the prefetched subdirectory, if any  */
+		sdir = pentry->subdir;
+		pentry->subdir = NULL;
+	}
+
 	ret = try_exclude(params);
 	if (unlikely(ret < 0)) /* Excluded? */
 		goto out_progress;
@@ -549,7 +1014,13 @@ unix_build_dentry_tree_recursive(struct wim_dentry **tree_ret,
 	else
 		stat_flags = AT_SYMLINK_NOFOLLOW;
 
-	ret = my_fstatat(params->cur_path, dirfd, relpath, &stbuf, stat_flags);
+	if (pentry && pentry->stat_errno == 0) {
+		stbuf = pentry->stbuf;
+		ret = 0;
+	} else {
+		ret = my_fstatat(params->cur_path, dirfd, relpath, &stbuf,
+				 stat_flags);
+	}
 
 	if (ret) {
 		ERROR_WITH_ERRNO("\"%s\": Can't read metadata",
@@ -632,7 +1103,7 @@ unix_build_dentry_tree_recursive(struct wim_dentry **tree_ret,
 					     stbuf.st_size, inode,
 					     params->unhashed_blobs);
 	} else if (S_ISDIR(stbuf.st_mode)) {
-		ret = unix_scan_directory(tree, dirfd, relpath, params);
+		ret = unix_scan_directory(tree, dirfd, relpath, params, sdir);
 	} else if (S_ISLNK(stbuf.st_mode)) {
 		ret = unix_scan_symlink(dirfd, relpath, inode, params);
 	}
@@ -651,6 +1122,7 @@ out:
 		tree = NULL;
 		ret = report_scan_error(params, ret);
 	}
+	release_scan_dir(sdir);
 	*tree_ret = tree;
 	return ret;
 }
@@ -678,14 +1150,26 @@ int
 unix_build_dentry_tree(struct wim_dentry **root_ret,
 		       const char *root_disk_path, struct scan_params *params)
 {
+	struct scan_dir_entry root_entry = { .stat_errno = -1 };
+	struct scan_prefetcher *pf = NULL;
 	int ret;
 
 	ret = pathbuf_init(params, root_disk_path);
 	if (ret)
 		return ret;
 
-	return unix_build_dentry_tree_recursive(root_ret, AT_FDCWD,
-						root_disk_path, params);
+	root_entry.subdir = start_scan_prefetch(root_disk_path,
+		(params->add_flags & WIMLIB_ADD_FLAG_DEREFERENCE) ?
+			0 : AT_SYMLINK_NOFOLLOW);
+	if (root_entry.subdir)
+		pf = root_entry.subdir->pf;
+
+	ret = unix_build_dentry_tree_recursive(root_ret, AT_FDCWD,
+					       root_disk_path, params,
+					       &root_entry);
+	if (pf)
+		stop_scan_prefetch(pf);
+	return ret;
 }
 
 #endif /* !_WIN32 */
@@ -37,10 +37,15 @@
 #  include <sys/syscall.h>
 #endif
 #include <unistd.h>
+#if defined(__i386__) || defined(__x86_64__)
+#  include <immintrin.h>
+#endif
 
 #include "wimlib.h"
 #include "wimlib/assert.h"
+#include "wimlib/cpu_features.h"
 #include "wimlib/error.h"
+#include "wimlib/threads.h"
 #include "wimlib/timestamp.h"
 #include "wimlib/util.h"
 
@@ -155,6 +160,62 @@ wimlib_set_memory_allocator(void *(*malloc_func)(size_t),
 	return 0;
 }
 
+/*
+ * The memory budget.  Large allocations whose size can be traded off against
+ * speed, such as the buffers of the parallel chunk compressor and decompressor
+ * and the chunk cache, are charged against a global limit, which defaults to
+ * the amount of physical memory.  Each user sizes itself to fit in what's left
+ * of the budget and gives its share back when done.  This is approximate: the
+ * check and the charge aren't one atomic step, and small allocations aren't
+ * counted at all.
+ */
+static u64 memory_limit;
+static u64 memory_charged;
+
+/* The amount of physical memory, once it has been queried.  It's cached since
+ * the budget is checked often, e.g. on every chunk cache insertion.  */
+static u64 physical_memory;
+
+/* API function documented in wimlib.h  */
+WIMLIBAPI int
+wimlib_set_memory_limit(uint64_t limit)
+{
+	atomic_store_relaxed(&memory_limit, limit);
+	return 0;
+}
+
+/* Return how much memory is left in the budget.  */
+u64
+get_memory_budget(void)
+{
+	u64 limit = atomic_load_relaxed(&memory_limit);
+	u64 charged = atomic_load_relaxed(&memory_charged);
+
+	if (!limit) {
+		limit = atomic_load_relaxed(&physical_memory);
+		if (!limit) {
+			limit = get_available_memory();
+			atomic_store_relaxed(&physical_memory, limit);
+		}
+	}
+
+	return charged < limit ? limit - charged : 0;
+}
+
+/* Charge @size bytes against the memory budget.  */
+void
+charge_memory(u64 size)
+{
+	atomic_add_relaxed(&memory_charged, size);
+}
+
+/* Give back @size bytes that were charged with charge_memory().  */
+void
+uncharge_memory(u64 size)
+{
+	atomic_add_relaxed(&memory_charged, -size);
+}
+
 /*******************
  * String utilities
  *******************/
@@ -166,6 +227,96 @@ void *mempcpy(void *dst, const void *src, size_t n)
 }
 #endif
 
+/*******************
+ * Zero detection
+ *******************/
+
+static bool
+is_all_zeroes_generic(const u8 *p, const u8 *end)
+{
+	for (; (uintptr_t)p % WORDBYTES && p != end; p++)
+		if (*p)
+			return false;
+
+	for (; end - p >= 4 * WORDBYTES; p += 4 * WORDBYTES) {
+		const machine_word_t *w = (const machine_word_t *)p;
+
+		if (w[0] | w[1] | w[2] | w[3])
+			return false;
+	}
+
+	for (; end - p >= WORDBYTES; p += WORDBYTES)
+		if (*(const machine_word_t *)p)
+			return false;
+
+	for (; p != end; p++)
+		if (*p)
+			return false;
+
+	return true;
+}
+
+/*
+ * The vectorized versions OR together 64 or 128 bytes at a time and only test
+ * the result.  This is memory bound, but it lets mostly-zero buffers be scanned
+ * at close to memory bandwidth.  Nonzero data is usually rejected within the
+ * first iteration anyway.
+ */
+#ifdef __SSE2__
+static bool
+is_all_zeroes_sse2(const u8 *p, const u8 *end)
+{
+	for (; end - p >= 64; p += 64) {
+		const __m128i *v = (const __m128i *)p;
+		__m128i x = _mm_or_si128(_mm_or_si128(_mm_loadu_si128(&v[0]),
+						      _mm_loadu_si128(&v[1])),
+					 _mm_or_si128(_mm_loadu_si128(&v[2]),
+						      _mm_loadu_si128(&v[3])));
+
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, _mm_setzero_si128())) !=
+		    0xFFFF)
+			return false;
+	}
+	return is_all_zeroes_generic(p, end);
+}
+#endif /* __SSE2__ */
+
+#if defined(__i386__) || defined(__x86_64__)
+static bool __attribute__((target("avx2")))
+is_all_zeroes_avx2(const u8 *p, const u8 *end)
+{
+	for (; end - p >= 128; p += 128) {
+		const __m256i *v = (const __m256i *)p;
+		__m256i x = _mm256_or_si256(
+				_mm256_or_si256(_mm256_loadu_si256(&v[0]),
+						_mm256_loadu_si256(&v[1])),
+				_mm256_or_si256(_mm256_loadu_si256(&v[2]),
+						_mm256_loadu_si256(&v[3])));
+
+		if (!_mm256_testz_si256(x, x))
+			return false;
+	}
+	return is_all_zeroes_generic(p, end);
+}
+#endif /* __i386__ || __x86_64__ */
+
+/* Return true if all @size bytes at @p are zero.  */
+bool
+is_all_zeroes(const void *p, size_t size)
+{
+	const u8 *end = (const u8 *)p + size;
+
+#if defined(__i386__) || defined(__x86_64__)
+	if ((cpu_features & X86_CPU_FEATURE_AVX2) && size >= 128)
+		return is_all_zeroes_avx2(p, end);
+#endif
+#ifdef __SSE2__
+	return is_all_zeroes_sse2(p, end);
+#else
+	return is_all_zeroes_generic(p, end);
+#endif
+}
+
 /**************************
  * Random number generation
  **************************/
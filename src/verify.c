@@ -25,12 +25,18 @@
 #  include "config.h"
 #endif
 
+#include <stdlib.h>
+
 #include "wimlib/blob_table.h"
 #include "wimlib/dentry.h"
 #include "wimlib/error.h"
 #include "wimlib/metadata.h"
 #include "wimlib/progress.h"
+#include "wimlib/resource.h"
 #include "wimlib/security.h"
+#include "wimlib/threads.h"
+#include "wimlib/util.h"
+#include "wimlib/wim.h"
 
 static int
 append_blob_to_list(struct blob_descriptor *blob, void *_list)
@@ -44,6 +50,18 @@ struct verify_blob_list_ctx {
 	void *progctx;
 	union wimlib_progress_info *progress;
 	u64 next_progress;
+
+	/* The remaining fields are used only when verifying resources in
+	 * parallel.  Each group is a list of the blobs in one resource.  */
+	struct mutex lock;
+	struct condvar cond;
+	struct list_head *groups;
+	size_t num_groups;
+	size_t next_group;
+	size_t num_busy_groups;
+	bool progress_pending;
+	bool aborting;
+	int status;
 };
 
 static int
@@ -73,6 +91,267 @@ verify_continue_blob(const struct blob_descriptor *blob, u64 offset,
 	return 0;
 }
 
+/* Like verify_continue_blob(), but called from a worker thread.  The progress
+ * messages are sent by the main thread, so this just wakes it up when one is
+ * due.  */
+static int
+verify_continue_blob_parallel(const struct blob_descriptor *blob, u64 offset,
+			      const void *chunk, size_t size, void *_ctx)
+{
+	struct verify_blob_list_ctx *ctx = _ctx;
+	union wimlib_progress_info *progress = ctx->progress;
+	int ret = 0;
+
+	mutex_lock(&ctx->lock);
+	if (ctx->aborting) {
+		/* Another thread failed; the status doesn't matter.  */
+		ret = WIMLIB_ERR_ABORTED_BY_PROGRESS;
+	} else {
+		if (offset + size == blob->size)
+			progress->verify_streams.completed_streams++;
+		progress->verify_streams.completed_bytes += size;
+		if (progress->verify_streams.completed_bytes >=
+		    ctx->next_progress && !ctx->progress_pending) {
+			ctx->progress_pending = true;
+			condvar_broadcast(&ctx->cond);
+		}
+	}
+	mutex_unlock(&ctx->lock);
+	return ret;
+}
+
+static void
+verify_job_func(void *_ctx)
+{
+	struct verify_blob_list_ctx *ctx = _ctx;
+	const struct read_blob_callbacks cbs = {
+		.continue_blob	= verify_continue_blob_parallel,
+		.ctx		= ctx,
+	};
+	struct list_head *group;
+	int ret;
+
+	mutex_lock(&ctx->lock);
+	while (!ctx->aborting && ctx->next_group < ctx->num_groups) {
+		group = &ctx->groups[ctx->next_group++];
+		ctx->num_busy_groups++;
+		mutex_unlock(&ctx->lock);
+
+		ret = read_blob_list(group,
+				     offsetof(struct blob_descriptor,
+					      extraction_list),
+				     &cbs, VERIFY_BLOB_HASHES);
+
+		mutex_lock(&ctx->lock);
+		ctx->num_busy_groups--;
+		if (ret && !ctx->aborting) {
+			ctx->status = ret;
+			ctx->aborting = true;
+		}
+		condvar_broadcast(&ctx->cond);
+	}
+	mutex_unlock(&ctx->lock);
+}
+
+static bool
+verify_groups_done(const struct verify_blob_list_ctx *ctx)
+{
+	return (ctx->aborting || ctx->next_group == ctx->num_groups) &&
+		ctx->num_busy_groups == 0;
+}
+
+/*
+ * Verify the groups of blobs in @ctx->groups using up to @num_threads threads
+ * of the thread pool, each of which reads whole resources.  The main thread
+ * just sends the progress messages.  Returns a negative value if the work
+ * couldn't be started, in which case the caller should verify the blobs itself.
+ */
+static int
+verify_groups_in_parallel(struct verify_blob_list_ctx *ctx,
+			  unsigned num_threads)
+{
+	struct thread_pool_job job;
+	union wimlib_progress_info progress;
+	int ret;
+
+	num_threads = thread_pool_reserve(num_threads);
+	if (num_threads == 0)
+		return -1;
+	if (!mutex_init(&ctx->lock))
+		return -1;
+	if (!condvar_init(&ctx->cond))
+		goto out_destroy_lock;
+	if (!thread_pool_job_init(&job, verify_job_func, ctx, num_threads))
+		goto out_destroy_cond;
+
+	ctx->next_group = 0;
+	ctx->num_busy_groups = 0;
+	ctx->progress_pending = false;
+	ctx->aborting = false;
+	ctx->status = 0;
+
+	for (unsigned i = 0; i < num_threads; i++)
+		thread_pool_job_kick(&job);
+
+	mutex_lock(&ctx->lock);
+	for (;;) {
+		while (!verify_groups_done(ctx) && !ctx->progress_pending)
+			condvar_wait(&ctx->cond, &ctx->lock);
+		if (!ctx->progress_pending)
+			break;
+		ctx->progress_pending = false;
+		if (ctx->aborting)
+			continue;
+		progress = *ctx->progress;
+		set_next_progress(progress.verify_streams.completed_bytes,
+				  progress.verify_streams.total_bytes,
+				  &ctx->next_progress);
+		mutex_unlock(&ctx->lock);
+
+		ret = call_progress(ctx->progfunc,
+				    WIMLIB_PROGRESS_MSG_VERIFY_STREAMS,
+				    &progress, ctx->progctx);
+
+		mutex_lock(&ctx->lock);
+		if (ret && !ctx->aborting) {
+			ctx->status = ret;
+			ctx->aborting = true;
+		}
+	}
+	mutex_unlock(&ctx->lock);
+
+	thread_pool_job_destroy(&job);
+	condvar_destroy(&ctx->cond);
+	mutex_destroy(&ctx->lock);
+	return ctx->status;
+
+out_destroy_cond:
+	condvar_destroy(&ctx->cond);
+out_destroy_lock:
+	mutex_destroy(&ctx->lock);
+	return -1;
+}
+
+/* Should the blob be verified by a worker thread, together with the other
+ * blobs in the same resource?  Large compressed resources are better left to
+ * the parallel chunk decompressor, and other locations may not support
+ * concurrent reads.  */
+static bool
+blob_can_be_verified_in_parallel(const struct blob_descriptor *blob)
+{
+	const struct wim_resource_descriptor *rdesc;
+
+	if (blob->blob_location != BLOB_IN_WIM)
+		return false;
+	rdesc = blob->rdesc;
+	if (!filedes_is_seekable(&rdesc->wim->in_fd))
+		return false;
+	return rdesc->compression_type == WIMLIB_COMPRESSION_TYPE_NONE ||
+	       rdesc->uncompressed_size <= max(2000000, rdesc->chunk_size);
+}
+
+static int
+cmp_blobs_by_rdesc(const void *p1, const void *p2)
+{
+	const struct blob_descriptor *blob1 = *(const struct blob_descriptor **)p1;
+	const struct blob_descriptor *blob2 = *(const struct blob_descriptor **)p2;
+
+	if ((uintptr_t)blob1->rdesc < (uintptr_t)blob2->rdesc)
+		return -1;
+	if ((uintptr_t)blob1->rdesc > (uintptr_t)blob2->rdesc)
+		return 1;
+	return 0;
+}
+
+/*
+ * Verify the blobs in @blob_list.  If there are enough resources, each resource
+ * is verified as a unit by one of several worker threads, so that verifying
+ * many resources scales with the number of processors.  Blobs that can't be
+ * verified this way are verified first by the calling thread.
+ */
+static int
+verify_blob_list(struct list_head *blob_list, struct verify_blob_list_ctx *ctx,
+		 unsigned num_threads)
+{
+	const struct read_blob_callbacks cbs = {
+		.continue_blob	= verify_continue_blob,
+		.ctx		= ctx,
+	};
+	struct blob_descriptor **blobs = NULL;
+	struct blob_descriptor *blob, *tmp;
+	size_t num_blobs = 0;
+	size_t num_groups;
+	size_t i;
+	LIST_HEAD(serial_list);
+	int ret;
+
+	if (num_threads == 0)
+		num_threads = get_available_cpus();
+	if (num_threads <= 1)
+		goto verify_serially;
+
+	list_for_each_entry(blob, blob_list, extraction_list)
+		if (blob_can_be_verified_in_parallel(blob))
+			num_blobs++;
+	if (num_blobs < 2)
+		goto verify_serially;
+
+	blobs = MALLOC(num_blobs * sizeof(blobs[0]));
+	if (!blobs)
+		goto verify_serially;
+	num_blobs = 0;
+	list_for_each_entry_safe(blob, tmp, blob_list, extraction_list) {
+		if (blob_can_be_verified_in_parallel(blob))
+			blobs[num_blobs++] = blob;
+		else
+			list_move_tail(&blob->extraction_list, &serial_list);
+	}
+	qsort(blobs, num_blobs, sizeof(blobs[0]), cmp_blobs_by_rdesc);
+
+	num_groups = 0;
+	for (i = 0; i < num_blobs; i++)
+		if (i == 0 || blobs[i]->rdesc != blobs[i - 1]->rdesc)
+			num_groups++;
+	ctx->groups = MALLOC(num_groups * sizeof(ctx->groups[0]));
+	if (!ctx->groups)
+		goto out_restore_list;
+	ctx->num_groups = 0;
+	for (i = 0; i < num_blobs; i++) {
+		if (i == 0 || blobs[i]->rdesc != blobs[i - 1]->rdesc)
+			INIT_LIST_HEAD(&ctx->groups[ctx->num_groups++]);
+		list_move_tail(&blobs[i]->extraction_list,
+			       &ctx->groups[ctx->num_groups - 1]);
+	}
+
+	ret = read_blob_list(&serial_list,
+			     offsetof(struct blob_descriptor, extraction_list),
+			     &cbs, VERIFY_BLOB_HASHES);
+	if (ret == 0) {
+		ret = verify_groups_in_parallel(ctx,
+						min(num_threads,
+						    ctx->num_groups));
+		if (ret < 0) {
+			for (i = 0; i < ctx->num_groups; i++)
+				list_splice_tail(&ctx->groups[i], blob_list);
+			ret = read_blob_list(blob_list,
+					     offsetof(struct blob_descriptor,
+						      extraction_list),
+					     &cbs, VERIFY_BLOB_HASHES);
+		}
+	}
+	FREE(ctx->groups);
+	FREE(blobs);
+	return ret;
+
+out_restore_list:
+	list_splice_tail(&serial_list, blob_list);
+	FREE(blobs);
+verify_serially:
+	return read_blob_list(blob_list,
+			      offsetof(struct blob_descriptor, extraction_list),
+			      &cbs, VERIFY_BLOB_HASHES);
+}
+
 static int
 verify_file_data_present(struct wim_image_metadata *imd,
 			 struct blob_table *blob_table)
@@ -97,10 +376,6 @@ wimlib_verify_wim(WIMStruct *wim, int verify_flags)
 	union wimlib_progress_info progress;
 	struct verify_blob_list_ctx ctx;
 	struct blob_descriptor *blob;
-	struct read_blob_callbacks cbs = {
-		.continue_blob	= verify_continue_blob,
-		.ctx		= &ctx,
-	};
 
 	/* Check parameters  */
 
@@ -168,7 +443,6 @@ wimlib_verify_wim(WIMStruct *wim, int verify_flags)
 	if (ret)
 		return ret;
 
-	return read_blob_list(&blob_list,
-			      offsetof(struct blob_descriptor, extraction_list),
-			      &cbs, VERIFY_BLOB_HASHES);
+	return verify_blob_list(&blob_list, &ctx,
+				wim->num_decompression_threads);
 }
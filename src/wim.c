@@ -26,12 +26,17 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <stdlib.h>
+#ifndef _WIN32
+#  include <sys/mman.h>
+#endif
 #include <sys/stat.h>
 #include <unistd.h>
 
 #include "wimlib.h"
 #include "wimlib/assert.h"
+#include "wimlib/blob_hasher.h"
 #include "wimlib/blob_table.h"
+#include "wimlib/chunk_cache.h"
 #include "wimlib/cpu_features.h"
 #include "wimlib/dentry.h"
 #include "wimlib/encoding.h"
@@ -143,10 +148,16 @@ new_wim_struct(void)
 	WIMStruct *wim = CALLOC(1, sizeof(WIMStruct));
 	if (!wim)
 		return NULL;
+	if (!mutex_init(&wim->decompressor_lock)) {
+		FREE(wim);
+		return NULL;
+	}
 
 	wim->refcnt = 1;
 	filedes_invalidate(&wim->in_fd);
 	filedes_invalidate(&wim->out_fd);
+	filedes_invalidate(&wim->out_direct_fd);
+	wim->chunk_cache_max_size = CHUNK_CACHE_DEFAULT_MAX_SIZE;
 	wim->out_solid_compression_type = wim_default_solid_compression_type();
 	wim->out_solid_chunk_size = wim_default_solid_chunk_size(
 					wim->out_solid_compression_type);
@@ -371,6 +382,34 @@ deselect_current_wim_image(WIMStruct *wim)
 	}
 }
 
+/*
+ * Get the metadata for the specified image for read-only access, loading it if
+ * needed.  Normally this selects the image, like select_wim_image().  But if
+ * the WIMStruct was opened with WIMLIB_OPEN_FLAG_CONCURRENT_READS, all images
+ * are already loaded and nothing is modified, so this may be called from
+ * multiple threads concurrently.
+ */
+int
+get_image_for_reading(WIMStruct *wim, int image,
+		      struct wim_image_metadata **imd_ret)
+{
+	int ret;
+
+	if (wim->concurrent_reads) {
+		if (image < 1 || image > wim->hdr.image_count)
+			return WIMLIB_ERR_INVALID_IMAGE;
+		if (!wim_has_metadata(wim))
+			return WIMLIB_ERR_METADATA_NOT_FOUND;
+		*imd_ret = wim->image_metadata[image - 1];
+		return 0;
+	}
+	ret = select_wim_image(wim, image);
+	if (ret)
+		return ret;
+	*imd_ret = wim_get_current_image_metadata(wim);
+	return 0;
+}
+
 /*
  * Calls a function on images in the WIM.  If @image is WIMLIB_ALL_IMAGES,
  * @visitor is called on the WIM once for each image, with each image selected
@@ -597,6 +636,25 @@ wimlib_set_output_pack_chunk_size(WIMStruct *wim, u32 chunk_size)
 	return 0;
 }
 
+/* API function documented in wimlib.h  */
+WIMLIBAPI int
+wimlib_set_decompression_threads(WIMStruct *wim, unsigned num_threads)
+{
+	wim->num_decompression_threads = num_threads;
+	return 0;
+}
+
+/* API function documented in wimlib.h  */
+WIMLIBAPI int
+wimlib_set_chunk_cache_size(WIMStruct *wim, uint64_t max_size)
+{
+	/* The cache will be reallocated with the new size when needed.  */
+	free_chunk_cache(wim->chunk_cache);
+	wim->chunk_cache = NULL;
+	wim->chunk_cache_max_size = max_size;
+	return 0;
+}
+
 /* API function documented in wimlib.h  */
 WIMLIBAPI const tchar *
 wimlib_get_compression_type_string(enum wimlib_compression_type ctype)
@@ -630,6 +688,75 @@ open_wim_file(const tchar *filename, struct filedes *fd_ret)
 	return 0;
 }
 
+/*
+ * Load the metadata for all images in the WIM and pin it in memory, so that the
+ * WIMStruct can be read by multiple threads concurrently.  The images are
+ * pinned only after all of them have been loaded successfully, so on failure
+ * wimlib_free() still unloads everything.
+ */
+static int
+enable_concurrent_reads(WIMStruct *wim)
+{
+	int ret;
+
+	if (wim_has_metadata(wim)) {
+		for (int i = 0; i < wim->hdr.image_count; i++) {
+			struct wim_image_metadata *imd = wim->image_metadata[i];
+
+			if (!is_image_loaded(imd)) {
+				ret = read_metadata_resource(imd);
+				if (ret)
+					return ret;
+			}
+		}
+		for (int i = 0; i < wim->hdr.image_count; i++)
+			wim->image_metadata[i]->selected_refcnt++;
+	}
+	wim->concurrent_reads = 1;
+	return 0;
+}
+
+/*
+ * Map the WIM's backing file into memory, if possible.  This is only an
+ * optimization, so failure isn't an error; reads just go through the file
+ * descriptor instead.
+ */
+static void
+map_wim_file(WIMStruct *wim)
+{
+#ifndef _WIN32
+	void *map;
+
+	if (!filedes_is_seekable(&wim->in_fd) || wim->file_size == 0 ||
+	    wim->file_size != (size_t)wim->file_size)
+		return;
+	map = mmap(NULL, wim->file_size, PROT_READ, MAP_SHARED,
+		   wim->in_fd.fd, 0);
+	if (map == MAP_FAILED) {
+		WARNING_WITH_ERRNO("Failed to memory-map \"%"TS"\"; "
+				   "reading it normally instead",
+				   wim->filename);
+		return;
+	}
+	wim->in_map = map;
+	wim->in_map_size = wim->file_size;
+#endif
+}
+
+/* Remove the memory mapping of the WIM's backing file, if there is one.  This
+ * must be done before the file is changed or closed.  */
+void
+wim_unmap_file(WIMStruct *wim)
+{
+#ifndef _WIN32
+	if (wim->in_map) {
+		munmap((void *)wim->in_map, wim->in_map_size);
+		wim->in_map = NULL;
+		wim->in_map_size = 0;
+	}
+#endif
+}
+
 /*
  * Begins the reading of a WIM file; opens the file and reads its header and
  * blob table, and optionally checks the integrity.
@@ -679,6 +806,9 @@ begin_read(WIMStruct *wim, const void *wim_filename_or_fd, int open_flags)
 		}
 	}
 
+	if (open_flags & WIMLIB_OPEN_FLAG_MMAP)
+		map_wim_file(wim);
+
 	ret = read_wim_header(wim, &wim->hdr);
 	if (ret)
 		return ret;
@@ -776,6 +906,12 @@ begin_read(WIMStruct *wim, const void *wim_filename_or_fd, int open_flags)
 		ret = read_blob_table(wim);
 		if (ret)
 			return ret;
+
+		if (open_flags & WIMLIB_OPEN_FLAG_CONCURRENT_READS) {
+			ret = enable_concurrent_reads(wim);
+			if (ret)
+				return ret;
+		}
 	}
 	return 0;
 }
@@ -817,7 +953,13 @@ wimlib_open_wim_with_progress(const tchar *wimfile, int open_flags,
 {
 	if (open_flags & ~(WIMLIB_OPEN_FLAG_CHECK_INTEGRITY |
 			   WIMLIB_OPEN_FLAG_ERROR_IF_SPLIT |
-			   WIMLIB_OPEN_FLAG_WRITE_ACCESS))
+			   WIMLIB_OPEN_FLAG_WRITE_ACCESS |
+			   WIMLIB_OPEN_FLAG_CONCURRENT_READS |
+			   WIMLIB_OPEN_FLAG_MMAP))
+		return WIMLIB_ERR_INVALID_PARAM;
+
+	if ((open_flags & WIMLIB_OPEN_FLAG_WRITE_ACCESS) &&
+	    (open_flags & WIMLIB_OPEN_FLAG_CONCURRENT_READS))
 		return WIMLIB_ERR_INVALID_PARAM;
 
 	if (!wimfile || !*wimfile || !wim_ret)
@@ -841,23 +983,55 @@ wimlib_open_wim(const tchar *wimfile, int open_flags, WIMStruct **wim_ret)
 int
 wim_checksum_unhashed_blobs(WIMStruct *wim)
 {
+	struct blob_descriptor *blob, *tmp;
+	struct blob_descriptor **blobs;
+	struct blob_hasher *hasher = NULL;
+	size_t num_blobs = 0;
 	int ret;
 
 	if (!wim_has_metadata(wim))
 		return 0;
+
+	/* Start checksumming the blobs in parallel, in the order in which
+	 * they're processed below.  */
+	for (int i = 0; i < wim->hdr.image_count; i++)
+		image_for_each_unhashed_blob(blob, wim->image_metadata[i])
+			if (blob_can_be_hashed_in_parallel(blob))
+				num_blobs++;
+	if (num_blobs >= 2) {
+		blobs = MALLOC(num_blobs * sizeof(blobs[0]));
+		if (!blobs)
+			return WIMLIB_ERR_NOMEM;
+		num_blobs = 0;
+		for (int i = 0; i < wim->hdr.image_count; i++)
+			image_for_each_unhashed_blob(blob, wim->image_metadata[i])
+				if (blob_can_be_hashed_in_parallel(blob))
+					blobs[num_blobs++] = blob;
+		ret = new_blob_hasher(blobs, num_blobs, 0, &hasher);
+		FREE(blobs);
+		if (ret > 0)
+			return ret;
+	}
+
+	ret = 0;
 	for (int i = 0; i < wim->hdr.image_count; i++) {
-		struct blob_descriptor *blob, *tmp;
 		struct wim_image_metadata *imd = wim->image_metadata[i];
 		image_for_each_unhashed_blob_safe(blob, tmp, imd) {
 			struct blob_descriptor *new_blob;
-			ret = hash_unhashed_blob(blob, wim->blob_table, &new_blob);
+			u8 hash[SHA1_HASH_SIZE];
+
+			ret = blob_hasher_get_hash(hasher, blob, hash);
 			if (ret)
-				return ret;
+				goto out;
+			new_blob = set_unhashed_blob_hash(blob, hash,
+							  wim->blob_table);
 			if (new_blob != blob)
 				free_blob_descriptor(blob);
 		}
 	}
-	return 0;
+out:
+	free_blob_hasher(hasher);
+	return ret;
 }
 
 /*
@@ -868,11 +1042,18 @@ wim_checksum_unhashed_blobs(WIMStruct *wim)
  * 2. The WIM is not part of a spanned set.
  * 3. The WIM_HDR_FLAG_READONLY flag is not set in the WIM header.
  *
+ * Also, a WIM opened for concurrent reads is never writeable.
+ *
  * Return value is 0 if writable; WIMLIB_ERR_WIM_IS_READONLY otherwise.
  */
 int
 can_modify_wim(WIMStruct *wim)
 {
+	if (wim->concurrent_reads) {
+		ERROR("Cannot modify \"%"TS"\": is opened for concurrent reads",
+		      wim->filename);
+		return WIMLIB_ERR_WIM_IS_READONLY;
+	}
 	if (wim->filename) {
 		if (taccess(wim->filename, W_OK)) {
 			ERROR_WITH_ERRNO("Can't modify \"%"TS"\"", wim->filename);
@@ -900,16 +1081,82 @@ wim_decrement_refcnt(WIMStruct *wim)
 	wimlib_assert(wim->refcnt > 0);
 	if (--wim->refcnt != 0)
 		return;
+	wim_unmap_file(wim);
 	if (filedes_valid(&wim->in_fd))
 		filedes_close(&wim->in_fd);
 	if (filedes_valid(&wim->out_fd))
 		filedes_close(&wim->out_fd);
-	wimlib_free_decompressor(wim->decompressor);
+	if (filedes_valid(&wim->out_direct_fd))
+		filedes_close(&wim->out_direct_fd);
+	for (unsigned i = 0; i < wim->num_cached_decompressors; i++)
+		wimlib_free_decompressor(wim->decompressors[i].decompressor);
+	mutex_destroy(&wim->decompressor_lock);
+	free_chunk_cache(wim->chunk_cache);
 	xml_free_info_struct(wim->xml_info);
 	FREE(wim->filename);
 	FREE(wim);
 }
 
+/*
+ * Get a decompressor for data in the specified WIM file, with the specified
+ * compression type and maximum block size.  A cached decompressor is reused if
+ * one is available; otherwise a new one is created.  The decompressor should be
+ * returned with wim_put_decompressor() when no longer needed.  This can be
+ * called from multiple threads concurrently.
+ *
+ * Returns 0 or the error code from wimlib_create_decompressor().
+ */
+int
+wim_get_decompressor(WIMStruct *wim, int ctype, u32 max_block_size,
+		     struct wimlib_decompressor **decompressor_ret)
+{
+	mutex_lock(&wim->decompressor_lock);
+	for (unsigned i = wim->num_cached_decompressors; i-- > 0; ) {
+		struct cached_decompressor *cached = &wim->decompressors[i];
+
+		if (cached->ctype == ctype &&
+		    cached->max_block_size == max_block_size)
+		{
+			*decompressor_ret = cached->decompressor;
+			memmove(cached, cached + 1,
+				(--wim->num_cached_decompressors - i) *
+					sizeof(*cached));
+			mutex_unlock(&wim->decompressor_lock);
+			return 0;
+		}
+	}
+	mutex_unlock(&wim->decompressor_lock);
+
+	return wimlib_create_decompressor(ctype, max_block_size,
+					  decompressor_ret);
+}
+
+/* Return a decompressor obtained from wim_get_decompressor() to the WIM file's
+ * cache.  If the cache is full, the oldest decompressor in it is freed.  */
+void
+wim_put_decompressor(WIMStruct *wim, struct wimlib_decompressor *decompressor,
+		     int ctype, u32 max_block_size)
+{
+	struct wimlib_decompressor *to_free = NULL;
+
+	mutex_lock(&wim->decompressor_lock);
+	if (wim->num_cached_decompressors == WIM_MAX_CACHED_DECOMPRESSORS) {
+		to_free = wim->decompressors[0].decompressor;
+		memmove(&wim->decompressors[0], &wim->decompressors[1],
+			--wim->num_cached_decompressors *
+				sizeof(wim->decompressors[0]));
+	}
+	wim->decompressors[wim->num_cached_decompressors++] =
+		(struct cached_decompressor) {
+			.decompressor = decompressor,
+			.ctype = ctype,
+			.max_block_size = max_block_size,
+		};
+	mutex_unlock(&wim->decompressor_lock);
+
+	wimlib_free_decompressor(to_free);
+}
+
 /* API function documented in wimlib.h  */
 WIMLIBAPI void
 wimlib_free(WIMStruct *wim)
@@ -925,8 +1172,11 @@ wimlib_free(WIMStruct *wim)
 	wim->blob_table = NULL;
 	if (wim->image_metadata != NULL) {
 		deselect_current_wim_image(wim);
-		for (int i = 0; i < wim->hdr.image_count; i++)
+		for (int i = 0; i < wim->hdr.image_count; i++) {
+			if (wim->concurrent_reads)
+				wim->image_metadata[i]->selected_refcnt--;
 			put_image_metadata(wim->image_metadata[i]);
+		}
 		FREE(wim->image_metadata);
 		wim->image_metadata = NULL;
 	}
@@ -1016,6 +1266,8 @@ wimlib_global_cleanup(void)
 	if (!lib_initialized)
 		goto out_unlock;
 
+	thread_pool_destroy();
+
 #ifdef _WIN32
 	win32_global_cleanup();
 #endif
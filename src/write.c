@@ -39,6 +39,7 @@
 
 #include "wimlib/alloca.h"
 #include "wimlib/assert.h"
+#include "wimlib/blob_hasher.h"
 #include "wimlib/blob_table.h"
 #include "wimlib/chunk_compressor.h"
 #include "wimlib/endianness.h"
@@ -54,6 +55,7 @@
 #include "wimlib/solid.h"
 #include "wimlib/win32.h" /* win32_rename_replacement() */
 #include "wimlib/write.h"
+#include "wimlib/write_behind.h"
 #include "wimlib/xml.h"
 
 
@@ -63,6 +65,7 @@
 #define WRITE_RESOURCE_FLAG_SOLID		0x00000004
 #define WRITE_RESOURCE_FLAG_SEND_DONE_WITH_FILE	0x00000008
 #define WRITE_RESOURCE_FLAG_SOLID_SORT		0x00000010
+#define WRITE_RESOURCE_FLAG_DIRECT_IO		0x00000020
 
 static int
 write_flags_to_resource_flags(int write_flags)
@@ -86,6 +89,9 @@ write_flags_to_resource_flags(int write_flags)
 	    WIMLIB_WRITE_FLAG_SOLID)
 		write_resource_flags |= WRITE_RESOURCE_FLAG_SOLID_SORT;
 
+	if (write_flags & WIMLIB_WRITE_FLAG_DIRECT_IO)
+		write_resource_flags |= WRITE_RESOURCE_FLAG_DIRECT_IO;
+
 	return write_resource_flags;
 }
 
@@ -271,7 +277,8 @@ blob_set_out_reshdr_for_reuse(struct blob_descriptor *blob)
 /* Write the header for a blob in a pipable WIM.  */
 static int
 write_pwm_blob_header(const struct blob_descriptor *blob,
-		      struct filedes *out_fd, bool compressed)
+		      struct filedes *out_fd, struct write_behind *wb,
+		      bool compressed)
 {
 	struct pwm_blob_hdr blob_hdr;
 	u32 reshdr_flags;
@@ -286,7 +293,7 @@ write_pwm_blob_header(const struct blob_descriptor *blob,
 	if (compressed)
 		reshdr_flags |= WIM_RESHDR_FLAG_COMPRESSED;
 	blob_hdr.flags = cpu_to_le32(reshdr_flags);
-	ret = full_write(out_fd, &blob_hdr, sizeof(blob_hdr));
+	ret = write_behind_write(wb, out_fd, &blob_hdr, sizeof(blob_hdr));
 	if (ret)
 		ERROR_WITH_ERRNO("Error writing blob header to WIM file");
 	return ret;
@@ -342,6 +349,10 @@ struct write_blobs_ctx {
 	/* File descriptor to which the blobs are being written.  */
 	struct filedes *out_fd;
 
+	/* If not NULL, the data being written to @out_fd is handed off to this
+	 * to be written asynchronously.  */
+	struct write_behind *wb;
+
 	/* Blob table for the WIMStruct on whose behalf the blobs are being
 	 * written.  */
 	struct blob_table *blob_table;
@@ -365,6 +376,11 @@ struct write_blobs_ctx {
 	 * uncompressed.  */
 	struct chunk_compressor *compressor;
 
+	/* If not NULL, this is checksumming the unhashed blobs that need to be
+	 * checksummed before they're written, in parallel and ahead of the
+	 * blobs actually being read for writing.  */
+	struct blob_hasher *hasher;
+
 	/* A buffer of size @out_chunk_size that has been loaned out from the
 	 * chunk compressor and is currently being filled with the uncompressed
 	 * data of the next chunk.  */
@@ -457,7 +473,8 @@ begin_chunk_table(struct write_blobs_ctx *ctx, u64 res_expected_size)
 		if (ctx->write_resource_flags & WRITE_RESOURCE_FLAG_SOLID)
 			reserve_size += sizeof(struct alt_chunk_table_header_disk);
 		memset(ctx->chunk_csizes, 0, reserve_size);
-		ret = full_write(ctx->out_fd, ctx->chunk_csizes, reserve_size);
+		ret = write_behind_write(ctx->wb, ctx->out_fd,
+					 ctx->chunk_csizes, reserve_size);
 		if (ret) {
 			ERROR_WITH_ERRNO("Error reserving space for chunk "
 					 "table in WIM file");
@@ -544,7 +561,8 @@ end_chunk_table(struct write_blobs_ctx *ctx, u64 res_actual_size,
 	u64 res_end_offset;
 
 	if (ctx->write_resource_flags & WRITE_RESOURCE_FLAG_PIPABLE) {
-		ret = full_write(ctx->out_fd, ctx->chunk_csizes, chunk_table_size);
+		ret = write_behind_write(ctx->wb, ctx->out_fd,
+					 ctx->chunk_csizes, chunk_table_size);
 		if (ret)
 			goto write_error;
 		res_end_offset = ctx->out_fd->offset;
@@ -567,8 +585,10 @@ end_chunk_table(struct write_blobs_ctx *ctx, u64 res_actual_size,
 			STATIC_ASSERT(WIMLIB_COMPRESSION_TYPE_LZX == 2);
 			STATIC_ASSERT(WIMLIB_COMPRESSION_TYPE_LZMS == 3);
 
-			ret = full_pwrite(ctx->out_fd, &hdr, sizeof(hdr),
-					  chunk_table_offset - sizeof(hdr));
+			ret = write_behind_pwrite(ctx->wb, ctx->out_fd,
+						  &hdr, sizeof(hdr),
+						  chunk_table_offset -
+						  sizeof(hdr));
 			if (ret)
 				goto write_error;
 			res_start_offset = chunk_table_offset - sizeof(hdr);
@@ -576,8 +596,9 @@ end_chunk_table(struct write_blobs_ctx *ctx, u64 res_actual_size,
 			res_start_offset = chunk_table_offset;
 		}
 
-		ret = full_pwrite(ctx->out_fd, ctx->chunk_csizes,
-				  chunk_table_size, chunk_table_offset);
+		ret = write_behind_pwrite(ctx->wb, ctx->out_fd,
+					  ctx->chunk_csizes, chunk_table_size,
+					  chunk_table_offset);
 		if (ret)
 			goto write_error;
 	}
@@ -677,6 +698,51 @@ done_with_blob(struct blob_descriptor *blob, struct write_blobs_ctx *ctx)
 				 ctx->progress_data.progctx);
 }
 
+static inline bool
+blob_needs_hash_before_write(const struct blob_descriptor *blob,
+			     const struct write_blobs_ctx *ctx)
+{
+	return ctx->blob_table != NULL && blob->unhashed && !blob->unique_size;
+}
+
+/*
+ * Start checksumming the blobs in @blob_list that need to be checksummed before
+ * they are written, using multiple threads.  The blobs are checksummed in the
+ * order in which read_blob_list() will read them, so the checksumming runs
+ * ahead of, and concurrently with, the reading and compression of the blobs.
+ */
+static int
+start_hashing_blobs(struct list_head *blob_list, unsigned num_threads,
+		    struct write_blobs_ctx *ctx)
+{
+	struct blob_descriptor *blob;
+	struct blob_descriptor **blobs;
+	size_t num_blobs = 0;
+	int ret;
+
+	list_for_each_entry(blob, blob_list, write_blobs_list)
+		if (blob_needs_hash_before_write(blob, ctx) &&
+		    blob_can_be_hashed_in_parallel(blob))
+			num_blobs++;
+	if (num_blobs < 2)
+		return 0;
+
+	blobs = MALLOC(num_blobs * sizeof(blobs[0]));
+	if (!blobs)
+		return WIMLIB_ERR_NOMEM;
+	num_blobs = 0;
+	list_for_each_entry(blob, blob_list, write_blobs_list)
+		if (blob_needs_hash_before_write(blob, ctx) &&
+		    blob_can_be_hashed_in_parallel(blob))
+			blobs[num_blobs++] = blob;
+
+	ret = new_blob_hasher(blobs, num_blobs, num_threads, &ctx->hasher);
+	FREE(blobs);
+	if (ret < 0) /* Not worthwhile; hash the blobs as they are read.  */
+		ret = 0;
+	return ret;
+}
+
 /* Begin processing a blob for writing.  */
 static int
 write_blob_begin_read(struct blob_descriptor *blob, void *_ctx)
@@ -696,13 +762,15 @@ write_blob_begin_read(struct blob_descriptor *blob, void *_ctx)
 	 * of read_blob_list(), which will still provide the data again to
 	 * write_blob_process_chunk().  This is okay because an unhashed blob
 	 * cannot be in a WIM resource, which might be costly to decompress.  */
-	if (ctx->blob_table != NULL && blob->unhashed && !blob->unique_size) {
+	if (blob_needs_hash_before_write(blob, ctx)) {
 
 		struct blob_descriptor *new_blob;
+		u8 hash[SHA1_HASH_SIZE];
 
-		ret = hash_unhashed_blob(blob, ctx->blob_table, &new_blob);
+		ret = blob_hasher_get_hash(ctx->hasher, blob, hash);
 		if (ret)
 			return ret;
+		new_blob = set_unhashed_blob_hash(blob, hash, ctx->blob_table);
 		if (new_blob != blob) {
 			/* Duplicate blob detected.  */
 
@@ -755,23 +823,41 @@ write_blob_begin_read(struct blob_descriptor *blob, void *_ctx)
 	return 0;
 }
 
+static int
+write_uncompressed_chunk(const struct blob_descriptor *blob, u64 offset,
+			 const void *chunk, size_t size, void *_ctx)
+{
+	struct write_blobs_ctx *ctx = _ctx;
+	int ret = write_behind_write(ctx->wb, ctx->out_fd, chunk, size);
+
+	if (unlikely(ret))
+		ERROR_WITH_ERRNO("Error writing data to WIM file");
+	return ret;
+}
+
 /* Rewrite a blob that was just written compressed (as a non-solid WIM resource)
  * as uncompressed instead.  */
 static int
-write_blob_uncompressed(struct blob_descriptor *blob, struct filedes *out_fd)
+write_blob_uncompressed(struct blob_descriptor *blob,
+			struct write_blobs_ctx *ctx)
 {
+	struct filedes *out_fd = ctx->out_fd;
+	struct read_blob_callbacks cbs = {
+		.continue_blob	= write_uncompressed_chunk,
+		.ctx		= ctx,
+	};
 	int ret;
 	u64 begin_offset = blob->out_reshdr.offset_in_wim;
 	u64 end_offset = out_fd->offset;
 
-	if (filedes_seek(out_fd, begin_offset) == -1)
+	if (write_behind_seek(ctx->wb, out_fd, begin_offset) == -1)
 		return 0;
 
-	ret = extract_blob_to_fd(blob, out_fd, false);
+	ret = read_blob_with_sha1(blob, &cbs, false);
 	if (ret) {
 		/* Error reading the uncompressed data.  */
 		if (out_fd->offset == begin_offset &&
-		    filedes_seek(out_fd, end_offset) != -1)
+		    write_behind_seek(ctx->wb, out_fd, end_offset) != -1)
 		{
 			/* Nothing was actually written yet, and we successfully
 			 * seeked to the end of the compressed resource, so
@@ -861,7 +947,7 @@ maybe_rewrite_blob_uncompressed(struct write_blobs_ctx *ctx,
 		return 0;
 	}
 
-	return write_blob_uncompressed(blob, ctx->out_fd);
+	return write_blob_uncompressed(blob, ctx);
 }
 
 /* Write the next chunk of (typically compressed) data to the output WIM,
@@ -883,7 +969,7 @@ write_chunk(struct write_blobs_ctx *ctx, const void *cchunk,
 		/* Starting to write a new blob in non-solid mode.  */
 
 		if (ctx->write_resource_flags & WRITE_RESOURCE_FLAG_PIPABLE) {
-			ret = write_pwm_blob_header(blob, ctx->out_fd,
+			ret = write_pwm_blob_header(blob, ctx->out_fd, ctx->wb,
 						    ctx->compressor != NULL);
 			if (ret)
 				return ret;
@@ -905,15 +991,15 @@ write_chunk(struct write_blobs_ctx *ctx, const void *cchunk,
 			struct pwm_chunk_hdr chunk_hdr = {
 				.compressed_size = cpu_to_le32(csize),
 			};
-			ret = full_write(ctx->out_fd, &chunk_hdr,
-					 sizeof(chunk_hdr));
+			ret = write_behind_write(ctx->wb, ctx->out_fd,
+						 &chunk_hdr, sizeof(chunk_hdr));
 			if (ret)
 				goto write_error;
 		}
 	}
 
 	/* Write the chunk data.  */
-	ret = full_write(ctx->out_fd, cchunk, csize);
+	ret = write_behind_write(ctx->wb, ctx->out_fd, cchunk, csize);
 	if (ret)
 		goto write_error;
 
@@ -1209,6 +1295,7 @@ write_raw_copy_resource(struct wim_resource_descriptor *in_rdesc,
 	struct filedes *in_fd;
 	struct blob_descriptor *blob;
 	u64 out_offset_in_wim;
+	const u8 *map;
 
 	/* Copy the raw data.  */
 	cur_read_offset = in_rdesc->offset_in_wim;
@@ -1227,7 +1314,33 @@ write_raw_copy_resource(struct wim_resource_descriptor *in_rdesc,
 
 	if (likely(!in_rdesc->wim->being_compacted) ||
 	    in_rdesc->offset_in_wim > out_fd->offset) {
-		do {
+		/* First let the kernel copy as much of the data as it can.  On
+		 * filesystems that support reflinks, this may just share the
+		 * data between the two files.  */
+		ret = copy_data_in_kernel(in_fd, &cur_read_offset,
+					  end_read_offset, out_fd);
+		if (ret) {
+			ERROR_WITH_ERRNO("Error copying raw data to WIM file");
+			return ret;
+		}
+
+		/* Copy the rest, directly from the mapping if the input WIM is
+		 * memory-mapped.  (A WIM being compacted is never mapped, since
+		 * wimlib_overwrite() unmaps it first.)  */
+		map = wim_mapped_data(in_rdesc->wim, cur_read_offset,
+				      end_read_offset - cur_read_offset);
+		if (map) {
+			ret = full_write(out_fd, map,
+					 end_read_offset - cur_read_offset);
+			if (ret) {
+				ERROR_WITH_ERRNO("Error writing raw data "
+						 "to WIM file");
+				return ret;
+			}
+			cur_read_offset = end_read_offset;
+		}
+
+		while (cur_read_offset != end_read_offset) {
 			bytes_to_read = min(sizeof(buf),
 					    end_read_offset - cur_read_offset);
 
@@ -1247,8 +1360,7 @@ write_raw_copy_resource(struct wim_resource_descriptor *in_rdesc,
 			}
 
 			cur_read_offset += bytes_to_read;
-
-		} while (cur_read_offset != end_read_offset);
+		}
 	} else {
 		/* Optimization: the WIM file is being compacted and the
 		 * resource being written is already in the desired location.
@@ -1374,6 +1486,10 @@ init_done_with_file_info(struct list_head *blob_list)
  * @out_fd
  *	The file descriptor, opened for writing, to which to write the blobs.
  *
+ * @out_direct_fd
+ *	If not NULL and valid, a second file descriptor for the same file,
+ *	opened with O_DIRECT, through which to write the bulk of the data.
+ *
  * @write_resource_flags
  *	Flags to modify how the blobs are written:
  *
@@ -1393,6 +1509,10 @@ init_done_with_file_info(struct list_head *blob_list)
  *		version number has been, or will be, set to WIM_VERSION_SOLID.
  *		This flag may not be combined with WRITE_RESOURCE_FLAG_PIPABLE.
  *
+ *	WRITE_RESOURCE_FLAG_DIRECT_IO:
+ *		Drop the data of files on disk from the page cache after reading
+ *		it.
+ *
  * @out_ctype
  *	Compression format to use in the output resources, specified as one of
  *	the WIMLIB_COMPRESSION_TYPE_* constants.  WIMLIB_COMPRESSION_TYPE_NONE
@@ -1470,6 +1590,7 @@ init_done_with_file_info(struct list_head *blob_list)
 static int
 write_blob_list(struct list_head *blob_list,
 		struct filedes *out_fd,
+		const struct filedes *out_direct_fd,
 		int write_resource_flags,
 		int out_ctype,
 		u32 out_chunk_size,
@@ -1545,6 +1666,10 @@ write_blob_list(struct list_head *blob_list,
 					       out_ctype, out_chunk_size,
 					       &raw_copy_blobs);
 
+	ret = start_hashing_blobs(blob_list, num_threads, &ctx);
+	if (ret)
+		goto out_destroy_context;
+
 	/* Unless no data needs to be compressed, allocate a chunk_compressor to
 	 * do compression.  There are serial and parallel implementations of the
 	 * chunk_compressor interface.  We default to parallel using the
@@ -1593,6 +1718,11 @@ write_blob_list(struct list_head *blob_list,
 
 	INIT_LIST_HEAD(&ctx.blobs_being_compressed);
 
+	/* If there's enough data, write it from a separate thread so that
+	 * waiting for the output file doesn't hold up the compression.  */
+	if (num_nonraw_bytes > max(2000000, out_chunk_size))
+		ctx.wb = write_behind_new(ctx.out_fd, out_direct_fd);
+
 	if (write_resource_flags & WRITE_RESOURCE_FLAG_SOLID) {
 
 		INIT_LIST_HEAD(&ctx.blobs_in_solid_resource);
@@ -1617,7 +1747,10 @@ write_blob_list(struct list_head *blob_list,
 			     &cbs,
 			     BLOB_LIST_ALREADY_SORTED |
 				VERIFY_BLOB_HASHES |
-				COMPUTE_MISSING_BLOB_HASHES);
+				COMPUTE_MISSING_BLOB_HASHES |
+				((write_resource_flags &
+				  WRITE_RESOURCE_FLAG_DIRECT_IO) ?
+					DROP_FILE_CACHE : 0));
 
 	if (ret)
 		goto out_destroy_context;
@@ -1650,7 +1783,13 @@ write_blob_list(struct list_head *blob_list,
 		wimlib_assert(offset_in_res == reshdr.uncompressed_size);
 	}
 
+	ret = write_behind_flush(ctx.wb);
+	if (ret)
+		ERROR_WITH_ERRNO("Error writing data to WIM file");
+
 out_destroy_context:
+	write_behind_free(ctx.wb);
+	free_blob_hasher(ctx.hasher);
 	FREE(ctx.chunk_csizes);
 	if (ctx.compressor)
 		ctx.compressor->destroy(ctx.compressor);
@@ -1681,6 +1820,7 @@ write_file_data_blobs(WIMStruct *wim,
 
 	return write_blob_list(blob_list,
 			       &wim->out_fd,
+			       &wim->out_direct_fd,
 			       write_resource_flags,
 			       out_ctype,
 			       out_chunk_size,
@@ -1704,6 +1844,7 @@ write_wim_resource(struct blob_descriptor *blob,
 	blob->will_be_in_output_wim = 1;
 	return write_blob_list(&blob_list,
 			       out_fd,
+			       NULL,
 			       write_resource_flags & ~WRITE_RESOURCE_FLAG_SOLID,
 			       out_ctype,
 			       out_chunk_size,
@@ -2210,7 +2351,8 @@ write_metadata_resources(WIMStruct *wim, int image, int write_flags)
 }
 
 static int
-open_wim_writable(WIMStruct *wim, const tchar *path, int open_flags)
+open_wim_writable(WIMStruct *wim, const tchar *path, int open_flags,
+		  int write_flags)
 {
 	int raw_fd = topen(path, open_flags | O_BINARY, 0644);
 	if (raw_fd < 0) {
@@ -2218,6 +2360,16 @@ open_wim_writable(WIMStruct *wim, const tchar *path, int open_flags)
 		return WIMLIB_ERR_OPEN;
 	}
 	filedes_init(&wim->out_fd, raw_fd);
+#ifdef O_DIRECT
+	/* For direct I/O, open the file a second time with O_DIRECT rather than
+	 * change the flags of the first file descriptor, which is also used for
+	 * the small, unaligned writes.  If this fails, don't use direct I/O.  */
+	if (write_flags & WIMLIB_WRITE_FLAG_DIRECT_IO) {
+		raw_fd = topen(path, O_WRONLY | O_DIRECT | O_BINARY);
+		if (raw_fd >= 0)
+			filedes_init(&wim->out_direct_fd, raw_fd);
+	}
+#endif
 	return 0;
 }
 
@@ -2231,6 +2383,10 @@ close_wim_writable(WIMStruct *wim, int write_flags)
 			if (filedes_close(&wim->out_fd))
 				ret = WIMLIB_ERR_WRITE;
 	filedes_invalidate(&wim->out_fd);
+	if (filedes_valid(&wim->out_direct_fd))
+		if (filedes_close(&wim->out_direct_fd))
+			ret = WIMLIB_ERR_WRITE;
+	filedes_invalidate(&wim->out_direct_fd);
 	return ret;
 }
 
@@ -2827,7 +2983,7 @@ write_wim_part(WIMStruct *wim,
 		/* Filename of WIM to write was provided; open file descriptor
 		 * to it.  */
 		ret = open_wim_writable(wim, (const tchar*)path_or_fd,
-					O_TRUNC | O_CREAT | O_RDWR);
+					O_TRUNC | O_CREAT | O_RDWR, write_flags);
 		if (ret)
 			goto out_cleanup;
 	}
@@ -2905,6 +3061,10 @@ wimlib_write_to_fd(WIMStruct *wim, int fd,
 	if (fd < 0)
 		return WIMLIB_ERR_INVALID_PARAM;
 
+	/* Direct I/O would need another file descriptor for the file.  */
+	if (write_flags & WIMLIB_WRITE_FLAG_DIRECT_IO)
+		return WIMLIB_ERR_INVALID_PARAM;
+
 	write_flags |= WIMLIB_WRITE_FLAG_FILE_DESCRIPTOR;
 
 	return write_standalone_wim(wim, &fd, image, write_flags, num_threads);
@@ -3179,7 +3339,7 @@ overwrite_wim_inplace(WIMStruct *wim, int write_flags, unsigned num_threads)
 	if (ret)
 		goto out;
 
-	ret = open_wim_writable(wim, wim->filename, O_RDWR);
+	ret = open_wim_writable(wim, wim->filename, O_RDWR, write_flags);
 	if (ret)
 		goto out;
 
@@ -3355,6 +3515,10 @@ wimlib_overwrite(WIMStruct *wim, int write_flags, unsigned num_threads)
 	if (ret)
 		return ret;
 
+	/* The file is about to be changed (possibly truncated) or replaced, so
+	 * stop reading it through a memory mapping.  */
+	wim_unmap_file(wim);
+
 	if (can_overwrite_wim_inplace(wim, write_flags)) {
 		ret = overwrite_wim_inplace(wim, write_flags, num_threads);
 		if (ret != WIMLIB_ERR_RESOURCE_ORDER)
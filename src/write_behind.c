@@ -0,0 +1,594 @@
+/*
+ * write_behind.c - asynchronous writing of WIM file data
+ */
+
+/*
+ * Copyright (C) 2023 Eric Biggers
+ *
+ * This file is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This file is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this file; if not, see https://www.gnu.org/licenses/.
+ */
+
+/*
+ * When writing a WIM file, the thread that writes the compressed chunks to the
+ * output file is also the one that feeds uncompressed data to the chunk
+ * compressor.  If it blocks in write() because the output storage is slow, the
+ * compressor threads run out of work.
+ *
+ * A 'struct write_behind' lets that thread hand off its writes instead.  The
+ * data is copied into large buffers, and each full buffer is queued to a
+ * dedicated I/O thread, which writes runs of contiguous buffers with pwritev().
+ * The file offset tracked in the 'struct filedes' is advanced right away, as if
+ * the data had been written.  Writes to earlier parts of the file (the chunk
+ * tables, which are filled in after the chunks) are patched into the buffer
+ * still being filled if they fall within it, or else are queued in order
+ * behind the data they overwrite.
+ *
+ * An error from the I/O thread is remembered and returned by the next call
+ * that has to wait for the I/O thread, or at the latest by
+ * write_behind_flush().  Before the file descriptor is used directly again,
+ * write_behind_flush() must be called; it waits for all the writes and then
+ * moves the file position to the tracked offset.
+ *
+ * With direct I/O, the I/O thread writes the block-aligned part of each buffer
+ * through a second file descriptor that the caller opened with O_DIRECT, so
+ * that the WIM data doesn't push everything else out of the page cache.  Each
+ * buffer is filled starting at the same offset modulo the alignment as its
+ * data's offset in the file, so that part is aligned in memory too.  The unaligned ends of the buffers, at the
+ * boundaries of the resources, and the patches are written normally.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <errno.h>
+#include <string.h>
+#ifdef HAVE_PWRITEV
+#  include <sys/uio.h>
+#endif
+#include <unistd.h>
+
+#include "wimlib/error.h"
+#include "wimlib/list.h"
+#include "wimlib/threads.h"
+#include "wimlib/util.h"
+#include "wimlib/write_behind.h"
+
+/* Size of each buffer of data, and the maximum number of buffers  */
+#define WRITE_BEHIND_BUF_SIZE		((size_t)1 << 22)
+#define WRITE_BEHIND_MAX_BUFS		8
+
+/* Always allow this many buffers, regardless of the memory budget  */
+#define WRITE_BEHIND_MIN_BUFS		2
+
+/* Maximum number of buffers written with a single system call  */
+#define WRITE_BEHIND_MAX_IOVS		WRITE_BEHIND_MAX_BUFS
+
+/* Alignment of the buffers  */
+#define WRITE_BEHIND_BUF_ALIGNMENT	4096
+
+struct write_behind_buf {
+	struct list_head list;
+
+	/* The data, which is at @offset in the file, and the space available
+	 * for it  */
+	u8 *data;
+	size_t size;
+	size_t capacity;
+	u64 offset;
+
+	/* The memory allocated for the data  */
+	u8 *mem;
+
+	/* If true, this buffer holds data for an earlier part of the file, was
+	 * allocated just for that, and is freed after being written.  */
+	bool is_patch;
+};
+
+struct write_behind {
+	struct filedes *fd;
+
+	/* If valid, a file descriptor for the same file opened with O_DIRECT,
+	 * with which the aligned data is written  */
+	struct filedes direct_fd;
+
+	struct mutex lock;
+	struct condvar work_avail_cond;
+	struct condvar write_done_cond;
+	struct thread thread;
+	bool terminating;
+
+	/* Buffers waiting to be written, in order  */
+	struct list_head queue;
+
+	/* Buffers available to be filled  */
+	struct list_head free_bufs;
+	unsigned num_bufs;
+
+	/* True while the I/O thread is writing buffers it took off the queue */
+	bool busy;
+
+	/* First error from the I/O thread, and the errno that came with it  */
+	int status;
+	int status_errno;
+
+	/* Buffer currently being filled by the main thread, or NULL  */
+	struct write_behind_buf *cur;
+};
+
+/* Write data, which must be aligned, with O_DIRECT.  Returns -1 if the file
+ * doesn't support O_DIRECT.  */
+static int
+pwrite_direct(struct write_behind *wb, const u8 *data, size_t size, u64 offset)
+{
+	int ret = full_pwrite(&wb->direct_fd, data, size, offset);
+
+	if (ret && errno == EINVAL)
+		return -1;
+	return ret;
+}
+
+/* Write a buffer with O_DIRECT, except for the unaligned data at its ends.  If
+ * O_DIRECT turns out not to work, stop using it.  */
+static int
+write_buffer_direct(struct write_behind *wb, struct write_behind_buf *buf)
+{
+	const u64 align = WRITE_BEHIND_BUF_ALIGNMENT;
+	u64 start = buf->offset;
+	u64 end = buf->offset + buf->size;
+	u64 aligned_start = ALIGN(start, align);
+	u64 aligned_end = end & ~(align - 1);
+	int ret;
+
+	if (buf->is_patch || aligned_start >= aligned_end)
+		return full_pwrite(wb->fd, buf->data, buf->size, start);
+
+	ret = full_pwrite(wb->fd, buf->data, aligned_start - start, start);
+	if (ret)
+		return ret;
+	ret = full_pwrite(wb->fd, &buf->data[aligned_end - start],
+			  end - aligned_end, aligned_end);
+	if (ret)
+		return ret;
+	ret = pwrite_direct(wb, &buf->data[aligned_start - start],
+			    aligned_end - aligned_start, aligned_start);
+	if (ret >= 0)
+		return ret;
+	filedes_invalidate(&wb->direct_fd);
+	return full_pwrite(wb->fd, &buf->data[aligned_start - start],
+			   aligned_end - aligned_start, aligned_start);
+}
+
+/* Write @n buffers, which are contiguous in the file.  */
+static int
+write_buffers(struct write_behind *wb, struct write_behind_buf **bufs,
+	      unsigned n)
+{
+	if (filedes_valid(&wb->direct_fd)) {
+		for (unsigned i = 0; i < n; i++) {
+			int ret = write_buffer_direct(wb, bufs[i]);
+			if (ret)
+				return ret;
+		}
+		return 0;
+	}
+#ifdef HAVE_PWRITEV
+	struct iovec iovs[WRITE_BEHIND_MAX_IOVS];
+	struct iovec *iov = iovs;
+	u64 offset = bufs[0]->offset;
+
+	for (unsigned i = 0; i < n; i++) {
+		iovs[i].iov_base = bufs[i]->data;
+		iovs[i].iov_len = bufs[i]->size;
+	}
+	while (n) {
+		ssize_t ret = pwritev(wb->fd->fd, iov, n, offset);
+		if (unlikely(ret < 0)) {
+			if (errno == EINTR)
+				continue;
+			return WIMLIB_ERR_WRITE;
+		}
+		offset += ret;
+		while (n && (size_t)ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			n--;
+		}
+		if (n) {
+			iov->iov_base += ret;
+			iov->iov_len -= ret;
+		}
+	}
+	return 0;
+#else
+	for (unsigned i = 0; i < n; i++) {
+		int ret = full_pwrite(wb->fd, bufs[i]->data, bufs[i]->size,
+				      bufs[i]->offset);
+		if (ret)
+			return ret;
+	}
+	return 0;
+#endif
+}
+
+static void *
+write_behind_thread(void *arg)
+{
+	struct write_behind *wb = arg;
+	struct write_behind_buf *bufs[WRITE_BEHIND_MAX_IOVS];
+	struct write_behind_buf *buf;
+
+	mutex_lock(&wb->lock);
+	for (;;) {
+		unsigned n = 0;
+		u64 end = 0;
+		bool failed;
+		int ret = 0;
+		int saved_errno = 0;
+
+		while (list_empty(&wb->queue) && !wb->terminating)
+			condvar_wait(&wb->work_avail_cond, &wb->lock);
+		if (list_empty(&wb->queue))
+			break;
+
+		/* Take the longest run of contiguous buffers from the front of
+		 * the queue.  */
+		list_for_each_entry(buf, &wb->queue, list) {
+			if (n == WRITE_BEHIND_MAX_IOVS ||
+			    (n != 0 && buf->offset != end))
+				break;
+			bufs[n++] = buf;
+			end = buf->offset + buf->size;
+		}
+		for (unsigned i = 0; i < n; i++)
+			list_del(&bufs[i]->list);
+		wb->busy = true;
+		failed = (wb->status != 0);
+		mutex_unlock(&wb->lock);
+
+		/* After an error, just discard the remaining data.  */
+		if (!failed) {
+			ret = write_buffers(wb, bufs, n);
+			saved_errno = errno;
+		}
+
+		mutex_lock(&wb->lock);
+		if (ret && !wb->status) {
+			wb->status = ret;
+			wb->status_errno = saved_errno;
+		}
+		for (unsigned i = 0; i < n; i++) {
+			if (bufs[i]->is_patch)
+				FREE(bufs[i]);
+			else
+				list_add(&bufs[i]->list, &wb->free_bufs);
+		}
+		wb->busy = false;
+		condvar_signal(&wb->write_done_cond);
+	}
+	mutex_unlock(&wb->lock);
+	return NULL;
+}
+
+/*
+ * Start writing behind to the specified file, which is positioned at the
+ * offset recorded in @fd.  If @direct_fd is not NULL and is valid, it must be
+ * another file descriptor for the same file, opened with O_DIRECT, and it's
+ * used to bypass the page cache where possible; it isn't closed by
+ * write_behind_free().  Returns NULL if the file can't be written
+ * asynchronously (e.g. because it's a pipe) or if the I/O thread couldn't be
+ * created; then the caller should just write synchronously.
+ */
+struct write_behind *
+write_behind_new(struct filedes *fd, const struct filedes *direct_fd)
+{
+	struct write_behind *wb;
+
+	if (!filedes_is_seekable(fd))
+		return NULL;
+
+	wb = CALLOC(1, sizeof(*wb));
+	if (!wb)
+		return NULL;
+	wb->fd = fd;
+	if (direct_fd)
+		wb->direct_fd = *direct_fd;
+	else
+		filedes_invalidate(&wb->direct_fd);
+	INIT_LIST_HEAD(&wb->queue);
+	INIT_LIST_HEAD(&wb->free_bufs);
+
+	if (!mutex_init(&wb->lock))
+		goto err;
+	if (!condvar_init(&wb->work_avail_cond))
+		goto err_destroy_lock;
+	if (!condvar_init(&wb->write_done_cond))
+		goto err_destroy_work_avail_cond;
+	if (!thread_create(&wb->thread, write_behind_thread, wb))
+		goto err_destroy_write_done_cond;
+	return wb;
+
+err_destroy_write_done_cond:
+	condvar_destroy(&wb->write_done_cond);
+err_destroy_work_avail_cond:
+	condvar_destroy(&wb->work_avail_cond);
+err_destroy_lock:
+	mutex_destroy(&wb->lock);
+err:
+	FREE(wb);
+	return NULL;
+}
+
+/* Return the I/O thread's error, with errno restored.  */
+static int
+get_status(struct write_behind *wb)
+{
+	if (wb->status)
+		errno = wb->status_errno;
+	return wb->status;
+}
+
+static void
+queue_buffer(struct write_behind *wb, struct write_behind_buf *buf)
+{
+	mutex_lock(&wb->lock);
+	list_add_tail(&buf->list, &wb->queue);
+	condvar_signal(&wb->work_avail_cond);
+	mutex_unlock(&wb->lock);
+}
+
+static struct write_behind_buf *
+new_buffer(void)
+{
+	struct write_behind_buf *buf = MALLOC(sizeof(*buf));
+
+	if (!buf)
+		return NULL;
+	buf->mem = ALIGNED_MALLOC(WRITE_BEHIND_BUF_SIZE,
+				  WRITE_BEHIND_BUF_ALIGNMENT);
+	if (!buf->mem) {
+		FREE(buf);
+		return NULL;
+	}
+	buf->is_patch = false;
+	return buf;
+}
+
+/* Get an empty buffer to fill, waiting for one to be written if needed.  */
+static int
+get_buffer(struct write_behind *wb, struct write_behind_buf **buf_ret)
+{
+	struct write_behind_buf *buf;
+	int ret;
+
+	mutex_lock(&wb->lock);
+	for (;;) {
+		ret = get_status(wb);
+		if (ret)
+			goto out_unlock;
+		if (!list_empty(&wb->free_bufs)) {
+			buf = list_first_entry(&wb->free_bufs,
+					       struct write_behind_buf, list);
+			list_del(&buf->list);
+			break;
+		}
+		if (wb->num_bufs < WRITE_BEHIND_MIN_BUFS ||
+		    (wb->num_bufs < WRITE_BEHIND_MAX_BUFS &&
+		     get_memory_budget() >= WRITE_BEHIND_BUF_SIZE))
+		{
+			buf = new_buffer();
+			if (buf) {
+				/* The minimum buffers are always allowed, so
+				 * only the ones beyond them are charged.  */
+				if (wb->num_bufs++ >= WRITE_BEHIND_MIN_BUFS)
+					charge_memory(WRITE_BEHIND_BUF_SIZE);
+				break;
+			}
+			if (wb->num_bufs == 0) {
+				errno = ENOMEM;
+				ret = WIMLIB_ERR_NOMEM;
+				goto out_unlock;
+			}
+		}
+		/* All the buffers are queued or being written.  */
+		condvar_wait(&wb->write_done_cond, &wb->lock);
+	}
+	buf->offset = wb->fd->offset;
+	buf->data = &buf->mem[buf->offset % WRITE_BEHIND_BUF_ALIGNMENT];
+	buf->size = 0;
+	buf->capacity = WRITE_BEHIND_BUF_SIZE -
+			(buf->offset % WRITE_BEHIND_BUF_ALIGNMENT);
+	*buf_ret = buf;
+out_unlock:
+	mutex_unlock(&wb->lock);
+	return ret;
+}
+
+/* Queue the buffer being filled, if it contains anything.  */
+static void
+release_current_buffer(struct write_behind *wb)
+{
+	struct write_behind_buf *cur = wb->cur;
+
+	if (!cur)
+		return;
+	wb->cur = NULL;
+	if (cur->size) {
+		queue_buffer(wb, cur);
+	} else {
+		mutex_lock(&wb->lock);
+		list_add(&cur->list, &wb->free_bufs);
+		mutex_unlock(&wb->lock);
+	}
+}
+
+/*
+ * Write @count bytes from @buf at the current offset of @fd, as full_write()
+ * would.  If @wb is NULL, this just calls full_write().
+ */
+int
+write_behind_write(struct write_behind *wb, struct filedes *fd,
+		   const void *buf, size_t count)
+{
+	int ret;
+
+	if (!wb)
+		return full_write(fd, buf, count);
+
+	while (count) {
+		struct write_behind_buf *cur = wb->cur;
+		size_t n;
+
+		if (!cur) {
+			ret = get_buffer(wb, &cur);
+			if (ret)
+				return ret;
+			wb->cur = cur;
+		}
+		n = min(count, cur->capacity - cur->size);
+		memcpy(&cur->data[cur->size], buf, n);
+		cur->size += n;
+		fd->offset += n;
+		buf += n;
+		count -= n;
+		if (cur->size == cur->capacity) {
+			queue_buffer(wb, cur);
+			wb->cur = NULL;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Write @count bytes from @buf at the specified offset of @fd, as full_pwrite()
+ * would.  The region must already have been written.  If @wb is NULL, this
+ * just calls full_pwrite().
+ */
+int
+write_behind_pwrite(struct write_behind *wb, struct filedes *fd,
+		    const void *buf, size_t count, u64 offset)
+{
+	struct write_behind_buf *cur = wb ? wb->cur : NULL;
+	struct write_behind_buf *patch;
+
+	if (!wb)
+		return full_pwrite(fd, buf, count, offset);
+
+	if (count == 0)
+		return 0;
+
+	if (cur) {
+		if (offset >= cur->offset &&
+		    offset + count <= cur->offset + cur->size) {
+			/* The region hasn't been queued yet, so just update
+			 * it in the buffer.  */
+			memcpy(&cur->data[offset - cur->offset], buf, count);
+			return 0;
+		}
+		if (offset + count > cur->offset) {
+			/* The region overlaps the buffer; the patch must be
+			 * written after it.  */
+			queue_buffer(wb, cur);
+			wb->cur = NULL;
+		}
+	}
+
+	patch = MALLOC(sizeof(*patch) + count);
+	if (!patch)
+		return WIMLIB_ERR_NOMEM;
+	patch->data = (u8 *)(patch + 1);
+	memcpy(patch->data, buf, count);
+	patch->size = count;
+	patch->offset = offset;
+	patch->is_patch = true;
+	queue_buffer(wb, patch);
+	return 0;
+}
+
+/*
+ * Move the offset at which write_behind_write() writes to @offset, as
+ * filedes_seek() would.  Data written from there replaces whatever was given
+ * for that part of the file before.  If @wb is NULL, this just calls
+ * filedes_seek().
+ */
+off_t
+write_behind_seek(struct write_behind *wb, struct filedes *fd, off_t offset)
+{
+	if (!wb)
+		return filedes_seek(fd, offset);
+
+	release_current_buffer(wb);
+	fd->offset = offset;
+	return offset;
+}
+
+/*
+ * Wait for all data given to the write-behind to be written, then position the
+ * file at the offset recorded in its 'struct filedes', so that it can be used
+ * directly.  Returns 0, or the error that occurred while writing the data with
+ * errno set.  If @wb is NULL, this does nothing.
+ */
+int
+write_behind_flush(struct write_behind *wb)
+{
+	int ret;
+
+	if (!wb)
+		return 0;
+
+	release_current_buffer(wb);
+
+	mutex_lock(&wb->lock);
+	while (!list_empty(&wb->queue) || wb->busy)
+		condvar_wait(&wb->write_done_cond, &wb->lock);
+	ret = get_status(wb);
+	mutex_unlock(&wb->lock);
+	if (ret)
+		return ret;
+
+	if (lseek(wb->fd->fd, wb->fd->offset, SEEK_SET) == -1)
+		return WIMLIB_ERR_WRITE;
+	return 0;
+}
+
+/* Stop writing behind.  Data that was queued is still written, but errors are
+ * ignored; call write_behind_flush() first to get them.  */
+void
+write_behind_free(struct write_behind *wb)
+{
+	struct write_behind_buf *buf, *tmp;
+
+	if (!wb)
+		return;
+
+	release_current_buffer(wb);
+
+	mutex_lock(&wb->lock);
+	wb->terminating = true;
+	condvar_signal(&wb->work_avail_cond);
+	mutex_unlock(&wb->lock);
+	thread_join(&wb->thread);
+
+	list_for_each_entry_safe(buf, tmp, &wb->free_bufs, list) {
+		ALIGNED_FREE(buf->mem);
+		FREE(buf);
+	}
+	if (wb->num_bufs > WRITE_BEHIND_MIN_BUFS)
+		uncharge_memory((u64)(wb->num_bufs - WRITE_BEHIND_MIN_BUFS) *
+				WRITE_BEHIND_BUF_SIZE);
+	condvar_destroy(&wb->write_done_cond);
+	condvar_destroy(&wb->work_avail_cond);
+	mutex_destroy(&wb->lock);
+	FREE(wb);
+}
@@ -0,0 +1,813 @@
+/*
+ * Tests for parts of the library API that wimlib-imagex doesn't reach
+ *
+ * The tests capture a directory tree whose contents are known into WIM files
+ * of several formats, then read the WIMs back in different ways and compare
+ * the data against the known contents.  With no arguments, all tests are run;
+ * otherwise, only the tests that are named on the command line.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#include "wimlib.h"
+
+#define TEST_SUBDIR		"tmpdir_wimlib_api_tests"
+#define IN_DIR			"in.dir"
+#define OUT_DIR			"out.dir"
+#define NUM_THREADS		4
+
+#define ARRAY_LEN(A)		(sizeof(A) / sizeof((A)[0]))
+
+static void __attribute__((noreturn, format(printf, 2, 3)))
+failed(int line, const char *format, ...)
+{
+	va_list va;
+
+	fprintf(stderr, "wimlib_api_tests.c:%d: ", line);
+	va_start(va, format);
+	vfprintf(stderr, format, va);
+	va_end(va);
+	fputc('\n', stderr);
+	exit(1);
+}
+
+#define CHECK(cond)							\
+do {									\
+	if (!(cond))							\
+		failed(__LINE__, "check failed: %s", #cond);		\
+} while (0)
+
+#define CHECK_RET(expr)							\
+do {									\
+	int _ret = (expr);						\
+	if (_ret != 0)							\
+		failed(__LINE__, "%s failed: %s", #expr,		\
+		       wimlib_get_error_string(_ret));			\
+} while (0)
+
+struct test_file {
+	const char *path;
+	size_t size;
+	uint8_t *data;
+};
+
+/* The files of the test tree.  Their contents are generated by
+ * init_test_files().  */
+static struct test_file files[] = {
+	{ "empty" },
+	{ "text" },		/* compressible, several MB */
+	{ "random" },		/* incompressible */
+	{ "sparse" },		/* mostly a hole */
+	{ "dir/dup1" },		/* three copies of the same data */
+	{ "dir/dup2" },
+	{ "dir/subdir/dup3" },
+	{ "dir/subdir/odd" },	/* size not a multiple of any chunk size */
+	{ "small/0" }, { "small/1" }, { "small/2" }, { "small/3" },
+	{ "small/4" }, { "small/5" }, { "small/6" }, { "small/7" },
+	{ "small/8" }, { "small/9" }, { "small/10" }, { "small/11" },
+	{ "small/12" }, { "small/13" }, { "small/14" }, { "small/15" },
+};
+
+#define HARDLINK_PATH	"text_link"
+#define HARDLINK_TARGET	"text"
+
+/* The WIM formats that the test tree is written in  */
+static const struct {
+	const char *path;
+	int ctype;
+	int write_flags;
+} wim_formats[] = {
+	{ "lzx.wim", WIMLIB_COMPRESSION_TYPE_LZX, 0 },
+	{ "solid.wim", WIMLIB_COMPRESSION_TYPE_LZMS, WIMLIB_WRITE_FLAG_SOLID },
+	{ "pipable.wim", WIMLIB_COMPRESSION_TYPE_XPRESS,
+	  WIMLIB_WRITE_FLAG_PIPABLE },
+	{ "uncompressed.wim", WIMLIB_COMPRESSION_TYPE_NONE, 0 },
+};
+
+static uint64_t rand_state = 0x9E3779B97F4A7C15;
+
+static uint32_t
+next_rand(void)
+{
+	rand_state ^= rand_state << 13;
+	rand_state ^= rand_state >> 7;
+	rand_state ^= rand_state << 17;
+	return rand_state >> 32;
+}
+
+static uint8_t *
+alloc_data(size_t size)
+{
+	uint8_t *data = malloc(size ? size : 1);
+
+	CHECK(data != NULL);
+	return data;
+}
+
+static void
+fill_text(uint8_t *data, size_t size)
+{
+	size_t i = 0;
+
+	while (i < size) {
+		char line[32];
+		int len = snprintf(line, sizeof(line), "%u %u\n",
+				   (unsigned)i, next_rand() % 1000);
+
+		for (int j = 0; j < len && i < size; j++)
+			data[i++] = line[j];
+	}
+}
+
+static void
+fill_random(uint8_t *data, size_t size)
+{
+	for (size_t i = 0; i < size; i++)
+		data[i] = next_rand();
+}
+
+static void
+init_test_files(void)
+{
+	for (size_t i = 0; i < ARRAY_LEN(files); i++) {
+		struct test_file *f = &files[i];
+
+		if (!strcmp(f->path, "empty")) {
+			f->size = 0;
+			f->data = alloc_data(0);
+		} else if (!strcmp(f->path, "text")) {
+			f->size = 6000000;
+			f->data = alloc_data(f->size);
+			fill_text(f->data, f->size);
+		} else if (!strcmp(f->path, "random")) {
+			f->size = 2000000;
+			f->data = alloc_data(f->size);
+			fill_random(f->data, f->size);
+		} else if (!strcmp(f->path, "sparse")) {
+			f->size = 4000000;
+			f->data = alloc_data(f->size);
+			memset(f->data, 0, f->size);
+			fill_text(&f->data[3000000], 100000);
+		} else if (!strcmp(f->path, "dir/dup1")) {
+			f->size = 1000000;
+			f->data = alloc_data(f->size);
+			fill_text(f->data, f->size);
+		} else if (!strncmp(f->path, "dir/", 4) &&
+			   strstr(f->path, "dup")) {
+			f->size = files[i - 1].size;
+			f->data = alloc_data(f->size);
+			memcpy(f->data, files[i - 1].data, f->size);
+		} else if (!strcmp(f->path, "dir/subdir/odd")) {
+			f->size = 3 * 65536 + 12345;
+			f->data = alloc_data(f->size);
+			fill_text(f->data, f->size);
+		} else {
+			f->size = next_rand() % 20000;
+			f->data = alloc_data(f->size);
+			fill_text(f->data, f->size);
+		}
+	}
+}
+
+static void
+make_parent_dirs(const char *path)
+{
+	char buf[256];
+
+	snprintf(buf, sizeof(buf), "%s", path);
+	for (char *p = strchr(buf, '/'); p; p = strchr(p + 1, '/')) {
+		*p = '\0';
+		CHECK(mkdir(buf, 0755) == 0 || errno == EEXIST);
+		*p = '/';
+	}
+}
+
+static void
+create_test_tree(const char *dir)
+{
+	char path[256];
+	char link_path[256];
+
+	CHECK(mkdir(dir, 0755) == 0);
+	for (size_t i = 0; i < ARRAY_LEN(files); i++) {
+		const struct test_file *f = &files[i];
+		int fd;
+
+		snprintf(path, sizeof(path), "%s/%s", dir, f->path);
+		make_parent_dirs(path);
+		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		CHECK(fd >= 0);
+		if (!strcmp(f->path, "sparse")) {
+			/* Leave holes around the data.  */
+			CHECK(ftruncate(fd, f->size) == 0);
+			CHECK(pwrite(fd, &f->data[3000000], 100000,
+				     3000000) == 100000);
+		} else {
+			CHECK(write(fd, f->data, f->size) == (ssize_t)f->size);
+		}
+		CHECK(close(fd) == 0);
+	}
+
+	snprintf(path, sizeof(path), "%s/%s", dir, HARDLINK_TARGET);
+	snprintf(link_path, sizeof(link_path), "%s/%s", dir, HARDLINK_PATH);
+	CHECK(link(path, link_path) == 0);
+}
+
+static int
+remove_file(const char *path, const struct stat *st, int type,
+	    struct FTW *ftw)
+{
+	return remove(path);
+}
+
+static void
+remove_tree(const char *dir)
+{
+	CHECK(nftw(dir, remove_file, 16, FTW_DEPTH | FTW_PHYS) == 0 ||
+	      errno == ENOENT);
+}
+
+static void
+check_extracted_file(const char *dir, const struct test_file *f)
+{
+	char path[256];
+	struct stat st;
+	uint8_t *buf;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, f->path);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		failed(__LINE__, "%s wasn't extracted", path);
+	CHECK(fstat(fd, &st) == 0);
+	if (st.st_size != f->size)
+		failed(__LINE__, "%s: size is %lld, expected %zu", path,
+		       (long long)st.st_size, f->size);
+	buf = alloc_data(f->size);
+	CHECK(pread(fd, buf, f->size, 0) == (ssize_t)f->size);
+	if (memcmp(buf, f->data, f->size))
+		failed(__LINE__, "%s: contents differ", path);
+	free(buf);
+	CHECK(close(fd) == 0);
+}
+
+static void
+check_extracted_tree(const char *dir)
+{
+	char path[256];
+	struct stat st1, st2;
+
+	for (size_t i = 0; i < ARRAY_LEN(files); i++)
+		check_extracted_file(dir, &files[i]);
+
+	snprintf(path, sizeof(path), "%s/%s", dir, HARDLINK_TARGET);
+	CHECK(stat(path, &st1) == 0);
+	snprintf(path, sizeof(path), "%s/%s", dir, HARDLINK_PATH);
+	CHECK(stat(path, &st2) == 0);
+	if (st1.st_ino != st2.st_ino)
+		failed(__LINE__, "hard link wasn't extracted");
+}
+
+/* Capture the test tree into a new WIM file.  */
+static void
+write_wim(const char *wim_path, int ctype, int write_flags)
+{
+	WIMStruct *wim;
+
+	CHECK_RET(wimlib_create_new_wim(ctype, &wim));
+	/* With the default solid chunk size, each random read would have to
+	 * decompress the whole resource again when the chunk doesn't fit in
+	 * the chunk cache.  */
+	CHECK_RET(wimlib_set_output_pack_chunk_size(wim, 1 << 16));
+	CHECK_RET(wimlib_add_image(wim, IN_DIR, "test", NULL, 0));
+	CHECK_RET(wimlib_write(wim, wim_path, WIMLIB_ALL_IMAGES, write_flags,
+			       NUM_THREADS));
+	wimlib_free(wim);
+}
+
+/* Capture the test tree into a WIM file of each format.  */
+static void
+write_wims(int extra_write_flags)
+{
+	for (size_t i = 0; i < ARRAY_LEN(wim_formats); i++)
+		write_wim(wim_formats[i].path, wim_formats[i].ctype,
+			  wim_formats[i].write_flags | extra_write_flags);
+}
+
+/* Extract the image with multiple threads and check the result.  */
+static void
+extract_and_check(WIMStruct *wim)
+{
+	CHECK_RET(wimlib_set_decompression_threads(wim, NUM_THREADS));
+	CHECK_RET(wimlib_extract_image(wim, 1, OUT_DIR, 0));
+	check_extracted_tree(OUT_DIR);
+	remove_tree(OUT_DIR);
+}
+
+/* Open each of the WIMs written by write_wims() and extract and verify it.  */
+static void
+check_wims(int open_flags)
+{
+	for (size_t i = 0; i < ARRAY_LEN(wim_formats); i++) {
+		WIMStruct *wim;
+
+		CHECK_RET(wimlib_open_wim(wim_formats[i].path, open_flags,
+					  &wim));
+		extract_and_check(wim);
+		CHECK_RET(wimlib_verify_wim(wim, 0));
+		wimlib_free(wim);
+	}
+}
+
+/* Read a file through @reader in pieces of @piece_size bytes, forwards or
+ * backwards, and compare the data.  Each read asks for more than is left at
+ * the end of the file.  */
+static void
+check_file_reads(struct wimlib_file_reader *reader, const struct test_file *f,
+		 size_t piece_size, bool backwards)
+{
+	size_t num_pieces = f->size / piece_size + 1;
+	uint8_t *buf = alloc_data(piece_size + 100);
+
+	for (size_t i = 0; i < num_pieces; i++) {
+		size_t piece = backwards ? num_pieces - 1 - i : i;
+		uint64_t offset = (uint64_t)piece * piece_size;
+		size_t expected = f->size - offset < piece_size ?
+				  f->size - offset : piece_size;
+		size_t bytes_read;
+
+		CHECK_RET(wimlib_read_file_reader(reader, buf, piece_size + 100,
+						  offset, &bytes_read));
+		if (expected < piece_size)
+			CHECK(bytes_read == expected);
+		else
+			CHECK(bytes_read >= expected);
+		if (memcmp(buf, &f->data[offset], expected))
+			failed(__LINE__, "%s: data read at %llu differs",
+			       f->path, (unsigned long long)offset);
+	}
+	free(buf);
+}
+
+/* Decompression of resources by multiple threads  */
+static void
+test_parallel_decompression(void)
+{
+	check_wims(0);
+}
+
+/* Random-access reads with the cache of decompressed chunks disabled, smaller
+ * than a chunk, big enough for a few chunks, and at its default size.  The
+ * pieces are read backwards too, so that they don't just hit the chunk that
+ * the previous read decompressed.  */
+static void
+test_chunk_cache(void)
+{
+	const int64_t cache_sizes[] = { 0, 4096, 1 << 20, -1 };
+
+	for (size_t i = 0; i < ARRAY_LEN(wim_formats); i++) {
+		for (size_t j = 0; j < ARRAY_LEN(cache_sizes); j++) {
+			WIMStruct *wim;
+
+			CHECK_RET(wimlib_open_wim(wim_formats[i].path, 0,
+						  &wim));
+			if (cache_sizes[j] >= 0)
+				CHECK_RET(wimlib_set_chunk_cache_size(
+						wim, cache_sizes[j]));
+			for (size_t k = 0; k < ARRAY_LEN(files); k++) {
+				struct wimlib_file_reader *reader;
+
+				CHECK_RET(wimlib_open_file_reader(
+						wim, 1, files[k].path,
+						&reader));
+				check_file_reads(reader, &files[k], 4097,
+						 true);
+				check_file_reads(reader, &files[k], 100000,
+						 false);
+				wimlib_close_file_reader(reader);
+			}
+			wimlib_free(wim);
+		}
+	}
+}
+
+static const struct test_file *
+find_test_file(const char *path)
+{
+	for (size_t i = 0; i < ARRAY_LEN(files); i++)
+		if (!strcmp(files[i].path, path))
+			return &files[i];
+	failed(__LINE__, "%s isn't a test file", path);
+}
+
+/* The file reader API: sizes, errors, reads at and past the end of the file,
+ * and reads that straddle chunk boundaries  */
+static void
+test_file_reader(void)
+{
+	for (size_t i = 0; i < ARRAY_LEN(wim_formats); i++) {
+		struct wimlib_file_reader *reader;
+		WIMStruct *wim;
+		uint8_t buf[4];
+		size_t bytes_read;
+
+		CHECK_RET(wimlib_open_wim(wim_formats[i].path, 0, &wim));
+
+		wimlib_set_print_errors(false);
+		CHECK(wimlib_open_file_reader(wim, 1, "dir", &reader) ==
+		      WIMLIB_ERR_NOT_A_REGULAR_FILE);
+		CHECK(wimlib_open_file_reader(wim, 1, "nonexistent",
+					      &reader) ==
+		      WIMLIB_ERR_PATH_DOES_NOT_EXIST);
+		CHECK(wimlib_open_file_reader(wim, 2, "text", &reader) ==
+		      WIMLIB_ERR_INVALID_IMAGE);
+		wimlib_set_print_errors(true);
+
+		for (size_t j = 0; j < ARRAY_LEN(files); j++) {
+			const struct test_file *f = &files[j];
+			uint8_t *data = alloc_data(f->size);
+
+			CHECK_RET(wimlib_open_file_reader(wim, 1, f->path,
+							  &reader));
+			CHECK(wimlib_get_file_reader_size(reader) == f->size);
+
+			/* The whole file at once  */
+			CHECK_RET(wimlib_read_file_reader(reader, data,
+							  f->size, 0,
+							  &bytes_read));
+			CHECK(bytes_read == f->size);
+			CHECK(!memcmp(data, f->data, f->size));
+
+			/* Four bytes around each 32 KiB boundary  */
+			for (uint64_t off = 32768; off < f->size; off += 32768) {
+				CHECK_RET(wimlib_read_file_reader(
+						reader, buf, 4, off - 2,
+						&bytes_read));
+				CHECK(bytes_read == 4);
+				CHECK(!memcmp(buf, &f->data[off - 2], 4));
+			}
+
+			/* At and past the end of the file  */
+			CHECK_RET(wimlib_read_file_reader(reader, buf, 4,
+							  f->size,
+							  &bytes_read));
+			CHECK(bytes_read == 0);
+			CHECK_RET(wimlib_read_file_reader(reader, buf, 4,
+							  f->size + 1000000,
+							  &bytes_read));
+			CHECK(bytes_read == 0);
+
+			wimlib_close_file_reader(reader);
+			free(data);
+		}
+
+		/* A hard link reads the same data.  */
+		CHECK_RET(wimlib_open_file_reader(wim, 1, HARDLINK_PATH,
+						  &reader));
+		check_file_reads(reader, find_test_file(HARDLINK_TARGET),
+				 1 << 20, false);
+		wimlib_close_file_reader(reader);
+
+		wimlib_free(wim);
+	}
+}
+
+struct reader_thread_args {
+	WIMStruct *wim;
+	struct wimlib_file_reader **readers;
+	unsigned thread_id;
+};
+
+static int
+count_nondirectory(const struct wimlib_dir_entry *dentry, void *_count)
+{
+	if (!(dentry->attributes & WIMLIB_FILE_ATTRIBUTE_DIRECTORY))
+		++*(unsigned *)_count;
+	return 0;
+}
+
+/* List the image and read every file through the shared readers, in pieces of
+ * a size and order that depend on the thread.  */
+static void *
+reader_thread(void *_args)
+{
+	const struct reader_thread_args *args = _args;
+	const size_t piece_sizes[] = { 65536, 4096 + 1, 100000, 12345 };
+	size_t piece_size = piece_sizes[args->thread_id %
+					ARRAY_LEN(piece_sizes)];
+	struct wimlib_wim_info info;
+	unsigned count = 0;
+
+	CHECK_RET(wimlib_get_wim_info(args->wim, &info));
+	CHECK(info.image_count == 1);
+	CHECK_RET(wimlib_iterate_dir_tree(args->wim, 1, "/",
+					  WIMLIB_ITERATE_DIR_TREE_FLAG_RECURSIVE,
+					  count_nondirectory, &count));
+	CHECK(count == ARRAY_LEN(files) + 1);
+
+	for (size_t i = 0; i < ARRAY_LEN(files); i++) {
+		size_t j = (i + args->thread_id) % ARRAY_LEN(files);
+
+		check_file_reads(args->readers[j], &files[j], piece_size,
+				 args->thread_id & 1);
+	}
+	return NULL;
+}
+
+/* Reads from several threads at once, sharing both the WIMStruct and the file
+ * readers  */
+static void
+test_concurrent_reads(void)
+{
+	for (size_t i = 0; i < ARRAY_LEN(wim_formats); i++) {
+		struct wimlib_file_reader *readers[ARRAY_LEN(files)];
+		struct reader_thread_args args[NUM_THREADS];
+		pthread_t threads[NUM_THREADS];
+		WIMStruct *wim;
+
+		CHECK_RET(wimlib_open_wim(wim_formats[i].path,
+					  WIMLIB_OPEN_FLAG_CONCURRENT_READS,
+					  &wim));
+		for (size_t j = 0; j < ARRAY_LEN(files); j++)
+			CHECK_RET(wimlib_open_file_reader(wim, 1,
+							  files[j].path,
+							  &readers[j]));
+		for (unsigned j = 0; j < NUM_THREADS; j++) {
+			args[j].wim = wim;
+			args[j].readers = readers;
+			args[j].thread_id = j;
+			CHECK(pthread_create(&threads[j], NULL, reader_thread,
+					     &args[j]) == 0);
+		}
+		for (unsigned j = 0; j < NUM_THREADS; j++)
+			CHECK(pthread_join(threads[j], NULL) == 0);
+		for (size_t j = 0; j < ARRAY_LEN(files); j++)
+			wimlib_close_file_reader(readers[j]);
+
+		extract_and_check(wim);
+		wimlib_set_print_errors(false);
+		CHECK(wimlib_overwrite(wim, 0, 0) ==
+		      WIMLIB_ERR_WIM_IS_READONLY);
+		wimlib_set_print_errors(true);
+		wimlib_free(wim);
+	}
+}
+
+/* Writing, extracting, and random-access reads under a memory limit far below
+ * what the buffers would normally use, so that the thread counts and buffer
+ * sizes all have to scale down  */
+static void
+test_memory_limit(void)
+{
+	CHECK_RET(wimlib_set_memory_limit(1 << 20));
+	for (size_t i = 0; i < ARRAY_LEN(wim_formats); i++) {
+		WIMStruct *wim;
+
+		write_wim("memory_limit.wim", wim_formats[i].ctype,
+			  wim_formats[i].write_flags);
+		CHECK_RET(wimlib_open_wim("memory_limit.wim", 0, &wim));
+		extract_and_check(wim);
+		for (size_t j = 0; j < ARRAY_LEN(files); j++) {
+			struct wimlib_file_reader *reader;
+
+			CHECK_RET(wimlib_open_file_reader(wim, 1,
+							  files[j].path,
+							  &reader));
+			check_file_reads(reader, &files[j], 65536, true);
+			wimlib_close_file_reader(reader);
+		}
+		wimlib_free(wim);
+	}
+	CHECK(unlink("memory_limit.wim") == 0);
+	CHECK_RET(wimlib_set_memory_limit(0));
+}
+
+/* Reads from a memory-mapped WIM, and overwriting a WIM while it's mapped  */
+static void
+test_mmap(void)
+{
+	struct wimlib_wim_info info;
+	WIMStruct *wim;
+
+	check_wims(WIMLIB_OPEN_FLAG_MMAP);
+	check_wims(WIMLIB_OPEN_FLAG_MMAP | WIMLIB_OPEN_FLAG_CONCURRENT_READS);
+
+	for (size_t i = 0; i < ARRAY_LEN(wim_formats); i++) {
+		CHECK_RET(wimlib_open_wim(wim_formats[i].path,
+					  WIMLIB_OPEN_FLAG_MMAP, &wim));
+		for (size_t j = 0; j < ARRAY_LEN(files); j++) {
+			struct wimlib_file_reader *reader;
+
+			CHECK_RET(wimlib_open_file_reader(wim, 1,
+							  files[j].path,
+							  &reader));
+			check_file_reads(reader, &files[j], 4097, false);
+			wimlib_close_file_reader(reader);
+		}
+		wimlib_free(wim);
+	}
+
+	/* Append an image in place, then rebuild the WIM, each time while it's
+	 * mapped.  */
+	write_wim("mmap.wim", WIMLIB_COMPRESSION_TYPE_LZX, 0);
+	CHECK_RET(wimlib_open_wim("mmap.wim", WIMLIB_OPEN_FLAG_MMAP |
+				  WIMLIB_OPEN_FLAG_WRITE_ACCESS, &wim));
+	CHECK_RET(wimlib_add_image(wim, IN_DIR, "test2", NULL, 0));
+	CHECK_RET(wimlib_overwrite(wim, 0, NUM_THREADS));
+	wimlib_free(wim);
+	CHECK_RET(wimlib_open_wim("mmap.wim", WIMLIB_OPEN_FLAG_MMAP |
+				  WIMLIB_OPEN_FLAG_WRITE_ACCESS, &wim));
+	extract_and_check(wim);
+	CHECK_RET(wimlib_overwrite(wim, WIMLIB_WRITE_FLAG_REBUILD,
+				   NUM_THREADS));
+	wimlib_free(wim);
+
+	CHECK_RET(wimlib_open_wim("mmap.wim", WIMLIB_OPEN_FLAG_MMAP, &wim));
+	CHECK_RET(wimlib_get_wim_info(wim, &info));
+	CHECK(info.image_count == 2);
+	extract_and_check(wim);
+	CHECK_RET(wimlib_verify_wim(wim, 0));
+	wimlib_free(wim);
+	CHECK(unlink("mmap.wim") == 0);
+}
+
+/* Writing and appending with WIMLIB_WRITE_FLAG_DIRECT_IO  */
+static void
+test_direct_io(void)
+{
+	WIMStruct *wim;
+	int fd;
+
+	for (size_t i = 0; i < ARRAY_LEN(wim_formats); i++) {
+		write_wim("direct_io.wim", wim_formats[i].ctype,
+			  wim_formats[i].write_flags |
+			  WIMLIB_WRITE_FLAG_DIRECT_IO);
+		CHECK_RET(wimlib_open_wim("direct_io.wim", 0, &wim));
+		extract_and_check(wim);
+		CHECK_RET(wimlib_verify_wim(wim, 0));
+		wimlib_free(wim);
+	}
+
+	/* Append an image in place.  */
+	write_wim("direct_io.wim", WIMLIB_COMPRESSION_TYPE_LZX, 0);
+	CHECK_RET(wimlib_open_wim("direct_io.wim",
+				  WIMLIB_OPEN_FLAG_WRITE_ACCESS, &wim));
+	CHECK_RET(wimlib_add_image(wim, IN_DIR, "test2", NULL, 0));
+	CHECK_RET(wimlib_overwrite(wim, WIMLIB_WRITE_FLAG_DIRECT_IO,
+				   NUM_THREADS));
+	wimlib_free(wim);
+	CHECK_RET(wimlib_open_wim("direct_io.wim", 0, &wim));
+	CHECK_RET(wimlib_verify_wim(wim, 0));
+
+	/* The flag isn't allowed with a file descriptor from the caller.  */
+	fd = open("direct_io_fd.wim", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	CHECK(fd >= 0);
+	CHECK(wimlib_write_to_fd(wim, fd, 1, WIMLIB_WRITE_FLAG_DIRECT_IO, 0) ==
+	      WIMLIB_ERR_INVALID_PARAM);
+	CHECK(close(fd) == 0);
+	wimlib_free(wim);
+
+	CHECK(unlink("direct_io_fd.wim") == 0);
+	CHECK(unlink("direct_io.wim") == 0);
+}
+
+#define MANY_TARGETS_DIR	"many_targets.dir"
+#define NUM_MANY_TARGET_BLOBS	32
+#define NUM_TARGETS_PER_BLOB	200
+
+/* Extracting, with several threads and a low limit on open files, blobs that
+ * each have many targets.  The threads together must not open more files than
+ * a serial extraction would.  */
+static void
+test_many_targets(void)
+{
+	struct rlimit old_limit, limit;
+	char path[256];
+	uint8_t data[100];
+	WIMStruct *wim;
+
+	CHECK(mkdir(MANY_TARGETS_DIR, 0755) == 0);
+	for (int i = 0; i < NUM_MANY_TARGET_BLOBS; i++) {
+		memset(data, 'a' + i, sizeof(data));
+		for (int j = 0; j < NUM_TARGETS_PER_BLOB; j++) {
+			int fd;
+
+			snprintf(path, sizeof(path), "%s/f%d_%d",
+				 MANY_TARGETS_DIR, i, j);
+			fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			CHECK(fd >= 0);
+			CHECK(write(fd, data, sizeof(data)) == sizeof(data));
+			CHECK(close(fd) == 0);
+		}
+	}
+	CHECK_RET(wimlib_create_new_wim(WIMLIB_COMPRESSION_TYPE_LZX, &wim));
+	CHECK_RET(wimlib_add_image(wim, MANY_TARGETS_DIR, NULL, NULL, 0));
+	CHECK_RET(wimlib_write(wim, "many_targets.wim", WIMLIB_ALL_IMAGES, 0,
+			       0));
+	wimlib_free(wim);
+
+	/* Enough for a serial extraction, which has at most MAX_OPEN_FILES
+	 * (512) targets open, but not for several threads that each open all
+	 * the targets of a blob.  */
+	CHECK(getrlimit(RLIMIT_NOFILE, &old_limit) == 0);
+	limit = old_limit;
+	if (limit.rlim_cur == RLIM_INFINITY || limit.rlim_cur > 600)
+		limit.rlim_cur = 600;
+	CHECK(setrlimit(RLIMIT_NOFILE, &limit) == 0);
+
+	CHECK_RET(wimlib_open_wim("many_targets.wim", 0, &wim));
+	CHECK_RET(wimlib_set_decompression_threads(wim, 8));
+	CHECK_RET(wimlib_extract_image(wim, 1, OUT_DIR, 0));
+	wimlib_free(wim);
+
+	CHECK(setrlimit(RLIMIT_NOFILE, &old_limit) == 0);
+
+	for (int i = 0; i < NUM_MANY_TARGET_BLOBS; i++) {
+		for (int j = 0; j < NUM_TARGETS_PER_BLOB; j++) {
+			uint8_t buf[sizeof(data) + 1];
+			int fd;
+
+			snprintf(path, sizeof(path), "%s/f%d_%d",
+				 OUT_DIR, i, j);
+			fd = open(path, O_RDONLY);
+			CHECK(fd >= 0);
+			CHECK(read(fd, buf, sizeof(buf)) == sizeof(data));
+			memset(data, 'a' + i, sizeof(data));
+			CHECK(!memcmp(buf, data, sizeof(data)));
+			CHECK(close(fd) == 0);
+		}
+	}
+	remove_tree(OUT_DIR);
+	remove_tree(MANY_TARGETS_DIR);
+	CHECK(unlink("many_targets.wim") == 0);
+}
+
+static const struct {
+	const char *name;
+	void (*func)(void);
+} tests[] = {
+	{ "parallel_decompression", test_parallel_decompression },
+	{ "chunk_cache", test_chunk_cache },
+	{ "concurrent_reads", test_concurrent_reads },
+	{ "file_reader", test_file_reader },
+	{ "memory_limit", test_memory_limit },
+	{ "mmap", test_mmap },
+	{ "direct_io", test_direct_io },
+	{ "many_targets", test_many_targets },
+};
+
+static bool
+should_run(const char *name, int argc, char **argv)
+{
+	if (argc <= 1)
+		return true;
+	for (int i = 1; i < argc; i++)
+		if (!strcmp(argv[i], name))
+			return true;
+	return false;
+}
+
+int
+main(int argc, char **argv)
+{
+	CHECK_RET(wimlib_global_init(0));
+	wimlib_set_print_errors(true);
+
+	remove_tree(TEST_SUBDIR);
+	CHECK(mkdir(TEST_SUBDIR, 0755) == 0);
+	CHECK(chdir(TEST_SUBDIR) == 0);
+
+	init_test_files();
+	create_test_tree(IN_DIR);
+	write_wims(0);
+
+	for (size_t i = 0; i < ARRAY_LEN(tests); i++) {
+		if (!should_run(tests[i].name, argc, argv))
+			continue;
+		printf("Testing %s\n", tests[i].name);
+		fflush(stdout);
+		tests[i].func();
+	}
+
+	CHECK(chdir("..") == 0);
+	remove_tree(TEST_SUBDIR);
+	for (size_t i = 0; i < ARRAY_LEN(files); i++)
+		free(files[i].data);
+	wimlib_global_cleanup();
+	printf("All tests passed\n");
+	return 0;
+}